@@ -0,0 +1,120 @@
+/**
+ * Minimal Arduino core to build firmware headers that need Arduino natively (see mqtt_bench).
+ *
+ * Time is virtual: millis() and micros() return hostClockUs, which only moves by delay(),
+ * vTaskDelay() or the host network (see WiFiClient.h). Serial output is dropped unless
+ * hostSerialVerbose is set. FreeRTOS mutexes are no-ops, everything runs on one thread.
+ * Only what the included firmware headers use is there.
+ * */
+
+#ifndef ARDUINO_HOST_KD_H
+#define ARDUINO_HOST_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+
+#include "Print.h"
+
+#define ARDUINO_HOST
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define pgm_read_byte_near(addr) (*(const uint8_t *)(addr))
+
+#define LOW 0x0
+#define HIGH 0x1
+#define OUTPUT 0x03
+#define T2 2
+
+using std::max;
+using std::min;
+
+//----------------------------
+// VIRTUAL TIME
+//----------------------------
+inline uint64_t hostClockUs = 0;
+
+inline uint32_t millis() { return (uint32_t)(hostClockUs / 1000); }
+inline uint32_t micros() { return (uint32_t)hostClockUs; }
+inline void delay(uint32_t ms) { hostClockUs += (uint64_t)ms * 1000; }
+inline void delayMicroseconds(uint32_t us) { hostClockUs += us; }
+inline void yield() {}
+
+//----------------------------
+// BOARD
+//----------------------------
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+
+inline std::mt19937 &hostRandom() {
+    static std::mt19937 rng(1);
+    return rng;
+}
+inline uint32_t esp_random() { return hostRandom()(); }
+
+class EspClass {
+   public:
+    uint32_t getFreeHeap() { return 200000; }
+    uint32_t getMinFreeHeap() { return 150000; }
+    uint32_t getMaxAllocHeap() { return 110000; }
+    void restart() {}
+};
+inline EspClass ESP;
+
+inline bool hostSerialVerbose = false;
+
+class HardwareSerial : public Print {
+   public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override {
+        if (hostSerialVerbose) fputc(c, stdout);
+        return 1;
+    }
+    size_t write(const uint8_t *buf, size_t size) override {
+        if (hostSerialVerbose) fwrite(buf, 1, size, stdout);
+        return size;
+    }
+    using Print::write;
+};
+inline HardwareSerial Serial;
+
+//----------------------------
+// FREERTOS
+//----------------------------
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef uint32_t TickType_t;
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdTRUE 1
+#define pdFALSE 0
+
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+    static int handle;
+    return &handle;
+}
+// set by simulations while another task holds mutexes (e.g. a connect attempt), bounded takes time out
+inline bool hostMutexHeldElsewhere = false;
+inline int xSemaphoreTakeRecursive(SemaphoreHandle_t, TickType_t ticks) {
+    if (!hostMutexHeldElsewhere || ticks == portMAX_DELAY) return pdTRUE;
+    delay(ticks * portTICK_PERIOD_MS);
+    return pdFALSE;
+}
+inline int xSemaphoreGiveRecursive(SemaphoreHandle_t) { return pdTRUE; }
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+    static int handle;
+    return &handle;
+}
+inline int xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline int xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline void vTaskDelay(TickType_t ticks) { delay(ticks * portTICK_PERIOD_MS); }
+inline uint32_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+#endif  // ARDUINO_HOST_KD_H
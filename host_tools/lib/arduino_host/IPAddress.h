@@ -0,0 +1,24 @@
+/**
+ * IPv4 address of the Arduino core (see Arduino.h).
+ * */
+
+#ifndef IP_ADDRESS_HOST_KD_H
+#define IP_ADDRESS_HOST_KD_H
+
+#include <stdint.h>
+
+class IPAddress {
+   public:
+    IPAddress() : address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : address(address) {}
+
+    operator uint32_t() const { return address; }
+    bool operator==(const IPAddress &o) const { return address == o.address; }
+    uint8_t operator[](int i) const { return (uint8_t)(address >> (8 * i)); }
+
+   private:
+    uint32_t address;
+};
+
+#endif  // IP_ADDRESS_HOST_KD_H
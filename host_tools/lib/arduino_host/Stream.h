@@ -0,0 +1,17 @@
+/**
+ * Stream of the Arduino core (see Arduino.h).
+ * */
+
+#ifndef STREAM_HOST_KD_H
+#define STREAM_HOST_KD_H
+
+#include "Print.h"
+
+class Stream : public Print {
+   public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif  // STREAM_HOST_KD_H
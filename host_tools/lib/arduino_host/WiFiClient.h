@@ -0,0 +1,81 @@
+/**
+ * WiFiClient (and WiFiClientSecure.h) of the Arduino core (see Arduino.h) on a simulated network.
+ *
+ * Connections are made through hostNetwork, which decides how long connecting, writing
+ * and reading take in virtual time and when a connection breaks. Calls block as the
+ * sockets of the ESP32 core do: connect() until established or failed, write() until
+ * the bytes fit into the send buffer or the write timed out.
+ * */
+
+#ifndef WIFI_CLIENT_HOST_KD_H
+#define WIFI_CLIENT_HOST_KD_H
+
+#include "Arduino.h"
+#include "Client.h"
+
+class HostNetwork {
+   public:
+    virtual ~HostNetwork() {}
+    // returns connection id > 0 or 0 if failed, handshake is made if tls
+    virtual int open(const char *host, uint16_t port, bool tls) = 0;
+    // returns bytes accepted, 0 closes the connection
+    virtual size_t send(int conn, const uint8_t *buf, size_t len) = 0;
+    // bytes received, moves time on a bit if there are none (callers poll)
+    virtual int available(int conn) = 0;
+    virtual int receive(int conn, uint8_t *buf, size_t len, bool peek) = 0;
+    virtual bool isOpen(int conn) = 0;
+    virtual void close(int conn) = 0;
+};
+
+inline HostNetwork *hostNetwork = nullptr;
+
+class WiFiClient : public Client {
+   public:
+    int connect(IPAddress, uint16_t port) override { return connect("ip", port); }
+    int connect(const char *host, uint16_t port) override {
+        stop();
+        conn = hostNetwork->open(host, port, tls());
+        return conn > 0;
+    }
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size) override {
+        if (conn == 0) return 0;
+        size_t n = hostNetwork->send(conn, buf, size);
+        if (n < size) stop();
+        return n;
+    }
+    using Print::write;
+
+    int available() override { return conn != 0 ? hostNetwork->available(conn) : 0; }
+    int read() override {
+        uint8_t b;
+        return read(&b, 1) == 1 ? b : -1;
+    }
+    int read(uint8_t *buf, size_t size) override { return conn != 0 ? hostNetwork->receive(conn, buf, size, false) : -1; }
+    int peek() override {
+        uint8_t b;
+        return conn != 0 && hostNetwork->receive(conn, &b, 1, true) == 1 ? b : -1;
+    }
+
+    // as in the ESP32 core: discards received bytes
+    void flush() override {
+        uint8_t buf[64];
+        while (available() > 0 && read(buf, sizeof(buf)) > 0) {
+        }
+    }
+    void stop() override {
+        if (conn != 0) hostNetwork->close(conn);
+        conn = 0;
+    }
+    uint8_t connected() override { return conn != 0 && hostNetwork->isOpen(conn); }
+    operator bool() override { return connected(); }
+
+   protected:
+    virtual bool tls() const { return false; }
+
+   private:
+    int conn = 0;
+};
+
+#endif  // WIFI_CLIENT_HOST_KD_H
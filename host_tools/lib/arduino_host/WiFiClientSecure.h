@@ -0,0 +1,21 @@
+/**
+ * WiFiClientSecure of the Arduino core on a simulated network (see WiFiClient.h).
+ * Certificates are not checked, the network only adds the handshake.
+ * */
+
+#ifndef WIFI_CLIENT_SECURE_HOST_KD_H
+#define WIFI_CLIENT_SECURE_HOST_KD_H
+
+#include "WiFiClient.h"
+
+class WiFiClientSecure : public WiFiClient {
+   public:
+    void setCACert(const char *) {}
+    void setInsecure() {}
+    void setHandshakeTimeout(unsigned long) {}
+
+   protected:
+    bool tls() const override { return true; }
+};
+
+#endif  // WIFI_CLIENT_SECURE_HOST_KD_H
@@ -0,0 +1,68 @@
+/**
+ * Partition API of ESP-IDF with the data partition in memory (see Arduino.h).
+ *
+ * Only the data partition (spiffs subtype) exists, of hostDataPartitionSize bytes
+ * (192 kB as in min_spiffs.csv). Writes only clear bits, as on flash.
+ * */
+
+#ifndef ESP_PARTITION_HOST_KD_H
+#define ESP_PARTITION_HOST_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0x00, ESP_PARTITION_TYPE_DATA = 0x01 } esp_partition_type_t;
+typedef enum { ESP_PARTITION_SUBTYPE_DATA_SPIFFS = 0x82 } esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    bool encrypted;
+} esp_partition_t;
+
+inline size_t hostDataPartitionSize = 0x30000;
+
+inline std::vector<uint8_t> &hostDataPartition() {
+    static std::vector<uint8_t> data;
+    return data;
+}
+
+inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *) {
+    static esp_partition_t partition = {ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x3d0000, 0, "spiffs", false};
+    if (type != ESP_PARTITION_TYPE_DATA || subtype != ESP_PARTITION_SUBTYPE_DATA_SPIFFS || hostDataPartitionSize == 0) return nullptr;
+    if (hostDataPartition().size() != hostDataPartitionSize) hostDataPartition().assign(hostDataPartitionSize, 0xff);
+    partition.size = (uint32_t)hostDataPartitionSize;
+    return &partition;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t *p, size_t offset, void *dst, size_t size) {
+    if (offset + size > p->size) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, hostDataPartition().data() + offset, size);
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t *p, size_t offset, const void *src, size_t size) {
+    if (offset + size > p->size) return ESP_ERR_INVALID_SIZE;
+    uint8_t *d = hostDataPartition().data() + offset;
+    for (size_t i = 0; i < size; i++) d[i] &= ((const uint8_t *)src)[i];
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t offset, size_t size) {
+    if (offset + size > p->size) return ESP_ERR_INVALID_SIZE;
+    memset(hostDataPartition().data() + offset, 0xff, size);
+    return ESP_OK;
+}
+
+#endif  // ESP_PARTITION_HOST_KD_H
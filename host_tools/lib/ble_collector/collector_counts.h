@@ -0,0 +1,189 @@
+/**
+ * Sketch messages of loggers in COUNT_ONLY mode (see src/ble_hll.h) and their union over
+ * loggers and time, for backends.
+ *
+ * Sketches are put into buckets of fixed length by their start. Per bucket the registers of
+ * all sketches are merged, which gives the distinct devices seen by any logger in that time.
+ * Merging is idempotent, so a rollup together with its own windows counts each device once.
+ * Sketches longer than the bucket cannot be split and are skipped, as are those of another
+ * precision than the first sketch in the bucket.
+ * */
+
+#ifndef COLLECTOR_COUNTS_KD_H
+#define COLLECTOR_COUNTS_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "ble_hll.h"
+#include "collector_parser.h"
+
+struct CollectorSketch {
+    uint32_t start;     // epoch seconds
+    uint32_t seconds;
+    uint32_t estimate;  // as sent by the logger
+    uint8_t p;
+    std::vector<uint8_t> registers;  // 2^p
+};
+
+/**
+ * True if payload is a sketch message, JSON (`{"hll": ...}`) or binary (type BLE_HLL_BIN_TYPE).
+ */
+inline bool collectorIsSketch(const uint8_t *payload, size_t len) {
+    if (len > 0 && payload[0] == BLE_HLL_BIN_TYPE) return true;
+    CollectorJson js((const char *)payload, len);
+    const char *key;
+    size_t keyLen;
+    return js.eat('{') && js.string(key, keyLen) && collectorKeyIs(key, keyLen, "hll");
+}
+
+/**
+ * Parses and decodes a sketch message. Returns false if malformed.
+ */
+inline bool collectorParseSketch(const uint8_t *payload, size_t len, CollectorSketch &sketch) {
+    if (len > 0 && payload[0] == BLE_HLL_BIN_TYPE) {
+        BleHllMessage msg;
+        if (!bleHllParseBin(payload, len, msg)) return false;
+        sketch.start = msg.start;
+        sketch.seconds = msg.seconds;
+        sketch.estimate = msg.estimate;
+        sketch.p = msg.p;
+        sketch.registers.resize((size_t)1 << msg.p);
+        return bleHllDecode(sketch.registers.data(), msg.p, msg.data, msg.dataLen, msg.sparse);
+    }
+    CollectorJson js((const char *)payload, len);
+    const char *key;
+    size_t keyLen;
+    if (!js.eat('{') || !js.string(key, keyLen) || !collectorKeyIs(key, keyLen, "hll") || !js.eat(':') || !js.eat('{')) return false;
+    int64_t start = -1, seconds = -1, estimate = 0, p = 0;
+    const char *hex = nullptr;
+    size_t hexLen = 0;
+    bool sparse = false;
+    if (!js.eat('}')) {
+        do {
+            if (!js.string(key, keyLen) || !js.eat(':')) return false;
+            bool ok;
+            if (collectorKeyIs(key, keyLen, "start")) {
+                ok = js.integer(start);
+            } else if (collectorKeyIs(key, keyLen, "seconds")) {
+                ok = js.integer(seconds);
+            } else if (collectorKeyIs(key, keyLen, "p")) {
+                ok = js.integer(p);
+            } else if (collectorKeyIs(key, keyLen, "estimate")) {
+                ok = js.integer(estimate);
+            } else if (collectorKeyIs(key, keyLen, "sparse") || collectorKeyIs(key, keyLen, "dense")) {
+                sparse = key[0] == 's';
+                ok = js.string(hex, hexLen);
+            } else {
+                ok = js.skipValue();
+            }
+            if (!ok) return false;
+        } while (js.eat(','));
+        if (!js.eat('}')) return false;
+    }
+    if (!js.eat('}') || start < 0 || start > UINT32_MAX || seconds < 0 || seconds > UINT32_MAX || p < BLE_HLL_MIN_P || p > BLE_HLL_MAX_P ||
+        hex == nullptr || hexLen % 2 != 0 || hexLen / 2 > bleHllDenseLen((uint8_t)p))
+        return false;
+    // not on the stack of each call, dense registers of BLE_HLL_MAX_P are 48 kB
+    static thread_local uint8_t data[((1 << BLE_HLL_MAX_P) * 6 + 7) / 8];
+    for (size_t i = 0; i < hexLen / 2; i++) {
+        int hi = collectorHexNibble(hex[2 * i]), lo = collectorHexNibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        data[i] = (uint8_t)(hi << 4 | lo);
+    }
+    sketch.start = (uint32_t)start;
+    sketch.seconds = (uint32_t)seconds;
+    sketch.estimate = (uint32_t)estimate;
+    sketch.p = (uint8_t)p;
+    sketch.registers.resize((size_t)1 << p);
+    return bleHllDecode(sketch.registers.data(), sketch.p, data, hexLen / 2, sparse);
+}
+
+struct CountBucket {
+    uint32_t start;
+    uint32_t seconds;
+    uint32_t loggers;
+    uint32_t sketches;
+    double estimate;        // union over loggers
+    double loggerEstimates;  // sum of estimates per logger, counts devices seen by several loggers more than once
+};
+
+/**
+ * Buckets of merged sketches by start time.
+ */
+class CountMerger {
+   public:
+    explicit CountMerger(uint32_t bucketSeconds) : seconds(bucketSeconds > 0 ? bucketSeconds : 1) {}
+
+    /**
+     * Returns false if sketch was skipped (longer than a bucket or of other precision).
+     */
+    bool add(uint32_t logger, const CollectorSketch &sketch) {
+        if (sketch.seconds > seconds || sketch.registers.size() != ((size_t)1 << sketch.p)) {
+            skippedSketches++;
+            return false;
+        }
+        Bucket &b = buckets[sketch.start / seconds];
+        if (b.sketches == 0) {
+            b.p = sketch.p;
+            b.all.assign(sketch.registers.size(), 0);
+        } else if (b.p != sketch.p) {
+            skippedSketches++;
+            return false;
+        }
+        std::vector<uint8_t> &regs = b.perLogger[logger];
+        if (regs.empty()) regs.assign(sketch.registers.size(), 0);
+        bleHllMerge(regs.data(), sketch.registers.data(), b.p);
+        bleHllMerge(b.all.data(), sketch.registers.data(), b.p);
+        b.sketches++;
+        return true;
+    }
+
+    /**
+     * Hands buckets starting before t (epoch seconds) to sink(const CountBucket &) in time order and drops them.
+     */
+    template <typename Sink>
+    void emitBefore(uint64_t t, Sink &sink) {
+        while (!buckets.empty() && ((uint64_t)buckets.begin()->first + 1) * seconds <= t) {
+            emit(buckets.begin()->first, buckets.begin()->second, sink);
+            buckets.erase(buckets.begin());
+        }
+    }
+
+    template <typename Sink>
+    void emitAll(Sink &sink) {
+        emitBefore(UINT64_MAX, sink);
+    }
+
+    uint64_t skippedSketches = 0;
+
+   private:
+    struct Bucket {
+        uint8_t p = 0;
+        uint32_t sketches = 0;
+        std::vector<uint8_t> all;
+        std::map<uint32_t, std::vector<uint8_t>> perLogger;
+    };
+
+    template <typename Sink>
+    void emit(uint32_t index, const Bucket &b, Sink &sink) {
+        CountBucket out;
+        out.start = index * seconds;
+        out.seconds = seconds;
+        out.loggers = (uint32_t)b.perLogger.size();
+        out.sketches = b.sketches;
+        out.estimate = bleHllEstimate(b.all.data(), b.p);
+        out.loggerEstimates = 0;
+        for (const auto &l : b.perLogger) out.loggerEstimates += bleHllEstimate(l.second.data(), b.p);
+        sink(out);
+    }
+
+    uint32_t seconds;
+    std::map<uint32_t, Bucket> buckets;
+};
+
+#endif  // COLLECTOR_COUNTS_KD_H
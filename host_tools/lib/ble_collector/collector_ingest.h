@@ -0,0 +1,143 @@
+/**
+ * Feeds subscriber output into a CollectorStore (see collector_store.h).
+ *
+ * Input are lines "<topic> <payload>" as printed by `mosquitto_sub -v`. Binary payloads
+ * (BINARY_PAYLOAD) do not survive that, subscribe with `mosquitto_sub -F '%t %x'` to get them as
+ * hex; hex payloads are decoded, JSON and text are taken as they are.
+ * Sketch messages (COUNT_ONLY) carry no records and are only counted, see collector_counts.h.
+ *
+ * Data is split into lines in place, a partial last line is kept until the next call.
+ * Apart from new loggers nothing is allocated per message.
+ * */
+
+#ifndef COLLECTOR_INGEST_KD_H
+#define COLLECTOR_INGEST_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "collector_counts.h"
+#include "collector_parser.h"
+#include "collector_store.h"
+
+struct CollectorIngestStats {
+    uint64_t lines = 0;
+    uint64_t sensorMessages = 0;
+    uint64_t records = 0;
+    uint64_t adminMessages = 0;
+    uint64_t malformed = 0;
+    uint64_t sketches = 0;
+    uint64_t skipped = 0;  // other topics or no payload
+    uint64_t bytes = 0;
+};
+
+class CollectorIngest {
+   public:
+    explicit CollectorIngest(CollectorStore &store) : store(store), hex(64 * 1024), tail() { tail.reserve(64 * 1024); }
+
+    /**
+     * Takes any chunk of input.
+     */
+    void feed(const char *data, size_t len) {
+        stats.bytes += len;
+        const char *end = data + len;
+        if (!tail.empty()) {
+            const char *nl = (const char *)memchr(data, '\n', len);
+            if (nl == nullptr) {
+                tail.insert(tail.end(), data, end);
+                return;
+            }
+            tail.insert(tail.end(), data, nl);
+            line(tail.data(), tail.size());
+            tail.clear();
+            data = nl + 1;
+        }
+        while (data < end) {
+            const char *nl = (const char *)memchr(data, '\n', end - data);
+            if (nl == nullptr) {
+                tail.assign(data, end);
+                return;
+            }
+            line(data, nl - data);
+            data = nl + 1;
+        }
+    }
+
+    /**
+     * End of input, takes a last line without newline.
+     */
+    void finish() {
+        if (!tail.empty()) line(tail.data(), tail.size());
+        tail.clear();
+    }
+
+    /**
+     * One "<topic> <payload>" line, receivedMs for admin messages.
+     */
+    void line(const char *p, size_t len, int64_t receivedMs = 0) {
+        stats.lines++;
+        if (len > 0 && p[len - 1] == '\r') len--;
+        const char *sp = (const char *)memchr(p, ' ', len);
+        if (sp == nullptr) {
+            stats.skipped++;
+            return;
+        }
+        const char *loggerName;
+        size_t loggerLen;
+        CollectorTopic t = collectorSplitTopic(p, sp - p, loggerName, loggerLen);
+        const char *payload = sp + 1;
+        size_t payloadLen = len - (payload - p);
+        if (t == CT_OTHER || payloadLen == 0) {
+            stats.skipped++;
+            return;
+        }
+        uint32_t logger = store.logger(loggerName, loggerLen);
+        if (t == CT_ADMIN) {
+            stats.adminMessages++;
+            store.appendAdmin(receivedMs, logger, payload, (uint32_t)payloadLen);
+            return;
+        }
+        stats.sensorMessages++;
+        const uint8_t *bytes = (const uint8_t *)payload;
+        if (payload[0] != '{' && payload[0] != '[') {
+            size_t n = decodeHex(payload, payloadLen);
+            if (n == 0) {
+                stats.malformed++;
+                return;
+            }
+            bytes = hex.data();
+            payloadLen = n;
+        }
+        if (collectorIsSketch(bytes, payloadLen)) {
+            stats.sketches++;
+            return;
+        }
+        bool malformed;
+        stats.records += collectorParseSensor(bytes, payloadLen, logger, *this, malformed);
+        if (malformed) stats.malformed++;
+    }
+
+    // sink of collectorParseSensor()
+    void operator()(const CollectorRecord &r) { store.append(r); }
+
+    CollectorIngestStats stats;
+
+   private:
+    size_t decodeHex(const char *s, size_t len) {
+        if (len % 2 != 0 || len / 2 > hex.size()) return 0;
+        for (size_t i = 0; i < len / 2; i++) {
+            int hi = collectorHexNibble(s[2 * i]), lo = collectorHexNibble(s[2 * i + 1]);
+            if (hi < 0 || lo < 0) return 0;
+            hex[i] = (uint8_t)(hi << 4 | lo);
+        }
+        return len / 2;
+    }
+
+    CollectorStore &store;
+    std::vector<uint8_t> hex;
+    std::vector<char> tail;
+};
+
+#endif  // COLLECTOR_INGEST_KD_H
@@ -0,0 +1,369 @@
+/**
+ * Allocation-free parser for the messages of the loggers, for backends (see collector_store.h).
+ *
+ * Sensor messages are parsed into CollectorRecords, whatever the firmware config:
+ *   - one JSON record or a JSON array of records (BATCH_PUBLISH), numbers quoted or not (see ble_schema.h),
+ *     time as "timestamp"/"micros" or "ts",
+ *   - binary messages (BINARY_PAYLOAD, see ble_binary.h).
+ * Fields not stored in columns (name, frame, ...) are skipped without being copied. Delta records
+ * (DELTA_ENCODING) are taken as they are, address, RSSI and time are always complete.
+ *
+ * Admin messages are either JSON with one key naming the report ("metrics", "scan", "status", ...)
+ * or plain text; collectorAdminKind() tells which.
+ *
+ * Topics are "sensor/BLE/Scanner/<ssid>/<id>" and "admin/BLE/Scanner/<ssid>/<id>", the logger is
+ * the part after the prefix.
+ * */
+
+#ifndef COLLECTOR_PARSER_KD_H
+#define COLLECTOR_PARSER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_binary.h"
+#include "ble_record.h"
+
+#define CR_RSSI_NA ((int8_t)-128)
+#define CR_TX_POWER_NA ((int8_t)-128)
+#define CR_COMPANY_NA 0xffff
+
+struct CollectorRecord {
+    uint64_t address;  // 48 bit, most significant byte first as printed
+    int64_t tsMs;      // epoch milliseconds
+    uint32_t logger;   // id of topic suffix, see LoggerDict
+    uint16_t companyId;   // first two bytes of manufacturer data (little endian), CR_COMPANY_NA without
+    uint16_t appearance;
+    uint16_t count;    // sightings (aggregated records), 1 otherwise
+    int8_t rssi;       // mean for aggregated records, CR_RSSI_NA without
+    int8_t txPower;    // CR_TX_POWER_NA without
+    uint8_t addrType;
+    uint8_t flags;     // BLE_REC_HAVE_*
+};
+
+enum CollectorTopic : uint8_t { CT_OTHER, CT_SENSOR, CT_ADMIN };
+
+/**
+ * Classifies topic and points logger at the "<ssid>/<id>" suffix.
+ */
+inline CollectorTopic collectorSplitTopic(const char *topic, size_t len, const char *&logger, size_t &loggerLen) {
+    static const char SENSOR[] = "sensor/BLE/Scanner/";
+    static const char ADMIN[] = "admin/BLE/Scanner/";
+    CollectorTopic t = CT_OTHER;
+    size_t pre = 0;
+    if (len > sizeof(SENSOR) - 1 && memcmp(topic, SENSOR, sizeof(SENSOR) - 1) == 0) {
+        t = CT_SENSOR;
+        pre = sizeof(SENSOR) - 1;
+    } else if (len > sizeof(ADMIN) - 1 && memcmp(topic, ADMIN, sizeof(ADMIN) - 1) == 0) {
+        t = CT_ADMIN;
+        pre = sizeof(ADMIN) - 1;
+    }
+    logger = topic + pre;
+    loggerLen = len - pre;
+    return t;
+}
+
+//----------------------------
+// JSON
+//----------------------------
+class CollectorJson {
+   public:
+    CollectorJson(const char *data, size_t len) : p(data), end(data + len) {}
+
+    void ws() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) p++;
+    }
+
+    bool eat(char c) {
+        ws();
+        if (p < end && *p == c) {
+            p++;
+            return true;
+        }
+        return false;
+    }
+
+    bool atEnd() {
+        ws();
+        return p >= end;
+    }
+
+    /**
+     * String without quotes, escapes are left in place.
+     */
+    bool string(const char *&s, size_t &len) {
+        if (!eat('"')) return false;
+        s = p;
+        while (p < end && *p != '"') p += *p == '\\' ? 2 : 1;
+        if (p >= end) return false;
+        len = p - s;
+        p++;
+        return true;
+    }
+
+    /**
+     * Integer, quoted or not.
+     */
+    bool integer(int64_t &v) {
+        ws();
+        bool quoted = p < end && *p == '"';
+        if (quoted) p++;
+        bool neg = p < end && *p == '-';
+        if (neg) p++;
+        if (p >= end || *p < '0' || *p > '9') return false;
+        uint64_t u = 0;
+        while (p < end && *p >= '0' && *p <= '9') u = u * 10 + (*p++ - '0');
+        // fractions are cut (not written by the firmware)
+        if (p < end && *p == '.')
+            for (p++; p < end && *p >= '0' && *p <= '9';) p++;
+        if (quoted && (p >= end || *p++ != '"')) return false;
+        v = neg ? -(int64_t)u : (int64_t)u;
+        return true;
+    }
+
+    bool skipValue() {
+        ws();
+        if (p >= end) return false;
+        if (*p == '"') {
+            const char *s;
+            size_t n;
+            return string(s, n);
+        }
+        if (*p == '{' || *p == '[') {
+            int depth = 0;
+            while (p < end) {
+                char c = *p;
+                if (c == '"') {
+                    const char *s;
+                    size_t n;
+                    if (!string(s, n)) return false;
+                    continue;
+                }
+                p++;
+                if (c == '{' || c == '[') depth++;
+                if ((c == '}' || c == ']') && --depth == 0) return true;
+            }
+            return false;
+        }
+        // number, true, false, null
+        const char *start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ') p++;
+        return p > start;
+    }
+
+    const char *pos() const { return p; }
+
+   private:
+    const char *p;
+    const char *end;
+};
+
+inline int collectorHexNibble(char c) { return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1; }
+
+/**
+ * "38:2f:a6:01:02:03" to 0x382fa6010203.
+ */
+inline bool collectorParseAddress(const char *s, size_t len, uint64_t &address) {
+    if (len != 3 * BLE_ADDR_LEN - 1) return false;
+    uint64_t a = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) {
+        int hi = collectorHexNibble(s[3 * i]), lo = collectorHexNibble(s[3 * i + 1]);
+        if (hi < 0 || lo < 0 || (i + 1 < BLE_ADDR_LEN && s[3 * i + 2] != ':')) return false;
+        a = a << 8 | (uint64_t)(hi << 4 | lo);
+    }
+    address = a;
+    return true;
+}
+
+inline bool collectorKeyIs(const char *key, size_t len, const char *name) { return strlen(name) == len && memcmp(key, name, len) == 0; }
+
+/**
+ * Parses one JSON record object. Returns false if malformed or without address.
+ */
+inline bool collectorParseJsonRecord(CollectorJson &js, CollectorRecord &rec) {
+    if (!js.eat('{')) return false;
+    uint32_t logger = rec.logger;
+    memset(&rec, 0, sizeof(rec));
+    rec.logger = logger;
+    rec.rssi = CR_RSSI_NA;
+    rec.txPower = CR_TX_POWER_NA;
+    rec.companyId = CR_COMPANY_NA;
+    rec.count = 1;
+    bool haveAddress = false;
+    int64_t seconds = 0, micros = 0, ms = -1;
+    if (js.eat('}')) return false;
+    do {
+        const char *key;
+        size_t keyLen;
+        if (!js.string(key, keyLen) || !js.eat(':')) return false;
+        int64_t v = 0;
+        bool ok = true;
+        // dispatch on length first, most keys differ there
+        switch (keyLen) {
+            case 2:
+                if (collectorKeyIs(key, keyLen, "ts")) ok = js.integer(ms);
+                else ok = js.skipValue();
+                break;
+            case 4:
+                if (collectorKeyIs(key, keyLen, "rssi")) {
+                    ok = js.integer(v);
+                    rec.rssi = (int8_t)v;
+                    rec.flags |= BLE_REC_HAVE_RSSI;
+                } else if (collectorKeyIs(key, keyLen, "name")) {
+                    ok = js.skipValue();
+                    rec.flags |= BLE_REC_HAVE_NAME;
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 5:
+                if (collectorKeyIs(key, keyLen, "count")) {
+                    ok = js.integer(v);
+                    rec.count = (uint16_t)v;
+                    rec.flags |= BLE_REC_HAVE_STATS;
+                } else if (collectorKeyIs(key, keyLen, "frame")) {
+                    ok = js.skipValue();
+                    rec.flags |= BLE_REC_HAVE_FRAME;
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 6:
+                if (collectorKeyIs(key, keyLen, "micros")) ok = js.integer(micros);
+                else ok = js.skipValue();
+                break;
+            case 7:
+                if (collectorKeyIs(key, keyLen, "address")) {
+                    const char *s;
+                    size_t n;
+                    ok = js.string(s, n) && collectorParseAddress(s, n, rec.address);
+                    haveAddress = ok;
+                } else if (collectorKeyIs(key, keyLen, "txPower")) {
+                    ok = js.integer(v);
+                    rec.txPower = (int8_t)v;
+                    rec.flags |= BLE_REC_HAVE_TX_POWER;
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 8:
+                if (collectorKeyIs(key, keyLen, "addrType")) {
+                    ok = js.integer(v);
+                    rec.addrType = (uint8_t)v;
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 9:
+                if (collectorKeyIs(key, keyLen, "manufData")) {
+                    const char *s;
+                    size_t n;
+                    ok = js.string(s, n);
+                    if (ok && n >= 4) {
+                        int b0 = collectorHexNibble(s[0]) << 4 | collectorHexNibble(s[1]);
+                        int b1 = collectorHexNibble(s[2]) << 4 | collectorHexNibble(s[3]);
+                        if (b0 >= 0 && b1 >= 0) rec.companyId = (uint16_t)(b0 | b1 << 8);
+                    }
+                    rec.flags |= BLE_REC_HAVE_MANUF_DATA;
+                } else if (collectorKeyIs(key, keyLen, "timestamp")) {
+                    ok = js.integer(seconds);
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 10:
+                if (collectorKeyIs(key, keyLen, "appearance")) {
+                    ok = js.integer(v);
+                    rec.appearance = (uint16_t)v;
+                    rec.flags |= BLE_REC_HAVE_APPEARANCE;
+                } else {
+                    ok = js.skipValue();
+                }
+                break;
+            case 11:
+                if (collectorKeyIs(key, keyLen, "serviceUUID")) rec.flags |= BLE_REC_HAVE_SERVICE_UUID;
+                ok = js.skipValue();
+                break;
+            default:
+                ok = js.skipValue();
+                break;
+        }
+        if (!ok) return false;
+    } while (js.eat(','));
+    if (!js.eat('}') || !haveAddress) return false;
+    rec.tsMs = ms >= 0 ? ms : seconds * 1000 + micros / 1000;
+    return true;
+}
+
+inline void collectorFromBleRecord(const BleAdvRecord &b, uint32_t logger, CollectorRecord &rec) {
+    rec.address = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) rec.address = rec.address << 8 | b.address[i];
+    rec.tsMs = (int64_t)b.timestamp * 1000 + b.micros / 1000;
+    rec.logger = logger;
+    rec.companyId = bleRecHas(b, BLE_REC_HAVE_MANUF_DATA) && b.manufDataLen >= 2 ? (uint16_t)(b.manufData[0] | b.manufData[1] << 8) : CR_COMPANY_NA;
+    rec.appearance = bleRecHas(b, BLE_REC_HAVE_APPEARANCE) ? b.appearance : 0;
+    rec.count = bleRecHas(b, BLE_REC_HAVE_STATS) ? b.count : 1;
+    rec.rssi = bleRecHas(b, BLE_REC_HAVE_RSSI) ? b.rssi : CR_RSSI_NA;
+    rec.txPower = bleRecHas(b, BLE_REC_HAVE_TX_POWER) ? b.txPower : CR_TX_POWER_NA;
+    rec.addrType = b.addrType;
+    rec.flags = b.flags;
+}
+
+/**
+ * Parses a sensor message and hands each record to sink(const CollectorRecord &).
+ * Returns number of records; malformed is set if (part of) the message could not be parsed.
+ */
+template <typename Sink>
+inline size_t collectorParseSensor(const uint8_t *payload, size_t len, uint32_t logger, Sink &sink, bool &malformed) {
+    malformed = false;
+    size_t n = 0;
+    CollectorRecord rec;
+    rec.logger = logger;
+    if (len > 0 && payload[0] == BLE_BIN_VERSION) {
+        BinReader reader;
+        binDecodeBegin(reader, payload, len);
+        // not on the stack of each call, BleAdvRecord is large
+        static thread_local BleAdvRecord b;
+        binDecodeResult r;
+        while ((r = binDecodeRecord(reader, b)) == BIN_OK) {
+            collectorFromBleRecord(b, logger, rec);
+            sink(rec);
+            n++;
+        }
+        malformed = r == BIN_MALFORMED;
+        return n;
+    }
+    CollectorJson js((const char *)payload, len);
+    if (js.eat('[')) {
+        if (js.eat(']')) return 0;
+        do {
+            if (!collectorParseJsonRecord(js, rec)) {
+                malformed = true;
+                return n;
+            }
+            sink(rec);
+            n++;
+        } while (js.eat(','));
+        malformed = !js.eat(']');
+    } else if (collectorParseJsonRecord(js, rec)) {
+        sink(rec);
+        n++;
+    } else {
+        malformed = true;
+    }
+    return n;
+}
+
+/**
+ * Kind of admin message: the first key of a JSON object ("metrics", "status", ...), "text" otherwise.
+ */
+inline void collectorAdminKind(const char *payload, size_t len, const char *&kind, size_t &kindLen) {
+    CollectorJson js(payload, len);
+    if (!js.eat('{') || !js.string(kind, kindLen)) {
+        kind = "text";
+        kindLen = 4;
+    }
+}
+
+#endif  // COLLECTOR_PARSER_KD_H
@@ -0,0 +1,531 @@
+/**
+ * Append-only columnar store of CollectorRecords (see collector_parser.h), read memory-mapped.
+ *
+ * A store is a directory:
+ *   seg-000001.kds  segment: header, then one column per field for a fixed number of rows,
+ *                   written through a shared mapping, row count updated after the columns
+ *   seg-000001.kdi  index of a sealed segment: (address, time, row) sorted
+ *   loggers.txt     logger names ("<ssid>/<id>"), line n is logger id n
+ *   admin.kda       admin messages as they came (time received, logger, length, payload)
+ * Segments are sealed when full or when the writer closes, never written again. Segments left
+ * unsealed by a crash are sealed on next open, rows up to the saved count are kept.
+ *
+ * Sightings of an address in [t0, t1] are found by binary search in the index of each segment
+ * whose time range overlaps, without touching the other rows.
+ *
+ * Linux/POSIX only (mmap).
+ * */
+
+#ifndef COLLECTOR_STORE_KD_H
+#define COLLECTOR_STORE_KD_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "collector_parser.h"
+
+#define CS_SEGMENT_MAGIC "KDSG"
+#define CS_INDEX_MAGIC "KDIX"
+#define CS_VERSION 1
+#define CS_DEFAULT_CAPACITY (1u << 20)
+
+enum CollectorColumn : uint8_t {
+    CS_COL_ADDRESS,
+    CS_COL_TS,
+    CS_COL_LOGGER,
+    CS_COL_COMPANY,
+    CS_COL_APPEARANCE,
+    CS_COL_COUNT,
+    CS_COL_RSSI,
+    CS_COL_TX_POWER,
+    CS_COL_ADDR_TYPE,
+    CS_COL_FLAGS,
+    CS_COLUMNS
+};
+
+static const uint8_t CS_COLUMN_WIDTH[CS_COLUMNS] = {8, 8, 4, 2, 2, 2, 1, 1, 1, 1};
+static const char *const CS_COLUMN_NAMES[CS_COLUMNS] = {"address", "ts", "logger", "companyId", "appearance",
+                                                        "count",   "rssi", "txPower", "addrType", "flags"};
+
+struct SegmentHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t count;   // rows complete
+    uint32_t sealed;  // index written
+    uint32_t reserved;
+    int64_t minTsMs;
+    int64_t maxTsMs;
+    uint64_t columnOffset[CS_COLUMNS];
+};
+
+struct IndexEntry {
+    uint64_t address;
+    int64_t tsMs;
+    uint32_t row;
+    uint32_t reserved;
+};
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+};
+
+inline bool operator<(const IndexEntry &a, const IndexEntry &b) {
+    return a.address != b.address ? a.address < b.address : a.tsMs != b.tsMs ? a.tsMs < b.tsMs : a.row < b.row;
+}
+
+//----------------------------
+// MAPPING
+//----------------------------
+class MappedFile {
+   public:
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { unmap(); }
+
+    /**
+     * Maps existing file, or creates it with size if size > 0.
+     */
+    bool map(const std::string &path, bool writable, size_t size = 0) {
+        unmap();
+        int fd = open(path.c_str(), writable ? O_RDWR | (size > 0 ? O_CREAT | O_EXCL : 0) : O_RDONLY, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        if (size > 0 && ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return false;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+        void *p = mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            len = 0;
+            return false;
+        }
+        data = (uint8_t *)p;
+        return true;
+    }
+
+    void sync() {
+        if (data != nullptr) msync(data, len, MS_SYNC);
+    }
+
+    void unmap() {
+        if (data != nullptr) munmap(data, len);
+        data = nullptr;
+        len = 0;
+    }
+
+    uint8_t *data = nullptr;
+    size_t len = 0;
+};
+
+//----------------------------
+// SEGMENT
+//----------------------------
+class Segment {
+   public:
+    static size_t fileSize(uint32_t capacity, uint64_t offsets[CS_COLUMNS]) {
+        size_t off = (sizeof(SegmentHeader) + 63) / 64 * 64;
+        for (int c = 0; c < CS_COLUMNS; c++) {
+            offsets[c] = off;
+            off += ((size_t)capacity * CS_COLUMN_WIDTH[c] + 63) / 64 * 64;
+        }
+        return off;
+    }
+
+    /**
+     * New empty segment for writing.
+     */
+    bool create(const std::string &path, uint32_t capacity) {
+        uint64_t offsets[CS_COLUMNS];
+        size_t size = fileSize(capacity, offsets);
+        if (!file.map(path, true, size)) return false;
+        SegmentHeader *h = header();
+        memcpy(h->magic, CS_SEGMENT_MAGIC, 4);
+        h->version = CS_VERSION;
+        h->capacity = capacity;
+        h->minTsMs = INT64_MAX;
+        h->maxTsMs = INT64_MIN;
+        memcpy(h->columnOffset, offsets, sizeof(offsets));
+        bind();
+        return true;
+    }
+
+    bool open(const std::string &path, bool writable = false) {
+        if (!file.map(path, writable)) return false;
+        SegmentHeader *h = header();
+        uint64_t offsets[CS_COLUMNS];
+        if (file.len < sizeof(SegmentHeader) || memcmp(h->magic, CS_SEGMENT_MAGIC, 4) != 0 || h->version != CS_VERSION ||
+            fileSize(h->capacity, offsets) > file.len || memcmp(offsets, h->columnOffset, sizeof(offsets)) != 0 || h->count > h->capacity) {
+            file.unmap();
+            return false;
+        }
+        bind();
+        return true;
+    }
+
+    bool full() const { return header()->count >= header()->capacity; }
+
+    void append(const CollectorRecord &r) {
+        SegmentHeader *h = header();
+        uint32_t i = h->count;
+        address[i] = r.address;
+        ts[i] = r.tsMs;
+        logger[i] = r.logger;
+        companyId[i] = r.companyId;
+        appearance[i] = r.appearance;
+        count[i] = r.count;
+        rssi[i] = r.rssi;
+        txPower[i] = r.txPower;
+        addrType[i] = r.addrType;
+        flags[i] = r.flags;
+        if (r.tsMs < h->minTsMs) h->minTsMs = r.tsMs;
+        if (r.tsMs > h->maxTsMs) h->maxTsMs = r.tsMs;
+        // row is complete only now
+        h->count = i + 1;
+    }
+
+    void get(uint32_t i, CollectorRecord &r) const {
+        r.address = address[i];
+        r.tsMs = ts[i];
+        r.logger = logger[i];
+        r.companyId = companyId[i];
+        r.appearance = appearance[i];
+        r.count = count[i];
+        r.rssi = rssi[i];
+        r.txPower = txPower[i];
+        r.addrType = addrType[i];
+        r.flags = flags[i];
+    }
+
+    /**
+     * Writes the index next to the segment and marks it sealed.
+     */
+    bool seal(const std::string &indexPath) {
+        SegmentHeader *h = header();
+        std::vector<IndexEntry> entries(h->count);
+        for (uint32_t i = 0; i < h->count; i++) entries[i] = {address[i], ts[i], i, 0};
+        std::sort(entries.begin(), entries.end());
+        IndexHeader ih;
+        memcpy(ih.magic, CS_INDEX_MAGIC, 4);
+        ih.version = CS_VERSION;
+        ih.count = entries.size();
+        std::string tmp = indexPath + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (f == nullptr) return false;
+        bool ok = fwrite(&ih, sizeof(ih), 1, f) == 1 && fwrite(entries.data(), sizeof(IndexEntry), entries.size(), f) == entries.size();
+        ok = fclose(f) == 0 && ok && rename(tmp.c_str(), indexPath.c_str()) == 0;
+        if (!ok) return false;
+        file.sync();
+        h->sealed = 1;
+        file.sync();
+        return true;
+    }
+
+    bool loadIndex(const std::string &indexPath) {
+        if (!indexFile.map(indexPath, false)) return false;
+        const IndexHeader *ih = (const IndexHeader *)indexFile.data;
+        if (indexFile.len < sizeof(IndexHeader) || memcmp(ih->magic, CS_INDEX_MAGIC, 4) != 0 || ih->count != rows() ||
+            sizeof(IndexHeader) + ih->count * sizeof(IndexEntry) > indexFile.len) {
+            indexFile.unmap();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Rows of address within [t0, t1], in time order, by index if loaded or else by scan.
+     */
+    template <typename Fn>
+    void find(uint64_t addr, int64_t t0, int64_t t1, Fn fn) const {
+        if (rows() == 0 || t1 < header()->minTsMs || t0 > header()->maxTsMs) return;
+        if (indexFile.data != nullptr) {
+            const IndexEntry *b = (const IndexEntry *)(indexFile.data + sizeof(IndexHeader));
+            const IndexEntry *e = b + rows();
+            IndexEntry key = {addr, t0, 0, 0};
+            for (const IndexEntry *it = std::lower_bound(b, e, key); it < e && it->address == addr && it->tsMs <= t1; ++it) fn(it->row);
+            return;
+        }
+        scan(addr, t0, t1, fn);
+    }
+
+    template <typename Fn>
+    void scan(uint64_t addr, int64_t t0, int64_t t1, Fn fn) const {
+        for (uint32_t i = 0, n = rows(); i < n; i++)
+            if (address[i] == addr && ts[i] >= t0 && ts[i] <= t1) fn(i);
+    }
+
+    SegmentHeader *header() const { return (SegmentHeader *)file.data; }
+    uint32_t rows() const { return header()->count; }
+    bool sealed() const { return header()->sealed != 0; }
+    bool indexed() const { return indexFile.data != nullptr; }
+
+    // columns
+    uint64_t *address = nullptr;
+    int64_t *ts = nullptr;
+    uint32_t *logger = nullptr;
+    uint16_t *companyId = nullptr;
+    uint16_t *appearance = nullptr;
+    uint16_t *count = nullptr;
+    int8_t *rssi = nullptr;
+    int8_t *txPower = nullptr;
+    uint8_t *addrType = nullptr;
+    uint8_t *flags = nullptr;
+
+   private:
+    void bind() {
+        const uint64_t *o = header()->columnOffset;
+        uint8_t *d = file.data;
+        address = (uint64_t *)(d + o[CS_COL_ADDRESS]);
+        ts = (int64_t *)(d + o[CS_COL_TS]);
+        logger = (uint32_t *)(d + o[CS_COL_LOGGER]);
+        companyId = (uint16_t *)(d + o[CS_COL_COMPANY]);
+        appearance = (uint16_t *)(d + o[CS_COL_APPEARANCE]);
+        count = (uint16_t *)(d + o[CS_COL_COUNT]);
+        rssi = (int8_t *)(d + o[CS_COL_RSSI]);
+        txPower = (int8_t *)(d + o[CS_COL_TX_POWER]);
+        addrType = (uint8_t *)(d + o[CS_COL_ADDR_TYPE]);
+        flags = (uint8_t *)(d + o[CS_COL_FLAGS]);
+    }
+
+    MappedFile file;
+    MappedFile indexFile;
+};
+
+//----------------------------
+// LOGGERS
+//----------------------------
+/**
+ * Logger names to ids, lookups do not allocate (open addressing over a fixed table).
+ */
+class LoggerDict {
+   public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    LoggerDict() : slots(SLOTS, NONE) {}
+
+    uint32_t find(const char *name, size_t len) const {
+        for (uint32_t s = hash(name, len) & (SLOTS - 1);; s = (s + 1) & (SLOTS - 1)) {
+            uint32_t id = slots[s];
+            if (id == NONE) return NONE;
+            if (names[id].size() == len && memcmp(names[id].data(), name, len) == 0) return id;
+        }
+    }
+
+    /**
+     * Id of name, added if new (NONE if table is full).
+     */
+    uint32_t intern(const char *name, size_t len, bool &added) {
+        added = false;
+        uint32_t id = find(name, len);
+        if (id != NONE || names.size() >= SLOTS / 2) return id;
+        id = (uint32_t)names.size();
+        names.emplace_back(name, len);
+        uint32_t s = hash(name, len) & (SLOTS - 1);
+        while (slots[s] != NONE) s = (s + 1) & (SLOTS - 1);
+        slots[s] = id;
+        added = true;
+        return id;
+    }
+
+    const std::string &name(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+
+   private:
+    static constexpr uint32_t SLOTS = 1 << 16;
+
+    static uint32_t hash(const char *s, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)s[i]) * 16777619u;
+        return h;
+    }
+
+    std::vector<uint32_t> slots;
+    std::vector<std::string> names;
+};
+
+//----------------------------
+// STORE
+//----------------------------
+class CollectorStore {
+   public:
+    explicit CollectorStore(const std::string &dir) : dir(dir) {}
+    ~CollectorStore() { close(); }
+
+    /**
+     * Opens directory for appending, seals segments left open. capacity: rows per new segment.
+     */
+    bool openForAppend(uint32_t capacity = CS_DEFAULT_CAPACITY) {
+        cap = capacity;
+        mkdir(dir.c_str(), 0755);
+        if (!loadLoggers()) return false;
+        std::vector<uint32_t> numbers = segmentNumbers();
+        for (uint32_t n : numbers) {
+            Segment s;
+            if (!s.open(segmentPath(n), true)) continue;
+            if (!s.sealed() && !s.seal(indexPath(n))) return false;
+        }
+        nextNumber = numbers.empty() ? 1 : numbers.back() + 1;
+        loggerFile = fopen((dir + "/loggers.txt").c_str(), "a");
+        adminFile = fopen((dir + "/admin.kda").c_str(), "ab");
+        return loggerFile != nullptr && adminFile != nullptr;
+    }
+
+    /**
+     * Opens directory for queries, mapping all segments and indexes.
+     */
+    bool openForRead() {
+        if (!loadLoggers()) return false;
+        for (uint32_t n : segmentNumbers()) {
+            std::unique_ptr<Segment> s(new Segment());
+            if (!s->open(segmentPath(n))) continue;
+            if (s->sealed()) s->loadIndex(indexPath(n));
+            segments.push_back(std::move(s));
+        }
+        return true;
+    }
+
+    uint32_t logger(const char *name, size_t len) {
+        bool added;
+        uint32_t id = loggers.intern(name, len, added);
+        if (added && loggerFile != nullptr) {
+            fwrite(name, 1, len, loggerFile);
+            fputc('\n', loggerFile);
+            fflush(loggerFile);
+        }
+        return id;
+    }
+
+    bool append(const CollectorRecord &r) {
+        if (!writer || writer->full()) {
+            if (!sealWriter()) return false;
+            writer.reset(new Segment());
+            if (!writer->create(segmentPath(nextNumber), cap)) {
+                writer.reset();
+                return false;
+            }
+            writerNumber = nextNumber++;
+        }
+        writer->append(r);
+        return true;
+    }
+
+    bool appendAdmin(int64_t receivedMs, uint32_t logger, const char *payload, uint32_t len) {
+        if (adminFile == nullptr) return false;
+        return fwrite(&receivedMs, sizeof(receivedMs), 1, adminFile) == 1 && fwrite(&logger, sizeof(logger), 1, adminFile) == 1 &&
+               fwrite(&len, sizeof(len), 1, adminFile) == 1 && fwrite(payload, 1, len, adminFile) == len;
+    }
+
+    /**
+     * Reads admin messages: fn(receivedMs, logger, payload, len).
+     */
+    template <typename Fn>
+    void forEachAdmin(Fn fn) const {
+        FILE *f = fopen((dir + "/admin.kda").c_str(), "rb");
+        if (f == nullptr) return;
+        int64_t ms;
+        uint32_t logger, len;
+        std::vector<char> buf;
+        while (fread(&ms, sizeof(ms), 1, f) == 1 && fread(&logger, sizeof(logger), 1, f) == 1 && fread(&len, sizeof(len), 1, f) == 1) {
+            buf.resize(len);
+            if (fread(buf.data(), 1, len, f) != len) break;
+            fn(ms, logger, buf.data(), len);
+        }
+        fclose(f);
+    }
+
+    void close() {
+        sealWriter();
+        if (loggerFile != nullptr) fclose(loggerFile);
+        if (adminFile != nullptr) fclose(adminFile);
+        loggerFile = adminFile = nullptr;
+    }
+
+    /**
+     * All sightings of address within [t0, t1]: fn(const Segment &, row).
+     * With useIndex false every row of every overlapping segment is compared.
+     */
+    template <typename Fn>
+    void sightings(uint64_t address, int64_t t0, int64_t t1, Fn fn, bool useIndex = true) const {
+        for (const std::unique_ptr<Segment> &s : segments) {
+            const Segment &seg = *s;
+            if (useIndex)
+                seg.find(address, t0, t1, [&](uint32_t row) { fn(seg, row); });
+            else if (seg.rows() > 0 && t1 >= seg.header()->minTsMs && t0 <= seg.header()->maxTsMs)
+                seg.scan(address, t0, t1, [&](uint32_t row) { fn(seg, row); });
+        }
+    }
+
+    const std::vector<std::unique_ptr<Segment>> &allSegments() const { return segments; }
+    const LoggerDict &loggerDict() const { return loggers; }
+
+   private:
+    bool sealWriter() {
+        if (!writer) return true;
+        bool ok = writer->seal(indexPath(writerNumber));
+        writer.reset();
+        return ok;
+    }
+
+    std::string segmentPath(uint32_t n) const { return numbered(n, ".kds"); }
+    std::string indexPath(uint32_t n) const { return numbered(n, ".kdi"); }
+
+    std::string numbered(uint32_t n, const char *ext) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/seg-%06u%s", n, ext);
+        return dir + name;
+    }
+
+    std::vector<uint32_t> segmentNumbers() const {
+        std::vector<uint32_t> numbers;
+        DIR *d = opendir(dir.c_str());
+        if (d == nullptr) return numbers;
+        while (struct dirent *e = readdir(d)) {
+            unsigned n;
+            char ext[8];
+            if (sscanf(e->d_name, "seg-%6u.%3s", &n, ext) == 2 && strcmp(ext, "kds") == 0) numbers.push_back(n);
+        }
+        closedir(d);
+        std::sort(numbers.begin(), numbers.end());
+        return numbers;
+    }
+
+    bool loadLoggers() {
+        FILE *f = fopen((dir + "/loggers.txt").c_str(), "r");
+        if (f == nullptr) return true;
+        char line[256];
+        bool added;
+        while (fgets(line, sizeof(line), f) != nullptr) loggers.intern(line, strcspn(line, "\n"), added);
+        fclose(f);
+        return true;
+    }
+
+    std::string dir;
+    uint32_t cap = CS_DEFAULT_CAPACITY;
+    LoggerDict loggers;
+    FILE *loggerFile = nullptr;
+    FILE *adminFile = nullptr;
+    std::unique_ptr<Segment> writer;
+    uint32_t writerNumber = 0;
+    uint32_t nextNumber = 1;
+    std::vector<std::unique_ptr<Segment>> segments;
+};
+
+#endif  // COLLECTOR_STORE_KD_H
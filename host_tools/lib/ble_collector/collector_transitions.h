@@ -0,0 +1,502 @@
+/**
+ * Streaming detection of transitions of addresses between loggers (see collector_parser.h).
+ *
+ * Sightings (address, logger, time) of all loggers are joined on address: an address seen at
+ * logger A and then at logger B makes a transition A -> B with
+ *   - dwell:  time between first and last sighting at A,
+ *   - travel: time between last sighting at A and first sighting at B (never negative, as
+ *             sightings are joined in time order; zero if both saw it at once).
+ * A move is confirmed after confirmSightings sightings in a row at B, so a single sighting by a
+ * neighbouring logger does not split a stay. Arrival is the first sighting of the confirming run.
+ *
+ * Out-of-order arrival: sightings are held in a reorder buffer and processed in time order once
+ * they are latenessMs older than the newest one. Sightings older than what was processed already
+ * are counted as late and dropped.
+ * Clock offsets: LoggerClockOffsets corrects the time of each logger, either set by hand or
+ * estimated from the time messages are received (min. lag per logger, relative to the median).
+ *
+ * Memory: an address is forgotten windowMs after its last sighting (the randomization
+ * interval, 15 min), and at most maxAddresses are kept (least recently seen are evicted first).
+ * The state of an address takes 72 bytes plus 16 of hash table.
+ *
+ * TransitionShard is single-threaded. TransitionEngine spreads addresses over shards by hash,
+ * each run by its own thread behind an SpscQueue (see src/spsc_queue.h).
+ * */
+
+#ifndef COLLECTOR_TRANSITIONS_KD_H
+#define COLLECTOR_TRANSITIONS_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "collector_parser.h"
+#include "spsc_queue.h"
+
+#define TR_NO_LOGGER UINT32_MAX
+#define TR_OFFSET_EPOCHS 5
+
+struct TransitionConfig {
+    int64_t windowMs = 15 * 60 * 1000;
+    int64_t latenessMs = 30 * 1000;
+    uint32_t confirmSightings = 2;
+    uint32_t maxAddresses = 1 << 20;  // split over shards
+};
+
+struct Transition {
+    uint64_t address;
+    uint32_t from;
+    uint32_t to;
+    int64_t leftMs;     // last sighting at from
+    int64_t arrivedMs;  // first sighting at to
+    int64_t dwellMs;    // at from
+    int64_t travelMs;   // arrivedMs - leftMs
+    uint32_t fromSightings;
+};
+
+struct TransitionStats {
+    uint64_t sightings = 0;
+    uint64_t late = 0;
+    uint64_t transitions = 0;
+    uint64_t unconfirmed = 0;  // sightings elsewhere not followed by a move
+    uint64_t expired = 0;
+    uint64_t evicted = 0;
+    uint64_t live = 0;
+    uint64_t peakLive = 0;
+    uint64_t peakBuffered = 0;
+
+    void add(const TransitionStats &o) {
+        sightings += o.sightings;
+        late += o.late;
+        transitions += o.transitions;
+        unconfirmed += o.unconfirmed;
+        expired += o.expired;
+        evicted += o.evicted;
+        live += o.live;
+        peakLive += o.peakLive;
+        peakBuffered += o.peakBuffered;
+    }
+};
+
+/**
+ * Sighting with corrected time.
+ */
+struct TransitionInput {
+    int64_t tsMs;
+    uint64_t address;
+    uint32_t logger;
+};
+
+inline bool operator>(const TransitionInput &a, const TransitionInput &b) {
+    return a.tsMs != b.tsMs ? a.tsMs > b.tsMs : a.logger != b.logger ? a.logger > b.logger : a.address > b.address;
+}
+
+inline uint64_t transitionHash(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+//----------------------------
+// CLOCK OFFSETS
+//----------------------------
+/**
+ * Per logger correction added to its timestamps.
+ *
+ * The lag (time received minus timestamp) of a logger is its publish delay minus its clock
+ * offset. The min. lag over the last TR_OFFSET_EPOCHS epochs is taken as the lag of a fresh message,
+ * corrections shift each logger to the median of these. Loggers publishing with similar
+ * min. delay (e.g. same BATCH_PUBLISH deadline) are aligned to some ms then.
+ * Estimates above maxCorrectionMs are taken as a backlog (offline logger, store and forward)
+ * rather than a clock offset; the correction is kept as it was.
+ */
+class LoggerClockOffsets {
+   public:
+    explicit LoggerClockOffsets(int64_t epochMs = 60 * 1000, int64_t maxCorrectionMs = 10 * 1000)
+        : epochMs(epochMs), maxCorrectionMs(maxCorrectionMs) {}
+
+    /**
+     * Fixed offset (logger clock minus true time), not estimated anymore.
+     */
+    void set(uint32_t logger, int64_t offsetMs) {
+        Entry &e = entry(logger);
+        e.fixed = true;
+        e.correctionMs = -offsetMs;
+    }
+
+    void observe(uint32_t logger, int64_t tsMs, int64_t receivedMs) {
+        Entry &e = entry(logger);
+        int64_t lag = receivedMs - tsMs;
+        int64_t &cur = e.minLag[epoch % TR_OFFSET_EPOCHS];
+        if (lag < cur) cur = lag;
+        if (epochEndMs == INT64_MIN) epochEndMs = receivedMs + epochMs;
+        if (receivedMs >= epochEndMs) {
+            roll();
+            epochEndMs = receivedMs + epochMs;
+        }
+    }
+
+    int64_t correction(uint32_t logger) const { return logger < entries.size() ? entries[logger].correctionMs : 0; }
+
+   private:
+    struct Entry {
+        Entry() { std::fill(minLag, minLag + TR_OFFSET_EPOCHS, INT64_MAX); }
+
+        int64_t lag() const { return *std::min_element(minLag, minLag + TR_OFFSET_EPOCHS); }
+
+        int64_t minLag[TR_OFFSET_EPOCHS];
+        int64_t correctionMs = 0;
+        bool fixed = false;
+    };
+
+    Entry &entry(uint32_t logger) {
+        if (logger >= entries.size()) entries.resize(logger + 1);
+        return entries[logger];
+    }
+
+    void roll() {
+        lags.clear();
+        for (const Entry &e : entries)
+            if (!e.fixed && e.lag() != INT64_MAX) lags.push_back(e.lag());
+        if (!lags.empty()) {
+            std::nth_element(lags.begin(), lags.begin() + lags.size() / 2, lags.end());
+            int64_t median = lags[lags.size() / 2];
+            for (Entry &e : entries) {
+                if (e.fixed || e.lag() == INT64_MAX) continue;
+                int64_t c = e.lag() - median;
+                if (c <= maxCorrectionMs && c >= -maxCorrectionMs) e.correctionMs = c;
+            }
+        }
+        epoch++;
+        for (Entry &e : entries) e.minLag[epoch % TR_OFFSET_EPOCHS] = INT64_MAX;
+    }
+
+    int64_t epochMs;
+    int64_t maxCorrectionMs;
+    int64_t epochEndMs = INT64_MIN;
+    uint32_t epoch = 0;
+    std::vector<Entry> entries;
+    std::vector<int64_t> lags;
+};
+
+//----------------------------
+// SHARD
+//----------------------------
+class TransitionShard {
+   public:
+    explicit TransitionShard(const TransitionConfig &config) : cfg(config), nodes(std::max<uint32_t>(config.maxAddresses, 1)) {
+        size_t slotCount = 2;
+        while (slotCount < (size_t)nodes.size() * 2) slotCount *= 2;
+        slots.assign(slotCount, 0);
+        shift = 64;
+        for (size_t s = slotCount; s > 1; s >>= 1) shift--;
+        for (uint32_t i = 0; i < nodes.size(); i++) nodes[i].next = i + 1 < nodes.size() ? i + 1 : NIL;
+        freeHead = 0;
+    }
+
+    /**
+     * Sink: sink(const Transition &).
+     */
+    template <typename Sink>
+    void push(const TransitionInput &in, Sink &sink) {
+        stats.sightings++;
+        if (in.tsMs < doneMs) {
+            stats.late++;
+            return;
+        }
+        buffer.push_back(in);
+        std::push_heap(buffer.begin(), buffer.end(), std::greater<TransitionInput>());
+        if (buffer.size() > stats.peakBuffered) stats.peakBuffered = buffer.size();
+        if (in.tsMs > maxTsMs) maxTsMs = in.tsMs;
+        drain(maxTsMs - cfg.latenessMs, sink);
+    }
+
+    /**
+     * Processes everything buffered (end of input).
+     */
+    template <typename Sink>
+    void flush(Sink &sink) {
+        drain(INT64_MAX, sink);
+    }
+
+    TransitionStats stats;
+
+   private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct Visit {
+        uint32_t logger;
+        uint32_t sightings;
+        int64_t firstMs;
+        int64_t lastMs;
+    };
+
+    struct Node {
+        uint64_t address;
+        int64_t lastMs;
+        Visit visit;
+        Visit candidate;
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    template <typename Sink>
+    void drain(int64_t watermark, Sink &sink) {
+        while (!buffer.empty() && buffer.front().tsMs <= watermark) {
+            std::pop_heap(buffer.begin(), buffer.end(), std::greater<TransitionInput>());
+            TransitionInput in = buffer.back();
+            buffer.pop_back();
+            process(in, sink);
+        }
+    }
+
+    template <typename Sink>
+    void process(const TransitionInput &in, Sink &sink) {
+        doneMs = in.tsMs;
+        while (lruHead != NIL && nodes[lruHead].lastMs < in.tsMs - cfg.windowMs) {
+            stats.expired++;
+            remove(lruHead);
+        }
+        size_t slot;
+        uint32_t i = find(in.address, slot);
+        if (i == NIL) {
+            i = insert(in.address, slot);
+            Node &n = nodes[i];
+            n.visit = {in.logger, 1, in.tsMs, in.tsMs};
+            n.candidate.logger = TR_NO_LOGGER;
+            n.lastMs = in.tsMs;
+            return;
+        }
+        Node &n = nodes[i];
+        n.lastMs = in.tsMs;
+        touch(i);
+        if (in.logger == n.visit.logger) {
+            n.visit.sightings++;
+            n.visit.lastMs = in.tsMs;
+            if (n.candidate.logger != TR_NO_LOGGER) stats.unconfirmed++;
+            n.candidate.logger = TR_NO_LOGGER;
+            return;
+        }
+        if (in.logger == n.candidate.logger) {
+            n.candidate.sightings++;
+            n.candidate.lastMs = in.tsMs;
+        } else {
+            if (n.candidate.logger != TR_NO_LOGGER) stats.unconfirmed++;
+            n.candidate = {in.logger, 1, in.tsMs, in.tsMs};
+        }
+        if (n.candidate.sightings < cfg.confirmSightings) return;
+        Transition t;
+        t.address = n.address;
+        t.from = n.visit.logger;
+        t.to = n.candidate.logger;
+        t.leftMs = n.visit.lastMs;
+        t.arrivedMs = n.candidate.firstMs;
+        t.dwellMs = n.visit.lastMs - n.visit.firstMs;
+        t.travelMs = t.arrivedMs - t.leftMs;
+        t.fromSightings = n.visit.sightings;
+        stats.transitions++;
+        sink(t);
+        n.visit = n.candidate;
+        n.candidate.logger = TR_NO_LOGGER;
+    }
+
+    // open addressing, slots hold node index + 1
+    size_t home(uint64_t address) const { return (size_t)(transitionHash(address) >> shift); }
+
+    uint32_t find(uint64_t address, size_t &slot) const {
+        size_t mask = slots.size() - 1;
+        for (slot = home(address);; slot = (slot + 1) & mask) {
+            uint32_t s = slots[slot];
+            if (s == 0) return NIL;
+            if (nodes[s - 1].address == address) return s - 1;
+        }
+    }
+
+    uint32_t insert(uint64_t address, size_t slot) {
+        if (freeHead == NIL) {
+            stats.evicted++;
+            remove(lruHead);
+            // slot may have moved by removal
+            find(address, slot);
+        }
+        uint32_t i = freeHead;
+        freeHead = nodes[i].next;
+        nodes[i].address = address;
+        slots[slot] = i + 1;
+        // append to LRU tail
+        nodes[i].prev = lruTail;
+        nodes[i].next = NIL;
+        if (lruTail != NIL) nodes[lruTail].next = i;
+        else lruHead = i;
+        lruTail = i;
+        if (++stats.live > stats.peakLive) stats.peakLive = stats.live;
+        return i;
+    }
+
+    void unlink(uint32_t i) {
+        Node &n = nodes[i];
+        if (n.prev != NIL) nodes[n.prev].next = n.next;
+        else lruHead = n.next;
+        if (n.next != NIL) nodes[n.next].prev = n.prev;
+        else lruTail = n.prev;
+    }
+
+    void touch(uint32_t i) {
+        if (i == lruTail) return;
+        unlink(i);
+        nodes[i].prev = lruTail;
+        nodes[i].next = NIL;
+        nodes[lruTail].next = i;
+        lruTail = i;
+    }
+
+    void remove(uint32_t i) {
+        size_t slot;
+        find(nodes[i].address, slot);
+        // backward shift deletion, keeps probe sequences without tombstones
+        size_t mask = slots.size() - 1;
+        size_t hole = slot;
+        for (size_t j = (hole + 1) & mask; slots[j] != 0; j = (j + 1) & mask) {
+            size_t h = home(nodes[slots[j] - 1].address);
+            // move entry j into hole if its home is not within (hole, j]
+            if (((j - h) & mask) >= ((j - hole) & mask)) {
+                slots[hole] = slots[j];
+                hole = j;
+            }
+        }
+        slots[hole] = 0;
+        unlink(i);
+        nodes[i].next = freeHead;
+        freeHead = i;
+        stats.live--;
+    }
+
+    TransitionConfig cfg;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> slots;
+    int shift;
+    uint32_t freeHead = NIL;
+    uint32_t lruHead = NIL;
+    uint32_t lruTail = NIL;
+    std::vector<TransitionInput> buffer;  // min-heap by time
+    int64_t maxTsMs = INT64_MIN;
+    int64_t doneMs = INT64_MIN;
+};
+
+//----------------------------
+// ENGINE
+//----------------------------
+/**
+ * Sink: sink(shard, const Transition &), called from the thread of the shard.
+ * push() and finish() are to be called from one thread. With threads 0 everything runs
+ * on the caller in one shard.
+ */
+template <typename Sink, size_t QueueLen = 1 << 14>
+class TransitionEngine {
+   public:
+    TransitionEngine(const TransitionConfig &cfg, unsigned threads, Sink &sink) : inline_(threads == 0) {
+        unsigned n = std::max(threads, 1u);
+        TransitionConfig shardCfg = cfg;
+        shardCfg.maxAddresses = cfg.maxAddresses / n;
+        for (unsigned s = 0; s < n; s++) shards.emplace_back(new Worker(shardCfg, s, sink));
+        if (!inline_)
+            for (auto &w : shards) {
+                Worker *p = w.get();
+                w->thread = std::thread([p] { p->run(); });
+            }
+    }
+
+    ~TransitionEngine() { finish(); }
+
+    /**
+     * Sighting as parsed; receivedMs >= 0 updates the estimate of clock offsets.
+     */
+    void push(const CollectorRecord &rec, int64_t receivedMs = -1) {
+        if (receivedMs >= 0 && correct) clockOffsets.observe(rec.logger, rec.tsMs, receivedMs);
+        TransitionInput in = {rec.tsMs + (correct ? clockOffsets.correction(rec.logger) : 0), rec.address, rec.logger};
+        Worker &w = *shards[transitionHash(rec.address) % shards.size()];
+        if (inline_) {
+            w.shard.push(in, w);
+            return;
+        }
+        // single producer: room stays once seen
+        while (w.queue.size() >= w.queue.capacity()) std::this_thread::yield();
+        w.queue.push(in);
+    }
+
+    /**
+     * Processes everything buffered and stops the threads.
+     */
+    void finish() {
+        if (finished) return;
+        finished = true;
+        for (auto &w : shards) {
+            if (inline_) w->shard.flush(*w);
+            else w->done.store(true, std::memory_order_release);
+        }
+        for (auto &w : shards)
+            if (w->thread.joinable()) w->thread.join();
+    }
+
+    /**
+     * Sum over shards, consistent after finish().
+     */
+    TransitionStats stats() const {
+        TransitionStats sum;
+        for (const auto &w : shards) sum.add(w->shard.stats);
+        return sum;
+    }
+
+    size_t shardCount() const { return shards.size(); }
+
+    LoggerClockOffsets clockOffsets;
+    bool correct = true;  // apply clockOffsets
+
+   private:
+    struct Worker {
+        Worker(const TransitionConfig &cfg, unsigned index, Sink &sink) : shard(cfg), index(index), sink(sink) {}
+
+        void run() {
+            TransitionInput in;
+            for (;;) {
+                bool any = false;
+                while (queue.pop(in)) {
+                    shard.push(in, *this);
+                    any = true;
+                }
+                if (any) continue;
+                // done is set after the last push, check queue once more
+                if (done.load(std::memory_order_acquire)) {
+                    while (queue.pop(in)) shard.push(in, *this);
+                    shard.flush(*this);
+                    return;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        void operator()(const Transition &t) { sink(index, t); }
+
+        TransitionShard shard;
+        unsigned index;
+        Sink &sink;
+        SpscQueue<TransitionInput, QueueLen> queue;
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+
+    bool inline_;
+    bool finished = false;
+    std::vector<std::unique_ptr<Worker>> shards;
+};
+
+#endif  // COLLECTOR_TRANSITIONS_KD_H
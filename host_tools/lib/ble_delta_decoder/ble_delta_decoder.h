@@ -0,0 +1,117 @@
+/**
+ * Reconstruction of full records from a delta encoded stream (see src/ble_delta.h), for backends.
+ *
+ * Feed every record of a sensor in the order received, e.g. as decoded by binDecodeRecord().
+ * JSON consumers fill a BleAdvRecord the same way: "delta" present sets
+ * BLE_DELTA_RECORD and rec.removed to its value, additionally missing "payloadLength"
+ * sets BLE_DELTA_SAME_META.
+ *
+ * Keep one decoder per sensor, since each sensor delta encodes on its own.
+ * Messages replayed from store (STORE_AND_FORWARD) arrive after newer ones. The logger stores
+ * them with full records only, which do not replace a newer base.
+ * */
+
+#ifndef BLE_DELTA_DECODER_KD_H
+#define BLE_DELTA_DECODER_KD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include "ble_delta.h"
+#include "ble_record.h"
+
+enum BleDeltaResult {
+    BLE_DELTA_FULL,     // full record (keyframe), taken as new base unless older than base
+    BLE_DELTA_MERGED,   // delta record completed from base
+    BLE_DELTA_NO_BASE,  // delta record of a device without keyframe so far, left as it is
+    BLE_DELTA_STALE     // delta record older than base (e.g. replayed from store), left as it is
+};
+
+/**
+ * True if optional fields covered by delta encoding and address type and payload length are equal.
+ */
+inline bool bleDeltaSameFields(const BleAdvRecord &a, const BleAdvRecord &b) {
+    uint8_t flags = a.flags & BLE_DELTA_FIELDS;
+    if (flags != (b.flags & BLE_DELTA_FIELDS) || a.addrType != b.addrType || a.payloadLength != b.payloadLength)
+        return false;
+    if ((flags & BLE_REC_HAVE_NAME) && strncmp(a.name, b.name, BLE_MAX_NAME_LEN) != 0) return false;
+    if ((flags & BLE_REC_HAVE_APPEARANCE) && a.appearance != b.appearance) return false;
+    if ((flags & BLE_REC_HAVE_MANUF_DATA) &&
+        (a.manufDataLen != b.manufDataLen || memcmp(a.manufData, b.manufData, a.manufDataLen) != 0)) return false;
+    if ((flags & BLE_REC_HAVE_SERVICE_UUID) &&
+        (a.serviceUUIDLen != b.serviceUUIDLen || memcmp(a.serviceUUID, b.serviceUUID, a.serviceUUIDLen) != 0)) return false;
+    if ((flags & BLE_REC_HAVE_TX_POWER) && a.txPower != b.txPower) return false;
+    if ((flags & BLE_REC_HAVE_FRAME) &&
+        (a.frameType != b.frameType || a.frameLen != b.frameLen || memcmp(a.frame, b.frame, a.frameLen) != 0)) return false;
+    return true;
+}
+
+class BleDeltaDecoder {
+   public:
+    /**
+     * Completes rec in place, on BLE_DELTA_FULL and BLE_DELTA_MERGED rec is a full record afterwards.
+     */
+    BleDeltaResult apply(BleAdvRecord &rec) {
+        uint64_t key = addrKey(rec.address);
+        auto it = last.find(key);
+        if (!(rec.delta & BLE_DELTA_RECORD)) {
+            rec.delta = 0;
+            rec.removed = 0;
+            if (it == last.end())
+                last[key] = rec;
+            else if (timeUs(rec) >= timeUs(it->second))
+                it->second = rec;
+            return BLE_DELTA_FULL;
+        }
+        if (it == last.end()) return BLE_DELTA_NO_BASE;
+        BleAdvRecord &base = it->second;
+        if (timeUs(rec) < timeUs(base)) return BLE_DELTA_STALE;
+
+        uint8_t missing = base.flags & ~rec.flags & ~rec.removed & BLE_DELTA_FIELDS;
+        if (missing & BLE_REC_HAVE_NAME) memcpy(rec.name, base.name, sizeof(rec.name));
+        if (missing & BLE_REC_HAVE_APPEARANCE) rec.appearance = base.appearance;
+        if (missing & BLE_REC_HAVE_MANUF_DATA) {
+            memcpy(rec.manufData, base.manufData, base.manufDataLen);
+            rec.manufDataLen = base.manufDataLen;
+        }
+        if (missing & BLE_REC_HAVE_SERVICE_UUID) {
+            memcpy(rec.serviceUUID, base.serviceUUID, base.serviceUUIDLen);
+            rec.serviceUUIDLen = base.serviceUUIDLen;
+        }
+        if (missing & BLE_REC_HAVE_TX_POWER) rec.txPower = base.txPower;
+        if (missing & BLE_REC_HAVE_FRAME) {
+            rec.frameType = base.frameType;
+            memcpy(rec.frame, base.frame, base.frameLen);
+            rec.frameLen = base.frameLen;
+        }
+        rec.flags |= missing;
+        if (rec.delta & BLE_DELTA_SAME_META) {
+            rec.addrType = base.addrType;
+            rec.payloadLength = base.payloadLength;
+        }
+        rec.delta = 0;
+        rec.removed = 0;
+        base = rec;
+        return BLE_DELTA_MERGED;
+    }
+
+    void clear() { last.clear(); }
+    size_t size() const { return last.size(); }
+
+   private:
+    static uint64_t addrKey(const uint8_t *address) {
+        uint64_t key = 0;
+        for (size_t i = 0; i < BLE_ADDR_LEN; i++) key = key << 8 | address[i];
+        return key;
+    }
+
+    static uint64_t timeUs(const BleAdvRecord &rec) {
+        return (uint64_t)rec.timestamp * 1000000 + rec.micros;
+    }
+
+    std::unordered_map<uint64_t, BleAdvRecord> last;
+};
+
+#endif  // BLE_DELTA_DECODER_KD_H
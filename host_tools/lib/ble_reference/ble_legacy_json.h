@@ -0,0 +1,117 @@
+/**
+ * Reference of the JSON record as the firmware wrote it before the fixed-buffer serializer:
+ * std::stringstream and addKeyValuePair() of the former ble.h, fed with the values the
+ * BLEAdvertisedDevice getters returned for a record (BLEAddress::toString,
+ * BLEUtils::buildHexData, BLEUUID::toString, snprintf "%d").
+ *
+ * serializeBleAdvRecord() (see src/ble_schema.h) has to write the same bytes for records
+ * without delta, window statistics or frame, which did not exist then.
+ * Allocates on every field like the original, which serializer_bench measures.
+ * */
+
+#ifndef BLE_LEGACY_JSON_KD_H
+#define BLE_LEGACY_JSON_KD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sstream>
+#include <string>
+
+#include "ble_record.h"
+
+inline std::string legacyKeyValuePair(std::string const &key, const std::string &value, bool first = false) {
+    // JSON
+    std::string s = (first ? "" : ", ") + std::string("\"") + key + std::string("\": \"") + value + std::string("\"");
+    return s;
+}
+inline std::string legacyKeyValuePair(const char *key, const char *value, bool first = false) {
+    return legacyKeyValuePair(std::string(key), std::string(value), first);
+}
+inline std::string legacyKeyValuePair(std::string const &key, int const &value, bool first = false) {
+    std::stringstream temp;
+    temp << value;
+    return legacyKeyValuePair(key, temp.str(), first);
+}
+
+// BLEAddress::toString()
+inline std::string legacyAddressString(const uint8_t *address) {
+    char s[18];
+    snprintf(s, sizeof(s), "%02x:%02x:%02x:%02x:%02x:%02x", address[0], address[1], address[2], address[3], address[4], address[5]);
+    return s;
+}
+
+// BLEUtils::buildHexData()
+inline std::string legacyHexData(const uint8_t *data, size_t len) {
+    std::string s;
+    char hex[3];
+    for (size_t i = 0; i < len; i++) {
+        snprintf(hex, sizeof(hex), "%02x", data[i]);
+        s += hex;
+    }
+    return s;
+}
+
+// BLEUUID::toString(), uuid little endian
+inline std::string legacyUUIDString(const uint8_t *uuid, size_t len) {
+    char s[37];
+    if (len == 2) {
+        snprintf(s, sizeof(s), "0000%04x-0000-1000-8000-00805f9b34fb", (unsigned)(uuid[0] | uuid[1] << 8));
+    } else if (len == 4) {
+        snprintf(s, sizeof(s), "%08x-0000-1000-8000-00805f9b34fb", (unsigned)((uint32_t)uuid[0] | (uint32_t)uuid[1] << 8 | (uint32_t)uuid[2] << 16 | (uint32_t)uuid[3] << 24));
+    } else {
+        const uint8_t *u = uuid;
+        snprintf(s, sizeof(s), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", u[15], u[14], u[13], u[12], u[11],
+                 u[10], u[9], u[8], u[7], u[6], u[5], u[4], u[3], u[2], u[1], u[0]);
+    }
+    return s;
+}
+
+/**
+ * addBleDeviceToStringStream() of the former ble.h, on a record instead of a BLEAdvertisedDevice.
+ */
+inline void legacyAddRecordToStringStream(std::stringstream &ss, const BleAdvRecord &rec) {
+    ss << "{";
+
+    ss << legacyKeyValuePair("address", legacyAddressString(rec.address), true);
+    if (bleRecHas(rec, BLE_REC_HAVE_NAME)) {
+        ss << legacyKeyValuePair("name", rec.name);
+    }
+
+    if (bleRecHas(rec, BLE_REC_HAVE_APPEARANCE)) {
+        char val[6];
+        snprintf(val, sizeof(val), "%d", rec.appearance);
+        ss << legacyKeyValuePair("appearance", val);
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_MANUF_DATA)) {
+        ss << legacyKeyValuePair("manufData", legacyHexData(rec.manufData, rec.manufDataLen));
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_SERVICE_UUID)) {
+        ss << legacyKeyValuePair("serviceUUID", legacyUUIDString(rec.serviceUUID, rec.serviceUUIDLen));
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_TX_POWER)) {
+        char val[6];
+        snprintf(val, sizeof(val), "%d", rec.txPower);
+        ss << legacyKeyValuePair("txPower", val);
+    }
+
+    if (bleRecHas(rec, BLE_REC_HAVE_RSSI)) {
+        ss << legacyKeyValuePair("rssi", rec.rssi);
+    }
+    ss << legacyKeyValuePair("payloadLength", rec.payloadLength);
+    ss << legacyKeyValuePair("addrType", rec.addrType);
+
+    // unsigned long passed as int, as before
+    ss << legacyKeyValuePair("timestamp", (int)rec.timestamp);
+    ss << legacyKeyValuePair("micros", (int)rec.micros);
+
+    ss << "}";
+}
+
+inline std::string legacySerialize(const BleAdvRecord &rec) {
+    std::stringstream ss;
+    legacyAddRecordToStringStream(ss, rec);
+    return ss.str();
+}
+
+#endif  // BLE_LEGACY_JSON_KD_H
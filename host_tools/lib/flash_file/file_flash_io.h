@@ -0,0 +1,109 @@
+/**
+ * FlashIo on a file (see src/flash_log.h), to run the flash log natively.
+ *
+ * Behaves as NOR flash: erased bytes are 0xff, writes only clear bits (new = old & data)
+ * and setting a bit without erase is counted as violation.
+ * For power loss tests a budget of bytes can be set: the write crossing it is cut after the
+ * bytes within budget (an erase counts as one byte and is done all or nothing), and all
+ * further access fails until the file is opened again.
+ * */
+
+#ifndef FILE_FLASH_IO_KD_H
+#define FILE_FLASH_IO_KD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "flash_log.h"
+
+class FileFlashIo : public FlashIo {
+   public:
+    ~FileFlashIo() { close(); }
+
+    /**
+     * Opens path, creates it erased with sectors * FLASH_LOG_SECTOR_SIZE bytes if it does not exist.
+     */
+    bool open(const char *path, size_t sectors) {
+        close();
+        bytes = sectors * FLASH_LOG_SECTOR_SIZE;
+        file = fopen(path, "r+b");
+        if (file == nullptr) {
+            file = fopen(path, "w+b");
+            if (file == nullptr) return false;
+            uint8_t erased[FLASH_LOG_SECTOR_SIZE];
+            memset(erased, 0xff, sizeof(erased));
+            for (size_t s = 0; s < sectors; s++)
+                if (fwrite(erased, 1, sizeof(erased), file) != sizeof(erased)) return false;
+        }
+        powerLost = false;
+        budget = SIZE_MAX;
+        return fflush(file) == 0;
+    }
+
+    void close() {
+        if (file != nullptr) fclose(file);
+        file = nullptr;
+    }
+
+    // bytes (and erases) still done before power is lost, SIZE_MAX for no limit
+    void losePowerAfter(size_t n) { budget = n; }
+    bool powerWasLost() const { return powerLost; }
+    // writes that tried to set bits
+    uint32_t violationCount() const { return violations; }
+
+    size_t size() override { return bytes; }
+
+    bool read(size_t offset, void *buf, size_t len) override {
+        if (!usable(offset, len)) return false;
+        return fseek(file, (long)offset, SEEK_SET) == 0 && fread(buf, 1, len, file) == len;
+    }
+
+    bool write(size_t offset, const void *buf, size_t len) override {
+        if (!usable(offset, len)) return false;
+        size_t n = len <= budget ? len : budget;
+        uint8_t old[FLASH_LOG_SECTOR_SIZE];
+        const uint8_t *data = (const uint8_t *)buf;
+        for (size_t done = 0; done < n;) {
+            size_t chunk = n - done < sizeof(old) ? n - done : sizeof(old);
+            if (fseek(file, (long)(offset + done), SEEK_SET) != 0 || fread(old, 1, chunk, file) != chunk) return false;
+            for (size_t i = 0; i < chunk; i++) {
+                if ((data[done + i] & ~old[i]) != 0) violations++;
+                old[i] &= data[done + i];
+            }
+            if (fseek(file, (long)(offset + done), SEEK_SET) != 0 || fwrite(old, 1, chunk, file) != chunk) return false;
+            done += chunk;
+        }
+        return spend(n, len) && fflush(file) == 0;
+    }
+
+    bool eraseSector(size_t offset) override {
+        if (!usable(offset, FLASH_LOG_SECTOR_SIZE) || offset % FLASH_LOG_SECTOR_SIZE != 0) return false;
+        if (budget == 0) return spend(0, 1);
+        uint8_t erased[FLASH_LOG_SECTOR_SIZE];
+        memset(erased, 0xff, sizeof(erased));
+        if (fseek(file, (long)offset, SEEK_SET) != 0 || fwrite(erased, 1, sizeof(erased), file) != sizeof(erased)) return false;
+        return spend(1, 1) && fflush(file) == 0;
+    }
+
+   private:
+    bool usable(size_t offset, size_t len) const {
+        return file != nullptr && !powerLost && offset <= bytes && len <= bytes - offset;
+    }
+
+    // done of wanted within budget, returns false if power was lost
+    bool spend(size_t done, size_t wanted) {
+        if (budget == SIZE_MAX) return true;
+        budget -= done;
+        if (done < wanted) powerLost = true;
+        return !powerLost;
+    }
+
+    FILE *file = nullptr;
+    size_t bytes = 0;
+    size_t budget = SIZE_MAX;
+    bool powerLost = false;
+    uint32_t violations = 0;
+};
+
+#endif  // FILE_FLASH_IO_KD_H
@@ -0,0 +1,362 @@
+/**
+ * Benchmark of ingesting raw advertisements into records (see src/ble_adv_parser.h).
+ *
+ * Advertisements of a synthetic device population (iBeacons, Apple and Microsoft devices,
+ * named and unnamed others) go through the filter rules and the window duplicate filter
+ * along three paths:
+ *   - "device": as the BLEScan path, an object like BLEAdvertisedDevice is built (std::string name and
+ *     manufacturer data, a vector of UUID objects, a heap copy of the payload), handed to the callback
+ *     by value and copied into a record (fillBleAdvRecord() in ble.h), which is filtered afterwards.
+ *     BLEAdvertisedDevice itself needs the ESP32 BLE library, so it is modelled after its parseAdvertisement().
+ *   - "raw fill": fillBleAdvRecordFromRaw(), then filter rules and duplicate filter.
+ *   - "view": BleAdView, filter rules and duplicate filter on the view, record filled for kept ones only
+ *     (onGapEvent() in ble.h).
+ *
+ * Usage:
+ *   adv_parse_bench [--advs <n>] [--devices <n>] [--rssi-floor <dBm>] [--window <advs>]
+ *
+ * Reports time and heap allocations per advertisement, and the number of records kept (equal for all paths).
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_adv_parser.h"
+#include "ble_filter.h"
+#include "ble_record.h"
+#include "ble_seen_set.h"
+
+// as in globals_kd.h
+#define SEEN_SET_SIZE 1024
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct Options {
+    size_t advs = 1000000;
+    size_t devices = 200;
+    int rssiFloor = -90;
+    size_t window = 2000;  // advertisements per scan window
+};
+
+struct RawAdv {
+    uint8_t address[BLE_ADDR_LEN];
+    uint8_t addrType;
+    int8_t rssi;
+    uint8_t len;
+    uint8_t data[BLE_MAX_PAYLOAD_LEN];
+};
+
+/**
+ * Model of BLEUUID (esp_bt_uuid_t and a flag).
+ */
+struct UuidModel {
+    uint16_t len;
+    uint8_t uuid[16];
+    bool valueSet;
+};
+
+/**
+ * Model of BLEAdvertisedDevice with the members filled by parseAdvertisement().
+ */
+struct DeviceModel {
+    uint8_t address[BLE_ADDR_LEN];
+    uint8_t addrType;
+    int rssi;
+    bool haveName = false, haveManufacturerData = false, haveAppearance = false, haveTxPower = false;
+    std::string name;
+    std::string manufacturerData;
+    uint16_t appearance = 0;
+    int8_t txPower = 0;
+    std::vector<UuidModel> serviceUUIDs;
+    std::vector<std::string> serviceData;
+    std::vector<UuidModel> serviceDataUUIDs;
+    uint8_t *payload = nullptr;
+    size_t payloadLength = 0;
+
+    DeviceModel() = default;
+    DeviceModel(const DeviceModel &o)
+        : addrType(o.addrType), rssi(o.rssi), haveName(o.haveName), haveManufacturerData(o.haveManufacturerData),
+          haveAppearance(o.haveAppearance), haveTxPower(o.haveTxPower), name(o.name), manufacturerData(o.manufacturerData),
+          appearance(o.appearance), txPower(o.txPower), serviceUUIDs(o.serviceUUIDs), serviceData(o.serviceData),
+          serviceDataUUIDs(o.serviceDataUUIDs), payloadLength(o.payloadLength) {
+        memcpy(address, o.address, BLE_ADDR_LEN);
+        // BLEAdvertisedDevice copies only the pointer, which is freed with the original
+        payload = o.payload;
+    }
+    ~DeviceModel() {}
+
+    void parse(const RawAdv &adv) {
+        memcpy(address, adv.address, BLE_ADDR_LEN);
+        addrType = adv.addrType;
+        rssi = adv.rssi;
+        payload = (uint8_t *)malloc(adv.len);
+        allocations++;
+        memcpy(payload, adv.data, adv.len);
+        payloadLength = adv.len;
+        size_t pos = 0;
+        while (pos < adv.len) {
+            size_t adLen = adv.data[pos];
+            if (adLen == 0 || pos + 1 + adLen > adv.len) break;
+            uint8_t type = adv.data[pos + 1];
+            const uint8_t *v = adv.data + pos + 2;
+            size_t vLen = adLen - 1;
+            switch (type) {
+                case BLE_AD_NAME_SHORT:
+                case BLE_AD_NAME_CMPL:
+                    name = std::string((const char *)v, vLen);
+                    haveName = true;
+                    break;
+                case BLE_AD_TX_PWR:
+                    txPower = (int8_t)v[0];
+                    haveTxPower = true;
+                    break;
+                case BLE_AD_APPEARANCE:
+                    appearance = v[0] | (v[1] << 8);
+                    haveAppearance = true;
+                    break;
+                case BLE_AD_MANUFACTURER:
+                    manufacturerData = std::string((const char *)v, vLen);
+                    haveManufacturerData = true;
+                    break;
+                case BLE_AD_16SRV_PART:
+                case BLE_AD_16SRV_CMPL:
+                    for (size_t i = 0; i + 2 <= vLen; i += 2) addUuid(serviceUUIDs, v + i, 2);
+                    break;
+                case BLE_AD_128SRV_PART:
+                case BLE_AD_128SRV_CMPL:
+                    for (size_t i = 0; i + 16 <= vLen; i += 16) addUuid(serviceUUIDs, v + i, 16);
+                    break;
+                case 0x16:
+                    if (vLen >= 2) {
+                        addUuid(serviceDataUUIDs, v, 2);
+                        serviceData.push_back(std::string((const char *)v + 2, vLen - 2));
+                    }
+                    break;
+                default:
+                    break;
+            }
+            pos += 1 + adLen;
+        }
+    }
+
+    void release() { free(payload); }
+
+    static void addUuid(std::vector<UuidModel> &list, const uint8_t *v, size_t len) {
+        UuidModel u = {};
+        u.len = (uint16_t)len;
+        memcpy(u.uuid, v, len);
+        u.valueSet = true;
+        list.push_back(u);
+    }
+};
+
+/**
+ * As fillBleAdvRecord() in ble.h.
+ */
+static void fillFromDevice(BleAdvRecord &rec, DeviceModel device) {
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.address, device.address, BLE_ADDR_LEN);
+    rec.addrType = device.addrType;
+    rec.payloadLength = device.payloadLength;
+    if (device.haveName) {
+        const std::string name = device.name;
+        bleRecSetName(rec, name.data(), name.length());
+    }
+    if (device.haveAppearance) {
+        rec.appearance = device.appearance;
+        rec.flags |= BLE_REC_HAVE_APPEARANCE;
+    }
+    if (device.haveManufacturerData) {
+        const std::string md = device.manufacturerData;
+        bleRecSetManufData(rec, (const uint8_t *)md.data(), md.length());
+    }
+    if (!device.serviceUUIDs.empty()) {
+        UuidModel uuid = device.serviceUUIDs[0];
+        bleRecSetServiceUUID(rec, uuid.uuid, uuid.len);
+    }
+    if (device.haveTxPower) {
+        rec.txPower = device.txPower;
+        rec.flags |= BLE_REC_HAVE_TX_POWER;
+    }
+    rec.rssi = (int8_t)device.rssi;
+    rec.flags |= BLE_REC_HAVE_RSSI;
+}
+
+static size_t putAd(uint8_t *out, size_t pos, uint8_t type, const uint8_t *v, size_t len) {
+    if (pos + 2 + len > BLE_MAX_PAYLOAD_LEN) return pos;
+    out[pos] = (uint8_t)(len + 1);
+    out[pos + 1] = type;
+    memcpy(out + pos + 2, v, len);
+    return pos + 2 + len;
+}
+
+static void makeAdvs(std::vector<RawAdv> &advs, const Options &opt) {
+    std::mt19937 rng(1);
+    std::vector<RawAdv> devices(opt.devices);
+    for (RawAdv &d : devices) {
+        memset(&d, 0, sizeof(d));
+        for (uint8_t &b : d.address) b = (uint8_t)rng();
+        d.addrType = rng() % 2;
+        size_t pos = 0;
+        uint8_t flags = 0x06;
+        pos = putAd(d.data, pos, BLE_AD_FLAGS, &flags, 1);
+        uint8_t v[26];
+        for (uint8_t &b : v) b = (uint8_t)rng();
+        switch (rng() % 5) {
+            case 0:  // iBeacon
+                v[0] = 0x4c, v[1] = 0x00, v[2] = 0x02, v[3] = 0x15;
+                pos = putAd(d.data, pos, BLE_AD_MANUFACTURER, v, 25);
+                break;
+            case 1:  // Apple continuity
+                v[0] = 0x4c, v[1] = 0x00, v[2] = 0x10, v[3] = 0x05;
+                pos = putAd(d.data, pos, BLE_AD_MANUFACTURER, v, 9);
+                break;
+            case 2:  // Microsoft (dropped by rule)
+                v[0] = 0x06, v[1] = 0x00;
+                pos = putAd(d.data, pos, BLE_AD_MANUFACTURER, v, 26);
+                break;
+            default: {
+                char name[16];
+                int n = snprintf(name, sizeof(name), "Sensor %u", (unsigned)(rng() % 10000));
+                pos = putAd(d.data, pos, BLE_AD_NAME_CMPL, (const uint8_t *)name, n);
+                uint8_t uuid[2] = {0x0f, 0x18};
+                pos = putAd(d.data, pos, BLE_AD_16SRV_CMPL, uuid, 2);
+                uint8_t tx = 0xf4;
+                pos = putAd(d.data, pos, BLE_AD_TX_PWR, &tx, 1);
+                break;
+            }
+        }
+        d.len = (uint8_t)pos;
+    }
+    advs.reserve(opt.advs);
+    std::normal_distribution<double> rssi(-75, 12);
+    for (size_t i = 0; i < opt.advs; i++) {
+        RawAdv a = devices[rng() % devices.size()];
+        a.rssi = (int8_t)std::max(-127.0, std::min(-20.0, rssi(rng)));
+        advs.push_back(a);
+    }
+}
+
+struct Result {
+    double nsPerAdv;
+    double allocsPerAdv;
+    size_t kept;
+    uint64_t checksum;
+};
+
+static void keep(Result &r, const BleAdvRecord &rec) {
+    r.kept++;
+    r.checksum += rec.payloadLength + rec.manufDataLen + rec.name[0] + (uint8_t)rec.rssi;
+}
+
+template <typename F>
+static Result run(const std::vector<RawAdv> &advs, const Options &opt, F ingest) {
+    BleSeenSet<SEEN_SET_SIZE> seenSet;
+    Result r = {};
+    uint64_t allocStart = allocations;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < advs.size(); i++) {
+        uint16_t window = (uint16_t)(i / opt.window + 1);
+        ingest(advs[i], seenSet, window, r);
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    r.nsPerAdv = sec * 1e9 / advs.size();
+    r.allocsPerAdv = (double)(allocations - allocStart) / advs.size();
+    return r;
+}
+
+static void printRow(const char *name, const Result &r) {
+    printf("%-10s %10.1f %10.2f %10zu\n", name, r.nsPerAdv, r.allocsPerAdv, r.kept);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: adv_parse_bench [--advs <n>] [--devices <n>] [--rssi-floor <dBm>] [--window <advs>]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--advs" && hasValue) {
+            opt.advs = std::max(1, atoi(argv[++i]));
+        } else if (a == "--devices" && hasValue) {
+            opt.devices = std::max(1, atoi(argv[++i]));
+        } else if (a == "--rssi-floor" && hasValue) {
+            opt.rssiFloor = atoi(argv[++i]);
+        } else if (a == "--window" && hasValue) {
+            opt.window = std::max(1, atoi(argv[++i]));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<RawAdv> advs;
+    makeAdvs(advs, opt);
+
+    BleFilter<> filter;
+    filter.rssiFloor = (int8_t)std::max(-128, std::min(127, opt.rssiFloor));
+    filter.addCompanyRule(BLE_COMPANY_MICROSOFT, BLE_FILTER_DROP);
+
+    Result device = run(advs, opt, [&](const RawAdv &adv, BleSeenSet<SEEN_SET_SIZE> &seen, uint16_t window, Result &r) {
+        DeviceModel d;
+        d.parse(adv);
+        BleAdvRecord rec;
+        // onResult() gets the device by value
+        fillFromDevice(rec, d);
+        d.release();
+        if (filter.evaluate(rec) == BLE_FILTER_DROP) return;
+        if (!seen.markSeen(adv.address, window)) return;
+        keep(r, rec);
+    });
+    Result raw = run(advs, opt, [&](const RawAdv &adv, BleSeenSet<SEEN_SET_SIZE> &seen, uint16_t window, Result &r) {
+        BleAdvRecord rec;
+        fillBleAdvRecordFromRaw(rec, adv.address, adv.addrType, adv.rssi, adv.data, adv.len);
+        if (filter.evaluate(rec) == BLE_FILTER_DROP) return;
+        if (!seen.markSeen(adv.address, window)) return;
+        keep(r, rec);
+    });
+    Result view = run(advs, opt, [&](const RawAdv &adv, BleSeenSet<SEEN_SET_SIZE> &seen, uint16_t window, Result &r) {
+        BleAdView v(adv.address, adv.addrType, adv.rssi, adv.data, adv.len);
+        if (filter.evaluate(v) == BLE_FILTER_DROP) return;
+        if (!seen.markSeen(adv.address, window)) return;
+        BleAdvRecord rec;
+        v.fill(rec);
+        keep(r, rec);
+    });
+
+    printf("%zu advertisements of %zu devices, %zu per window, rssi floor %d dBm, company 0x0006 dropped.\n\n", advs.size(),
+           opt.devices, opt.window, opt.rssiFloor);
+    printf("%-10s %10s %10s %10s\n", "", "ns/adv", "allocs/adv", "kept");
+    printRow("device", device);
+    printRow("raw fill", raw);
+    printRow("view", view);
+    if (device.kept != view.kept || raw.kept != view.kept || device.checksum != view.checksum || raw.checksum != view.checksum) {
+        fprintf(stderr, "ERR: paths kept different records.\n");
+        return 1;
+    }
+    return 0;
+}
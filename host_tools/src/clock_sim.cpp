@@ -0,0 +1,164 @@
+/**
+ * Simulation of clock discipline (see src/clock_discipline.h) against a drifting crystal.
+ *
+ * The monotonic clock runs off by a drift (ppm) that wanders randomly per hour.
+ * Every sync interval, SNTP delivers the true time plus normal distributed jitter.
+ * Timestamps are compared to true time every 100 ms for
+ *   - "sntp step": system time set on each sync and running on monotonic time in between
+ *     (as gettimeofday() does),
+ *   - "discipline": monotonic time mapped by ClockDiscipline.
+ *
+ * Usage:
+ *   clock_sim [--hours <h>] [--drift-ppm <ppm>] [--wander-ppm <ppm per hour>] [--jitter-ms <ms>] [--interval-s <s>] [--seed <n>]
+ *
+ * Reports error against true time (mean, p99 and max of absolute value), the largest step
+ * between two timestamps (beyond true elapsed time), how often time ran backwards, and for
+ * the discipline how often the error was within errorBoundUs() and its mean.
+ * The first hour is left out (warm-up).
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "clock_discipline.h"
+
+struct Options {
+    double hours = 48;
+    double driftPpm = 25;
+    double wanderPpm = 1;
+    double jitterMs = 10;
+    uint32_t intervalS = 900;
+    uint32_t seed = 1;
+};
+
+struct Stats {
+    std::vector<double> errors;  // absolute, us
+    double maxStepUs = 0;
+    uint64_t backwards = 0;
+    uint64_t withinBound = 0;
+    double boundSum = 0;
+    bool havePrev = false;
+    int64_t prevStamp = 0;
+    int64_t prevTrue = 0;
+
+    void add(int64_t stamp, int64_t trueUs, bool counted) {
+        if (havePrev) {
+            double step = std::fabs((double)((stamp - prevStamp) - (trueUs - prevTrue)));
+            if (counted) maxStepUs = std::max(maxStepUs, step);
+            if (counted && stamp < prevStamp) backwards++;
+        }
+        havePrev = true;
+        prevStamp = stamp;
+        prevTrue = trueUs;
+        if (counted) errors.push_back(std::fabs((double)(stamp - trueUs)));
+    }
+};
+
+static void printRow(const char *name, Stats &s, bool withBound) {
+    std::sort(s.errors.begin(), s.errors.end());
+    double sum = 0;
+    for (double e : s.errors) sum += e;
+    size_t n = s.errors.size();
+    printf("%-11s %9.2f %9.2f %9.2f %9.2f %9llu", name, sum / n / 1000, s.errors[n * 99 / 100] / 1000, s.errors.back() / 1000,
+           s.maxStepUs / 1000, (unsigned long long)s.backwards);
+    if (withBound)
+        printf(" %8.2f%% %9.2f", 100.0 * s.withinBound / n, s.boundSum / n / 1000);
+    printf("\n");
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clock_sim [--hours <h>] [--drift-ppm <ppm>] [--wander-ppm <ppm per hour>] [--jitter-ms <ms>] [--interval-s <s>] [--seed <n>]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--hours" && hasValue) {
+            opt.hours = std::max(2.0, atof(argv[++i]));
+        } else if (a == "--drift-ppm" && hasValue) {
+            opt.driftPpm = atof(argv[++i]);
+        } else if (a == "--wander-ppm" && hasValue) {
+            opt.wanderPpm = std::max(0.0, atof(argv[++i]));
+        } else if (a == "--jitter-ms" && hasValue) {
+            opt.jitterMs = std::max(0.0, atof(argv[++i]));
+        } else if (a == "--interval-s" && hasValue) {
+            opt.intervalS = std::max(15, atoi(argv[++i]));
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::mt19937 rng(opt.seed);
+    std::normal_distribution<double> jitter(0, opt.jitterMs * 1000);
+    std::normal_distribution<double> wander(0, opt.wanderPpm);
+
+    const int64_t stepUs = 100000;
+    const int64_t epochStartUs = 1651042693LL * 1000000;
+    const int64_t endUs = (int64_t)(opt.hours * 3600e6);
+    const int64_t warmUpUs = 3600LL * 1000000;
+    const int64_t intervalUs = (int64_t)opt.intervalS * 1000000;
+
+    ClockDiscipline<> discipline;
+    Stats step, disc;
+    double drift = opt.driftPpm;
+    double mono = 0;  // us, fractional
+    int64_t nextSyncUs = 5LL * 1000000;  // first sync after boot
+    int64_t nextWanderUs = 3600LL * 1000000;
+    bool synced = false;
+    int64_t stepSyncMono = 0, stepSyncEpoch = 0;
+
+    for (int64_t t = 0; t <= endUs; t += stepUs) {
+        // true time t (since boot), monotonic clock slow by drift
+        if (t > 0) mono += stepUs * (1 - drift / 1e6);
+        if (t >= nextWanderUs) {
+            drift += wander(rng);
+            nextWanderUs += 3600LL * 1000000;
+        }
+        int64_t monoUs = (int64_t)mono;
+        int64_t trueEpochUs = epochStartUs + t;
+        if (t >= nextSyncUs) {
+            int64_t received = trueEpochUs + (int64_t)llround(jitter(rng));
+            discipline.sync(monoUs, received);
+            stepSyncMono = monoUs;
+            stepSyncEpoch = received;
+            synced = true;
+            nextSyncUs += intervalUs;
+        }
+        if (!synced) continue;
+        bool counted = t >= warmUpUs;
+        step.add(stepSyncEpoch + (monoUs - stepSyncMono), trueEpochUs, counted);
+        int64_t mapped = discipline.toEpochUs(monoUs);
+        disc.add(mapped, trueEpochUs, counted);
+        if (counted) {
+            uint32_t bound = discipline.errorBoundUs(monoUs);
+            if (std::fabs((double)(mapped - trueEpochUs)) <= bound) disc.withinBound++;
+            disc.boundSum += bound;
+        }
+    }
+
+    printf("%.0f h, drift %.1f ppm (wander %.1f ppm/h), sync every %u s with jitter %.1f ms, %u syncs, %u steps.\n",
+           opt.hours, opt.driftPpm, opt.wanderPpm, opt.intervalS, opt.jitterMs, discipline.syncCount(), discipline.stepCount());
+    printf("Estimated drift %.3f ppm (true %.3f ppm), jitter %.2f ms.\n\n", discipline.driftPpb() / 1000.0, drift,
+           discipline.jitterUs() / 1000.0);
+    printf("%-11s %9s %9s %9s %9s %9s %9s %9s\n", "", "mean ms", "p99 ms", "max ms", "step ms", "backwards", "in bound",
+           "bound ms");
+    printRow("sntp step", step, false);
+    printRow("discipline", disc, true);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * Benchmark of write coalescing (see src/write_coalescer.h) against a mock Client.
+ *
+ * Sensor records of a synthetic device population are serialized (JSON or binary) and wrapped into
+ * MQTT PUBLISH packets as PubSubClient does (one write() per packet). The packets are written
+ * to a mock Client directly and through WriteCoalescer of several buffer sizes.
+ * Time is simulated: records arrive at a fixed rate and the buffer is flushed at each window end,
+ * as BufferedClient in the firmware does.
+ *
+ * Usage:
+ *   coalesce_bench [--records <n>] [--rate <records/s>] [--devices <n>] [--window <s>] [--delay-ms <ms>] [--binary]
+ *
+ * Reports write calls, payload bytes, estimated bytes on the wire (TLS 1.2 AES-GCM adds
+ * 29 bytes per record: 5 header, 8 nonce, 16 tag), the time packets waited in the buffer
+ * and CPU time per packet.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_binary.h"
+#include "ble_json.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+#include "write_coalescer.h"
+
+// as in globals_kd.h
+#define MAX_MQTT_MESSAGE_SIZE 512
+#define MQTT_MAX_HEADER_SIZE 5
+#define TLS_RECORD_OVERHEAD 29
+
+static const char *TOPIC = "sensor/BLE/Scanner/ssid_from_AP_1/esp32_ble_scan_0001";
+
+struct Options {
+    size_t records = 100000;
+    uint32_t rate = 200;
+    size_t devices = 100;
+    uint32_t windowSec = 10;
+    uint32_t delayMs = 100;
+    bool binary = false;
+};
+
+/**
+ * Counts write calls and bytes, and the time packets waited since they were handed over.
+ */
+struct MockClient {
+    uint64_t writes = 0;
+    uint64_t bytes = 0;
+    uint32_t nowMs = 0;
+    std::vector<uint32_t> pendingMs;  // hand-over time of packets not written yet
+    uint64_t delaySumMs = 0;
+    uint32_t delayMaxMs = 0;
+
+    size_t write(const uint8_t *buf, size_t size) {
+        (void)buf;
+        writes++;
+        bytes += size;
+        for (uint32_t t : pendingMs) {
+            delaySumMs += nowMs - t;
+            delayMaxMs = std::max(delayMaxMs, nowMs - t);
+        }
+        pendingMs.clear();
+        return size;
+    }
+};
+
+/**
+ * MQTT PUBLISH packet (QoS 0) as built by PubSubClient::publish().
+ */
+static size_t mqttPublishPacket(uint8_t *out, const char *topic, const uint8_t *payload, size_t len) {
+    size_t topicLen = strlen(topic);
+    size_t remaining = 2 + topicLen + len;
+    size_t pos = 0;
+    out[pos++] = 0x30;
+    do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        if (remaining > 0) digit |= 0x80;
+        out[pos++] = digit;
+    } while (remaining > 0);
+    out[pos++] = (uint8_t)(topicLen >> 8);
+    out[pos++] = (uint8_t)topicLen;
+    memcpy(out + pos, topic, topicLen);
+    pos += topicLen;
+    memcpy(out + pos, payload, len);
+    return pos + len;
+}
+
+static void makeDevices(std::vector<BleAdvRecord> &devices, size_t n) {
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < n; i++) {
+        BleAdvRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        for (size_t b = 0; b < BLE_ADDR_LEN; b++) rec.address[b] = (uint8_t)rng();
+        rec.addrType = rng() % 2;
+        rec.payloadLength = 10 + rng() % 50;
+        if (rng() % 10 < 3) {
+            char name[16];
+            snprintf(name, sizeof(name), "Device %u", (unsigned)(rng() % 10000));
+            bleRecSetName(rec, name, strlen(name));
+        }
+        if (rng() % 10 < 6) {
+            uint8_t data[26];
+            for (uint8_t &d : data) d = (uint8_t)rng();
+            bleRecSetManufData(rec, data, 4 + rng() % 22);
+        }
+        devices.push_back(rec);
+    }
+}
+
+/**
+ * Serialized sensor messages as MQTT packets.
+ */
+static std::vector<std::vector<uint8_t>> makePackets(const Options &opt) {
+    std::vector<BleAdvRecord> devices;
+    makeDevices(devices, opt.devices);
+    std::mt19937 rng(2);
+    std::vector<std::vector<uint8_t>> packets;
+    packets.reserve(opt.records);
+    uint8_t payload[MAX_MQTT_MESSAGE_SIZE];
+    uint8_t packet[MAX_MQTT_MESSAGE_SIZE + MQTT_MAX_HEADER_SIZE + 64];
+    for (size_t i = 0; i < opt.records; i++) {
+        BleAdvRecord rec = devices[rng() % devices.size()];
+        rec.rssi = -40 - (int8_t)(rng() % 60);
+        rec.flags |= BLE_REC_HAVE_RSSI;
+        rec.timestamp = 1651042693 + (uint32_t)(i / opt.rate);
+        rec.micros = rng() % 1000000;
+        size_t len = opt.binary ? binEncodeMessage(payload, sizeof(payload), rec)
+                                : serializeBleAdvRecord((char *)payload, sizeof(payload), rec);
+        size_t n = mqttPublishPacket(packet, TOPIC, payload, len);
+        packets.emplace_back(packet, packet + n);
+    }
+    return packets;
+}
+
+static void printRow(const char *name, const MockClient &mock, size_t packets, double sec) {
+    uint64_t wire = mock.bytes + mock.writes * TLS_RECORD_OVERHEAD;
+    printf("%-10s %10llu %8.2f %12llu %12llu %8.1f %8u %8.1f\n", name, (unsigned long long)mock.writes,
+           (double)packets / mock.writes, (unsigned long long)mock.bytes, (unsigned long long)wire,
+           (double)mock.delaySumMs / packets, mock.delayMaxMs, sec * 1e9 / packets);
+}
+
+static uint32_t arrivalMs(size_t i, const Options &opt) {
+    return (uint32_t)((uint64_t)i * 1000 / opt.rate);
+}
+
+static void runDirect(const Options &opt, const std::vector<std::vector<uint8_t>> &packets) {
+    MockClient mock;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < packets.size(); i++) {
+        mock.nowMs = arrivalMs(i, opt);
+        mock.pendingMs.push_back(mock.nowMs);
+        mock.write(packets[i].data(), packets[i].size());
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printRow("direct", mock, packets.size(), sec);
+}
+
+template <size_t Size>
+static void runCoalesced(const Options &opt, const std::vector<std::vector<uint8_t>> &packets) {
+    WriteCoalescer<Size> coalescer(opt.delayMs);
+    MockClient mock;
+    uint32_t windowMs = opt.windowSec * 1000;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < packets.size(); i++) {
+        uint32_t now = arrivalMs(i, opt);
+        // publisher task wakes at least every 100 ms and polls
+        for (uint32_t t = mock.nowMs - mock.nowMs % 100 + 100; t <= now; t += 100) {
+            mock.nowMs = t;
+            // window end or due
+            if (t % windowMs == 0 || coalescer.due(t))
+                coalescer.flush(mock);
+        }
+        mock.nowMs = now;
+        mock.pendingMs.push_back(now);
+        coalescer.write(mock, packets[i].data(), packets[i].size(), now);
+    }
+    coalescer.flush(mock);
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    char name[16];
+    snprintf(name, sizeof(name), "buf %zu", Size);
+    printRow(name, mock, packets.size(), sec);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: coalesce_bench [--records <n>] [--rate <records/s>] [--devices <n>] [--window <s>] [--delay-ms <ms>] [--binary]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--records" && hasValue) {
+            opt.records = std::max(1, atoi(argv[++i]));
+        } else if (a == "--rate" && hasValue) {
+            opt.rate = std::max(1, atoi(argv[++i]));
+        } else if (a == "--devices" && hasValue) {
+            opt.devices = std::max(1, atoi(argv[++i]));
+        } else if (a == "--window" && hasValue) {
+            opt.windowSec = std::max(1, atoi(argv[++i]));
+        } else if (a == "--delay-ms" && hasValue) {
+            opt.delayMs = std::max(1, atoi(argv[++i]));
+        } else if (a == "--binary") {
+            opt.binary = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<std::vector<uint8_t>> packets = makePackets(opt);
+    size_t total = 0;
+    for (const auto &p : packets) total += p.size();
+    printf("%zu %s packets (%.1f bytes avg) at %u/s from %zu devices, flush after %u ms and every %u s.\n\n",
+           packets.size(), opt.binary ? "binary" : "JSON", (double)total / packets.size(), opt.rate, opt.devices,
+           opt.delayMs, opt.windowSec);
+    printf("%-10s %10s %8s %12s %12s %8s %8s %8s\n", "", "writes", "pkt/wr", "bytes", "wire bytes", "avg ms",
+           "max ms", "ns/pkt");
+    runDirect(opt, packets);
+    runCoalesced<512>(opt, packets);
+    runCoalesced<1024>(opt, packets);
+    runCoalesced<2048>(opt, packets);
+    runCoalesced<4096>(opt, packets);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * Collects logger messages into a columnar store and answers queries on it (see lib/ble_collector).
+ *
+ * Usage:
+ *   collector ingest <dir> [<file>]                    lines "<topic> <payload>", stdin without file
+ *   collector query <dir> <address> [<t0-ms> <t1-ms>]  sightings of address across loggers
+ *   collector stats <dir>                              segments, loggers and admin messages
+ *   collector transitions [<file>]                     moves of addresses between loggers, live
+ *   collector counts [<seconds>] [<file>]              distinct devices over all loggers (COUNT_ONLY), live
+ *
+ * Live from the broker e.g.:
+ *   mosquitto_sub -h broker -t 'sensor/BLE/Scanner/#' -t 'admin/BLE/Scanner/#' -F '%t %x' | collector ingest data/
+ * (-F '%t %x' passes binary payloads as hex, `-v` is enough for JSON payloads.)
+ *
+ * query prints CSV "ts,logger,rssi,txPower,companyId,count" in time order per segment.
+ * transitions prints CSV "address,from,to,left,arrived,dwellMs,travelMs" as moves are confirmed
+ * (see lib/ble_collector/collector_transitions.h), sharded over all cores.
+ * counts prints CSV "start,seconds,loggers,sketches,estimate,sumOfLoggers" per bucket of <seconds>
+ * (default 3600) merged from sketch messages (see lib/ble_collector/collector_counts.h). A bucket
+ * is printed once a sketch two buckets later came in, the rest at the end of input.
+ */
+
+#include <sys/time.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "collector_counts.h"
+#include "collector_ingest.h"
+#include "collector_parser.h"
+#include "collector_store.h"
+#include "collector_transitions.h"
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: collector ingest <dir> [<file>]\n"
+            "       collector query <dir> <address> [<t0-ms> <t1-ms>]\n"
+            "       collector stats <dir>\n"
+            "       collector transitions [<file>]\n"
+            "       collector counts [<seconds>] [<file>]\n");
+}
+
+static int64_t epochMs() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int ingest(const char *dir, const char *path) {
+    FILE *in = path != nullptr ? fopen(path, "rb") : stdin;
+    if (in == nullptr) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return 1;
+    }
+    CollectorStore store(dir);
+    if (!store.openForAppend()) {
+        fprintf(stderr, "Cannot open store %s.\n", dir);
+        return 1;
+    }
+    CollectorIngest ingest(store);
+    auto t0 = std::chrono::steady_clock::now();
+    // line by line so admin messages get the time they arrived, buffer only grows
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') len--;
+        ingest.line(line, (size_t)len, epochMs());
+    }
+    free(line);
+    store.close();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    const CollectorIngestStats &st = ingest.stats;
+    fprintf(stderr, "%" PRIu64 " sensor messages, %" PRIu64 " records, %" PRIu64 " admin messages, %" PRIu64 " malformed, %" PRIu64
+                    " skipped, %" PRIu64 " sketches (not stored) in %.1f s.\n",
+            st.sensorMessages, st.records, st.adminMessages, st.malformed, st.skipped, st.sketches, s);
+    if (in != stdin) fclose(in);
+    return 0;
+}
+
+static int query(const char *dir, const char *addr, int64_t t0, int64_t t1) {
+    uint64_t address;
+    if (!collectorParseAddress(addr, strlen(addr), address)) {
+        fprintf(stderr, "Address like 38:2f:a6:01:02:03 expected.\n");
+        return 1;
+    }
+    CollectorStore store(dir);
+    if (!store.openForRead()) {
+        fprintf(stderr, "Cannot open store %s.\n", dir);
+        return 1;
+    }
+    printf("ts,logger,rssi,txPower,companyId,count\n");
+    size_t n = 0;
+    store.sightings(address, t0, t1, [&](const Segment &seg, uint32_t row) {
+        CollectorRecord r;
+        seg.get(row, r);
+        printf("%" PRId64 ",%s,", r.tsMs, store.loggerDict().name(r.logger).c_str());
+        if (r.rssi != CR_RSSI_NA) printf("%d", r.rssi);
+        putchar(',');
+        if (r.txPower != CR_TX_POWER_NA) printf("%d", r.txPower);
+        putchar(',');
+        if (r.companyId != CR_COMPANY_NA) printf("0x%04x", r.companyId);
+        printf(",%u\n", r.count);
+        n++;
+    });
+    fprintf(stderr, "%zu sightings.\n", n);
+    return 0;
+}
+
+static int stats(const char *dir) {
+    CollectorStore store(dir);
+    if (!store.openForRead()) {
+        fprintf(stderr, "Cannot open store %s.\n", dir);
+        return 1;
+    }
+    uint64_t rows = 0;
+    printf("%-8s %10s %15s %15s %8s\n", "segment", "rows", "first ts", "last ts", "index");
+    size_t i = 0;
+    for (const auto &s : store.allSegments()) {
+        printf("%-8zu %10u %15" PRId64 " %15" PRId64 " %8s\n", ++i, s->rows(), s->rows() ? s->header()->minTsMs : 0, s->rows() ? s->header()->maxTsMs : 0,
+               s->indexed() ? "yes" : "no");
+        rows += s->rows();
+    }
+    std::map<std::string, uint64_t> kinds;
+    store.forEachAdmin([&](int64_t, uint32_t, const char *payload, uint32_t len) {
+        const char *kind;
+        size_t kindLen;
+        collectorAdminKind(payload, len, kind, kindLen);
+        kinds[std::string(kind, kindLen)]++;
+    });
+    printf("\n%" PRIu64 " records of %zu loggers.\nAdmin messages:", rows, store.loggerDict().size());
+    for (const auto &k : kinds) printf(" %s %" PRIu64 ",", k.first.c_str(), k.second);
+    printf("\n");
+    return 0;
+}
+
+/**
+ * Sensor payload of a "<topic> <payload>" line, hex decoded into buf if not JSON.
+ * Returns false for other topics and malformed hex.
+ */
+static bool sensorPayload(const char *line, size_t len, const char *&loggerName, size_t &loggerLen, std::vector<uint8_t> &buf,
+                          const uint8_t *&payload, size_t &payloadLen) {
+    const char *sp = (const char *)memchr(line, ' ', len);
+    if (sp == nullptr || collectorSplitTopic(line, sp - line, loggerName, loggerLen) != CT_SENSOR) return false;
+    payload = (const uint8_t *)sp + 1;
+    payloadLen = len - (sp + 1 - line);
+    if (payloadLen == 0) return false;
+    if (payload[0] == '{' || payload[0] == '[') return true;
+    if (payloadLen % 2 != 0) return false;
+    buf.resize(payloadLen / 2);
+    for (size_t i = 0; i < buf.size(); i++) {
+        int hi = collectorHexNibble(sp[1 + 2 * i]), lo = collectorHexNibble(sp[2 + 2 * i]);
+        if (hi < 0 || lo < 0) return false;
+        buf[i] = (uint8_t)(hi << 4 | lo);
+    }
+    payload = buf.data();
+    payloadLen = buf.size();
+    return true;
+}
+
+struct TransitionPrinter {
+    const LoggerDict &loggers;
+    std::mutex lock;
+
+    void operator()(unsigned, const Transition &t) {
+        std::lock_guard<std::mutex> guard(lock);
+        uint64_t a = t.address;
+        printf("%02x:%02x:%02x:%02x:%02x:%02x,%s,%s,%" PRId64 ",%" PRId64 ",%" PRId64 ",%" PRId64 "\n", (unsigned)(a >> 40) & 0xff,
+               (unsigned)(a >> 32) & 0xff, (unsigned)(a >> 24) & 0xff, (unsigned)(a >> 16) & 0xff, (unsigned)(a >> 8) & 0xff,
+               (unsigned)a & 0xff, loggers.name(t.from).c_str(), loggers.name(t.to).c_str(), t.leftMs, t.arrivedMs, t.dwellMs,
+               t.travelMs);
+        fflush(stdout);
+    }
+};
+
+struct TransitionFeed {
+    TransitionEngine<TransitionPrinter> &engine;
+    int64_t receivedMs;
+
+    void operator()(const CollectorRecord &r) { engine.push(r, receivedMs); }
+};
+
+static int transitions(const char *path) {
+    FILE *in = path != nullptr ? fopen(path, "rb") : stdin;
+    if (in == nullptr) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return 1;
+    }
+    // names are only added here, printer reads them from the shard threads
+    LoggerDict loggers;
+    TransitionPrinter printer{loggers, {}};
+    unsigned threads = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0;
+    TransitionEngine<TransitionPrinter> engine(TransitionConfig(), threads, printer);
+    std::vector<uint8_t> hex;
+    printf("address,from,to,left,arrived,dwellMs,travelMs\n");
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t records = 0;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') len--;
+        const char *loggerName;
+        size_t loggerLen;
+        const uint8_t *payload;
+        size_t payloadLen;
+        if (!sensorPayload(line, len, loggerName, loggerLen, hex, payload, payloadLen)) continue;
+        uint32_t logger;
+        {
+            std::lock_guard<std::mutex> guard(printer.lock);
+            bool added;
+            logger = loggers.intern(loggerName, loggerLen, added);
+        }
+        TransitionFeed feed{engine, epochMs()};
+        bool malformed;
+        records += collectorParseSensor(payload, payloadLen, logger, feed, malformed);
+    }
+    free(line);
+    engine.finish();
+    TransitionStats st = engine.stats();
+    fprintf(stderr, "%" PRIu64 " records, %" PRIu64 " transitions, %" PRIu64 " late, %" PRIu64 " addresses expired.\n", records,
+            st.transitions, st.late, st.expired);
+    if (in != stdin) fclose(in);
+    return 0;
+}
+
+struct CountPrinter {
+    void operator()(const CountBucket &b) {
+        printf("%u,%u,%u,%u,%.0f,%.0f\n", b.start, b.seconds, b.loggers, b.sketches, b.estimate, b.loggerEstimates);
+        fflush(stdout);
+    }
+};
+
+static int counts(uint32_t seconds, const char *path) {
+    FILE *in = path != nullptr ? fopen(path, "rb") : stdin;
+    if (in == nullptr) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return 1;
+    }
+    LoggerDict loggers;
+    CountMerger merger(seconds);
+    CountPrinter printer;
+    CollectorSketch sketch;
+    std::vector<uint8_t> hex;
+    uint64_t sketches = 0, malformed = 0;
+    uint32_t latest = 0;
+    printf("start,seconds,loggers,sketches,estimate,sumOfLoggers\n");
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[len - 1] == '\n') len--;
+        const char *loggerName;
+        size_t loggerLen;
+        const uint8_t *payload;
+        size_t payloadLen;
+        if (!sensorPayload(line, len, loggerName, loggerLen, hex, payload, payloadLen) || !collectorIsSketch(payload, payloadLen)) continue;
+        if (!collectorParseSketch(payload, payloadLen, sketch)) {
+            malformed++;
+            continue;
+        }
+        bool added;
+        merger.add(loggers.intern(loggerName, loggerLen, added), sketch);
+        sketches++;
+        // loggers publish late after outages, keep one bucket open for them
+        if (sketch.start > latest) {
+            latest = sketch.start;
+            if (latest >= seconds) merger.emitBefore(latest - seconds, printer);
+        }
+    }
+    free(line);
+    merger.emitAll(printer);
+    fprintf(stderr, "%" PRIu64 " sketches of %zu loggers, %" PRIu64 " skipped, %" PRIu64 " malformed.\n", sketches, loggers.size(),
+            merger.skippedSketches, malformed);
+    if (in != stdin) fclose(in);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2 && std::string(argv[1]) == "transitions") return transitions(nullptr);
+    if (argc >= 2 && argc <= 4 && std::string(argv[1]) == "counts")
+        return counts(argc >= 3 ? (uint32_t)atoi(argv[2]) : 3600, argc == 4 ? argv[3] : nullptr);
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+    std::string cmd = argv[1];
+    if (cmd == "ingest" && argc <= 4) return ingest(argv[2], argc == 4 ? argv[3] : nullptr);
+    if (cmd == "query" && (argc == 4 || argc == 6))
+        return query(argv[2], argv[3], argc == 6 ? atoll(argv[4]) : INT64_MIN, argc == 6 ? atoll(argv[5]) : INT64_MAX);
+    if (cmd == "stats" && argc == 3) return stats(argv[2]);
+    if (cmd == "transitions" && argc == 3) return transitions(argv[2]);
+    usage();
+    return 1;
+}
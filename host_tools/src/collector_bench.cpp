@@ -0,0 +1,282 @@
+/**
+ * Benchmark of the collector (see lib/ble_collector) on synthetic logger traffic.
+ *
+ * Sensor messages of several loggers are serialized with the firmware serializers, a third each
+ * as single JSON records, JSON batches (BATCH_PUBLISH) and binary batches (BINARY_PAYLOAD, hex as
+ * by `mosquitto_sub -F '%t %x'`), and written as subscriber lines into memory. These are ingested
+ * into a fresh store on one core, then sightings of random addresses are queried by index
+ * and by full scan.
+ *
+ * Usage:
+ *   collector_bench [--records <n>] [--loggers <n>] [--devices <n>] [--dir <dir>] [--capacity <rows>] [--queries <n>]
+ *
+ * Reports ingest rate (splitting, logger lookup, parsing, appending and sealing), query latency
+ * and checks both query paths against the generated records.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_batch.h"
+#include "ble_binary.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+#include "collector_ingest.h"
+#include "collector_store.h"
+
+// as in globals_kd.h
+#define MAX_MQTT_MESSAGE_SIZE 512
+
+struct Options {
+    size_t records = 2000000;
+    size_t loggers = 20;
+    size_t devices = 20000;
+    std::string dir = "collector_bench.store";
+    uint32_t capacity = CS_DEFAULT_CAPACITY;
+    size_t queries = 200;
+};
+
+struct Sighting {
+    uint64_t address;
+    int64_t tsMs;
+    uint32_t logger;
+
+    bool operator<(const Sighting &o) const { return address != o.address ? address < o.address : tsMs < o.tsMs; }
+};
+
+static void makeDevices(std::vector<BleAdvRecord> &devices, size_t n) {
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < n; i++) {
+        BleAdvRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        for (size_t b = 0; b < BLE_ADDR_LEN; b++) rec.address[b] = (uint8_t)rng();
+        rec.addrType = rng() % 2;
+        rec.payloadLength = 10 + rng() % 50;
+        if (rng() % 10 < 3) {
+            char name[16];
+            snprintf(name, sizeof(name), "Device %u", (unsigned)(rng() % 10000));
+            bleRecSetName(rec, name, strlen(name));
+        }
+        if (rng() % 10 < 6) {
+            uint8_t data[26];
+            for (uint8_t &d : data) d = (uint8_t)rng();
+            bleRecSetManufData(rec, data, 4 + rng() % 22);
+        }
+        devices.push_back(rec);
+    }
+}
+
+static uint64_t addressOf(const BleAdvRecord &rec) {
+    uint64_t a = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) a = a << 8 | rec.address[i];
+    return a;
+}
+
+static void putLine(std::string &out, const std::string &topic, const char *payload, size_t len, bool hex) {
+    static const char HEX[] = "0123456789abcdef";
+    out += topic;
+    out += ' ';
+    if (hex) {
+        for (size_t i = 0; i < len; i++) {
+            out += HEX[(uint8_t)payload[i] >> 4];
+            out += HEX[(uint8_t)payload[i] & 0xf];
+        }
+    } else {
+        out.append(payload, len);
+    }
+    out += '\n';
+}
+
+/**
+ * Subscriber output of all loggers, expected sightings (logger ids in order of first message).
+ */
+static void makeTraffic(const Options &opt, std::string &out, std::vector<Sighting> &expected) {
+    std::vector<BleAdvRecord> devices;
+    makeDevices(devices, opt.devices);
+    std::vector<std::string> topics;
+    for (size_t l = 0; l < opt.loggers; l++) {
+        char topic[96];
+        snprintf(topic, sizeof(topic), "sensor/BLE/Scanner/ssid_from_AP_%zu/esp32_ble_scan_%04zu", l % 4 + 1, l);
+        topics.push_back(topic);
+    }
+    std::vector<uint32_t> loggerId(opt.loggers, UINT32_MAX);
+    uint32_t nextId = 0;
+    std::mt19937 rng(2);
+    char buf[MAX_MQTT_MESSAGE_SIZE + 1];
+    BleBatch batch;
+    expected.reserve(opt.records);
+    out.reserve(opt.records * 120);
+    size_t i = 0;
+    uint32_t second = 1651042693;
+    while (i < opt.records) {
+        size_t l = rng() % opt.loggers;
+        // a logger sees each device in its own cycle
+        int mode = rng() % 3;
+        batchInit(batch, buf, sizeof(buf), mode == 2);
+        size_t want = mode == 0 ? 1 : 2 + rng() % 10;
+        if (loggerId[l] == UINT32_MAX) loggerId[l] = nextId++;
+        for (size_t k = 0; k < want && i < opt.records; k++) {
+            BleAdvRecord rec = devices[rng() % devices.size()];
+            rec.rssi = -40 - (int8_t)(rng() % 60);
+            rec.flags |= BLE_REC_HAVE_RSSI;
+            rec.timestamp = second + (uint32_t)(i / 2000);
+            rec.micros = rng() % 1000000;
+            if (mode == 0) {
+                size_t n = serializeBleAdvRecord(buf, sizeof(buf), rec);
+                putLine(out, topics[l], buf, n, false);
+            } else if (!batchAdd(batch, rec, 0)) {
+                break;
+            }
+            expected.push_back({addressOf(rec), (int64_t)rec.timestamp * 1000 + rec.micros / 1000, loggerId[l]});
+            i++;
+        }
+        if (mode != 0 && batch.count > 0) putLine(out, topics[l], buf, batchFinish(batch), mode == 2);
+    }
+    // some admin messages in between do not disturb
+    putLine(out, "admin/BLE/Scanner/ssid_from_AP_1/esp32_ble_scan_0000", "{\"status\": \"online\"}", 20, false);
+}
+
+static double msSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: collector_bench [--records <n>] [--loggers <n>] [--devices <n>] [--dir <dir>] [--capacity <rows>] [--queries <n>]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--records" && hasValue) {
+            opt.records = std::max(1, atoi(argv[++i]));
+        } else if (a == "--loggers" && hasValue) {
+            opt.loggers = std::max(1, atoi(argv[++i]));
+        } else if (a == "--devices" && hasValue) {
+            opt.devices = std::max(1, atoi(argv[++i]));
+        } else if (a == "--dir" && hasValue) {
+            opt.dir = argv[++i];
+        } else if (a == "--capacity" && hasValue) {
+            opt.capacity = std::max(1, atoi(argv[++i]));
+        } else if (a == "--queries" && hasValue) {
+            opt.queries = std::max(1, atoi(argv[++i]));
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    // store must be new
+    std::string rm = "rm -rf '" + opt.dir + "'";
+    if (system(rm.c_str()) != 0) return 1;
+
+    std::string traffic;
+    std::vector<Sighting> expected;
+    makeTraffic(opt, traffic, expected);
+    printf("%zu records of %zu devices from %zu loggers, %.1f MB subscriber output.\n\n", expected.size(), opt.devices,
+           opt.loggers, traffic.size() / 1e6);
+
+    // ingest
+    auto t0 = std::chrono::steady_clock::now();
+    CollectorIngestStats st;
+    {
+        CollectorStore store(opt.dir);
+        if (!store.openForAppend(opt.capacity)) {
+            fprintf(stderr, "Cannot open store %s.\n", opt.dir.c_str());
+            return 1;
+        }
+        CollectorIngest ingest(store);
+        const size_t CHUNK = 1 << 20;
+        for (size_t off = 0; off < traffic.size(); off += CHUNK) ingest.feed(traffic.data() + off, std::min(CHUNK, traffic.size() - off));
+        ingest.finish();
+        store.close();
+        st = ingest.stats;
+    }
+    double ingestMs = msSince(t0);
+    printf("ingest: %llu messages, %llu records, %llu admin, %llu malformed in %.0f ms = %.0f records/s, %.0f MB/s\n",
+           (unsigned long long)st.sensorMessages, (unsigned long long)st.records, (unsigned long long)st.adminMessages,
+           (unsigned long long)st.malformed, ingestMs, st.records / ingestMs * 1000, st.bytes / ingestMs / 1000);
+
+    // queries
+    CollectorStore store(opt.dir);
+    t0 = std::chrono::steady_clock::now();
+    store.openForRead();
+    double openMs = msSince(t0);
+    uint64_t rows = 0;
+    size_t indexed = 0;
+    for (const auto &s : store.allSegments()) {
+        rows += s->rows();
+        indexed += s->indexed();
+    }
+    printf("open: %zu segments (%zu indexed), %llu rows in %.1f ms\n", store.allSegments().size(), indexed,
+           (unsigned long long)rows, openMs);
+
+    std::sort(expected.begin(), expected.end());
+    int64_t first = INT64_MAX, last = INT64_MIN;
+    for (const Sighting &s : expected) {
+        first = std::min(first, s.tsMs);
+        last = std::max(last, s.tsMs);
+    }
+    std::mt19937 rng(3);
+    size_t mismatches = 0, found = 0;
+    double indexMs = 0, scanMs = 0, maxIndexMs = 0;
+    for (size_t q = 0; q < opt.queries; q++) {
+        const Sighting &pick = expected[rng() % expected.size()];
+        // whole range or a random window around a sighting
+        int64_t t0q = INT64_MIN, t1q = INT64_MAX;
+        if (q % 2 == 1) {
+            int64_t span = 1 + (int64_t)(rng() % (uint64_t)(last - first + 1));
+            t0q = pick.tsMs - span / 2;
+            t1q = pick.tsMs + span / 2;
+        }
+        std::vector<Sighting> byIndex, byScan;
+        auto collect = [&](std::vector<Sighting> &v) {
+            return [&](const Segment &seg, uint32_t row) { v.push_back({seg.address[row], seg.ts[row], seg.logger[row]}); };
+        };
+        auto tq = std::chrono::steady_clock::now();
+        store.sightings(pick.address, t0q, t1q, collect(byIndex), true);
+        double ms = msSince(tq);
+        indexMs += ms;
+        maxIndexMs = std::max(maxIndexMs, ms);
+        tq = std::chrono::steady_clock::now();
+        store.sightings(pick.address, t0q, t1q, collect(byScan), false);
+        scanMs += msSince(tq);
+
+        auto lo = std::lower_bound(expected.begin(), expected.end(), Sighting{pick.address, t0q, 0});
+        std::vector<Sighting> want;
+        for (auto it = lo; it != expected.end() && it->address == pick.address && it->tsMs <= t1q; ++it) want.push_back(*it);
+        auto same = [&](std::vector<Sighting> v) {
+            auto byAll = [](const Sighting &a, const Sighting &b) {
+                return a.address != b.address ? a.address < b.address : a.tsMs != b.tsMs ? a.tsMs < b.tsMs : a.logger < b.logger;
+            };
+            std::sort(v.begin(), v.end(), byAll);
+            std::vector<Sighting> w = want;
+            std::sort(w.begin(), w.end(), byAll);
+            if (v.size() != w.size()) return false;
+            for (size_t k = 0; k < v.size(); k++)
+                if (v[k].address != w[k].address || v[k].tsMs != w[k].tsMs || v[k].logger != w[k].logger) return false;
+            return true;
+        };
+        if (!same(byIndex) || !same(byScan)) mismatches++;
+        found += byIndex.size();
+    }
+    printf("query: %zu addresses, %zu sightings, index %.3f ms avg (%.3f max), scan %.3f ms avg, %zu mismatches\n",
+           opt.queries, found, indexMs / opt.queries, maxIndexMs, scanMs / opt.queries, mismatches);
+    bool ok = mismatches == 0 && st.records == expected.size() && rows == expected.size() && st.malformed == 0;
+    printf("\n%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/**
+ * Accuracy of the HyperLogLog sketches of COUNT_ONLY (see src/ble_hll.h) against exact counts.
+ *
+ * Each trial adds distinct addresses (a counter mapped bijectively onto 48 bits, other
+ * addresses per trial) and compares the estimate with the exact count at 100, 1k, ... up to
+ * --max addresses. Then sketches of loggers with overlapping crowds are merged and compared
+ * with the exact union, and messages are decoded again as the collector does.
+ *
+ * Usage:
+ *   hll_bench [--trials <n>] [--max <n>] [--p <p,p,...>]
+ *
+ * Reports bias, RMSE and max. error relative to the exact count, next to the standard error
+ * 1.04 / sqrt(2^p), and the length of JSON and binary messages against the JSON records a
+ * window would publish otherwise. Fails if RMSE exceeds 1.5x or any error 5x the standard error,
+ * if a merged sketch differs from the sketch of the union or if a message does not decode.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ble_hll.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+#include "collector_counts.h"
+
+struct Options {
+    size_t trials = 20;
+    size_t max = 1000000;
+    std::vector<uint8_t> precisions = {8, 10, 12, 14};
+};
+
+static void addressOf(uint64_t trial, uint64_t i, uint8_t *address) {
+    // odd multiplier is a bijection on 48 bits, so addresses within a trial are distinct
+    uint64_t a = ((trial << 40 | i) * 0x9e3779b97f4bULL + 0x2f5a) & 0xffffffffffffULL;
+    for (size_t b = 0; b < BLE_ADDR_LEN; b++) address[b] = (uint8_t)(a >> (8 * (BLE_ADDR_LEN - 1 - b)));
+}
+
+struct Sketch {
+    uint8_t p;
+    std::vector<uint8_t> regs;
+
+    explicit Sketch(uint8_t p) : p(p), regs((size_t)1 << p) {}
+    void add(const uint8_t *address) { bleHllAddHash(regs.data(), p, bleHllHash(address)); }
+    double estimate() const { return bleHllEstimate(regs.data(), p); }
+};
+
+static bool accuracy(const Options &opt) {
+    std::vector<size_t> checkpoints;
+    for (size_t n = 100; n <= opt.max; n *= 10) checkpoints.push_back(n);
+    if (checkpoints.empty() || checkpoints.back() != opt.max) checkpoints.push_back(opt.max);
+
+    printf("%3s %9s %8s %8s %8s %8s %10s %8s\n", "p", "distinct", "bias", "rmse", "stderr", "max err", "encoded", "");
+    bool ok = true;
+    auto t0 = std::chrono::steady_clock::now();
+    uint64_t added = 0;
+    for (uint8_t p : opt.precisions) {
+        double se = 1.04 / sqrt((double)((size_t)1 << p));
+        std::vector<double> sum(checkpoints.size()), sumSq(checkpoints.size()), maxErr(checkpoints.size());
+        std::vector<size_t> encoded(checkpoints.size());
+        std::vector<bool> sparse(checkpoints.size());
+        std::vector<uint8_t> buf(bleHllDenseLen(p));
+        for (size_t t = 0; t < opt.trials; t++) {
+            Sketch sketch(p);
+            uint8_t address[BLE_ADDR_LEN];
+            size_t n = 0;
+            for (size_t c = 0; c < checkpoints.size(); c++) {
+                for (; n < checkpoints[c]; n++) {
+                    addressOf(t, n, address);
+                    sketch.add(address);
+                }
+                double err = (sketch.estimate() - n) / n;
+                sum[c] += err;
+                sumSq[c] += err * err;
+                maxErr[c] = std::max(maxErr[c], std::abs(err));
+                bool sp;
+                encoded[c] = bleHllEncode(buf.data(), buf.size(), sketch.regs.data(), p, sp);
+                sparse[c] = sp;
+            }
+            added += n;
+        }
+        for (size_t c = 0; c < checkpoints.size(); c++) {
+            double rmse = sqrt(sumSq[c] / opt.trials);
+            bool pass = rmse <= 1.5 * se && maxErr[c] <= 5 * se;
+            ok = ok && pass;
+            printf("%3u %9zu %7.2f%% %7.2f%% %7.2f%% %7.2f%% %7zu B %-6s %s\n", p, checkpoints[c], 100 * sum[c] / opt.trials, 100 * rmse,
+                   100 * se, 100 * maxErr[c], encoded[c], sparse[c] ? "sparse" : "dense", pass ? "" : "FAILED");
+        }
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("\n%.1f M addresses added per second.\n", added / s / 1e6);
+    return ok;
+}
+
+/**
+ * Loggers in a row see overlapping crowds over several windows, merged as the collector does.
+ */
+static bool unions(const Options &opt) {
+    const size_t LOGGERS = 3, WINDOWS = 6, CROWD = opt.max / 10 > 0 ? opt.max / 10 : 1;
+    bool ok = true;
+    printf("\n%3s %9s %10s %8s %14s %8s\n", "p", "union", "estimate", "error", "sum of loggers", "merge");
+    for (uint8_t p : opt.precisions) {
+        Sketch all(p), direct(p);
+        // logger l sees addresses [l * CROWD / 2, l * CROWD / 2 + CROWD) in each window, a window adds CROWD / 4 new ones
+        double sumOfLoggers = 0;
+        size_t hi = 0;
+        for (size_t l = 0; l < LOGGERS; l++) {
+            Sketch logger(p);
+            for (size_t w = 0; w < WINDOWS; w++) {
+                Sketch window(p);
+                uint8_t address[BLE_ADDR_LEN];
+                size_t first = l * CROWD / 2 + w * CROWD / 4;
+                for (size_t i = first; i < first + CROWD; i++) {
+                    addressOf(1000, i, address);
+                    window.add(address);
+                    direct.add(address);
+                }
+                bleHllMerge(logger.regs.data(), window.regs.data(), p);
+                hi = std::max(hi, first + CROWD);
+            }
+            sumOfLoggers += logger.estimate();
+            bleHllMerge(all.regs.data(), logger.regs.data(), p);
+        }
+        size_t exact = hi;
+        double err = (all.estimate() - exact) / exact;
+        bool same = all.regs == direct.regs;
+        ok = ok && same && std::abs(err) <= 5 * 1.04 / sqrt((double)((size_t)1 << p));
+        printf("%3u %9zu %10.0f %7.2f%% %14.0f %8s\n", p, exact, all.estimate(), 100 * err, sumOfLoggers, same ? "equal" : "FAILED");
+    }
+    return ok;
+}
+
+/**
+ * Messages as published by the firmware, decoded by the collector.
+ */
+template <uint8_t P>
+static bool messages(size_t perWindow) {
+    BleHll<P> sketch;
+    // smallest records of the default schema (no name, manufacturer data, ...)
+    size_t recordBytes = 0;
+    for (size_t i = 0; i < perWindow; i++) {
+        BleAdvRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        addressOf(2000, i, rec.address);
+        rec.flags = BLE_REC_HAVE_RSSI;
+        rec.rssi = -40 - (int8_t)(i % 50);
+        rec.timestamp = 1651042690 + i % 10;
+        rec.micros = (uint32_t)(i * 7919 % 1000000);
+        rec.payloadLength = 20;
+        char buf[1024];
+        recordBytes += serializeBleAdvRecord(buf, sizeof(buf), rec);
+        sketch.add(rec.address);
+    }
+    static char json[BLE_HLL_JSON_OVERHEAD + 2 * BleHll<P>::maxEncodedLen];
+    static uint8_t bin[BLE_HLL_BIN_HEADER_LEN + BleHll<P>::maxEncodedLen];
+    size_t jsonLen = bleHllSerializeJson(json, sizeof(json), sketch, 1651042690, 10);
+    size_t binLen = bleHllSerializeBin(bin, sizeof(bin), sketch, 1651042690, 10);
+    CollectorSketch fromJson, fromBin;
+    bool ok = jsonLen > 0 && binLen > 0 && collectorIsSketch((const uint8_t *)json, jsonLen) && collectorIsSketch(bin, binLen) &&
+              collectorParseSketch((const uint8_t *)json, jsonLen, fromJson) && collectorParseSketch(bin, binLen, fromBin) &&
+              fromJson.p == P && fromBin.p == P && fromJson.start == 1651042690 && fromBin.seconds == 10 &&
+              memcmp(fromJson.registers.data(), sketch.registers(), BleHll<P>::size) == 0 &&
+              memcmp(fromBin.registers.data(), sketch.registers(), BleHll<P>::size) == 0 && fromBin.estimate == fromJson.estimate;
+    printf("%3u %8zu %12zu %10zu %10zu %8s\n", P, perWindow, recordBytes, jsonLen, binLen, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static void usage() { fprintf(stderr, "Usage: hll_bench [--trials <n>] [--max <n>] [--p <p,p,...>]\n"); }
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--trials" && hasValue) {
+            opt.trials = std::max(1, atoi(argv[++i]));
+        } else if (a == "--max" && hasValue) {
+            opt.max = std::max(100, atoi(argv[++i]));
+        } else if (a == "--p" && hasValue) {
+            opt.precisions.clear();
+            for (char *p = argv[++i]; *p != '\0';) {
+                unsigned long v = strtoul(p, &p, 10);
+                if (v < BLE_HLL_MIN_P || v > BLE_HLL_MAX_P) return false;
+                opt.precisions.push_back((uint8_t)v);
+                if (*p == ',') p++;
+                else if (*p != '\0') return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    printf("%zu trials of up to %zu distinct addresses.\n\n", opt.trials, opt.max);
+    bool ok = accuracy(opt);
+    ok = unions(opt) && ok;
+    printf("\n%3s %8s %12s %10s %10s %8s\n", "p", "devices", "records B", "json B", "binary B", "decoded");
+    for (size_t n : {10, 100, 1000}) {
+        ok = messages<10>(n) && ok;
+        ok = messages<12>(n) && ok;
+    }
+    printf("\n%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
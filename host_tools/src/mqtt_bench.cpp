@@ -0,0 +1,711 @@
+/**
+ * Benchmark of the MQTT publish path (src/mqtts.h, src/store_forward.h) against a broker stand-in
+ * with fault injection.
+ *
+ * The firmware headers are built natively on lib/arduino_host: time is virtual, the client
+ * (WiFiClientSecure with SECURE_MQTT) talks to an in-process broker over a simulated TCP path.
+ * The path has a round-trip time with jitter, an uplink throughput cap, segment loss (each
+ * lost segment costs a retransmit timeout) and the send buffer of lwIP, so writes block once
+ * unacknowledged bytes fill it and fail after WRITE_TIMEOUT_MS without progress.
+ * Faults are injected at random times (seeded):
+ *   stall   uplink sends nothing for a while (WiFi retries), writes block
+ *   drop    connection is reset
+ *   outage  broker unreachable: nothing gets through, connects time out
+ *   hang    broker accepts connections but does not answer and discards messages, then restarts
+ *
+ * The driver runs as the firmware does: sensor messages arrive at --rate and wait in a queue of
+ * PUBLISH_QUEUE_LEN (dropped if full), the publisher task sends them with sendMessage() and
+ * replays stored messages if the queue is empty, loop() calls loopMQTT() every 100 ms and
+ * reports metrics and store stats each window. Failed messages go to the store (STORE_AND_FORWARD)
+ * on the data partition in memory. Configuration is that of globals_kd.h (but without
+ * TLS_SESSION_RESUMPTION, which needs mbedTLS).
+ *
+ * Usage:
+ *   mqtt_bench [--duration <s>] [--drain <s>] [--rate <msg/s>] [--payload <bytes>] [--scenario <name>] [--seed <n>]
+ *              [--csv] [--verbose]
+ *
+ * Each scenario runs in a fresh process. Reported per scenario: messages delivered per second,
+ * latency of live messages from creation to broker (p50, p99, max), time sendMessage() blocked
+ * (p99 and total), time offline and blocked in connect attempts, connect attempts (failed),
+ * messages delivered from the store and messages lost (queue full, store full, lost on the way
+ * or still stored after --drain s). Exits with 1 if the broker saw malformed packets.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "globals_kd.h"
+
+#ifndef FW_VERSION
+#define FW_VERSION "0.0.0"
+#endif
+#ifndef CORE_DEBUG_LEVEL
+#define CORE_DEBUG_LEVEL 0
+#endif
+// needs mbedTLS, a full handshake per connect is simulated instead
+#undef TLS_SESSION_RESUMPTION
+
+#include "metrics.h"
+#include "mqtts.h"
+#include "store_forward.h"
+
+// TCP of lwIP in the ESP32 core
+#define TCP_SND_BUF 5744
+#define TCP_MSS 1436
+#define TCP_IP_HEADER 40
+#define TCP_MIN_RTO_MS 500
+// TLS 1.2 AES-GCM: 5 header, 8 nonce, 16 tag per record
+#define TLS_RECORD_OVERHEAD 29
+// full handshake on the ESP32 (ECDHE, certificate chain)
+#define TLS_HANDSHAKE_CPU_MS 1200
+// WiFiClient: default connect timeout, write gives up after 10 selects of 1 s without progress
+#define CONNECT_TIMEOUT_MS 3000
+#define WRITE_TIMEOUT_MS 10000
+// loop() calls loopMQTT() while waiting for the end of the scan window (see ble.h)
+#define LOOP_INTERVAL_MS 100
+
+struct Options {
+    uint32_t durationS = 1800;
+    uint32_t drainS = 600;
+    double rate = 10;
+    size_t payload = 250;
+    std::string scenario;
+    uint32_t seed = 1;
+    bool csv = false;
+    bool verbose = false;
+};
+
+struct Scenario {
+    const char *name;
+    uint32_t rttMs;
+    uint32_t jitterMs;
+    uint32_t bytesPerS;  // uplink, 0: unlimited
+    double lossPercent;  // per segment
+    uint32_t stallEveryS, stallMs;
+    uint32_t dropEveryS;
+    uint32_t outageEveryS, outageMs;
+    uint32_t hangEveryS, hangMs;
+    double rateFactor;  // of --rate
+};
+
+// clang-format off
+static const Scenario SCENARIOS[] = {
+    // name        rtt  jitter  bytes/s  loss%  stall       drop  outage          hang           rate
+    {"baseline",    40,     5,       0,   0,      0,     0,    0,    0,     0,      0,     0,      1},
+    {"latency",    600,   200,       0,   0,      0,     0,    0,    0,     0,      0,     0,      1},
+    {"capped",      40,     5,    2500,   0,      0,     0,    0,    0,     0,      0,     0,      1},
+    {"lossy",      100,    20,       0,   5,      0,     0,    0,    0,     0,      0,     0,      1},
+    {"stalls",      40,     5,       0,   0,    120, 15000,    0,    0,     0,      0,     0,      1},
+    {"drops",       40,     5,       0,   0,      0,     0,   60,    0,     0,      0,     0,      1},
+    {"outage",      40,     5,       0,   0,      0,     0,    0,  600, 90000,      0,     0,      1},
+    {"hang",        40,     5,       0,   0,      0,     0,    0,    0,     0,    600, 45000,      1},
+    {"capacity",    40,     5,       0,   0,      0,     0,    0,    0,     0,      0,     0,     50},
+};
+// clang-format on
+
+struct Interval {
+    uint64_t beginUs, endUs;
+};
+
+/**
+ * Intervals of given length every everyS on average (uniform between half and 1.5 times).
+ */
+static std::vector<Interval> faultTimes(std::mt19937_64 &rng, uint32_t everyS, uint32_t lengthMs, uint64_t untilUs) {
+    std::vector<Interval> v;
+    if (everyS == 0) return v;
+    uint64_t t = 0;
+    for (;;) {
+        t += (uint64_t)(everyS * (0.5 + std::uniform_real_distribution<double>()(rng)) * 1e6);
+        if (t >= untilUs) return v;
+        v.push_back({t, t + (uint64_t)lengthMs * 1000});
+        t += (uint64_t)lengthMs * 1000;
+    }
+}
+
+static const Interval *findInterval(const std::vector<Interval> &v, uint64_t t) {
+    auto it = std::upper_bound(v.begin(), v.end(), t, [](uint64_t x, const Interval &i) { return x < i.beginUs; });
+    if (it == v.begin()) return nullptr;
+    --it;
+    return t < it->endUs ? &*it : nullptr;
+}
+
+struct BrokerStats {
+    uint64_t connects = 0;
+    uint64_t publishes = 0;
+    uint64_t admin = 0;
+    uint64_t discarded = 0;  // while hung
+    uint64_t duplicates = 0;
+    uint64_t malformed = 0;
+    uint64_t resets = 0;
+    uint64_t writeTimeouts = 0;
+    uint64_t bytesOnWire = 0;
+};
+
+/**
+ * Simulated TCP path and MQTT broker (QoS 0, one connection at a time).
+ * Sensor messages carry "seq": n, the broker keeps their arrival time.
+ */
+class BrokerStandIn : public HostNetwork {
+   public:
+    BrokerStandIn(const Scenario &sc, uint64_t untilUs, size_t messages, uint32_t seed)
+        : sc(sc), rng(seed), arrivedUs(messages, UINT64_MAX) {
+        std::mt19937_64 faults(seed * 31 + 7);
+        stalls = faultTimes(faults, sc.stallEveryS, sc.stallMs, untilUs);
+        outages = faultTimes(faults, sc.outageEveryS, sc.outageMs, untilUs);
+        hangs = faultTimes(faults, sc.hangEveryS, sc.hangMs, untilUs);
+        std::vector<Interval> drops = faultTimes(faults, sc.dropEveryS, 0, untilUs);
+        // broker restarts after a hang
+        for (const Interval &i : drops) resets.push_back(i.beginUs);
+        for (const Interval &i : hangs) resets.push_back(i.endUs);
+        std::sort(resets.begin(), resets.end());
+    }
+
+    int open(const char *, uint16_t, bool tls) override {
+        process();
+        close(conn);
+        if (findInterval(outages, hostClockUs) != nullptr) {
+            // SYN unanswered
+            delay(CONNECT_TIMEOUT_MS);
+            return 0;
+        }
+        hostClockUs += rttUs();
+        if (tls) {
+            if (findInterval(hangs, hostClockUs) != nullptr) {
+                delay(TLS_HANDSHAKE_TIMEOUT_S * 1000);
+                return 0;
+            }
+            hostClockUs += 2 * rttUs() + TLS_HANDSHAKE_CPU_MS * 1000;
+        }
+        if (findInterval(outages, hostClockUs) != nullptr) return 0;
+        this->tls = tls;
+        isUp = true;
+        linkFreeUs = lastArrivalUs = lastResponseUs = hostClockUs;
+        inbound.clear();
+        return ++conn;
+    }
+
+    size_t send(int c, const uint8_t *buf, size_t len) override {
+        process();
+        if (c != conn || !isUp) return 0;
+        size_t sent = 0;
+        bool first = true;
+        while (sent < len) {
+            size_t piece = std::min(len - sent, (size_t)TCP_MSS);
+            if (!waitForRoom(piece)) {
+                stats.writeTimeouts++;
+                return sent;
+            }
+            transmit(buf + sent, piece, first);
+            first = false;
+            sent += piece;
+        }
+        return sent;
+    }
+
+    int available(int c) override {
+        process();
+        if (c != conn || !isUp) return 0;
+        size_t n = readable();
+        if (n == 0) {
+            // caller polls, move on to the next event (at most 1 ms)
+            uint64_t next = std::min(nextEventUs(), hostClockUs + 1000);
+            hostClockUs = std::max(next, hostClockUs + 1);
+        }
+        return (int)n;
+    }
+
+    int receive(int c, uint8_t *buf, size_t len, bool peek) override {
+        process();
+        if (c != conn || readable() == 0) return -1;
+        size_t n = 0;
+        auto it = toClient.begin();
+        size_t off = clientOffset;
+        while (n < len && it != toClient.end() && it->atUs <= hostClockUs) {
+            size_t k = std::min(len - n, it->bytes.size() - off);
+            memcpy(buf + n, it->bytes.data() + off, k);
+            n += k;
+            off += k;
+            if (off == it->bytes.size()) {
+                ++it;
+                off = 0;
+            }
+        }
+        if (!peek) {
+            toClient.erase(toClient.begin(), it);
+            clientOffset = off;
+        }
+        return (int)n;
+    }
+
+    bool isOpen(int c) override {
+        process();
+        return c == conn && isUp;
+    }
+
+    void close(int c) override {
+        if (c != conn || !isUp) return;
+        // unsent and unacknowledged bytes are gone
+        isUp = false;
+        toBroker.clear();
+        toClient.clear();
+        clientOffset = 0;
+        sendQueue.clear();
+    }
+
+    /**
+     * Handles what happened up to now.
+     */
+    void process() {
+        for (;;) {
+            uint64_t deliver = isUp && !toBroker.empty() ? toBroker.front().atUs : UINT64_MAX;
+            uint64_t reset = nextReset < resets.size() ? resets[nextReset] : UINT64_MAX;
+            if (std::min(deliver, reset) > hostClockUs) break;
+            if (reset <= deliver) {
+                eventUs = reset;
+                nextReset++;
+                if (isUp) stats.resets++;
+                close(conn);
+            } else {
+                eventUs = deliver;
+                Segment s = std::move(toBroker.front());
+                toBroker.pop_front();
+                receiveAtBroker(s);
+            }
+        }
+        while (!sendQueue.empty() && sendQueue.front().ackUs <= hostClockUs) sendQueue.pop_front();
+    }
+
+    bool delivered(size_t seq) const { return seq < arrivedUs.size() && arrivedUs[seq] != UINT64_MAX; }
+    uint64_t arrivalUs(size_t seq) const { return arrivedUs[seq]; }
+
+    BrokerStats stats;
+
+   private:
+    struct Segment {
+        uint64_t atUs;
+        std::vector<uint8_t> bytes;
+    };
+    struct Unacked {
+        uint64_t ackUs;
+        size_t bytes;
+    };
+
+    uint64_t rttUs() { return (uint64_t)sc.rttMs * 1000; }
+
+    uint64_t oneWayUs() {
+        uint64_t jitter = sc.jitterMs > 0 ? rng() % ((uint64_t)sc.jitterMs * 1000) : 0;
+        return rttUs() / 2 + jitter;
+    }
+
+    // nothing gets through in an outage, TCP retransmits afterwards
+    uint64_t afterOutage(uint64_t t) {
+        const Interval *o = findInterval(outages, t);
+        return o != nullptr ? o->endUs + TCP_MIN_RTO_MS * 1000 : t;
+    }
+
+    bool waitForRoom(size_t len) {
+        uint64_t progressUs = hostClockUs;
+        for (;;) {
+            size_t queued = 0;
+            for (const Unacked &u : sendQueue) queued += u.bytes;
+            if (queued + len <= TCP_SND_BUF) return true;
+            uint64_t next = sendQueue.front().ackUs;
+            if (next > progressUs + (uint64_t)WRITE_TIMEOUT_MS * 1000) {
+                hostClockUs = std::max(hostClockUs, progressUs + (uint64_t)WRITE_TIMEOUT_MS * 1000);
+                process();
+                return false;
+            }
+            hostClockUs = std::max(hostClockUs, next);
+            progressUs = hostClockUs;
+            process();
+            if (!isUp) return false;
+        }
+    }
+
+    void transmit(const uint8_t *buf, size_t len, bool record) {
+        size_t wire = len + TCP_IP_HEADER + (tls && record ? TLS_RECORD_OVERHEAD : 0);
+        stats.bytesOnWire += wire;
+        uint64_t start = std::max(hostClockUs, linkFreeUs);
+        const Interval *stall = findInterval(stalls, start);
+        if (stall != nullptr) start = stall->endUs;
+        uint64_t end = start + (sc.bytesPerS > 0 ? (uint64_t)wire * 1000000 / sc.bytesPerS : 0);
+        linkFreeUs = end;
+        uint64_t at = end + oneWayUs();
+        while (sc.lossPercent > 0 && std::uniform_real_distribution<double>()(rng) * 100 < sc.lossPercent)
+            at += std::max<uint64_t>(TCP_MIN_RTO_MS * 1000, 2 * rttUs());
+        at = std::max(afterOutage(at), lastArrivalUs);
+        lastArrivalUs = at;
+        sendQueue.push_back({at + rttUs() / 2, len});
+        toBroker.push_back({at, std::vector<uint8_t>(buf, buf + len)});
+    }
+
+    void respond(std::initializer_list<uint8_t> packet) {
+        uint64_t at = std::max(afterOutage(eventUs + oneWayUs()), lastResponseUs);
+        lastResponseUs = at;
+        toClient.push_back({at, std::vector<uint8_t>(packet)});
+    }
+
+    size_t readable() const {
+        size_t n = 0;
+        for (const Segment &s : toClient) {
+            if (s.atUs > hostClockUs) break;
+            n += s.bytes.size();
+        }
+        return n - clientOffset;
+    }
+
+    uint64_t nextEventUs() const {
+        uint64_t t = UINT64_MAX;
+        if (!toClient.empty()) t = std::min(t, toClient.front().atUs);
+        if (!toBroker.empty()) t = std::min(t, toBroker.front().atUs);
+        if (nextReset < resets.size()) t = std::min(t, resets[nextReset]);
+        return t;
+    }
+
+    void receiveAtBroker(const Segment &s) {
+        inbound.insert(inbound.end(), s.bytes.begin(), s.bytes.end());
+        size_t pos = 0;
+        while (isUp && inbound.size() - pos >= 2) {
+            // remaining length
+            size_t len = 0, i = 1;
+            for (int shift = 0;; shift += 7) {
+                if (pos + i >= inbound.size()) goto incomplete;
+                uint8_t d = inbound[pos + i++];
+                len |= (size_t)(d & 0x7f) << shift;
+                if ((d & 0x80) == 0) break;
+                if (shift > 14) {
+                    stats.malformed++;
+                    close(conn);
+                    return;
+                }
+            }
+            if (pos + i + len > inbound.size()) break;
+            packet(inbound[pos], inbound.data() + pos + i, len);
+            pos += i + len;
+        }
+    incomplete:
+        inbound.erase(inbound.begin(), inbound.begin() + pos);
+    }
+
+    void packet(uint8_t type, const uint8_t *p, size_t len) {
+        bool hung = findInterval(hangs, eventUs) != nullptr;
+        switch (type >> 4) {
+            case 1:  // CONNECT
+                stats.connects++;
+                if (!hung) respond({0x20, 2, 0, 0});
+                break;
+            case 3: {  // PUBLISH, QoS 0
+                size_t topicLen = len >= 2 ? (size_t)(p[0] << 8 | p[1]) : SIZE_MAX;
+                if (topicLen == SIZE_MAX || 2 + topicLen > len) {
+                    stats.malformed++;
+                    break;
+                }
+                if (hung) {
+                    stats.discarded++;
+                    break;
+                }
+                std::string topic((const char *)p + 2, topicLen);
+                if (topic.compare(0, strlen(SENSOR_TOPIC_PRE), SENSOR_TOPIC_PRE) != 0) {
+                    stats.admin++;
+                    break;
+                }
+                stats.publishes++;
+                std::string payload((const char *)p + 2 + topicLen, len - 2 - topicLen);
+                size_t at = payload.find("\"seq\": ");
+                if (at == std::string::npos) {
+                    stats.malformed++;
+                    break;
+                }
+                size_t seq = strtoul(payload.c_str() + at + 7, nullptr, 10);
+                if (seq >= arrivedUs.size()) {
+                    stats.malformed++;
+                } else if (arrivedUs[seq] != UINT64_MAX) {
+                    stats.duplicates++;
+                } else {
+                    arrivedUs[seq] = eventUs;
+                }
+                break;
+            }
+            case 8:  // SUBSCRIBE
+                if (!hung && len >= 2) respond({0x90, 3, p[0], p[1], 0});
+                break;
+            case 12:  // PINGREQ
+                if (!hung) respond({0xd0, 0});
+                break;
+            case 14:  // DISCONNECT
+                close(conn);
+                break;
+            default:
+                stats.malformed++;
+        }
+    }
+
+    const Scenario &sc;
+    std::mt19937_64 rng;
+    std::vector<Interval> stalls, outages, hangs;
+    std::vector<uint64_t> resets;
+    size_t nextReset = 0;
+    // time of the event being processed
+    uint64_t eventUs = 0;
+
+    int conn = 0;
+    bool isUp = false;
+    bool tls = false;
+    uint64_t linkFreeUs = 0, lastArrivalUs = 0, lastResponseUs = 0;
+    std::deque<Segment> toBroker, toClient;
+    size_t clientOffset = 0;
+    std::deque<Unacked> sendQueue;
+    std::vector<uint8_t> inbound;
+    std::vector<uint64_t> arrivedUs;
+};
+
+//----------------------------
+// FIRMWARE CALLBACKS
+//----------------------------
+char *getCurSsid() { return (char *)SSID_AP_1; }
+char *getDeviceId() { return (char *)"0001"; }
+char *getFullDeviceName() { return (char *)DEVICE_NAME_PRE "0001"; }
+void onIncomingOtaMessage(byte *, unsigned int) {}
+bool transmitAdminInfo(const char *msg) { return sendMessage(msg, true); }
+int64_t getEpochTimeUs() { return 1651042693000000LL + (int64_t)hostClockUs; }
+void jsonPutClock(JsonBuf &jb) { jsonPut(jb, "\"clock\": {}"); }
+
+//----------------------------
+// DRIVER
+//----------------------------
+static double percentile(std::vector<uint64_t> &v, double p) {
+    if (v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p / 100 * v.size()));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k] / 1000.0;
+}
+
+static size_t makePayload(char *buf, size_t size, size_t seq, size_t want) {
+    // a sensor record with filler up to the wanted size
+    int n = snprintf(buf, size, "{\"seq\": %zu, \"address\": \"38:2f:a6:%02zx:%02zx:%02zx\", \"rssi\": -%zu, \"pad\": \"", seq,
+                     seq >> 16 & 0xff, seq >> 8 & 0xff, seq & 0xff, 40 + seq % 50);
+    size_t len = std::min((size_t)n, size - 3);
+    while (len + 2 < want && len + 3 < size) buf[len++] = 'x';
+    buf[len++] = '"';
+    buf[len++] = '}';
+    return len;
+}
+
+static void runScenario(const Options &opt, const Scenario &sc) {
+    hostSerialVerbose = opt.verbose;
+    hostRandom().seed(opt.seed);
+    double rate = opt.rate * sc.rateFactor;
+    uint64_t untilUs = (uint64_t)opt.durationS * 1000000;
+    size_t messages = (size_t)(rate * opt.durationS);
+    BrokerStandIn broker(sc, untilUs + (uint64_t)opt.drainS * 1000000, messages, opt.seed);
+    hostNetwork = &broker;
+
+    initStoreForward();
+    initMQTT();
+
+    std::deque<size_t> queue;
+    std::vector<uint64_t> blockedUs;
+    uint64_t blockedTotalUs = 0, offlineUs = 0, connectUs = 0;
+    size_t queueDropped = 0, next = 0;
+    uint64_t nextLoopUs = 0, nextWindowUs = (uint64_t)SCAN_TIME_IN_SECONDS * 1000000, lastLoopUs = 0;
+    bool wasConnected = false;
+    std::vector<char> stored(messages, 0);
+    char buf[MAX_MQTT_MESSAGE_SIZE];
+    auto createdUs = [&](size_t seq) { return (uint64_t)(seq * 1e6 / rate); };
+    auto storeUnread = []() { return (size_t)(storeLog.appendedCount() - storeLog.replayedCount() - storeLog.droppedCount()); };
+    auto publish = [&]() {
+        size_t seq = queue.front();
+        queue.pop_front();
+        size_t len = makePayload(buf, sizeof(buf), seq, opt.payload);
+        uint64_t t0 = hostClockUs;
+        if (!sendMessage((const uint8_t *)buf, len, false)) stored[seq] = 1;
+        blockedUs.push_back(hostClockUs - t0);
+        blockedTotalUs += hostClockUs - t0;
+    };
+
+    // new messages up to now, sent right away if the publisher task ran meanwhile
+    auto arrive = [&](bool publisherRan) {
+        while (next < messages && createdUs(next) <= hostClockUs) {
+            if (queue.size() < PUBLISH_QUEUE_LEN) {
+                queue.push_back(next);
+            } else {
+                queueDropped++;
+            }
+            next++;
+            if (publisherRan) publish();
+        }
+    };
+
+    for (;;) {
+        arrive(false);
+        if (hostClockUs >= nextLoopUs) {
+            // loop task, offline if down at either end of the interval and during connect attempts
+            bool connected = isConnectedMQTT();
+            if (!connected || !wasConnected) offlineUs += hostClockUs - lastLoopUs;
+            uint32_t attempts = metricGet(metrics, MC_MQTT_CONNECTS) + metricGet(metrics, MC_MQTT_CONNECT_FAILED);
+            uint64_t t0 = hostClockUs;
+            loopMQTT();
+            if (!connected) offlineUs += hostClockUs - t0;
+            wasConnected = isConnectedMQTT();
+            lastLoopUs = hostClockUs;
+            if (metricGet(metrics, MC_MQTT_CONNECTS) + metricGet(metrics, MC_MQTT_CONNECT_FAILED) != attempts) {
+                connectUs += hostClockUs - t0;
+                // publisher task ran meanwhile, its sends failed fast (stored)
+                hostMutexHeldElsewhere = true;
+                while (!queue.empty()) publish();
+                arrive(true);
+                hostMutexHeldElsewhere = false;
+            }
+            if (hostClockUs >= nextWindowUs) {
+                nextWindowUs += (uint64_t)SCAN_TIME_IN_SECONDS * 1000000;
+                reportStoreStats();
+                reportMetrics();
+                flushMQTT();
+            }
+            nextLoopUs = hostClockUs + LOOP_INTERVAL_MS * 1000;
+            continue;
+        }
+        // publisher task
+        if (!queue.empty()) {
+            publish();
+            continue;
+        }
+        pollMQTT();
+        replayStoredMessages();
+        if (next == messages && (storeUnread() == 0 || hostClockUs >= untilUs + (uint64_t)opt.drainS * 1000000)) break;
+        uint64_t wake = next < messages ? std::min(nextLoopUs, createdUs(next)) : nextLoopUs;
+        hostClockUs = std::max(hostClockUs, wake);
+    }
+    // last bytes in flight
+    hostClockUs += 10 * 1000000;
+    broker.process();
+
+    std::vector<uint64_t> latencyUs;
+    size_t delivered = 0, replayed = 0;
+    for (size_t seq = 0; seq < messages; seq++) {
+        if (!broker.delivered(seq)) continue;
+        delivered++;
+        if (stored[seq]) {
+            replayed++;
+        } else {
+            latencyUs.push_back(broker.arrivalUs(seq) - createdUs(seq));
+        }
+    }
+    size_t lost = messages - delivered;
+    size_t storeDropped = storeLog.droppedCount();
+    size_t leftStored = storeUnread();
+    size_t onTheWay = lost - std::min(lost, queueDropped + storeDropped + leftStored);
+    double blockedP99 = percentile(blockedUs, 99);
+    double p50 = percentile(latencyUs, 50), p99 = percentile(latencyUs, 99), pMax = percentile(latencyUs, 100);
+    uint32_t connects = metricGet(metrics, MC_MQTT_CONNECTS), failed = metricGet(metrics, MC_MQTT_CONNECT_FAILED);
+    const char *fmt = opt.csv ? "%s,%.1f,%.0f,%.0f,%.0f,%.0f,%.1f,%.1f,%.1f,%u,%u,%zu,%zu,%zu,%zu,%zu,%zu,%llu\n"
+                              : "%-9s %7.1f %7.0f %7.0f %7.0f %8.0f %8.1f %8.1f %8.1f %5u/%-4u %7zu %6zu %6zu %6zu %6zu %6zu %10llu\n";
+    printf(fmt, sc.name, delivered / (double)opt.durationS, p50, p99, pMax, blockedP99, blockedTotalUs / 1e6, offlineUs / 1e6,
+           connectUs / 1e6, connects + failed, failed, replayed, lost, queueDropped, storeDropped, onTheWay, leftStored,
+           (unsigned long long)broker.stats.bytesOnWire);
+    fflush(stdout);
+    if (opt.verbose)
+        printf("  broker: %llu connects, %llu publishes, %llu admin, %llu discarded, %llu duplicates, %llu resets, %llu write timeouts\n",
+               (unsigned long long)broker.stats.connects, (unsigned long long)broker.stats.publishes, (unsigned long long)broker.stats.admin,
+               (unsigned long long)broker.stats.discarded, (unsigned long long)broker.stats.duplicates, (unsigned long long)broker.stats.resets,
+               (unsigned long long)broker.stats.writeTimeouts);
+    if (broker.stats.malformed > 0) {
+        fprintf(stderr, "%s: broker got %llu malformed packets.\n", sc.name, (unsigned long long)broker.stats.malformed);
+        exit(1);
+    }
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: mqtt_bench [--duration <s>] [--drain <s>] [--rate <msg/s>] [--payload <bytes>] [--scenario <name>] [--seed <n>]\n"
+            "                  [--csv] [--verbose]\n"
+            "Scenarios:");
+    for (const Scenario &sc : SCENARIOS) fprintf(stderr, " %s", sc.name);
+    fprintf(stderr, "\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--duration" && hasValue) {
+            opt.durationS = std::max(1, atoi(argv[++i]));
+        } else if (a == "--drain" && hasValue) {
+            opt.drainS = std::max(0, atoi(argv[++i]));
+        } else if (a == "--rate" && hasValue) {
+            opt.rate = std::max(0.1, atof(argv[++i]));
+        } else if (a == "--payload" && hasValue) {
+            opt.payload = std::max(100, atoi(argv[++i]));
+        } else if (a == "--scenario" && hasValue) {
+            opt.scenario = argv[++i];
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        } else if (a == "--csv") {
+            opt.csv = true;
+        } else if (a == "--verbose") {
+            opt.verbose = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (opt.payload + 64 > MAX_MQTT_MESSAGE_SIZE) {
+        fprintf(stderr, "Payload exceeds MAX_MQTT_MESSAGE_SIZE (%d).\n", MAX_MQTT_MESSAGE_SIZE);
+        return 1;
+    }
+    if (opt.csv) {
+        printf("scenario,delivered/s,p50Ms,p99Ms,maxMs,blockedP99Ms,blockedS,offlineS,connectS,attempts,failed,replayed,lost,"
+               "queueFull,storeFull,onTheWay,stillStored,wireBytes\n");
+    } else {
+        printf("%.0f s at %.1f msg/s of %zu bytes, %s, %u ms socket timeout, store of %zu kB.\n\n", (double)opt.durationS, opt.rate,
+               opt.payload,
+#ifdef SECURE_MQTT
+               "TLS",
+#else
+               "plain TCP",
+#endif  // SECURE_MQTT
+               MQTT_SOCKET_TIMEOUT_S * 1000, hostDataPartitionSize / 1024);
+        printf("%-9s %7s %7s %7s %7s %8s %8s %8s %8s %10s %7s %6s %6s %6s %6s %6s %10s\n", "", "msg/s", "p50 ms", "p99 ms", "max ms",
+               "blocked", "blocked", "offline", "connect", "attempts", "from", "lost", "queue", "store", "on the", "still", "wire");
+        printf("%-9s %7s %7s %7s %7s %8s %8s %8s %8s %10s %7s %6s %6s %6s %6s %6s %10s\n", "scenario", "", "", "", "", "p99 ms",
+               "s", "s", "s", "(failed)", "store", "", "full", "full", "way", "stored", "bytes");
+    }
+    fflush(stdout);
+    bool ok = true, found = false;
+    for (const Scenario &sc : SCENARIOS) {
+        if (!opt.scenario.empty() && opt.scenario != sc.name) continue;
+        found = true;
+        // firmware state is global, start each scenario fresh
+        pid_t pid = fork();
+        if (pid == 0) {
+            runScenario(opt, sc);
+            exit(0);
+        }
+        int status = 1;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+    }
+    if (!found) {
+        usage();
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,348 @@
+/**
+ * Creates a delta OTA patch (see src/delta_patch.h) between two firmware images.
+ *
+ * Images are the bin-files named by name_bin_file.py, e.g. firmware-1-1-20.bin (base, running
+ * on the loggers) and firmware-1-1-21.bin (new). The patch is named after both versions, e.g.
+ * firmware-1-1-20_1-1-21.kdp, unless given by -o.
+ *
+ * Matching follows bsdiff (Colin Percival): suffix array of the base, extend approximate matches,
+ * store the byte difference for matched regions and new bytes as they are. Code moved by a
+ * change differs in few bytes (addresses), so the difference is mostly zero and coded as runs.
+ *
+ * The patch is verified by applying it with the patcher of the firmware before it is written.
+ * Prints sizes and the OTA message to publish at the ota-topic, with --url the location the
+ * patch will be uploaded to.
+ *
+ * Usage:
+ *   ota_diff <base.bin> <new.bin> [-o <patch>] [--url <url>]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "delta_patch.h"
+
+struct Options {
+    const char *base = nullptr;
+    const char *next = nullptr;
+    std::string out;
+    std::string url;
+};
+
+typedef std::vector<uint8_t> Bytes;
+
+static bool readFile(const char *path, Bytes &data) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) return false;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) data.insert(data.end(), chunk, chunk + n);
+    fclose(f);
+    return true;
+}
+
+/**
+ * "1.1.20" from ".../firmware-1-1-20.bin", empty if not named that way.
+ */
+static std::string versionFromName(const char *path) {
+    const char *p = strstr(path, "firmware-");
+    if (p == nullptr) return "";
+    std::string v;
+    for (p += strlen("firmware-"); *p != '\0' && *p != '.' && *p != '_'; p++) v += *p == '-' ? '.' : *p;
+    return v;
+}
+
+//----------------------------
+// DIFF
+//----------------------------
+/**
+ * Suffix array by prefix doubling, including the empty suffix (first).
+ */
+static std::vector<int32_t> suffixArray(const Bytes &s) {
+    int32_t n = (int32_t)s.size();
+    std::vector<int32_t> sa(n + 1), rank(n + 1), tmp(n + 1);
+    for (int32_t i = 0; i <= n; i++) {
+        sa[i] = i;
+        rank[i] = i < n ? s[i] : -1;
+    }
+    for (int32_t k = 1;; k *= 2) {
+        auto key = [&](int32_t i) { return std::make_pair(rank[i], i + k <= n ? rank[i + k] : -1); };
+        std::sort(sa.begin(), sa.end(), [&](int32_t a, int32_t b) { return key(a) < key(b); });
+        tmp[sa[0]] = 0;
+        for (int32_t i = 1; i <= n; i++) tmp[sa[i]] = tmp[sa[i - 1]] + (key(sa[i - 1]) < key(sa[i]) ? 1 : 0);
+        rank.swap(tmp);
+        if (rank[sa[n]] == n) break;
+    }
+    return sa;
+}
+
+static int32_t matchLen(const uint8_t *a, int32_t aLen, const uint8_t *b, int32_t bLen) {
+    int32_t i = 0;
+    while (i < aLen && i < bLen && a[i] == b[i]) i++;
+    return i;
+}
+
+/**
+ * Longest match of next[0..] in base, binary search over the suffix array.
+ */
+static int32_t search(const std::vector<int32_t> &sa, const Bytes &base, const uint8_t *next, int32_t nextLen, int32_t &pos) {
+    int32_t n = (int32_t)base.size();
+    int32_t lo = 0, hi = n;
+    while (hi - lo >= 2) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (memcmp(base.data() + sa[mid], next, std::min(n - sa[mid], nextLen)) < 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    int32_t x = matchLen(base.data() + sa[lo], n - sa[lo], next, nextLen);
+    int32_t y = matchLen(base.data() + sa[hi], n - sa[hi], next, nextLen);
+    pos = x > y ? sa[lo] : sa[hi];
+    return std::max(x, y);
+}
+
+static void putVarint(Bytes &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+/**
+ * Diff bytes as tokens, zero runs shorter than 3 bytes stay in the literal (cheaper than two tokens).
+ */
+static void putDiff(Bytes &out, const uint8_t *diff, int32_t len) {
+    int32_t i = 0;
+    while (i < len) {
+        int32_t j = i;
+        while (j < len && diff[j] == 0) j++;
+        if (j - i >= 3 || j == len) {
+            putVarint(out, (uint64_t)(j - i) << 1);
+            i = j;
+            continue;
+        }
+        // literal until a zero run of 3
+        j = i;
+        while (j < len) {
+            int32_t z = j;
+            while (z < len && diff[z] == 0) z++;
+            if (z > j && (z - j >= 3 || z == len)) break;
+            j = z > j ? z : j + 1;
+        }
+        putVarint(out, ((uint64_t)(j - i) << 1) | 1);
+        out.insert(out.end(), diff + i, diff + j);
+        i = j;
+    }
+}
+
+struct DiffStats {
+    size_t blocks = 0;
+    size_t diffBytes = 0;
+    size_t extraBytes = 0;
+};
+
+static void diffImages(const Bytes &base, const Bytes &next, Bytes &patch, DiffStats &st) {
+    std::vector<int32_t> sa = suffixArray(base);
+    const uint8_t *o = base.data(), *nw = next.data();
+    int32_t oldSize = (int32_t)base.size(), newSize = (int32_t)next.size();
+    Bytes diff;
+
+    int32_t scan = 0, len = 0, pos = 0, lastScan = 0, lastPos = 0, lastOffset = 0;
+    while (scan < newSize) {
+        int32_t oldScore = 0;
+        int32_t scsc;
+        for (scsc = scan += len; scan < newSize; scan++) {
+            len = search(sa, base, nw + scan, newSize - scan, pos);
+            for (; scsc < scan + len; scsc++)
+                if (scsc + lastOffset < oldSize && o[scsc + lastOffset] == nw[scsc]) oldScore++;
+            if ((len == oldScore && len != 0) || len > oldScore + 8) break;
+            if (scan + lastOffset < oldSize && o[scan + lastOffset] == nw[scan]) oldScore--;
+        }
+        if (len == oldScore && scan != newSize) continue;
+
+        // extend last match forwards
+        int32_t s = 0, sf = 0, lenF = 0;
+        for (int32_t i = 0; lastScan + i < scan && lastPos + i < oldSize;) {
+            if (o[lastPos + i] == nw[lastScan + i]) s++;
+            i++;
+            if (s * 2 - i > sf * 2 - lenF) {
+                sf = s;
+                lenF = i;
+            }
+        }
+        // and this one backwards
+        int32_t lenB = 0;
+        if (scan < newSize) {
+            int32_t sb = 0;
+            s = 0;
+            for (int32_t i = 1; scan >= lastScan + i && pos >= i; i++) {
+                if (o[pos - i] == nw[scan - i]) s++;
+                if (s * 2 - i > sb * 2 - lenB) {
+                    sb = s;
+                    lenB = i;
+                }
+            }
+        }
+        if (lastScan + lenF > scan - lenB) {
+            int32_t overlap = (lastScan + lenF) - (scan - lenB);
+            int32_t ss = 0, lenS = 0;
+            s = 0;
+            for (int32_t i = 0; i < overlap; i++) {
+                if (nw[lastScan + lenF - overlap + i] == o[lastPos + lenF - overlap + i]) s++;
+                if (nw[scan - lenB + i] == o[pos - lenB + i]) s--;
+                if (s > ss) {
+                    ss = s;
+                    lenS = i + 1;
+                }
+            }
+            lenF += lenS - overlap;
+            lenB -= lenS;
+        }
+
+        int32_t extraLen = (scan - lenB) - (lastScan + lenF);
+        putVarint(patch, (uint64_t)lenF);
+        putVarint(patch, (uint64_t)extraLen);
+        putVarint(patch, zigzag((int64_t)(pos - lenB) - (lastPos + lenF)));
+        diff.resize(lenF);
+        for (int32_t i = 0; i < lenF; i++) diff[i] = (uint8_t)(nw[lastScan + i] - o[lastPos + i]);
+        putDiff(patch, diff.data(), lenF);
+        patch.insert(patch.end(), nw + lastScan + lenF, nw + lastScan + lenF + extraLen);
+        st.blocks++;
+        st.diffBytes += lenF;
+        st.extraBytes += extraLen;
+
+        lastScan = scan - lenB;
+        lastPos = pos - lenB;
+        lastOffset = pos - scan;
+    }
+}
+
+//----------------------------
+// VERIFY
+//----------------------------
+struct MemoryTarget {
+    const Bytes &base;
+    Bytes out;
+
+    explicit MemoryTarget(const Bytes &b) : base(b) {}
+    bool begin(const DeltaPatchHeader &h) {
+        out.reserve(h.newSize);
+        return h.baseSize == base.size();
+    }
+    bool readBase(uint32_t offset, uint8_t *buf, size_t len) {
+        memcpy(buf, base.data() + offset, len);
+        return true;
+    }
+    bool writeNew(const uint8_t *buf, size_t len) {
+        out.insert(out.end(), buf, buf + len);
+        return true;
+    }
+};
+
+/**
+ * Applies patch in chunks of varying size, as it would arrive over the network.
+ */
+static bool verifyPatch(const Bytes &base, const Bytes &next, const Bytes &patch) {
+    MemoryTarget target(base);
+    DeltaPatcher<MemoryTarget> patcher(target);
+    DeltaPatchStatus status = DELTA_PATCH_MORE;
+    size_t chunk = 1;
+    for (size_t i = 0; i < patch.size() && status != DELTA_PATCH_ERROR; i += chunk, chunk = chunk * 7 % 1499 + 1)
+        status = patcher.feed(patch.data() + i, std::min(chunk, patch.size() - i));
+    if (status != DELTA_PATCH_DONE) {
+        fprintf(stderr, "Patch does not apply: %s.\n", status == DELTA_PATCH_ERROR ? DELTA_PATCH_ERROR_NAMES[patcher.error()] : "incomplete");
+        return false;
+    }
+    return target.out == next;
+}
+
+static void usage() { fprintf(stderr, "Usage: ota_diff <base.bin> <new.bin> [-o <patch>] [--url <url>]\n"); }
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "-o" && hasValue) {
+            opt.out = argv[++i];
+        } else if (a == "--url" && hasValue) {
+            opt.url = argv[++i];
+        } else if (a[0] != '-' && opt.base == nullptr) {
+            opt.base = argv[i];
+        } else if (a[0] != '-' && opt.next == nullptr) {
+            opt.next = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return opt.next != nullptr;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    Bytes base, next;
+    if (!readFile(opt.base, base) || !readFile(opt.next, next)) {
+        fprintf(stderr, "Cannot read %s or %s.\n", opt.base, opt.next);
+        return 1;
+    }
+    std::string baseVersion = versionFromName(opt.base), newVersion = versionFromName(opt.next);
+    if (baseVersion.empty() || newVersion.empty()) fprintf(stderr, "Warning: file names are not firmware-x-y-z, versions unknown.\n");
+    if (opt.out.empty()) {
+        std::string dashed = newVersion;
+        std::replace(dashed.begin(), dashed.end(), '.', '-');
+        std::string name = opt.base;
+        name = name.substr(0, name.rfind('.'));
+        opt.out = name + "_" + (dashed.empty() ? "new" : dashed) + ".kdp";
+    }
+
+    DeltaPatchHeader h;
+    h.baseSize = (uint32_t)base.size();
+    h.newSize = (uint32_t)next.size();
+    Sha256 sha;
+    sha.update(base.data(), base.size());
+    sha.finish(h.baseSha256);
+    sha.reset();
+    sha.update(next.data(), next.size());
+    sha.finish(h.newSha256);
+
+    auto t0 = std::chrono::steady_clock::now();
+    Bytes patch(DELTA_PATCH_HEADER_LEN);
+    deltaPatchPutHeader(patch.data(), h);
+    DiffStats st;
+    diffImages(base, next, patch, st);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if (!verifyPatch(base, next, patch)) {
+        fprintf(stderr, "Patch verification failed, nothing written.\n");
+        return 1;
+    }
+    FILE *f = fopen(opt.out.c_str(), "wb");
+    if (f == nullptr || fwrite(patch.data(), 1, patch.size(), f) != patch.size()) {
+        fprintf(stderr, "Cannot write %s.\n", opt.out.c_str());
+        return 1;
+    }
+    fclose(f);
+
+    char newHex[2 * SHA256_LEN + 1];
+    sha256Hex(h.newSha256, newHex);
+    printf("base  %-24s %9zu bytes\n", baseVersion.c_str(), base.size());
+    printf("new   %-24s %9zu bytes\n", newVersion.c_str(), next.size());
+    printf("patch %-24s %9zu bytes (%.1f%% of new, %.1fx smaller), %zu blocks, %zu diff, %zu extra bytes, %.1f s\n",
+           opt.out.c_str(), patch.size(), 100.0 * patch.size() / std::max<size_t>(1, next.size()),
+           (double)next.size() / std::max<size_t>(1, patch.size()), st.blocks, st.diffBytes, st.extraBytes, s);
+    std::string url = opt.url.empty() ? opt.out.substr(opt.out.rfind('/') + 1) : opt.url;
+    printf("\nOTA message:\n{\"version\": \"%s\", \"base\": \"%s\", \"url\": \"%s\", \"sha256\": \"%s\"}\n", newVersion.c_str(),
+           baseVersion.c_str(), url.c_str(), newHex);
+    return 0;
+}
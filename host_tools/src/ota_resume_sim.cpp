@@ -0,0 +1,379 @@
+/**
+ * Runs the resumable OTA download (see src/ota_download.h) against a local HTTP server stand-in.
+ *
+ * The stand-in listens on 127.0.0.1 and serves a random image with range requests. Per request it
+ * may, as set by the scenario:
+ *   - drop the connection somewhere within the body,
+ *   - stall before the body until the client times out,
+ *   - answer 503,
+ *   - flip a byte (once), which only the final hash check finds,
+ *   - ignore the range and send the whole image (200).
+ * The device side talks HTTP over a socket and writes into a flash partition in memory that behaves
+ * like NOR flash (write only clears bits, erase per sector). A scenario may cut power during a flash
+ * write: the downloader is thrown away and created again from the saved progress, like after a reboot.
+ *
+ * Usage:
+ *   ota_resume_sim [--size <bytes>] [--chunk <bytes>] [--rate <bytes/s>] [--timeout-ms <ms>] [--seed <n>]
+ *
+ * Reports per scenario whether the image in flash matches, time, mean rate (bounded by --rate),
+ * bytes fetched per image byte, retried chunks, reboots and the final or last error.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ota_download.h"
+
+struct Options {
+    uint32_t size = 0x100000 + 12345;
+    uint32_t chunk = 32768;
+    uint32_t rate = 2000000;
+    uint32_t timeoutMs = 200;
+    uint32_t seed = 1;
+};
+
+struct Scenario {
+    const char *name;
+    double drop;       // per request
+    double stall;      // per request
+    double error503;   // per request
+    bool corruptOnce;
+    bool noRange;
+    double powerLoss;  // per flash write
+};
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t nowMs() {
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------
+// SERVER STAND-IN
+//----------------------------
+class Server {
+   public:
+    Server(const Bytes &image, const Scenario &sc, uint32_t seed, uint32_t stallMs) : image(image), sc(sc), rng(seed), stallMs(stallMs) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, (sockaddr *)&addr, sizeof(addr));
+        listen(fd, 16);
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+        acceptor = std::thread([this] { acceptLoop(); });
+    }
+
+    ~Server() {
+        running = false;
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+        acceptor.join();
+        for (std::thread &t : workers) t.join();
+    }
+
+    uint16_t port = 0;
+    std::atomic<uint32_t> requests{0};
+
+   private:
+    void acceptLoop() {
+        while (running) {
+            int c = accept(fd, nullptr, nullptr);
+            if (c < 0) continue;
+            // a stalled connection must not block the next one
+            workers.emplace_back([this, c] { serve(c); });
+        }
+    }
+
+    void serve(int c) {
+        std::string req;
+        char ch;
+        while (req.find("\r\n\r\n") == std::string::npos && recv(c, &ch, 1, 0) == 1) req += ch;
+        requests++;
+        uint32_t first = 0, last = (uint32_t)image.size() - 1;
+        bool ranged = false;
+        size_t r = req.find("Range: bytes=");
+        if (r != std::string::npos && !sc.noRange) {
+            unsigned long a, b;
+            if (sscanf(req.c_str() + r, "Range: bytes=%lu-%lu", &a, &b) == 2 && a < image.size()) {
+                first = (uint32_t)a;
+                last = (uint32_t)std::min<unsigned long>(b, image.size() - 1);
+                ranged = true;
+            }
+        }
+        double u, v, w;
+        size_t cut;
+        bool corrupt = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::uniform_real_distribution<double> uni(0, 1);
+            u = uni(rng);
+            v = uni(rng);
+            w = uni(rng);
+            cut = rng() % (last - first + 1);
+            if (sc.corruptOnce && !corrupted && requests > 2) corrupt = corrupted = true;
+        }
+        if (w < sc.error503) {
+            sendAll(c, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            close(c);
+            return;
+        }
+        char head[256];
+        if (ranged)
+            snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %u-%u/%zu\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", first, last,
+                     image.size(), last - first + 1);
+        else
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", image.size());
+        sendAll(c, head);
+        if (v < sc.stall) std::this_thread::sleep_for(std::chrono::milliseconds(stallMs));
+        Bytes body(image.begin() + first, image.begin() + last + 1);
+        if (corrupt) body[cut] ^= 0x10;
+        size_t n = u < sc.drop ? cut : body.size();
+        if (running) send(c, body.data(), n, MSG_NOSIGNAL);
+        close(c);
+    }
+
+    static void sendAll(int c, const std::string &s) { send(c, s.data(), s.size(), MSG_NOSIGNAL); }
+
+    const Bytes &image;
+    Scenario sc;
+    std::mt19937 rng;
+    std::mutex mutex;
+    uint32_t stallMs;
+    bool corrupted = false;
+    int fd;
+    std::atomic<bool> running{true};
+    std::thread acceptor;
+    std::vector<std::thread> workers;
+};
+
+//----------------------------
+// DEVICE SIDE
+//----------------------------
+class SocketHttp {
+   public:
+    SocketHttp(uint16_t port, uint32_t timeoutMs) : port(port), timeoutMs(timeoutMs) {}
+    ~SocketHttp() { close(); }
+
+    int get(uint32_t offset, uint32_t len, OtaRange &range) {
+        close();
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        timeval tv = {(time_t)(timeoutMs / 1000), (suseconds_t)(timeoutMs % 1000 * 1000)};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) return -1;
+        char req[160];
+        int n = snprintf(req, sizeof(req), "GET /firmware.bin HTTP/1.1\r\nHost: 127.0.0.1\r\nRange: bytes=%u-%u\r\nConnection: close\r\n\r\n", offset,
+                         offset + len - 1);
+        if (send(fd, req, n, MSG_NOSIGNAL) != n) return -1;
+        std::string head;
+        char ch;
+        while (head.find("\r\n\r\n") == std::string::npos) {
+            if (recv(fd, &ch, 1, 0) != 1) return -1;
+            head += ch;
+        }
+        int status = 0;
+        if (sscanf(head.c_str(), "HTTP/1.1 %d", &status) != 1) return -1;
+        size_t p = head.find("Content-Range: ");
+        if (p != std::string::npos) {
+            std::string value = head.substr(p + 15, head.find("\r\n", p) - p - 15);
+            parseContentRange(value.c_str(), range);
+        }
+        return status;
+    }
+
+    int read(uint8_t *buf, size_t len) { return (int)recv(fd, buf, len, 0); }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+   private:
+    uint16_t port;
+    uint32_t timeoutMs;
+    int fd = -1;
+};
+
+struct PowerLoss {};
+
+class NorFlash {
+   public:
+    NorFlash(uint32_t capacity, double powerLoss, uint32_t seed) : data(capacity, 0xff), powerLoss(powerLoss), rng(seed) {}
+
+    bool erase(uint32_t offset, uint32_t len) {
+        if (offset % OTA_SECTOR_BYTES != 0) return false;
+        len = (len + OTA_SECTOR_BYTES - 1) / OTA_SECTOR_BYTES * OTA_SECTOR_BYTES;
+        if ((uint64_t)offset + len > data.size()) return false;
+        std::fill(data.begin() + offset, data.begin() + offset + len, 0xff);
+        erases += len / OTA_SECTOR_BYTES;
+        return true;
+    }
+
+    bool write(uint32_t offset, const uint8_t *buf, size_t len) {
+        if ((uint64_t)offset + len > data.size()) return false;
+        bool cut = std::uniform_real_distribution<double>(0, 1)(rng) < powerLoss;
+        // power may go in the middle of a write
+        size_t n = cut ? rng() % (len + 1) : len;
+        for (size_t i = 0; i < n; i++) data[offset + i] &= buf[i];
+        if (cut) throw PowerLoss();
+        return true;
+    }
+
+    bool read(uint32_t offset, uint8_t *buf, size_t len) {
+        if ((uint64_t)offset + len > data.size()) return false;
+        memcpy(buf, data.data() + offset, len);
+        return true;
+    }
+
+    uint32_t capacity() const { return (uint32_t)data.size(); }
+
+    Bytes data;
+    uint32_t erases = 0;
+
+   private:
+    double powerLoss;
+    std::mt19937 rng;
+};
+
+// like NVS, survives the reboot
+struct MemoryStore {
+    OtaProgress saved;
+    bool valid = false;
+
+    bool load(OtaProgress &p) {
+        p = saved;
+        return valid;
+    }
+    bool save(const OtaProgress &p) {
+        saved = p;
+        valid = true;
+        return true;
+    }
+};
+
+typedef OtaDownloader<SocketHttp, NorFlash, MemoryStore> Downloader;
+
+struct Result {
+    bool match = false;
+    double seconds = 0;
+    uint32_t fetched = 0;
+    uint32_t retries = 0;
+    uint32_t reboots = 0;
+    uint32_t requests = 0;
+    OtaDownloadState state = OTA_DL_DOWNLOAD;
+    OtaDownloadError error = OTA_DL_ERR_NONE;
+};
+
+static Result run(const Options &opt, const Scenario &sc, const Bytes &image, const uint8_t sha[SHA256_LEN]) {
+    Server server(image, sc, opt.seed, 3 * opt.timeoutMs);
+    // partition of the default table
+    NorFlash flash(0x140000, sc.powerLoss, opt.seed + 1);
+    MemoryStore store;
+    OtaDownloadConfig cfg = {opt.chunk, opt.rate, 8, 20};
+    Result r;
+    uint32_t start = nowMs();
+    while (r.state != OTA_DL_DONE && r.state != OTA_DL_FAILED) {
+        // boot
+        SocketHttp http(server.port, opt.timeoutMs);
+        std::unique_ptr<Downloader> dl(new Downloader(http, flash, store, cfg));
+        dl->begin(sha);
+        try {
+            while (r.state != OTA_DL_DONE && r.state != OTA_DL_FAILED) {
+                r.state = dl->step(nowMs());
+                uint32_t wait = dl->waitMs(nowMs());
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+            }
+        } catch (const PowerLoss &) {
+            r.reboots++;
+        }
+        r.fetched += dl->fetchedBytes();
+        r.retries += dl->retryCount();
+        r.error = dl->error();
+    }
+    r.seconds = (nowMs() - start) / 1000.0;
+    r.match = r.state == OTA_DL_DONE && std::equal(image.begin(), image.end(), flash.data.begin());
+    r.requests = server.requests;
+    return r;
+}
+
+static void printRow(const char *name, const Result &r, size_t size) {
+    double rate = r.match ? size / 1000.0 / std::max(0.001, r.seconds) : 0;
+    printf("%-22s %-6s %7.2f %9.0f %9.2f %8u %8u %8u  %s\n", name, r.match ? "yes" : "no", r.seconds, rate,
+           (double)r.fetched / size, r.requests, r.retries, r.reboots, r.error != OTA_DL_ERR_NONE ? OTA_DL_ERROR_NAMES[r.error] : "-");
+}
+
+static void usage() { fprintf(stderr, "Usage: ota_resume_sim [--size <bytes>] [--chunk <bytes>] [--rate <bytes/s>] [--timeout-ms <ms>] [--seed <n>]\n"); }
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--size" && hasValue) {
+            opt.size = std::max(1, atoi(argv[++i]));
+        } else if (a == "--chunk" && hasValue) {
+            opt.chunk = std::max(1, atoi(argv[++i]));
+        } else if (a == "--rate" && hasValue) {
+            opt.rate = std::max(0, atoi(argv[++i]));
+        } else if (a == "--timeout-ms" && hasValue) {
+            opt.timeoutMs = std::max(10, atoi(argv[++i]));
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    Bytes image(opt.size);
+    std::mt19937 rng(opt.seed);
+    for (uint8_t &b : image) b = (uint8_t)rng();
+    uint8_t sha[SHA256_LEN];
+    Sha256 h;
+    h.update(image.data(), image.size());
+    h.finish(sha);
+
+    static const Scenario SCENARIOS[] = {
+        {"clean", 0, 0, 0, false, false, 0},
+        {"drops 10%", 0.1, 0, 0, false, false, 0},
+        {"drops 30%, stalls 10%", 0.3, 0.1, 0, false, false, 0},
+        {"503 20%", 0, 0, 0.2, false, false, 0},
+        {"power loss", 0.05, 0, 0, false, false, 0.005},
+        {"corrupt byte", 0, 0, 0, true, false, 0},
+        {"no range support", 0, 0, 0, false, true, 0},
+    };
+    printf("Image of %u bytes in chunks of %u, limited to %u bytes/s, client timeout %u ms.\n\n", opt.size, opt.chunk, opt.rate, opt.timeoutMs);
+    printf("%-22s %-6s %7s %9s %9s %8s %8s %8s  %s\n", "scenario", "match", "s", "kB/s", "fetched", "requests", "retries", "reboots", "error");
+    for (const Scenario &sc : SCENARIOS) printRow(sc.name, run(opt, sc, image, sha), image.size());
+    return 0;
+}
@@ -0,0 +1,316 @@
+/**
+ * Replays a capture of raw advertisements (see src/ble_capture.h) through the firmware pipeline:
+ * raw data -> BleAdvRecord -> window duplicate filter -> publish queue -> publisher thread
+ * -> (delta encoding) -> JSON/binary (batched) message -> publish.
+ * Publishing is simulated by a fixed delay per message (broker round-trip).
+ * Delta encoded records are reconstructed again (as on a backend) and compared to the originals.
+ *
+ * Usage:
+ *   replay <capture> [--speed <factor>|max] [--publish-us <us>] [--batch <bytes>] [--binary] [--window <s>] [--delta]
+ *
+ * <capture> is either a capture file or a serial log holding "CAP <hex>" lines (CAPTURE_SERIAL/CAPTURE_FLASH).
+ *
+ * Reports throughput, duplicates, queue drops and latency from capture (callback) to publish.
+ */
+
+#include <sys/time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ble_adv_parser.h"
+#include "ble_batch.h"
+#include "ble_binary.h"
+#include "ble_capture.h"
+#include "ble_delta.h"
+#include "ble_delta_decoder.h"
+#include "ble_json.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+#include "ble_seen_set.h"
+#include "spsc_queue.h"
+
+// as in globals_kd.h
+#define PUBLISH_QUEUE_LEN 64
+#define SEEN_SET_SIZE 1024
+#define MAX_MQTT_MESSAGE_SIZE 512
+#define MAX_MQTT_BATCH_SIZE 4096
+#define BATCH_DEADLINE_MS 2000
+#define DELTA_CACHE_SIZE 256
+#define DELTA_KEYFRAME_S 300
+
+using Clock = std::chrono::steady_clock;
+
+static SpscQueue<BleAdvRecord, PUBLISH_QUEUE_LEN> publishQueue;
+static BleSeenSet<SEEN_SET_SIZE> seenSet;
+static BleDeltaCache<DELTA_CACHE_SIZE> deltaCache(DELTA_KEYFRAME_S);
+static BleDeltaDecoder deltaDecoder;
+static std::atomic<bool> producerDone{false};
+
+struct Options {
+    const char *path = nullptr;
+    double speed = 1.0;  // 0 = max
+    uint32_t publishUs = 0;
+    size_t batchBytes = 0;  // 0 = no batching
+    bool binary = false;
+    uint32_t windowSec = 10;
+    bool delta = false;
+};
+
+struct PublishStats {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+    uint64_t deltaRecords = 0;
+    uint64_t deltaMismatches = 0;  // reconstructed record differs from original
+    std::vector<uint64_t> latencyUs;
+};
+
+static uint64_t epochUs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+//----------------------------
+// LOADING
+//----------------------------
+static bool hexToBytes(const std::string &hex, std::vector<uint8_t> &out) {
+    if (hex.size() % 2) return false;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        char *end;
+        out.push_back((uint8_t)strtoul(byte, &end, 16));
+        if (*end) return false;
+    }
+    return true;
+}
+
+/**
+ * Turns a serial log into capture bytes, lines not starting with "CAP " are ignored.
+ */
+static bool serialLogToCapture(const std::string &log, std::vector<uint8_t> &out) {
+    std::istringstream in(log);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t pos = line.find("CAP ");
+        if (pos == std::string::npos) continue;
+        std::string hex = line.substr(pos + 4);
+        while (!hex.empty() && (hex.back() == '\r' || hex.back() == ' ')) hex.pop_back();
+        if (!hexToBytes(hex, out)) return false;
+    }
+    return !out.empty();
+}
+
+static bool loadCapture(const char *path, std::vector<BleRawAdv> &advs) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    std::vector<uint8_t> data(content.begin(), content.end());
+
+    uint64_t startEpochUs;
+    if (!captureDecodeHeader(data.data(), data.size(), startEpochUs)) {
+        data.clear();
+        if (!serialLogToCapture(content, data) || !captureDecodeHeader(data.data(), data.size(), startEpochUs)) return false;
+    }
+    size_t pos = BLE_CAPTURE_HEADER_LEN;
+    uint64_t prevUs = 0;
+    while (pos < data.size()) {
+        // later headers (device rebooted while capturing) restart the time base
+        uint64_t ignored;
+        if (captureDecodeHeader(data.data() + pos, data.size() - pos, ignored)) {
+            pos += BLE_CAPTURE_HEADER_LEN;
+            prevUs = advs.empty() ? 0 : advs.back().timeUs;
+            continue;
+        }
+        BleRawAdv adv;
+        size_t n = captureDecodeRecord(data.data() + pos, data.size() - pos, prevUs, adv);
+        if (n == 0) {
+            fprintf(stderr, "Malformed record at offset %zu, stop reading.\n", pos);
+            break;
+        }
+        advs.push_back(adv);
+        pos += n;
+    }
+    return true;
+}
+
+//----------------------------
+// PIPELINE
+//----------------------------
+static void publish(PublishStats &stats, const Options &opt, size_t len, const std::vector<uint64_t> &stampsUs) {
+    // simulated broker round-trip
+    if (opt.publishUs > 0) std::this_thread::sleep_for(std::chrono::microseconds(opt.publishUs));
+    uint64_t now = epochUs();
+    stats.messages++;
+    stats.bytes += len;
+    stats.records += stampsUs.size();
+    for (uint64_t t : stampsUs) stats.latencyUs.push_back(now - t);
+}
+
+/**
+ * Delta encodes rec and checks that it can be reconstructed.
+ */
+static void deltaEncode(PublishStats &stats, BleAdvRecord &rec) {
+    BleAdvRecord original = rec;
+    if (!deltaCache.encode(rec)) stats.deltaRecords++;
+    BleAdvRecord reconstructed = rec;
+    BleDeltaResult result = deltaDecoder.apply(reconstructed);
+    if ((result != BLE_DELTA_FULL && result != BLE_DELTA_MERGED) || !bleDeltaSameFields(original, reconstructed))
+        stats.deltaMismatches++;
+}
+
+static uint32_t nowMs() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static void publisherThread(const Options &opt, PublishStats &stats) {
+    static char msg[MAX_MQTT_BATCH_SIZE];
+    BleBatch batch;
+    batchInit(batch, msg, opt.batchBytes + 1, opt.binary);
+    std::vector<uint64_t> stamps;
+    BleAdvRecord rec;
+
+    for (;;) {
+        bool done = producerDone.load();
+        bool got = false;
+        while (publishQueue.pop(rec)) {
+            got = true;
+            uint64_t stamp = (uint64_t)rec.timestamp * 1000000 + rec.micros;
+            if (opt.delta) deltaEncode(stats, rec);
+            if (opt.batchBytes > 0) {
+                if (!batchAdd(batch, rec, nowMs())) {
+                    publish(stats, opt, batchFinish(batch), stamps);
+                    batchReset(batch);
+                    stamps.clear();
+                    batchAdd(batch, rec, nowMs());
+                }
+                stamps.push_back(stamp);
+                continue;
+            }
+            size_t len;
+            if (opt.binary) {
+                len = binEncodeMessage((uint8_t *)msg, MAX_MQTT_MESSAGE_SIZE, rec);
+            } else {
+                len = serializeBleAdvRecord(msg, MAX_MQTT_MESSAGE_SIZE, rec);
+            }
+            publish(stats, opt, len, std::vector<uint64_t>{stamp});
+        }
+        if (batch.count > 0 && batchDeadlinePassed(batch, nowMs(), BATCH_DEADLINE_MS)) {
+            publish(stats, opt, batchFinish(batch), stamps);
+            batchReset(batch);
+            stamps.clear();
+        }
+        if (done && !got) break;
+        // as ulTaskNotifyTake() timeout in firmware
+        if (!got) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    if (batch.count > 0) publish(stats, opt, batchFinish(batch), stamps);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: replay <capture> [--speed <factor>|max] [--publish-us <us>] [--batch <bytes>] [--binary] [--window <s>] [--delta]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--speed" && hasValue) {
+            std::string v = argv[++i];
+            opt.speed = v == "max" ? 0 : atof(v.c_str());
+        } else if (a == "--publish-us" && hasValue) {
+            opt.publishUs = atoi(argv[++i]);
+        } else if (a == "--batch" && hasValue) {
+            opt.batchBytes = std::min<size_t>(atoi(argv[++i]), MAX_MQTT_BATCH_SIZE - 1);
+        } else if (a == "--binary") {
+            opt.binary = true;
+        } else if (a == "--delta") {
+            opt.delta = true;
+        } else if (a == "--window" && hasValue) {
+            opt.windowSec = std::max(1, atoi(argv[++i]));
+        } else if (a[0] != '-' && opt.path == nullptr) {
+            opt.path = argv[i];
+        } else {
+            return false;
+        }
+    }
+    return opt.path != nullptr;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[idx];
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<BleRawAdv> advs;
+    if (!loadCapture(opt.path, advs) || advs.empty()) {
+        fprintf(stderr, "Could not read capture \"%s\".\n", opt.path);
+        return 1;
+    }
+    double spanSec = (advs.back().timeUs - advs.front().timeUs) / 1e6;
+    printf("Loaded %zu advertisements spanning %.1f s.\n", advs.size(), spanSec);
+
+    PublishStats stats;
+    std::thread publisher(publisherThread, std::cref(opt), std::ref(stats));
+
+    uint64_t duplicates = 0;
+    uint64_t windowUs = (uint64_t)opt.windowSec * 1000000;
+    uint64_t firstUs = advs.front().timeUs;
+    Clock::time_point t0 = Clock::now();
+    for (const BleRawAdv &adv : advs) {
+        if (opt.speed > 0) {
+            auto offset = std::chrono::microseconds((uint64_t)((adv.timeUs - firstUs) / opt.speed));
+            std::this_thread::sleep_until(t0 + offset);
+        }
+        // same steps as onGapEvent() in ble.h
+        uint16_t window = (uint16_t)(adv.timeUs / windowUs);
+        if (!seenSet.markSeen(adv.address, window == 0 ? 1 : window)) {
+            duplicates++;
+            continue;
+        }
+        BleAdvRecord rec;
+        fillBleAdvRecordFromRaw(rec, adv.address, adv.addrType, adv.rssi, adv.data, adv.len);
+        uint64_t now = epochUs();
+        rec.timestamp = now / 1000000;
+        rec.micros = now % 1000000;
+        publishQueue.push(rec);
+    }
+    double ingestSec = std::chrono::duration<double>(Clock::now() - t0).count();
+    producerDone = true;
+    publisher.join();
+    double totalSec = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    std::sort(stats.latencyUs.begin(), stats.latencyUs.end());
+    printf("Ingested:   %zu advertisements in %.3f s (%.0f/s)\n", advs.size(), ingestSec, advs.size() / ingestSec);
+    printf("Duplicates: %llu filtered within %u s windows\n", (unsigned long long)duplicates, opt.windowSec);
+    printf("Queue:      %u queued, %u dropped, high-water %u/%d\n", publishQueue.pushedCount(), publishQueue.droppedCount(),
+           publishQueue.highWaterMark(), PUBLISH_QUEUE_LEN);
+    printf("Published:  %llu records in %llu messages, %llu bytes (%.1f bytes/record) in %.3f s (%.0f records/s)\n",
+           (unsigned long long)stats.records, (unsigned long long)stats.messages, (unsigned long long)stats.bytes,
+           stats.records ? (double)stats.bytes / stats.records : 0.0, totalSec, stats.records / totalSec);
+    if (opt.delta)
+        printf("Delta:      %llu of %llu records as delta, %u evicted, %llu not reconstructed\n",
+               (unsigned long long)stats.deltaRecords, (unsigned long long)stats.records, deltaCache.evictedCount(),
+               (unsigned long long)stats.deltaMismatches);
+    printf("Latency:    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           percentile(stats.latencyUs, 0.5) / 1e3, percentile(stats.latencyUs, 0.9) / 1e3,
+           percentile(stats.latencyUs, 0.99) / 1e3, percentile(stats.latencyUs, 1.0) / 1e3);
+    return 0;
+}
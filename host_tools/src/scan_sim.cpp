@@ -0,0 +1,216 @@
+/**
+ * Simulation of the adaptive scan controller (see src/scan_controller.h) against a density trace.
+ *
+ * A trace holds per scan window what a logger saw at full duty cycle with active scanning:
+ * sightings and devices (first sightings), optionally free heap. Read from
+ *   - serial logs of the firmware ("- Window done, 812 sightings, 57 reported, 81234 free heap."),
+ *   - CSV lines "sightings,devices[,freeHeap]",
+ * or, without --trace, generated for a day at an office (quiet night, busy day, crowded lunch).
+ *
+ * Per window the scan params are applied to the trace by a simple model:
+ *   - a device is seen if one of its advertisements falls into a scan window,
+ *     i.e. with probability 1 - (1 - duty)^events, events per device from the trace,
+ *   - sightings scale with duty cycle, passive scanning misses the scan responses (--rsp-share),
+ *   - devices seen are queued for publishing, the publisher drains --publish-rate records per
+ *     second, less the more sightings the BT task handles (--bt-capacity sightings per second stall it).
+ *
+ * Usage:
+ *   scan_sim [--trace <file>] [--window-s <s>] [--rsp-share <0..1>] [--publish-rate <records/s>]
+ *            [--bt-capacity <sightings/s>] [--queue <records>] [--hours <h>] [--seed <n>] [--verbose]
+ *
+ * Reports for fixed params (SCAN_INTERVAL_MS, SCAN_WINDOW_MS, active) and the controller
+ * (bounds as in globals_kd.h): devices seen and published (of those in the trace), mean duty
+ * cycle, windows scanned passively, records dropped by the queue and number of changes.
+ * --verbose prints every decision.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "scan_controller.h"
+
+struct Options {
+    const char *trace = nullptr;
+    uint32_t windowS = 10;
+    double rspShare = 0.3;
+    double publishRate = 40;
+    double btCapacity = 1500;
+    uint32_t queue = 64;
+    double hours = 24;
+    uint32_t seed = 1;
+    bool verbose = false;
+};
+
+struct TraceWindow {
+    double sightings;
+    double devices;
+    uint32_t freeHeap;
+};
+
+struct Result {
+    double devicesSeen = 0;
+    double devicesTotal = 0;
+    double dutySum = 0;
+    uint32_t passiveWindows = 0;
+    double dropped = 0;
+    uint32_t changes = 0;
+    size_t windows = 0;
+};
+
+// as in globals_kd.h
+static const ScanParams FIXED = {100, 100, true};
+static const ScanControlConfig CONFIG = {100, 1280, 20, 100, 60, 80, 300, 50, 40000, 3};
+
+static bool readTrace(const char *path, std::vector<TraceWindow> &trace) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        unsigned s, d, h = 100000;
+        const char *p = strstr(line.c_str(), "Window done, ");
+        if (p != nullptr) {
+            if (sscanf(p, "Window done, %u sightings, %u reported, %u free heap", &s, &d, &h) < 2) continue;
+        } else if (sscanf(line.c_str(), "%u,%u,%u", &s, &d, &h) < 2) {
+            continue;
+        }
+        trace.push_back({(double)s, (double)d, h});
+    }
+    return !trace.empty();
+}
+
+/**
+ * Devices per window over a day: few at night, an office during the day, a crowd at lunch.
+ */
+static void generateTrace(const Options &opt, std::vector<TraceWindow> &trace) {
+    std::mt19937 rng(opt.seed);
+    size_t n = (size_t)(opt.hours * 3600 / opt.windowS);
+    for (size_t i = 0; i < n; i++) {
+        double h = fmod(i * opt.windowS / 3600.0, 24);
+        double devices = 3;
+        if (h >= 7 && h < 19) devices += 80 * sin((h - 7) / 12 * M_PI);
+        if (h >= 12 && h < 13.5) devices += 900 * sin((h - 12) / 1.5 * M_PI);
+        std::poisson_distribution<int> dev(devices);
+        double d = dev(rng);
+        // ~3 advertisements per device and second
+        double events = 3.0 * opt.windowS;
+        trace.push_back({d * events / (1 - opt.rspShare), d, 100000});
+    }
+}
+
+static Result simulate(const Options &opt, const std::vector<TraceWindow> &trace, bool adaptive) {
+    ScanController controller(CONFIG, FIXED);
+    ScanParams p = adaptive ? controller.params() : FIXED;
+    Result r;
+    double backlog = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        const TraceWindow &w = trace[i];
+        double duty = (double)p.windowMs / p.intervalMs;
+        double events = w.devices > 0 ? w.sightings * (1 - opt.rspShare) / w.devices : 0;
+        double seen = w.devices * (1 - pow(1 - duty, events));
+        double sightings = w.sightings * duty * (p.active ? 1 : 1 - opt.rspShare);
+        double load = sightings / opt.windowS / opt.btCapacity;
+        double served = opt.publishRate * opt.windowS * std::max(0.1, 1 - load);
+        backlog = std::max(0.0, backlog + seen - served);
+        double dropped = std::max(0.0, backlog - opt.queue);
+        backlog = std::min(backlog, (double)opt.queue);
+
+        r.devicesSeen += seen;
+        r.devicesTotal += w.devices;
+        r.dutySum += duty;
+        if (!p.active) r.passiveWindows++;
+        r.dropped += dropped;
+        r.windows++;
+        if (!adaptive) continue;
+
+        ScanWindowInput in;
+        in.windowMs = opt.windowS * 1000;
+        in.sightings = (uint32_t)llround(sightings);
+        in.devices = (uint32_t)llround(seen);
+        in.filtered = 0;
+        in.queueDepth = (uint32_t)llround(backlog);
+        in.queueCapacity = opt.queue;
+        in.queueDropped = (uint32_t)llround(dropped);
+        in.freeHeap = w.freeHeap;
+        ScanDecision d = controller.update(in);
+        if (d.changed && opt.verbose)
+            printf("%7.2f h  %-6s interval %4u ms, window %3u ms, %-7s (%u devices/min, %u sightings/s, %u%% dup, queue %u)\n",
+                   (i + 1) * opt.windowS / 3600.0, SCAN_REASON_NAMES[d.reason], d.params.intervalMs, d.params.windowMs,
+                   d.params.active ? "active" : "passive", d.devicesPerMin, d.sightingsPerSec, d.duplicatePercent, in.queueDepth);
+        p = d.params;
+    }
+    r.changes = controller.changeCount();
+    return r;
+}
+
+static void printRow(const char *name, const Result &r) {
+    double total = std::max(1.0, r.devicesTotal);
+    printf("%-9s %9.1f%% %9.1f%% %9.1f%% %9.1f%% %10.0f %8u\n", name, 100 * r.devicesSeen / total,
+           100 * (r.devicesSeen - r.dropped) / total, 100 * r.dutySum / r.windows, 100.0 * r.passiveWindows / r.windows, r.dropped, r.changes);
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: scan_sim [--trace <file>] [--window-s <s>] [--rsp-share <0..1>] [--publish-rate <records/s>]\n"
+            "                [--bt-capacity <sightings/s>] [--queue <records>] [--hours <h>] [--seed <n>] [--verbose]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--trace" && hasValue) {
+            opt.trace = argv[++i];
+        } else if (a == "--window-s" && hasValue) {
+            opt.windowS = std::max(1, atoi(argv[++i]));
+        } else if (a == "--rsp-share" && hasValue) {
+            opt.rspShare = std::min(0.9, std::max(0.0, atof(argv[++i])));
+        } else if (a == "--publish-rate" && hasValue) {
+            opt.publishRate = std::max(1.0, atof(argv[++i]));
+        } else if (a == "--bt-capacity" && hasValue) {
+            opt.btCapacity = std::max(1.0, atof(argv[++i]));
+        } else if (a == "--queue" && hasValue) {
+            opt.queue = std::max(1, atoi(argv[++i]));
+        } else if (a == "--hours" && hasValue) {
+            opt.hours = std::max(0.1, atof(argv[++i]));
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = atoi(argv[++i]);
+        } else if (a == "--verbose") {
+            opt.verbose = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<TraceWindow> trace;
+    if (opt.trace != nullptr) {
+        if (!readTrace(opt.trace, trace)) {
+            fprintf(stderr, "No windows found in %s.\n", opt.trace);
+            return 1;
+        }
+    } else {
+        generateTrace(opt, trace);
+    }
+
+    Result fixed = simulate(opt, trace, false);
+    Result adaptive = simulate(opt, trace, true);
+    printf("%zu windows of %u s, publishing %.0f records/s, queue of %u.\n\n", trace.size(), opt.windowS, opt.publishRate, opt.queue);
+    printf("%-9s %10s %10s %10s %10s %10s %8s\n", "", "seen", "published", "duty", "passive", "dropped", "changes");
+    printRow("fixed", fixed);
+    printRow("adaptive", adaptive);
+    return 0;
+}
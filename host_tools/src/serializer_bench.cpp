@@ -0,0 +1,152 @@
+/**
+ * Heap allocations and time per message of the record serializer (see src/ble_schema.h) against
+ * the stringstream serializer it replaced (lib/ble_reference).
+ *
+ * Random records as a crowd advertises them (most with manufacturer data, some with name or
+ * service UUID) are serialized by both. Allocations are counted by replacing the global
+ * operator new, as the firmware's heap would see them.
+ *
+ * Usage:
+ *   serializer_bench [--records <n>] [--seed <n>]
+ *
+ * Reports allocations, allocated bytes and ns per message and the mean message length. Fails if
+ * the outputs differ or if serializeBleAdvRecord() allocates at all.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_legacy_json.h"
+#include "ble_schema.h"
+
+static uint64_t allocations = 0;
+static uint64_t allocatedBytes = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    allocatedBytes += size;
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct Options {
+    size_t records = 200000;
+    uint32_t seed = 1;
+};
+
+static std::vector<BleAdvRecord> crowd(const Options &opt) {
+    std::mt19937 rng(opt.seed);
+    auto rnd = [&rng](uint32_t n) { return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng); };
+    std::vector<BleAdvRecord> records(opt.records);
+    for (BleAdvRecord &rec : records) {
+        memset(&rec, 0, sizeof(rec));
+        for (size_t i = 0; i < BLE_ADDR_LEN; i++) rec.address[i] = (uint8_t)rnd(256);
+        rec.addrType = (uint8_t)rnd(2);
+        rec.payloadLength = (uint16_t)(10 + rnd(21));
+        rec.timestamp = 1651042690 + rnd(86400);
+        rec.micros = rnd(1000000);
+        rec.rssi = (int8_t)(-40 - (int)rnd(60));
+        rec.flags |= BLE_REC_HAVE_RSSI;
+        if (rnd(10) < 8) {
+            uint8_t data[24];
+            for (uint8_t &b : data) b = (uint8_t)rnd(256);
+            bleRecSetManufData(rec, data, 4 + rnd(20));
+        }
+        if (rnd(10) < 2) bleRecSetName(rec, "Galaxy Buds Pro", 15);
+        if (rnd(10) < 2) {
+            const uint8_t uuid[] = {0x6f, 0xfd};
+            bleRecSetServiceUUID(rec, uuid, sizeof(uuid));
+        }
+        if (rnd(10) < 3) {
+            rec.txPower = (int8_t)(rnd(20) - 10);
+            rec.flags |= BLE_REC_HAVE_TX_POWER;
+        }
+    }
+    return records;
+}
+
+struct Result {
+    double allocsPerMsg;
+    double bytesPerMsg;
+    double nsPerMsg;
+    double meanLen;
+};
+
+template <typename Serialize>
+static Result measure(const std::vector<BleAdvRecord> &records, Serialize serialize) {
+    uint64_t allocs0 = allocations, bytes0 = allocatedBytes;
+    size_t lenSum = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (const BleAdvRecord &rec : records) lenSum += serialize(rec);
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    double n = (double)records.size();
+    return {(allocations - allocs0) / n, (allocatedBytes - bytes0) / n, sec * 1e9 / n, lenSum / n};
+}
+
+static void usage() { fprintf(stderr, "Usage: serializer_bench [--records <n>] [--seed <n>]\n"); }
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--records" && hasValue) {
+            opt.records = std::max(1, atoi(argv[++i]));
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<BleAdvRecord> records = crowd(opt);
+
+    size_t differ = 0;
+    for (const BleAdvRecord &rec : records) {
+        char buf[BleLegacySchema<>::maxJsonLen + 1];
+        size_t len = serializeBleAdvRecord(buf, sizeof(buf), rec);
+        if (legacySerialize(rec) != std::string(buf, len)) differ++;
+    }
+
+    Result legacy = measure(records, [](const BleAdvRecord &rec) {
+        std::stringstream ss;
+        legacyAddRecordToStringStream(ss, rec);
+        return ss.str().size();
+    });
+    Result fixed = measure(records, [](const BleAdvRecord &rec) {
+        // as on the scan path: buffer on the stack
+        char buf[BleLegacySchema<>::maxJsonLen + 1];
+        return serializeBleAdvRecord(buf, sizeof(buf), rec);
+    });
+
+    printf("%zu records, %zu differ.\n\n", records.size(), differ);
+    printf("%-14s %12s %12s %10s %10s\n", "serializer", "allocs/msg", "bytes/msg", "ns/msg", "mean len");
+    printf("%-14s %12.2f %12.1f %10.1f %10.1f\n", "stringstream", legacy.allocsPerMsg, legacy.bytesPerMsg, legacy.nsPerMsg, legacy.meanLen);
+    printf("%-14s %12.2f %12.1f %10.1f %10.1f\n", "fixed buffer", fixed.allocsPerMsg, fixed.bytesPerMsg, fixed.nsPerMsg, fixed.meanLen);
+    bool ok = differ == 0 && fixed.allocsPerMsg == 0;
+    printf("\n%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/**
+ * Accuracy of the Space-Saving counters of TOP_K (see src/ble_topk.h) against exact counts on
+ * skewed synthetic crowds.
+ *
+ * Keys are drawn from a Zipf distribution (rank r with weight 1 / r^s) over --keys keys, for
+ * several skews s and counter numbers. Then a crowd of devices with company IDs, service UUIDs
+ * and names as seen in offices is counted by BleTopK and its report is printed.
+ *
+ * Usage:
+ *   topk_bench [--items <n>] [--keys <n>] [--k <n>] [--seed <n>]
+ *
+ * Reports per skew and counters: recall of the true top k, mean and max. error of their counts,
+ * the max. overestimate against the guarantee total / N and items per second. Fails if a count
+ * is below the true count or more than its error above, if a key outside the top k is more
+ * frequent than the reported bound, or if a report does not fit BleTopK::maxJsonLen().
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ble_topk.h"
+
+struct Options {
+    size_t items = 1000000;
+    size_t keys = 5000;
+    size_t k = 10;
+    uint32_t seed = 1;
+};
+
+/**
+ * Draws ranks 0..n-1 with weight 1 / (rank + 1)^s.
+ */
+class Zipf {
+   public:
+    Zipf(size_t n, double s) : cdf(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) cdf[i] = sum += 1 / pow((double)(i + 1), s);
+        for (double &c : cdf) c /= sum;
+    }
+
+    size_t operator()(std::mt19937_64 &rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+
+   private:
+    std::vector<double> cdf;
+};
+
+template <size_t N>
+static bool run(const Options &opt, double s) {
+    std::mt19937_64 rng(opt.seed);
+    Zipf zipf(opt.keys, s);
+    std::vector<uint16_t> stream(opt.items);
+    // ranks mapped onto scattered company IDs
+    for (uint16_t &key : stream) key = (uint16_t)(zipf(rng) * 7919 % 65536);
+
+    BleSpaceSaving<N, 2> counters;
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint16_t key : stream) {
+        uint8_t k[2] = {(uint8_t)(key >> 8), (uint8_t)key};
+        counters.add(k, 2);
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    counters.sort();
+
+    std::unordered_map<uint16_t, uint32_t> exact;
+    for (uint16_t key : stream) exact[key]++;
+    std::vector<std::pair<uint32_t, uint16_t>> ranked;
+    for (const auto &e : exact) ranked.push_back({e.second, e.first});
+    std::sort(ranked.rbegin(), ranked.rend());
+
+    size_t k = std::min(opt.k, N);
+    size_t violations = 0, found = 0;
+    double errSum = 0, errMax = 0, overMax = 0;
+    std::unordered_map<uint16_t, size_t> position;
+    for (size_t i = 0; i < counters.size(); i++) {
+        const auto &e = counters.entry(i);
+        uint16_t key = (uint16_t)(e.key[0] << 8 | e.key[1]);
+        position[key] = i;
+        uint32_t truth = exact[key];
+        if (e.count < truth || e.count - e.error > truth) violations++;
+        overMax = std::max(overMax, (double)(e.count - truth));
+    }
+    uint32_t bound = counters.bound(k);
+    for (const auto &r : ranked) {
+        auto it = position.find(r.second);
+        bool reported = it != position.end() && it->second < k;
+        if (!reported && r.first > bound) violations++;
+    }
+    for (size_t i = 0; i < k && i < ranked.size(); i++) {
+        auto it = position.find(ranked[i].second);
+        if (it == position.end()) continue;
+        if (it->second < k) found++;
+        double err = (double)(counters.entry(it->second).count - ranked[i].first) / ranked[i].first;
+        errSum += err;
+        errMax = std::max(errMax, err);
+    }
+    double guarantee = (double)opt.items / N;
+    bool ok = violations == 0 && overMax <= guarantee;
+    printf("%5.2f %8zu %8zu %7.1f%% %8.2f%% %8.2f%% %10.0f %10.0f %12.0f %8s\n", s, N, exact.size(), 100.0 * found / k,
+           100 * errSum / k, 100 * errMax, overMax, guarantee, opt.items / sec, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+struct Brand {
+    int32_t companyId;  // -1 without manufacturer data
+    uint16_t uuid;      // 0 without service UUID
+    const char *name;   // nullptr without name
+    double share;
+};
+
+/**
+ * Counts an office crowd with BleTopK as the firmware does and prints its report.
+ */
+static bool crowd(const Options &opt) {
+    static const Brand BRANDS[] = {
+        {0x004c, 0, nullptr, 40},        // Apple, no name advertised
+        {0x0006, 0, nullptr, 12},        // Microsoft (Swift Pair, CDP)
+        {0x0075, 0, "Galaxy Buds", 6},   // Samsung
+        {0x0075, 0, "[TV] Samsung", 2},  //
+        {0x00e0, 0xfe9f, nullptr, 5},    // Google
+        {-1, 0xfd6f, nullptr, 10},       // exposure notifications
+        {0x0157, 0, "Mi Smart Band", 3},  // Anhui Huami
+        {0x0087, 0, "Forerunner", 2},    // Garmin
+        {0x0059, 0, nullptr, 3},         // Nordic (beacons, dev kits)
+        {0x038f, 0xfe95, "MJ_HT_V1", 2},  // Xiaomi sensors
+    };
+    std::mt19937_64 rng(opt.seed);
+    std::vector<double> weights;
+    for (const Brand &b : BRANDS) weights.push_back(b.share);
+    // rest: long tail of other companies and names
+    weights.push_back(15);
+    std::discrete_distribution<size_t> brand(weights.begin(), weights.end());
+    Zipf tail(2000, 1.0);
+
+    typedef BleTopK<32, 8> TopK;
+    static TopK topK;
+    topK.clear();
+    std::unordered_map<int32_t, uint32_t> exact;
+    size_t devices = std::min<size_t>(opt.items, 100000);
+    for (size_t i = 0; i < devices; i++) {
+        size_t b = brand(rng);
+        if (b < sizeof(BRANDS) / sizeof(BRANDS[0])) {
+            const Brand &br = BRANDS[b];
+            uint8_t uuid[2] = {(uint8_t)br.uuid, (uint8_t)(br.uuid >> 8)};
+            topK.add(br.companyId, br.uuid != 0 ? uuid : nullptr, 2, br.name, br.name != nullptr ? strlen(br.name) : 0);
+            if (br.companyId >= 0) exact[br.companyId]++;
+        } else {
+            int32_t id = (int32_t)(0x0100 + tail(rng));
+            char name[16];
+            snprintf(name, sizeof(name), "Tag-%04x", (unsigned)(rng() % 4096));
+            topK.add(id, nullptr, 0, name, strlen(name));
+            exact[id]++;
+        }
+    }
+    static char msg[TopK::maxJsonLen(10)];
+    size_t len = topK.serializeJson(msg, sizeof(msg), 1651042690, 60, opt.k < 10 ? opt.k : 10);
+    printf("\n%zu devices, %zu company IDs, %zu bytes of counters, report of %zu bytes:\n%s\n", devices, exact.size(), sizeof(TopK), len, msg);
+    bool ok = len > 0;
+
+    // longest keys everywhere still fit
+    static TopK worst;
+    worst.clear();
+    for (uint32_t i = 0; i < 64; i++) {
+        uint8_t uuid[16];
+        memset(uuid, (int)i, sizeof(uuid));
+        char name[9];
+        snprintf(name, sizeof(name), "%08u", (unsigned)i);
+        for (uint32_t n = 0; n <= i; n++) worst.add((int32_t)(0xff00 + i), uuid, sizeof(uuid), name, 8);
+    }
+    ok = worst.serializeJson(msg, sizeof(msg), 4294967295u, 4294967295u, 10) > 0 && ok;
+    return ok;
+}
+
+static void usage() { fprintf(stderr, "Usage: topk_bench [--items <n>] [--keys <n>] [--k <n>] [--seed <n>]\n"); }
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--items" && hasValue) {
+            opt.items = std::max(1, atoi(argv[++i]));
+        } else if (a == "--keys" && hasValue) {
+            opt.keys = std::min(std::max(1, atoi(argv[++i])), 65536);
+        } else if (a == "--k" && hasValue) {
+            opt.k = std::max(1, atoi(argv[++i]));
+        } else if (a == "--seed" && hasValue) {
+            opt.seed = (uint32_t)atoi(argv[++i]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    printf("%zu items of %zu keys, top %zu.\n\n", opt.items, opt.keys, opt.k);
+    printf("%5s %8s %8s %8s %9s %9s %10s %10s %12s %8s\n", "skew", "counters", "distinct", "recall", "mean err", "max err", "max over",
+           "total/N", "items/s", "bounds");
+    bool ok = true;
+    for (double s : {0.8, 1.1, 1.5}) {
+        ok = run<16>(opt, s) && ok;
+        ok = run<32>(opt, s) && ok;
+        ok = run<64>(opt, s) && ok;
+    }
+    ok = crowd(opt) && ok;
+    printf("\n%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
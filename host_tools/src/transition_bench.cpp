@@ -0,0 +1,233 @@
+/**
+ * Benchmark of transition detection (see lib/ble_collector/collector_transitions.h) on synthetic
+ * multi-logger traces.
+ *
+ * Loggers stand in a row, neighbours next to each other. Devices walk along it: they stay at a
+ * logger for 30 s to 4 min, seen every 0.5 to 2.5 s, then take 5 to 60 s to the next one. A
+ * device changes its address every 15 min (a new device then). A share of sightings (--noise)
+ * is made by a neighbouring logger as well.
+ * Each logger has its own clock offset (up to --offset-ms) and publishes batches every
+ * --batch-s with 20 to 300 ms network delay, so messages arrive out of order. With --outage-s
+ * the first logger is offline for that long mid-trace and publishes its backlog afterwards.
+ *
+ * Usage:
+ *   transition_bench [--addresses <n>] [--loggers <n>] [--hours <h>] [--offset-ms <ms>] [--noise <share>]
+ *                    [--batch-s <s>] [--outage-s <s>] [--lateness-ms <ms>] [--max-addresses <n>] [--threads <n,n,...>]
+ *
+ * Runs without clock correction, with estimated offsets and with known offsets, then with
+ * estimated offsets for each thread count (0: on the caller). Reports sightings per second,
+ * precision and recall of transitions against the trace and the mean error of travel times.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "collector_transitions.h"
+
+struct Options {
+    size_t addresses = 5000;
+    uint32_t loggers = 20;
+    double hours = 2;
+    int64_t offsetMs = 3000;
+    double noise = 0.02;
+    int64_t batchMs = 10000;
+    int64_t outageMs = 0;
+    int64_t latenessMs = 30000;
+    uint32_t maxAddresses = 1 << 20;
+    std::vector<unsigned> threads = {0, 1, 2, 4};
+};
+
+struct TraceRecord {
+    int64_t receivedMs;
+    CollectorRecord rec;
+};
+
+typedef std::tuple<uint64_t, uint32_t, uint32_t> TransitionKey;
+
+struct Trace {
+    std::vector<TraceRecord> records;
+    std::map<TransitionKey, std::vector<int64_t>> truth;  // true travel times in order
+    size_t truthCount = 0;
+    std::vector<int64_t> offsets;
+};
+
+static void makeTrace(const Options &opt, Trace &trace) {
+    std::mt19937_64 rng(1);
+    auto uniform = [&](int64_t lo, int64_t hi) { return lo + (int64_t)(rng() % (uint64_t)(hi - lo + 1)); };
+    int64_t durationMs = (int64_t)(opt.hours * 3600 * 1000);
+    const int64_t LIFETIME_MS = 15 * 60 * 1000;
+    const int64_t BASE_MS = 1651042693000;
+    std::vector<int64_t> phase(opt.loggers);
+    for (uint32_t l = 0; l < opt.loggers; l++) {
+        trace.offsets.push_back(uniform(-opt.offsetMs, opt.offsetMs));
+        phase[l] = uniform(0, opt.batchMs - 1);
+    }
+    int64_t outageStart = durationMs / 2, outageEnd = outageStart + opt.outageMs;
+    auto sighting = [&](uint64_t address, uint32_t logger, int64_t t) {
+        TraceRecord r;
+        memset(&r, 0, sizeof(r));
+        // published with the next batch of the logger
+        int64_t publish = t + (opt.batchMs - (t - phase[logger]) % opt.batchMs) % opt.batchMs;
+        if (logger == 0 && publish >= outageStart && publish < outageEnd) publish = outageEnd;
+        r.receivedMs = BASE_MS + publish + uniform(20, 300);
+        r.rec.address = address;
+        r.rec.tsMs = BASE_MS + t + trace.offsets[logger];
+        r.rec.logger = logger;
+        r.rec.rssi = (int8_t)uniform(-95, -40);
+        r.rec.count = 1;
+        trace.records.push_back(r);
+    };
+    for (size_t a = 0; a < opt.addresses; a++) {
+        uint64_t address = rng() & 0xffffffffffffull;
+        int64_t t = uniform(0, durationMs - 1);
+        int64_t end = std::min(t + LIFETIME_MS, durationMs);
+        uint32_t logger = (uint32_t)uniform(0, opt.loggers - 1);
+        uint32_t prev = UINT32_MAX;
+        int64_t prevLast = 0;
+        while (t < end) {
+            int64_t stayEnd = std::min(t + uniform(30000, 240000), end);
+            int64_t first = -1, last = -1;
+            int seen = 0;
+            for (; t < stayEnd; t += uniform(500, 2500)) {
+                sighting(address, logger, t);
+                if (rng() % 1000000 < (uint64_t)(opt.noise * 1000000) && opt.loggers > 1) {
+                    uint32_t other = logger == 0 ? 1 : logger + 1 == opt.loggers || rng() % 2 ? logger - 1 : logger + 1;
+                    sighting(address, other, t + uniform(1, 400));
+                }
+                if (first < 0) first = t;
+                last = t;
+                // move is known once the second sighting was made
+                if (++seen == 2 && prev != UINT32_MAX) {
+                    trace.truth[TransitionKey(address, prev, logger)].push_back(first - prevLast);
+                    trace.truthCount++;
+                }
+            }
+            if (seen >= 2) {
+                prev = logger;
+                prevLast = last;
+            }
+            t += uniform(5000, 60000);
+            if (opt.loggers > 1) logger = logger == 0 ? 1 : logger + 1 == opt.loggers || rng() % 2 ? logger - 1 : logger + 1;
+        }
+    }
+    std::stable_sort(trace.records.begin(), trace.records.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) { return a.receivedMs < b.receivedMs; });
+}
+
+struct Collected {
+    std::vector<std::vector<Transition>> perShard;
+
+    void operator()(unsigned shard, const Transition &t) { perShard[shard].push_back(t); }
+};
+
+enum ClockMode { CLOCK_NONE, CLOCK_ESTIMATED, CLOCK_KNOWN };
+
+static void run(const Options &opt, const Trace &trace, unsigned threads, ClockMode mode) {
+    TransitionConfig cfg;
+    cfg.latenessMs = opt.latenessMs;
+    cfg.maxAddresses = opt.maxAddresses;
+    Collected out;
+    out.perShard.resize(std::max(threads, 1u));
+    TransitionStats st;
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        TransitionEngine<Collected> engine(cfg, threads, out);
+        engine.correct = mode != CLOCK_NONE;
+        if (mode == CLOCK_KNOWN)
+            for (uint32_t l = 0; l < opt.loggers; l++) engine.clockOffsets.set(l, trace.offsets[l]);
+        for (const TraceRecord &r : trace.records) engine.push(r.rec, r.receivedMs);
+        engine.finish();
+        st = engine.stats();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::map<TransitionKey, size_t> used;
+    size_t emitted = 0, matched = 0;
+    double travelErr = 0;
+    for (const auto &shard : out.perShard) {
+        for (const Transition &t : shard) {
+            emitted++;
+            TransitionKey key(t.address, t.from, t.to);
+            auto it = trace.truth.find(key);
+            size_t &n = used[key];
+            if (it == trace.truth.end() || n >= it->second.size()) continue;
+            travelErr += std::abs((double)(t.travelMs - it->second[n]));
+            n++;
+            matched++;
+        }
+    }
+    static const char *MODES[] = {"none", "estimated", "known"};
+    printf("%-10s %7u %12.0f %11zu %9.2f%% %7.2f%% %9.0f %8llu %10llu %8llu %10llu\n", MODES[mode], threads,
+           trace.records.size() / sec, emitted, emitted ? 100.0 * matched / emitted : 0, 100.0 * matched / trace.truthCount,
+           matched ? travelErr / matched : 0, (unsigned long long)st.late, (unsigned long long)st.peakLive,
+           (unsigned long long)st.evicted, (unsigned long long)st.peakBuffered);
+}
+
+static void usage() {
+    fprintf(stderr,
+            "Usage: transition_bench [--addresses <n>] [--loggers <n>] [--hours <h>] [--offset-ms <ms>] [--noise <share>]\n"
+            "                        [--batch-s <s>] [--outage-s <s>] [--lateness-ms <ms>] [--max-addresses <n>] [--threads <n,n,...>]\n");
+}
+
+static bool parseArgs(int argc, char **argv, Options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--addresses" && hasValue) {
+            opt.addresses = std::max(1, atoi(argv[++i]));
+        } else if (a == "--loggers" && hasValue) {
+            opt.loggers = std::max(1, atoi(argv[++i]));
+        } else if (a == "--hours" && hasValue) {
+            opt.hours = std::max(0.1, atof(argv[++i]));
+        } else if (a == "--offset-ms" && hasValue) {
+            opt.offsetMs = std::max(0, atoi(argv[++i]));
+        } else if (a == "--noise" && hasValue) {
+            opt.noise = std::min(std::max(0.0, atof(argv[++i])), 1.0);
+        } else if (a == "--batch-s" && hasValue) {
+            opt.batchMs = std::max(1, atoi(argv[++i])) * 1000;
+        } else if (a == "--outage-s" && hasValue) {
+            opt.outageMs = std::max(0, atoi(argv[++i])) * 1000;
+        } else if (a == "--lateness-ms" && hasValue) {
+            opt.latenessMs = std::max(0, atoi(argv[++i]));
+        } else if (a == "--max-addresses" && hasValue) {
+            opt.maxAddresses = std::max(1, atoi(argv[++i]));
+        } else if (a == "--threads" && hasValue) {
+            opt.threads.clear();
+            for (char *p = argv[++i]; *p != '\0';) {
+                opt.threads.push_back((unsigned)strtoul(p, &p, 10));
+                if (*p == ',') p++;
+                else if (*p != '\0') return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    Trace trace;
+    makeTrace(opt, trace);
+    printf("%zu sightings of %zu addresses at %u loggers over %.1f h, %zu transitions, clock offsets up to %lld ms.\n\n",
+           trace.records.size(), opt.addresses, opt.loggers, opt.hours, trace.truthCount, (long long)opt.offsetMs);
+    printf("%-10s %7s %12s %11s %10s %8s %9s %8s %10s %8s %10s\n", "clock", "threads", "sightings/s", "transitions", "precision",
+           "recall", "travel ms", "late", "peak addr", "evicted", "peak buf");
+    run(opt, trace, 0, CLOCK_NONE);
+    run(opt, trace, 0, CLOCK_ESTIMATED);
+    run(opt, trace, 0, CLOCK_KNOWN);
+    for (unsigned threads : opt.threads) run(opt, trace, threads, CLOCK_ESTIMATED);
+    return 0;
+}
@@ -2,6 +2,24 @@
  *
  * https://github.com/nkolban/esp32-snippets/blob/master/cpp_utils/BLEScan.h
  * https://github.com/nkolban/ESP32_BLE_Arduino/blob/master/src/BLEAdvertisedDevice.cpp#L492
+ *
+ * With CONTINUOUS_SCAN the controller scans without end and scan results are taken directly
+ * from the GAP event (custom GAP handler). BLEScan is not started, so it keeps no results.
+ * Windows of SCAN_TIME_IN_SECONDS are only logical (by monotonic time), duplicates within
+ * a window are filtered by a fixed-size set.
+ *
+ * With FAST_BOOT scanning starts before WiFi, MQTT and NTP are up. Until time is synced,
+ * records are stamped with monotonic time since boot and re-stamped by the publisher (see boot_buffer.h).
+ *
+ * With ADAPTIVE_SCAN interval, window and active mode are adapted at the end of each scan window
+ * (see scan_controller.h). Each change is reported on the admin topic.
+ *
+ * With COUNT_ONLY no records are published. Addresses go into a HyperLogLog sketch, which is
+ * published at the end of each scan window and, merged, per HLL_ROLLUP_S (see ble_hll.h).
+ *
+ * With TOP_K the most frequent company IDs, service UUIDs and name prefixes of the devices are
+ * counted (once per device and scan window) and reported per TOPK_WINDOW_S on the admin topic
+ * (see ble_topk.h).
  * */
 
 #ifndef BLE_KD_H
@@ -12,126 +30,652 @@
 #include <BLEDevice.h>
 #include <BLEScan.h>
 #include <BLEUtils.h>
-
-#include <sstream>
+#include <esp_gap_ble_api.h>
+#include <esp_timer.h>
 
 // Watchdog
 #include <esp_task_wdt.h>
 
+#include "ble_adv_parser.h"
+#include "ble_aggregate.h"
+#include "ble_filter.h"
+#include "ble_frames.h"
+#include "ble_hll.h"
+#include "ble_record.h"
+#include "ble_seen_set.h"
+#include "ble_topk.h"
+#include "capture.h"
 #include "get_time.h"
 #include "globals_kd.h"
+#include "metrics.h"
+#include "publisher.h"
+#include "scan_controller.h"
+
+#if defined FAST_BOOT && !defined CONTINUOUS_SCAN
+#error "FAST_BOOT requires CONTINUOUS_SCAN"
+#endif
+#if defined ADAPTIVE_SCAN && !defined CONTINUOUS_SCAN && !defined AGGREGATE_WINDOW
+#error "ADAPTIVE_SCAN requires CONTINUOUS_SCAN or AGGREGATE_WINDOW, BLEScan drops repeated sightings before they are counted"
+#endif
+#if defined COUNT_ONLY && defined AGGREGATE_WINDOW
+#error "COUNT_ONLY publishes no records, don't combine it with AGGREGATE_WINDOW"
+#endif
 
 // BLE
 BLEScan *pBLEScan;
 
-// forward declaration from main
-bool transmitSensorsData(const char *msg);
+#ifdef AGGREGATE_WINDOW
+// every sighting is needed for statistics
+#define SCAN_WANT_DUPLICATES true
+// scan callback fills one table while the loop task publishes the other one of the window before
+static BleAggDoubleBuffer<AGG_TABLE_SIZE> aggTables;
+// guards aggTables and serializes pushes of scan callback and flush (publish queue has a single producer)
+static SemaphoreHandle_t aggMutex = nullptr;
+static uint32_t reportedEvicted = 0;
+static uint32_t reportedAggDropped = 0;
+static size_t aggregatedDevices = 0;
+
+void aggregateBleAdvRecord(const BleAdvRecord &rec) {
+    xSemaphoreTake(aggMutex, portMAX_DELAY);
+    aggTables.add(rec, [](const BleAdvRecord &evicted) {
+        // scan callback cannot wait for the publisher
+        if (!enqueueBleAdvRecord(evicted)) metricInc(MC_AGG_DROPPED);
+    });
+    xSemaphoreGive(aggMutex);
+}
+
+void flushAggregates() {
+    xSemaphoreTake(aggMutex, portMAX_DELAY);
+    BleAggDoubleBuffer<AGG_TABLE_SIZE>::Table &taken = aggTables.swap();
+    xSemaphoreGive(aggMutex);
+    // scan callback goes on with the other table meanwhile
+    size_t devices = taken.size();
+    uint32_t startMs = millis();
+    taken.flush([startMs](const BleAdvRecord &rec) {
+        uint32_t waited = millis() - startMs;
+        uint32_t waitMs = waited < AGG_FLUSH_WAIT_MS ? AGG_FLUSH_WAIT_MS - waited : 0;
+        if (!enqueueBleAdvRecordWait(rec, waitMs, aggMutex)) metricInc(MC_AGG_DROPPED);
+    });
+    uint32_t evicted = aggTables.evictedCount();
+    uint32_t dropped = metricGet(metrics, MC_AGG_DROPPED);
+    Serial.printf("- Aggregated %d devices, %u evicted early, %u dropped (publish queue full).\n", devices, evicted - reportedEvicted,
+                  dropped - reportedAggDropped);
+    reportedEvicted = evicted;
+    reportedAggDropped = dropped;
+    aggregatedDevices = devices;
+}
+#else
+#define SCAN_WANT_DUPLICATES false
+#endif  // AGGREGATE_WINDOW
+
+#ifdef COUNT_ONLY
+static_assert(BLE_HLL_JSON_OVERHEAD + 2 * BleHll<HLL_PRECISION>::maxEncodedLen + MQTT_MESSAGE_OVERHEAD <= MAX_MQTT_MESSAGE_SIZE,
+              "Sketch messages need to fit MAX_MQTT_MESSAGE_SIZE (replayed from store), lower HLL_PRECISION");
+static_assert(HLL_ROLLUP_S % SCAN_TIME_IN_SECONDS == 0, "HLL_ROLLUP_S needs to be a multiple of SCAN_TIME_IN_SECONDS");
+static BleHll<HLL_PRECISION> windowSketch;
+// scan callback adds, flush at window end takes the sketch
+static SemaphoreHandle_t countMutex = nullptr;
+// used by loop task only
+static BleHll<HLL_PRECISION> takenSketch;
+static BleHll<HLL_PRECISION> rollupSketch;
+static uint32_t countWindowStart = 0;  // epoch seconds, 0 until first window with synced time
+static uint32_t rollupBucket = 0;      // epoch seconds / HLL_ROLLUP_S, 0 before first window
+
+void countAddress(const uint8_t *address) {
+    xSemaphoreTake(countMutex, portMAX_DELAY);
+    windowSketch.add(address);
+    xSemaphoreGive(countMutex);
+}
+
+void publishSketch(const BleHll<HLL_PRECISION> &sketch, uint32_t start, uint32_t seconds) {
+#ifdef BINARY_PAYLOAD
+    static uint8_t bin[BLE_HLL_BIN_HEADER_LEN + BleHll<HLL_PRECISION>::maxEncodedLen];
+    size_t len = bleHllSerializeBin(bin, sizeof(bin), sketch, start, seconds);
+    if (len > 0) transmitSensorsData(bin, len);
+#else
+    static char msg[BLE_HLL_JSON_OVERHEAD + 2 * BleHll<HLL_PRECISION>::maxEncodedLen];
+    size_t len = bleHllSerializeJson(msg, sizeof(msg), sketch, start, seconds);
+    if (len > 0) transmitSensorsData(msg);
+#endif  // BINARY_PAYLOAD
+}
+
+/**
+ * Publishes sketch of the window and adds it to the rollup. Rollup is published when the
+ * first window of the next HLL_ROLLUP_S starts (a window belongs to the rollup it started in).
+ */
+void flushCounts() {
+    // until windows have a time (FAST_BOOT), keep counting into the first one
+    if (!timeSynced()) return;
+    uint32_t now = (uint32_t)(getEpochTimeUs() / 1000000);
+    if (countWindowStart == 0) countWindowStart = now - SCAN_TIME_IN_SECONDS;
+    xSemaphoreTake(countMutex, portMAX_DELAY);
+    takenSketch = windowSketch;
+    windowSketch.clear();
+    xSemaphoreGive(countMutex);
+    double estimate = takenSketch.estimate();
+    publishSketch(takenSketch, countWindowStart, now - countWindowStart);
+
+    uint32_t bucket = countWindowStart / HLL_ROLLUP_S;
+    if (bucket != rollupBucket) {
+        if (rollupBucket != 0) {
+            Serial.printf("- Rollup of %u s done, ~%.0f devices.\n", HLL_ROLLUP_S, rollupSketch.estimate());
+            publishSketch(rollupSketch, rollupBucket * HLL_ROLLUP_S, HLL_ROLLUP_S);
+        }
+        rollupSketch.clear();
+        rollupBucket = bucket;
+    }
+    rollupSketch.merge(takenSketch);
+    Serial.printf("- Counted ~%.0f devices in window, ~%.0f in rollup.\n", estimate, rollupSketch.estimate());
+    countWindowStart = now;
+}
+#endif  // COUNT_ONLY
+
+#ifdef TOP_K
+static_assert(TOPK_PUBLISH <= TOPK_COUNTERS, "TOPK_PUBLISH needs to be at most TOPK_COUNTERS");
+static_assert(TOPK_WINDOW_S % SCAN_TIME_IN_SECONDS == 0, "TOPK_WINDOW_S needs to be a multiple of SCAN_TIME_IN_SECONDS");
+typedef BleTopK<TOPK_COUNTERS, TOPK_NAME_PREFIX_LEN> TopK;
+static TopK topK;
+// scan callback counts, flush at window end takes the counters
+static SemaphoreHandle_t topKMutex = nullptr;
+// used by loop task only
+static TopK takenTopK;
+static uint32_t topKWindows = 0;
+#if defined AGGREGATE_WINDOW && !defined CONTINUOUS_SCAN
+// BLEScan reports each sighting with AGGREGATE_WINDOW, devices are counted on their first one per scan
+static BleSeenSet<SEEN_SET_SIZE> topKSeenSet;
+static uint32_t topKScan = 1;
+#endif  // AGGREGATE_WINDOW && !CONTINUOUS_SCAN
+
+template <typename T>
+void countTopK(const T &viewOrRecord) {
+    xSemaphoreTake(topKMutex, portMAX_DELAY);
+    topK.add(viewOrRecord);
+    xSemaphoreGive(topKMutex);
+}
+
+/**
+ * Reports counters each TOPK_WINDOW_S and starts over.
+ */
+void flushTopK() {
+    if (++topKWindows < TOPK_WINDOW_S / SCAN_TIME_IN_SECONDS) return;
+    topKWindows = 0;
+    xSemaphoreTake(topKMutex, portMAX_DELAY);
+    takenTopK = topK;
+    topK.clear();
+    xSemaphoreGive(topKMutex);
+    static char msg[TopK::maxJsonLen(TOPK_PUBLISH)];
+    uint32_t now = (uint32_t)(getEpochTimeUs() / 1000000);
+    if (takenTopK.serializeJson(msg, sizeof(msg), now - TOPK_WINDOW_S, TOPK_WINDOW_S, TOPK_PUBLISH) == 0) return;
+    Serial.printf("- Top-K of %u companies, %u UUIDs, %u names.\n", takenTopK.company.total(), takenTopK.uuid.total(),
+                  takenTopK.name.total());
+    transmitAdminInfo(msg);
+}
+#endif  // TOP_K
+
 // forward declaration see below
-void addBleDeviceToStringStream(std::stringstream &ss, BLEAdvertisedDevice device);
+void fillBleAdvRecord(BleAdvRecord &rec, BLEAdvertisedDevice &device);
+// forward declaration from mqtts
+bool loopMQTT();
+// forward declaration from main
+bool transmitAdminInfo(const char *msg);
+
+static const ScanParams SCAN_PARAMS_DEFAULT = {SCAN_INTERVAL_MS, SCAN_WINDOW_MS, SCAN_ACTIVE};
+
+void stampBleAdvRecord(BleAdvRecord &rec) {
+    // capture time, monotonic until synced (re-stamped by publisher with FAST_BOOT)
+    int64_t us = getEpochTimeUs();
+    rec.timestamp = us / 1000000;
+    rec.micros = us % 1000000;
+}
+
+#ifdef FILTER_RULES
+static BleFilter<FILTER_COMPANY_TABLE_SIZE> bleFilter;
+
+void initFilter() {
+    static const BleCompanyRule rules[] = FILTER_COMPANY_RULES;
+    bleFilter.rssiFloor = FILTER_RSSI_FLOOR;
+    bleFilter.dropAddrTypes = FILTER_DROP_ADDR_TYPES;
+    bleFilter.minPayloadLen = FILTER_MIN_PAYLOAD_LEN;
+    bleFilter.maxPayloadLen = FILTER_MAX_PAYLOAD_LEN;
+    bleFilter.defaultAction = FILTER_DEFAULT_ACTION;
+    for (const BleCompanyRule &rule : rules) {
+        if (!bleFilter.addCompanyRule(rule.companyId, rule.action))
+            Serial.printf("- ERR: No room for rule of company 0x%04x, increase FILTER_COMPANY_TABLE_SIZE.\n", rule.companyId);
+    }
+    Serial.printf("- With filter rules: rssi >= %d, %u company rules.\n", FILTER_RSSI_FLOOR, (unsigned)(sizeof(rules) / sizeof(rules[0])));
+}
+#endif  // FILTER_RULES
+
+/**
+ * Decodes frames (if DECODE_FRAMES) and applies filter rules (if FILTER_RULES).
+ * Returns false if rec is to be dropped.
+ */
+bool filterBleAdvRecord(BleAdvRecord &rec, const uint8_t *payload, size_t len) {
+#ifdef DECODE_FRAMES
+    bleDecodeFrames(rec, payload, len);
+#endif  // DECODE_FRAMES
+#ifdef FILTER_RULES
+    BleFilterAction action = bleFilter.evaluate(rec);
+    if (action == BLE_FILTER_DROP) {
+        metricInc(MC_ADV_FILTERED);
+        return false;
+    }
+    if (action == BLE_FILTER_TRUNCATE) {
+        bleFilterTruncate(rec);
+        metricInc(MC_ADV_TRUNCATED);
+    }
+#endif  // FILTER_RULES
+    return true;
+}
+
+/**
+ * Applies filter rules (if FILTER_RULES) to the raw advertisement before a record is filled.
+ */
+BleFilterAction filterBleAdView(const BleAdView &view) {
+#ifdef FILTER_RULES
+    BleFilterAction action = bleFilter.evaluate(view);
+    if (action == BLE_FILTER_DROP) metricInc(MC_ADV_FILTERED);
+    return action;
+#else
+    return BLE_FILTER_KEEP;
+#endif  // FILTER_RULES
+}
+
+/**
+ * Fills rec from view of a kept advertisement and decodes frames (if DECODE_FRAMES).
+ * Fields not in RecordSchema are not parsed at all (and so not published in binary format either).
+ */
+void fillBleAdvRecordFromView(BleAdvRecord &rec, const BleAdView &view, BleFilterAction action) {
+    view.fill(rec, RecordSchema::flags);
+#ifdef DECODE_FRAMES
+    if (RecordSchema::flags & BLE_REC_HAVE_FRAME) bleDecodeFrames(rec, view.payload(), view.payloadLength());
+#endif  // DECODE_FRAMES
+    if (action == BLE_FILTER_TRUNCATE) {
+        bleFilterTruncate(rec);
+        metricInc(MC_ADV_TRUNCATED);
+    }
+}
+
+void handleBleAdvRecord(const BleAdvRecord &rec) {
+#if defined COUNT_ONLY
+    countAddress(rec.address);
+#elif defined AGGREGATE_WINDOW
+    // published at window end
+    aggregateBleAdvRecord(rec);
+#else
+    // hand over to publisher (queued, if ASYNC_PUBLISH is set)
+    enqueueBleAdvRecord(rec);
+#endif  // AGGREGATE_WINDOW
+}
 
 class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
     void onResult(BLEAdvertisedDevice advertisedDevice) {
+        metricInc(MC_ADV_RECEIVED);
         // we need to do this in callback, since we only have here the correct timestamp
-        std::stringstream ss;
-        addBleDeviceToStringStream(ss, advertisedDevice);
-        // Serial.print("Found device:");
-        // Serial.println(ss.str());
-        transmitSensorsData(ss.str().c_str());
+        BleAdvRecord rec;
+        fillBleAdvRecord(rec, advertisedDevice);
+        // payload is valid within callback only
+        if (filterBleAdvRecord(rec, advertisedDevice.getPayload(), advertisedDevice.getPayloadLength())) {
+            // BLEScan filtered duplicates already (unless AGGREGATE_WINDOW)
+            metricInc(MC_ADV_REPORTED);
+#ifdef TOP_K
+#if defined AGGREGATE_WINDOW && !defined CONTINUOUS_SCAN
+            // once per device and scan
+            if (topKSeenSet.markSeen(rec.address, topKScan)) countTopK(rec);
+#else
+            countTopK(rec);
+#endif  // AGGREGATE_WINDOW && !CONTINUOUS_SCAN
+#endif  // TOP_K
+            handleBleAdvRecord(rec);
+        }
 
         // feed/reset watchdog
         esp_task_wdt_reset();
     }
 };
+
+#ifdef CONTINUOUS_SCAN
+static BleSeenSet<SEEN_SET_SIZE> seenSet;
+static uint32_t reportedSightings = 0;
+static uint32_t reportedNewDevices = 0;
+static uint32_t reportedSeenOverflows = 0;
+// params to scan with once the running scan stopped (see applyScanParams())
+static ScanParams restartScanParams;
+static std::atomic<bool> scanRestartPending{false};
+
+void startContinuousScan(const ScanParams &scan);
+
+uint32_t currentWindow() {
+    return bleSeenWindow(esp_timer_get_time(), (int64_t)SCAN_TIME_IN_SECONDS * 1000000);
+}
+
+/**
+ * Runs in BT task for every GAP event, BLEScan ignores results since it was not started.
+ */
+void onGapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+    switch (event) {
+        case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
+            if (param->scan_param_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+                Serial.printf("- ERR: Set scan params failed, status=%d.\n", param->scan_param_cmpl.status);
+                break;
+            }
+            // duration 0: scan until stopped
+            esp_err_t err = esp_ble_gap_start_scanning(0);
+            if (err != ESP_OK) Serial.printf("- ERR: Could not start scan, rc=%d.\n", err);
+            break;
+        }
+        case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+            if (param->scan_stop_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+                // still scanning with params as before
+                scanRestartPending = false;
+                Serial.printf("- ERR: Scan stop failed, status=%d.\n", param->scan_stop_cmpl.status);
+            } else if (scanRestartPending) {
+                scanRestartPending = false;
+                startContinuousScan(restartScanParams);
+            }
+            break;
+        case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+            if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS)
+                Serial.printf("- ERR: Scan start failed, status=%d.\n", param->scan_start_cmpl.status);
+            else
+                bootPhaseEnd(BOOT_BLE);
+            break;
+        case ESP_GAP_BLE_SCAN_RESULT_EVT: {
+            if (param->scan_rst.search_evt != ESP_GAP_SEARCH_INQ_RES_EVT) break;
+            metricInc(MC_ADV_RECEIVED);
+#if defined CAPTURE_SERIAL || defined CAPTURE_FLASH
+            BleRawAdv raw;
+            captureSetRawAdv(raw, esp_timer_get_time(), param->scan_rst.bda, param->scan_rst.ble_addr_type, param->scan_rst.rssi,
+                             param->scan_rst.ble_adv, param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len);
+            captureRawAdv(raw);
+#endif  // CAPTURE_SERIAL || CAPTURE_FLASH
+            // nothing is parsed or copied until needed
+            BleAdView view(param->scan_rst.bda, param->scan_rst.ble_addr_type, param->scan_rst.rssi, param->scan_rst.ble_adv,
+                           param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len);
+            // before duplicate filter, so a later sighting passing the rules is not lost
+            BleFilterAction action = filterBleAdView(view);
+            if (action == BLE_FILTER_DROP) break;
+#if !defined AGGREGATE_WINDOW || defined TOP_K
+            bool firstInWindow = seenSet.markSeen(param->scan_rst.bda, currentWindow());
+#endif  // !AGGREGATE_WINDOW || TOP_K
+#ifdef TOP_K
+            // once per device and window
+            if (firstInWindow) countTopK(view);
+#endif  // TOP_K
+#ifndef AGGREGATE_WINDOW
+            // first sighting per window only (as BLEScan did)
+            if (!firstInWindow) break;
+#endif  // AGGREGATE_WINDOW
+            metricInc(MC_ADV_REPORTED);
+#ifdef COUNT_ONLY
+            // no record needed
+            countAddress(param->scan_rst.bda);
+            break;
+#endif  // COUNT_ONLY
+            BleAdvRecord rec;
+            fillBleAdvRecordFromView(rec, view, action);
+            stampBleAdvRecord(rec);
+            handleBleAdvRecord(rec);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void startContinuousScan(const ScanParams &scan) {
+    esp_ble_scan_params_t params;
+    params.scan_type = scan.active ? BLE_SCAN_TYPE_ACTIVE : BLE_SCAN_TYPE_PASSIVE;
+    params.own_addr_type = BLE_ADDR_TYPE_PUBLIC;
+    params.scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL;
+    // in units of 0.625 ms
+    params.scan_interval = scan.intervalMs / 0.625;
+    params.scan_window = scan.windowMs / 0.625;
+    // controller must not filter, its filter would never reset without scan restarts
+    params.scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE;
+    // scan is started in onGapEvent() once params are set
+    esp_err_t err = esp_ble_gap_set_scan_params(&params);
+    if (err != ESP_OK)
+        Serial.printf("- ERR: Could not set scan params, rc=%d.\n", err);
+}
+#endif  // CONTINUOUS_SCAN
+
+#ifdef ADAPTIVE_SCAN
+static ScanController scanController({SCAN_MIN_INTERVAL_MS, SCAN_MAX_INTERVAL_MS, SCAN_MIN_WINDOW_MS, SCAN_MAX_WINDOW_MS,
+                                      SCAN_QUIET_DEVICES_PER_MIN, SCAN_QUIET_DUPLICATE_PERCENT, SCAN_FLOOD_SIGHTINGS_PER_S,
+                                      SCAN_QUEUE_HIGH_PERCENT, SCAN_MIN_FREE_HEAP, SCAN_HOLD_WINDOWS},
+                                     SCAN_PARAMS_DEFAULT);
+// counters at last window end
+static uint32_t adaptedSightings = 0;
+static uint32_t adaptedReported = 0;
+static uint32_t adaptedDropped = 0;
+static uint32_t adaptedFiltered = 0;
+
+void applyScanParams(const ScanParams &scan) {
+#ifdef CONTINUOUS_SCAN
+    // params cannot be changed while scanning, set and restarted in onGapEvent() once stopped
+    if (scanRestartPending) {
+        Serial.printf("- ERR: Scan restart still pending, params not applied.\n");
+        return;
+    }
+    restartScanParams = scan;
+    scanRestartPending = true;
+    esp_err_t err = esp_ble_gap_stop_scanning();
+    if (err != ESP_OK) {
+        scanRestartPending = false;
+        Serial.printf("- ERR: Could not stop scan to apply params, rc=%d.\n", err);
+    }
+#else
+    // for next scan
+    pBLEScan->setActiveScan(scan.active);
+    pBLEScan->setInterval(scan.intervalMs);
+    pBLEScan->setWindow(scan.windowMs);
+#endif  // CONTINUOUS_SCAN
+}
+
+/**
+ * Feeds the window just ended to the controller, applies and reports a change.
+ * queueDepth is taken before records of window end were queued.
+ */
+void adaptScan(size_t queueDepth) {
+    uint32_t sightings = metricGet(metrics, MC_ADV_RECEIVED);
+    uint32_t reported = metricGet(metrics, MC_ADV_REPORTED);
+    uint32_t dropped = publishQueueDropped();
+    uint32_t filtered = metricGet(metrics, MC_ADV_FILTERED);
+    ScanWindowInput in;
+    in.windowMs = SCAN_TIME_IN_SECONDS * 1000;
+    in.sightings = sightings - adaptedSightings;
+#ifdef AGGREGATE_WINDOW
+    // every sighting is reported, devices are those aggregated
+    in.devices = aggregatedDevices;
+#else
+    in.devices = reported - adaptedReported;
+#endif  // AGGREGATE_WINDOW
+    in.filtered = filtered - adaptedFiltered;
+#ifdef ASYNC_PUBLISH
+    in.queueCapacity = PUBLISH_QUEUE_LEN;
+#else
+    in.queueCapacity = 0;
+#endif  // ASYNC_PUBLISH
+    in.queueDepth = queueDepth;
+    in.queueDropped = dropped - adaptedDropped;
+    in.freeHeap = ESP.getFreeHeap();
+    adaptedSightings = sightings;
+    adaptedReported = reported;
+    adaptedDropped = dropped;
+    adaptedFiltered = filtered;
+
+    ScanDecision d = scanController.update(in);
+    if (!d.changed) return;
+    applyScanParams(d.params);
+    Serial.printf("- Scan adapted (%s): interval=%u ms, window=%u ms, active-scan=%s.\n", SCAN_REASON_NAMES[d.reason],
+                  d.params.intervalMs, d.params.windowMs, d.params.active ? "true" : "false");
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             "{\"scan\": {\"reason\": \"%s\", \"intervalMs\": %u, \"windowMs\": %u, \"active\": %s, \"devicesPerMin\": %u, "
+             "\"sightingsPerS\": %u, \"duplicatePercent\": %u, \"queue\": %u, \"dropped\": %u, \"freeHeap\": %u}}",
+             SCAN_REASON_NAMES[d.reason], d.params.intervalMs, d.params.windowMs, d.params.active ? "true" : "false", d.devicesPerMin,
+             d.sightingsPerSec, d.duplicatePercent, in.queueDepth, in.queueDropped, in.freeHeap);
+    transmitAdminInfo(msg);
+}
+#endif  // ADAPTIVE_SCAN
+
 void deinitBLE() {
+#ifdef CONTINUOUS_SCAN
+    esp_ble_gap_stop_scanning();
+#endif  // CONTINUOUS_SCAN
     BLEDevice::deinit();
 }
 
 void initBLE() {
     Serial.println("Setup BLE...");
+    bootPhaseBegin(BOOT_BLE);
     BLEDevice::init("");
     pBLEScan = BLEDevice::getScan();  // create new scan
-    pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-    pBLEScan->setActiveScan(SCAN_ACTIVE);  // active scan uses more power, but get results faster
-    pBLEScan->setInterval(SCAN_INTERVAL_MS);
-    pBLEScan->setWindow(SCAN_WINDOW_MS);  // less or equal setInterval value
-    Serial.printf("- With interval=%d ms, window=%d ms, active-scan=%s.\n", SCAN_INTERVAL_MS, SCAN_WINDOW_MS, SCAN_ACTIVE?"true":"false");
+    // scan callbacks run in this task of bluedroid
+    metricsWatchTask("BTC_TASK", xTaskGetHandle("BTC_TASK"));
+#ifdef AGGREGATE_WINDOW
+    aggMutex = xSemaphoreCreateMutex();
+#endif  // AGGREGATE_WINDOW
+#ifdef COUNT_ONLY
+    countMutex = xSemaphoreCreateMutex();
+    Serial.printf("- Count only, %u registers.\n", (unsigned)BleHll<HLL_PRECISION>::size);
+#endif  // COUNT_ONLY
+#ifdef TOP_K
+    topKMutex = xSemaphoreCreateMutex();
+#endif  // TOP_K
+#ifdef FILTER_RULES
+    initFilter();
+#endif  // FILTER_RULES
+    pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks(), SCAN_WANT_DUPLICATES);
+#ifdef ADAPTIVE_SCAN
+    // initial params within bounds
+    ScanParams scan = scanController.params();
+#else
+    ScanParams scan = SCAN_PARAMS_DEFAULT;
+#endif  // ADAPTIVE_SCAN
+    pBLEScan->setActiveScan(scan.active);  // active scan uses more power, but get results faster
+    pBLEScan->setInterval(scan.intervalMs);
+    pBLEScan->setWindow(scan.windowMs);  // less or equal setInterval value
+    Serial.printf("- With interval=%d ms, window=%d ms, active-scan=%s.\n", scan.intervalMs, scan.windowMs, scan.active?"true":"false");
+#ifdef CONTINUOUS_SCAN
+    BLEDevice::setCustomGapHandler(onGapEvent);
+    startContinuousScan(scan);
+    Serial.println("- Continuous scan started.");
+#else
+    // scans are started from loop()
+    bootPhaseEnd(BOOT_BLE);
+#endif  // CONTINUOUS_SCAN
 }
 
+void onScanWindowDone() {
+#ifdef ADAPTIVE_SCAN
+    // before flushes at window end fill it up
+    size_t queueDepth = publishQueueDepth();
+#endif  // ADAPTIVE_SCAN
+#ifdef AGGREGATE_WINDOW
+    flushAggregates();
+#endif  // AGGREGATE_WINDOW
+#ifdef COUNT_ONLY
+    flushCounts();
+#endif  // COUNT_ONLY
+#ifdef TOP_K
+    flushTopK();
+#endif  // TOP_K
+    requestPublisherFlush();
+    reportPublisherStats();
+#ifdef ADAPTIVE_SCAN
+    adaptScan(queueDepth);
+#endif  // ADAPTIVE_SCAN
+}
+
+#ifdef CONTINUOUS_SCAN
+void scanBleDevicesForXSeconds(int seconds) {
+    // scan keeps running in background, wait for end of logical window
+    int64_t windowUs = (int64_t)seconds * 1000000;
+    int64_t now = esp_timer_get_time();
+    int64_t end = (now / windowUs + 1) * windowUs;
+    Serial.printf("Wait %d ms for end of scan window...\n", (int)((end - now) / 1000));
+    // keep MQTT alive (and reconnecting) meanwhile
+    while ((now = esp_timer_get_time()) < end) {
+        loopMQTT();
+        int64_t leftMs = (end - now) / 1000 + 1;
+        delay(leftMs < 100 ? leftMs : 100);
+    }
+
+    uint32_t s = metricGet(metrics, MC_ADV_RECEIVED);
+    uint32_t n = metricGet(metrics, MC_ADV_REPORTED);
+    Serial.printf("- Window done, %u sightings, %u reported, %u free heap.\n", s - reportedSightings, n - reportedNewDevices, ESP.getFreeHeap());
+    reportedSightings = s;
+    reportedNewDevices = n;
+    uint32_t o = seenSet.overflowCount();
+    if (o != reportedSeenOverflows) {
+        Serial.printf("- ERR: %u sightings not reported, seen set full (SEEN_SET_SIZE).\n", o - reportedSeenOverflows);
+        metricInc(MC_SEEN_OVERFLOW, o - reportedSeenOverflows);
+        reportedSeenOverflows = o;
+    }
+    onScanWindowDone();
+}
+#else
 void scanBleDevicesForXSeconds(int seconds) {
     Serial.printf("Start scan for %i seconds...\n", seconds);
+#if defined TOP_K && defined AGGREGATE_WINDOW
+    // 0 marks unused entries in seen set
+    if (++topKScan == 0) topKScan = 1;
+#endif  // TOP_K && AGGREGATE_WINDOW
     // second param to false for deleting scanresults afterwards
     BLEScanResults foundDevices = pBLEScan->start(seconds, false);
 
     int count = foundDevices.getCount();
     Serial.printf("- Scan done, found %d devices.\n", count);
+    onScanWindowDone();
 
     pBLEScan->stop();
     // delete results from BLEScan buffer to release memory
     pBLEScan->clearResults();
     delay(100);
 }
+#endif  // CONTINUOUS_SCAN
 
-std::string addKeyValuePair(std::string const &key, const std::string &value, bool first = false) {
-    // JSON
-    std::string s = (first ? "" : ", ") + std::string("\"") + key + std::string("\": \"") + value + std::string("\"");
-    return s;
-}
-std::string addKeyValuePair(const char *key, const char *value, bool first = false) {
-    return addKeyValuePair(std::string(key), std::string(value), first);
-}
-std::string addKeyValuePair(std::string const &key, int const &value, bool first = false) {
-    std::stringstream temp;
-    temp << value;
-    return addKeyValuePair(key, temp.str(), first);
-}
+void fillBleAdvRecord(BleAdvRecord &rec, BLEAdvertisedDevice &device) {
+    memset(&rec, 0, sizeof(rec));
 
-void addBleDeviceToStringStream(std::stringstream &ss, BLEAdvertisedDevice device) {
-    ss << "{";
+    memcpy(rec.address, *device.getAddress().getNative(), BLE_ADDR_LEN);
+    rec.addrType = device.getAddressType();
+    rec.payloadLength = device.getPayloadLength();
 
-    ss << addKeyValuePair("address", device.getAddress().toString(), true);
     if (device.haveName()) {
-        ss << addKeyValuePair("name", device.getName().c_str());
+        // getName() returns a copy, keep it only as long as needed
+        const std::string &name = device.getName();
+        bleRecSetName(rec, name.data(), name.length());
     }
-
     if (device.haveAppearance()) {
-        char val[6];
-        snprintf(val, sizeof(val), "%d", device.getAppearance());
-        ss << addKeyValuePair("appearance", val);
+        rec.appearance = device.getAppearance();
+        rec.flags |= BLE_REC_HAVE_APPEARANCE;
     }
     if (device.haveManufacturerData()) {
-        std::string md = device.getManufacturerData();
-        uint8_t *mdp = (uint8_t *)device.getManufacturerData().data();
-        char *pHex = BLEUtils::buildHexData(nullptr, mdp, md.length());
-        ss << addKeyValuePair("manufData", pHex);
-        free(pHex);
+        const std::string &md = device.getManufacturerData();
+        bleRecSetManufData(rec, (const uint8_t *)md.data(), md.length());
     }
     if (device.haveServiceUUID()) {
-        ss << addKeyValuePair("serviceUUID", device.getServiceUUID().toString());
+        BLEUUID uuid = device.getServiceUUID();
+        esp_bt_uuid_t *native = uuid.getNative();
+        bleRecSetServiceUUID(rec, native->uuid.uuid128, native->len);
     }
     if (device.haveTXPower()) {
-        char val[6];
-        snprintf(val, sizeof(val), "%d", device.getTXPower());
-        ss << addKeyValuePair("txPower", val);
+        rec.txPower = device.getTXPower();
+        rec.flags |= BLE_REC_HAVE_TX_POWER;
     }
-
-    // add rSSI, payloadLength, addressType
     if (device.haveRSSI()) {
-        ss << addKeyValuePair("rssi", device.getRSSI());
+        rec.rssi = device.getRSSI();
+        rec.flags |= BLE_REC_HAVE_RSSI;
     }
-    ss << addKeyValuePair("payloadLength", device.getPayloadLength());
-    ss << addKeyValuePair("addrType", device.getAddressType());
 
     // don't use scan and payload from now since these are pointer ;)
 
     // don't use serviceDataUUID
 
-    // add timestamp and micros
-    unsigned long seconds, microseconds;
-    getTimeInSecAndUsec(seconds, microseconds);
-    ss << addKeyValuePair("timestamp", seconds);
-    ss << addKeyValuePair("micros", microseconds);
-
-    ss << "}";
+    stampBleAdvRecord(rec);
 }
 
 #endif  // BLE_KD_H
\ No newline at end of file
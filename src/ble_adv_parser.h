@@ -0,0 +1,217 @@
+/**
+ * Fills a BleAdvRecord directly from raw advertising data (AD structures), as delivered by the GAP scan result event.
+ * Interpretation follows BLEAdvertisedDevice::parseAdvertisement(), so records equal those of the BLEScan path:
+ * - last name / manufacturer data wins
+ * - first service UUID is kept (as BLEAdvertisedDevice::getServiceUUID())
+ *
+ * BleAdView is a view on the raw event data that copies nothing and allocates nothing.
+ * Address, type, RSSI and length are available right away. The AD structures are indexed
+ * (offsets only) on first access to another field, so advertisements dropped by RSSI or
+ * address type are never parsed, and those dropped by company ID are parsed only.
+ * A record is filled (copied) only for advertisements that are kept.
+ * A length byte running past the end stops parsing, fields found before are kept.
+ *
+ * https://github.com/espressif/arduino-esp32/blob/master/libraries/BLE/src/BLEAdvertisedDevice.cpp
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_ADV_PARSER_KD_H
+#define BLE_ADV_PARSER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_record.h"
+
+// AD types (Bluetooth Assigned Numbers, as ESP_BLE_AD_TYPE_*)
+#define BLE_AD_FLAGS 0x01
+#define BLE_AD_16SRV_PART 0x02
+#define BLE_AD_16SRV_CMPL 0x03
+#define BLE_AD_32SRV_PART 0x04
+#define BLE_AD_32SRV_CMPL 0x05
+#define BLE_AD_128SRV_PART 0x06
+#define BLE_AD_128SRV_CMPL 0x07
+#define BLE_AD_NAME_SHORT 0x08
+#define BLE_AD_NAME_CMPL 0x09
+#define BLE_AD_TX_PWR 0x0a
+#define BLE_AD_APPEARANCE 0x19
+#define BLE_AD_MANUFACTURER 0xff
+
+/**
+ * address: 6 bytes as esp_bd_addr_t, data: advertising data followed by scan response.
+ * Pointers have to stay valid as long as the view is used (e.g. within the GAP event).
+ */
+class BleAdView {
+    // value of an AD structure, offset 0 if not present (values start at 2 or later)
+    struct Field {
+        uint16_t offset;
+        uint8_t len;
+    };
+
+   public:
+    BleAdView(const uint8_t *address, uint8_t addrType, int rssi, const uint8_t *data, size_t len)
+        : addr(address), type(addrType), rssiValue((int8_t)rssi), data(data), len(len > 0xffff ? 0xffff : (uint16_t)len) {}
+
+    const uint8_t *address() const { return addr; }
+    uint8_t addrType() const { return type; }
+    int8_t rssi() const { return rssiValue; }
+    const uint8_t *payload() const { return data; }
+    uint16_t payloadLength() const { return len; }
+
+    /**
+     * Manufacturer data (company ID first) or nullptr.
+     */
+    const uint8_t *manufData(size_t &n) const { return value(index().manuf, n); }
+
+    /**
+     * Company ID of manufacturer data (little endian) or -1 if there is none.
+     */
+    int32_t companyId() const {
+        size_t n;
+        const uint8_t *v = manufData(n);
+        if (v == nullptr || n < 2) return -1;
+        return v[0] | (v[1] << 8);
+    }
+
+    /**
+     * Name (not zero terminated) or nullptr.
+     */
+    const char *name(size_t &n) const { return (const char *)value(index().name, n); }
+
+    /**
+     * Service UUID (2, 4 or 16 bytes, little endian) or nullptr.
+     */
+    const uint8_t *serviceUUID(size_t &n) const { return value(index().uuid, n); }
+
+    bool txPower(int8_t &tx) const {
+        size_t n;
+        const uint8_t *v = value(index().txPower, n);
+        if (v == nullptr) return false;
+        tx = (int8_t)v[0];
+        return true;
+    }
+
+    bool appearance(uint16_t &a) const {
+        size_t n;
+        const uint8_t *v = value(index().appearance, n);
+        if (v == nullptr) return false;
+        a = v[0] | (v[1] << 8);
+        return true;
+    }
+
+    // AD structures parsed
+    uint8_t structureCount() const { return index().count; }
+    // a length byte ran past the end
+    bool malformed() const { return index().malformed; }
+
+    /**
+     * Copies view into rec (as fillBleAdvRecordFromRaw()).
+     * Optional fields not in fields (BLE_REC_HAVE_*) are not looked up, e.g. those not in the record schema.
+     */
+    void fill(BleAdvRecord &rec, uint8_t fields = 0xff) const {
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.address, addr, BLE_ADDR_LEN);
+        rec.addrType = type;
+        rec.rssi = rssiValue;
+        rec.flags |= BLE_REC_HAVE_RSSI;
+        rec.payloadLength = len;
+        size_t n;
+        const uint8_t *v;
+        if ((fields & BLE_REC_HAVE_NAME) && (v = (const uint8_t *)name(n)) != nullptr) bleRecSetName(rec, (const char *)v, n);
+        if ((fields & BLE_REC_HAVE_TX_POWER) && txPower(rec.txPower)) rec.flags |= BLE_REC_HAVE_TX_POWER;
+        if ((fields & BLE_REC_HAVE_APPEARANCE) && appearance(rec.appearance)) rec.flags |= BLE_REC_HAVE_APPEARANCE;
+        if ((fields & BLE_REC_HAVE_MANUF_DATA) && (v = manufData(n)) != nullptr) bleRecSetManufData(rec, v, n);
+        if ((fields & BLE_REC_HAVE_SERVICE_UUID) && (v = serviceUUID(n)) != nullptr) bleRecSetServiceUUID(rec, v, n);
+    }
+
+   private:
+    struct Index {
+        Field name, manuf, uuid, txPower, appearance;
+        uint8_t count;
+        bool malformed;
+    };
+
+    const uint8_t *value(Field f, size_t &n) const {
+        n = f.len;
+        return f.offset == 0 ? nullptr : data + f.offset;
+    }
+
+    /**
+     * One pass over the AD structures on first use.
+     */
+    const Index &index() const {
+        if (indexed) return idx;
+        indexed = true;
+        memset(&idx, 0, sizeof(idx));
+        size_t pos = 0;
+        while (pos < len) {
+            size_t adLen = data[pos];
+            // zero length terminates (padding of advertising data)
+            if (adLen == 0) break;
+            // malformed length, ignore rest
+            if (pos + 1 + adLen > len) {
+                idx.malformed = true;
+                break;
+            }
+            if (idx.count < 0xff) idx.count++;
+            Field f = {(uint16_t)(pos + 2), (uint8_t)(adLen - 1)};
+            switch (data[pos + 1]) {
+                case BLE_AD_NAME_SHORT:
+                case BLE_AD_NAME_CMPL:
+                    idx.name = f;
+                    break;
+                case BLE_AD_TX_PWR:
+                    if (f.len >= 1) idx.txPower = f;
+                    break;
+                case BLE_AD_APPEARANCE:
+                    if (f.len >= 2) idx.appearance = f;
+                    break;
+                case BLE_AD_MANUFACTURER:
+                    idx.manuf = f;
+                    break;
+                case BLE_AD_16SRV_PART:
+                case BLE_AD_16SRV_CMPL:
+                    setUUID(f, 2);
+                    break;
+                case BLE_AD_32SRV_PART:
+                case BLE_AD_32SRV_CMPL:
+                    setUUID(f, 4);
+                    break;
+                case BLE_AD_128SRV_PART:
+                case BLE_AD_128SRV_CMPL:
+                    setUUID(f, 16);
+                    break;
+                default:
+                    break;
+            }
+            pos += 1 + adLen;
+        }
+        return idx;
+    }
+
+    // first UUID is kept
+    void setUUID(Field f, uint8_t uuidLen) const {
+        if (idx.uuid.offset != 0 || f.len < uuidLen) return;
+        idx.uuid = {f.offset, uuidLen};
+    }
+
+    const uint8_t *addr;
+    uint8_t type;
+    int8_t rssiValue;
+    const uint8_t *data;
+    uint16_t len;
+    mutable bool indexed = false;
+    mutable Index idx;
+};
+
+/**
+ * address: 6 bytes as esp_bd_addr_t, data: advertising data followed by scan response
+ */
+inline void fillBleAdvRecordFromRaw(BleAdvRecord &rec, const uint8_t *address, uint8_t addrType, int rssi,
+                                    const uint8_t *data, size_t len) {
+    BleAdView(address, addrType, rssi, data, len).fill(rec);
+}
+
+#endif  // BLE_ADV_PARSER_KD_H
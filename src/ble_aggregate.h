@@ -0,0 +1,190 @@
+/**
+ * Per scan window aggregation of BLE sightings.
+ *
+ * Fixed-capacity open-addressing hash table (linear probing) keyed by the 6-byte address.
+ * Each entry keeps count, min/max/mean RSSI, first/last timestamp and the latest record.
+ * At the end of a window flush() emits one record per device (with BLE_REC_HAVE_STATS).
+ *
+ * Memory is fixed to N entries. A device is stored at most MaxProbe slots behind its home slot.
+ * If all of these slots are taken by other devices, the one seen least recently is evicted:
+ * it is emitted right away (with statistics so far) and its slot is taken over.
+ * So the table loses no sighting, but a device may be reported more than once per window.
+ * Whether emitted records are published is up to the caller (the firmware drops them when the
+ * publish queue is full, see flushAggregates() in ble.h).
+ *
+ * BleAggDoubleBuffer holds two tables: sightings go to one of them while the other one, of the window
+ * just ended, is flushed. Callers serialize add() and swap() (e.g. by a mutex), flush runs without.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_AGGREGATE_KD_H
+#define BLE_AGGREGATE_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_record.h"
+
+inline uint32_t bleAddrHash(const uint8_t *address) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) {
+        h ^= address[i];
+        h *= 16777619u;
+    }
+    // final mix, since lower bits are used as index
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+template <size_t N, size_t MaxProbe = 16>
+class BleAggTable {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "BleAggTable size needs to be a power of two");
+    static_assert(MaxProbe > 0 && MaxProbe <= N, "MaxProbe needs to be within 1..N");
+
+    struct Entry {
+        bool used;
+        uint32_t rssiCount;
+        int32_t rssiSum;
+        uint64_t lastSeenUs;  // for eviction
+        BleAdvRecord rec;     // latest record plus statistics
+    };
+
+   public:
+    /**
+     * Folds rec into the table. emit(const BleAdvRecord &) is called for an evicted entry.
+     */
+    template <typename EmitFn>
+    void add(const BleAdvRecord &rec, EmitFn emit) {
+        uint32_t home = bleAddrHash(rec.address) & (N - 1);
+        Entry *victim = nullptr;
+        for (size_t i = 0; i < MaxProbe; i++) {
+            Entry &e = entries[(home + i) & (N - 1)];
+            if (!e.used) {
+                start(e, rec);
+                used++;
+                return;
+            }
+            if (memcmp(e.rec.address, rec.address, BLE_ADDR_LEN) == 0) {
+                update(e, rec);
+                return;
+            }
+            if (victim == nullptr || e.lastSeenUs < victim->lastSeenUs)
+                victim = &e;
+        }
+        // no free slot within reach, slot stays occupied so probing of other entries is not affected
+        BleAdvRecord out;
+        finish(*victim, out);
+        emit(out);
+        evicted++;
+        start(*victim, rec);
+    }
+
+    /**
+     * Emits one record per device and clears the table.
+     */
+    template <typename EmitFn>
+    void flush(EmitFn emit) {
+        BleAdvRecord out;
+        for (size_t i = 0; i < N; i++) {
+            if (!entries[i].used) continue;
+            finish(entries[i], out);
+            entries[i].used = false;
+            emit(out);
+        }
+        used = 0;
+    }
+
+    size_t size() const { return used; }
+    static constexpr size_t capacity() { return N; }
+    // entries emitted early since start
+    uint32_t evictedCount() const { return evicted; }
+
+   private:
+    static uint64_t timeUs(const BleAdvRecord &rec) {
+        return (uint64_t)rec.timestamp * 1000000 + rec.micros;
+    }
+
+    static void start(Entry &e, const BleAdvRecord &rec) {
+        e.used = true;
+        e.rec = rec;
+        e.rec.count = 1;
+        e.rec.firstTimestamp = rec.timestamp;
+        e.rec.firstMicros = rec.micros;
+        e.rec.rssiMin = rec.rssi;
+        e.rec.rssiMax = rec.rssi;
+        e.rssiCount = bleRecHas(rec, BLE_REC_HAVE_RSSI) ? 1 : 0;
+        e.rssiSum = e.rssiCount ? rec.rssi : 0;
+        e.lastSeenUs = timeUs(rec);
+    }
+
+    static void update(Entry &e, const BleAdvRecord &rec) {
+        uint16_t count = e.rec.count < UINT16_MAX ? e.rec.count + 1 : UINT16_MAX;
+        uint32_t firstTimestamp = e.rec.firstTimestamp;
+        uint32_t firstMicros = e.rec.firstMicros;
+        int8_t rssiMin = e.rec.rssiMin;
+        int8_t rssiMax = e.rec.rssiMax;
+        if (bleRecHas(rec, BLE_REC_HAVE_RSSI)) {
+            if (e.rssiCount == 0 || rec.rssi < rssiMin) rssiMin = rec.rssi;
+            if (e.rssiCount == 0 || rec.rssi > rssiMax) rssiMax = rec.rssi;
+            e.rssiSum += rec.rssi;
+            e.rssiCount++;
+        }
+        // keep latest payload
+        e.rec = rec;
+        e.rec.count = count;
+        e.rec.firstTimestamp = firstTimestamp;
+        e.rec.firstMicros = firstMicros;
+        e.rec.rssiMin = rssiMin;
+        e.rec.rssiMax = rssiMax;
+        e.lastSeenUs = timeUs(rec);
+    }
+
+    static void finish(const Entry &e, BleAdvRecord &out) {
+        out = e.rec;
+        out.flags |= BLE_REC_HAVE_STATS;
+        if (e.rssiCount > 0) {
+            // rounded mean
+            int32_t sum = e.rssiSum;
+            int32_t n = (int32_t)e.rssiCount;
+            out.rssi = (int8_t)(sum >= 0 ? (sum + n / 2) / n : (sum - n / 2) / n);
+            out.flags |= BLE_REC_HAVE_RSSI;
+        }
+    }
+
+    Entry entries[N] = {};
+    size_t used = 0;
+    uint32_t evicted = 0;
+};
+
+template <size_t N, size_t MaxProbe = 16>
+class BleAggDoubleBuffer {
+   public:
+    typedef BleAggTable<N, MaxProbe> Table;
+
+    template <typename EmitFn>
+    void add(const BleAdvRecord &rec, EmitFn emit) {
+        active->add(rec, emit);
+    }
+
+    /**
+     * Sightings go to the other table from now on. Returns the one of the window ended, to be flushed
+     * before the next swap.
+     */
+    Table &swap() {
+        Table *taken = active;
+        active = taken == &tables[0] ? &tables[1] : &tables[0];
+        return *taken;
+    }
+
+    uint32_t evictedCount() const { return tables[0].evictedCount() + tables[1].evictedCount(); }
+
+   private:
+    Table tables[2];
+    Table *active = &tables[0];
+};
+
+#endif  // BLE_AGGREGATE_KD_H
@@ -0,0 +1,109 @@
+/**
+ * Packs several serialized BleAdvRecords into one JSON array message:
+ * [{"address": ...}, {"address": ...}]
+ * or into one binary message (version byte followed by records, see ble_binary.h).
+ *
+ * Records are never split: if a record does not fit anymore, the batch is left unchanged
+ * and the caller has to flush it first.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_BATCH_KD_H
+#define BLE_BATCH_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ble_binary.h"
+#include "ble_json.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+
+struct BleBatch {
+    char *buf;
+    size_t size;  // including closing ']' and '\0'
+    size_t len;   // without closing ']'
+    uint16_t count;
+    uint32_t openedAtMs;  // time of first record
+    bool binary;
+};
+
+inline void batchReset(BleBatch &batch) {
+    batch.len = 0;
+    batch.count = 0;
+    batch.openedAtMs = 0;
+}
+
+/**
+ * size is the max. message length plus one for '\0'.
+ */
+inline void batchInit(BleBatch &batch, char *buf, size_t size, bool binary = false) {
+    batch.buf = buf;
+    batch.size = size;
+    batch.binary = binary;
+    batchReset(batch);
+}
+
+inline bool batchAddBinary(BleBatch &batch, const BleAdvRecord &rec) {
+    uint8_t *buf = (uint8_t *)batch.buf;
+    size_t len = batch.len;
+    // version byte once per message
+    if (batch.count == 0) {
+        if (batch.size < 2) return false;
+        buf[0] = BLE_BIN_VERSION;
+        len = 1;
+    }
+    // keep the byte of '\0' unused as in JSON mode
+    size_t n = binEncodeRecord(buf + len, batch.size - len - 1, rec);
+    if (n == 0) return false;
+    batch.len = len + n;
+    return true;
+}
+
+/**
+ * Returns false if rec does not fit into the batch anymore (batch is unchanged then).
+ * JSON records are written as of Schema (see ble_schema.h).
+ */
+template <typename Schema = BleLegacySchema<>>
+inline bool batchAdd(BleBatch &batch, const BleAdvRecord &rec, uint32_t nowMs) {
+    if (batch.binary) {
+        if (!batchAddBinary(batch, rec)) return false;
+        if (batch.count == 0) batch.openedAtMs = nowMs;
+        batch.count++;
+        return true;
+    }
+    // keep one byte for closing ']' (jsonFinish keeps the one for '\0')
+    if (batch.size < batch.len + 2) return false;
+    JsonBuf jb;
+    jsonInit(jb, batch.buf + batch.len, batch.size - batch.len - 1);
+    jsonPut(jb, batch.count == 0 ? "[" : ", ");
+    Schema::putJson(jb, rec);
+    if (jsonFinish(jb) == 0) {
+        // roll back partial record
+        batch.buf[batch.len] = '\0';
+        return false;
+    }
+    if (batch.count == 0) batch.openedAtMs = nowMs;
+    batch.len += jb.len;
+    batch.count++;
+    return true;
+}
+
+/**
+ * Closes the array. Returns message length (0 for empty batch).
+ */
+inline size_t batchFinish(BleBatch &batch) {
+    if (batch.count == 0) return 0;
+    if (batch.binary) return batch.len;
+    // batchAdd() made sure there is room left
+    batch.buf[batch.len] = ']';
+    batch.buf[batch.len + 1] = '\0';
+    return batch.len + 1;
+}
+
+inline bool batchDeadlinePassed(const BleBatch &batch, uint32_t nowMs, uint32_t deadlineMs) {
+    return batch.count > 0 && (uint32_t)(nowMs - batch.openedAtMs) >= deadlineMs;
+}
+
+#endif  // BLE_BATCH_KD_H
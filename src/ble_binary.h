@@ -0,0 +1,247 @@
+/**
+ * Compact binary encoding of BleAdvRecords (encoder and decoder).
+ *
+ * Message (version 1):
+ *   u8  version (0x01, JSON messages start with '{' or '[' instead)
+ *   one or more records
+ *
+ * Record:
+ *   u8     length of the following record bytes
+ *   u8[6]  address (as printed, most significant byte first)
+ *   u8     address type
+ *   i8     rssi (127 if not available)
+ *   u8     payload length
+ *   u32    timestamp (epoch seconds, little endian)
+ *   u24    micros (little endian)
+ *   TLVs   u8 type, u8 length, value (only for fields present)
+ *     0x01 txPower (i8)
+ *     0x02 appearance (u16 little endian)
+ *     0x03 name (without '\0')
+ *     0x04 manufacturer data
+ *     0x05 service UUID (2, 4 or 16 bytes, little endian)
+ *     0x06 window statistics (u16 count, i8 rssi min, i8 rssi max, u32 first timestamp, u24 first micros),
+ *          rssi holds the mean then
+ *     0x07 decoded frame (u8 frame type, fields as in ble_frames.h)
+ *     0x08 delta record (u8 BLE_REC_HAVE_* of removed fields), missing fields are unchanged (see ble_delta.h)
+ *
+ * Decoders skip unknown TLV types, so new fields can be added within version 1.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_BINARY_KD_H
+#define BLE_BINARY_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_record.h"
+
+#define BLE_BIN_VERSION 0x01
+#define BLE_BIN_FIXED_LEN 16
+#define BLE_BIN_RSSI_NA 127
+
+#define BLE_BIN_TLV_TX_POWER 0x01
+#define BLE_BIN_TLV_APPEARANCE 0x02
+#define BLE_BIN_TLV_NAME 0x03
+#define BLE_BIN_TLV_MANUF_DATA 0x04
+#define BLE_BIN_TLV_SERVICE_UUID 0x05
+#define BLE_BIN_TLV_STATS 0x06
+#define BLE_BIN_STATS_LEN 11
+#define BLE_BIN_TLV_FRAME 0x07
+#define BLE_BIN_TLV_DELTA 0x08
+
+// max. size of one encoded record including its length byte
+#define BLE_BIN_MAX_RECORD_LEN (1 + BLE_BIN_FIXED_LEN + 3 + 4 + (2 + BLE_MAX_NAME_LEN) + (2 + BLE_MAX_MANUF_DATA_LEN) + (2 + BLE_MAX_UUID_LEN) + (2 + BLE_BIN_STATS_LEN) + (3 + BLE_MAX_FRAME_LEN) + 3)
+
+//----------------------------
+// ENCODER
+//----------------------------
+inline uint8_t *binPutTLV(uint8_t *p, uint8_t type, const uint8_t *value, size_t len) {
+    *p++ = type;
+    *p++ = (uint8_t)len;
+    memcpy(p, value, len);
+    return p + len;
+}
+
+/**
+ * Encodes rec (without message version byte) into buf.
+ * Returns number of bytes written or 0 if buf was too small.
+ */
+inline size_t binEncodeRecord(uint8_t *buf, size_t size, const BleAdvRecord &rec) {
+    // encode on stack first, since the record length is only known afterwards
+    uint8_t tmp[BLE_BIN_MAX_RECORD_LEN];
+    uint8_t *p = tmp + 1;
+
+    memcpy(p, rec.address, BLE_ADDR_LEN);
+    p += BLE_ADDR_LEN;
+    *p++ = rec.addrType;
+    *p++ = (uint8_t)(bleRecHas(rec, BLE_REC_HAVE_RSSI) ? rec.rssi : BLE_BIN_RSSI_NA);
+    *p++ = (uint8_t)(rec.payloadLength > 0xff ? 0xff : rec.payloadLength);
+    for (int i = 0; i < 4; i++) *p++ = (uint8_t)(rec.timestamp >> (8 * i));
+    for (int i = 0; i < 3; i++) *p++ = (uint8_t)(rec.micros >> (8 * i));
+
+    if (bleRecHas(rec, BLE_REC_HAVE_TX_POWER)) {
+        uint8_t v = (uint8_t)rec.txPower;
+        p = binPutTLV(p, BLE_BIN_TLV_TX_POWER, &v, 1);
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_APPEARANCE)) {
+        uint8_t v[2] = {(uint8_t)rec.appearance, (uint8_t)(rec.appearance >> 8)};
+        p = binPutTLV(p, BLE_BIN_TLV_APPEARANCE, v, 2);
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_NAME)) {
+        p = binPutTLV(p, BLE_BIN_TLV_NAME, (const uint8_t *)rec.name, strnlen(rec.name, BLE_MAX_NAME_LEN));
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_MANUF_DATA)) {
+        p = binPutTLV(p, BLE_BIN_TLV_MANUF_DATA, rec.manufData, rec.manufDataLen);
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_SERVICE_UUID)) {
+        p = binPutTLV(p, BLE_BIN_TLV_SERVICE_UUID, rec.serviceUUID, rec.serviceUUIDLen);
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_STATS)) {
+        *p++ = BLE_BIN_TLV_STATS;
+        *p++ = BLE_BIN_STATS_LEN;
+        *p++ = (uint8_t)rec.count;
+        *p++ = (uint8_t)(rec.count >> 8);
+        *p++ = (uint8_t)rec.rssiMin;
+        *p++ = (uint8_t)rec.rssiMax;
+        for (int i = 0; i < 4; i++) *p++ = (uint8_t)(rec.firstTimestamp >> (8 * i));
+        for (int i = 0; i < 3; i++) *p++ = (uint8_t)(rec.firstMicros >> (8 * i));
+    }
+    if (bleRecHas(rec, BLE_REC_HAVE_FRAME)) {
+        *p++ = BLE_BIN_TLV_FRAME;
+        *p++ = (uint8_t)(1 + rec.frameLen);
+        *p++ = rec.frameType;
+        memcpy(p, rec.frame, rec.frameLen);
+        p += rec.frameLen;
+    }
+    if (rec.delta) {
+        p = binPutTLV(p, BLE_BIN_TLV_DELTA, &rec.removed, 1);
+    }
+
+    size_t len = p - tmp;
+    if (len > size) return 0;
+    tmp[0] = (uint8_t)(len - 1);
+    memcpy(buf, tmp, len);
+    return len;
+}
+
+/**
+ * Encodes a message holding only rec. Returns length or 0 if buf was too small.
+ */
+inline size_t binEncodeMessage(uint8_t *buf, size_t size, const BleAdvRecord &rec) {
+    if (size < 1) return 0;
+    buf[0] = BLE_BIN_VERSION;
+    size_t len = binEncodeRecord(buf + 1, size - 1, rec);
+    return len > 0 ? len + 1 : 0;
+}
+
+//----------------------------
+// DECODER
+//----------------------------
+struct BinReader {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+};
+
+enum binDecodeResult { BIN_OK,
+                       BIN_END,
+                       BIN_MALFORMED };
+
+/**
+ * Checks version byte and prepares reader for binDecodeRecord().
+ */
+inline bool binDecodeBegin(BinReader &reader, const uint8_t *buf, size_t len) {
+    reader.buf = buf;
+    reader.len = len;
+    reader.pos = 1;
+    return len > 0 && buf[0] == BLE_BIN_VERSION;
+}
+
+/**
+ * Decodes next record into rec. Returns BIN_END if no record left.
+ * On BIN_MALFORMED reader stops, since record boundaries cannot be trusted anymore.
+ */
+inline binDecodeResult binDecodeRecord(BinReader &reader, BleAdvRecord &rec) {
+    if (reader.pos >= reader.len) return BIN_END;
+    size_t recLen = reader.buf[reader.pos];
+    const uint8_t *p = reader.buf + reader.pos + 1;
+    if (recLen < BLE_BIN_FIXED_LEN || reader.pos + 1 + recLen > reader.len) {
+        reader.pos = reader.len;
+        return BIN_MALFORMED;
+    }
+    const uint8_t *end = p + recLen;
+
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.address, p, BLE_ADDR_LEN);
+    p += BLE_ADDR_LEN;
+    rec.addrType = *p++;
+    int8_t rssi = (int8_t)*p++;
+    if (rssi != BLE_BIN_RSSI_NA) {
+        rec.rssi = rssi;
+        rec.flags |= BLE_REC_HAVE_RSSI;
+    }
+    rec.payloadLength = *p++;
+    for (int i = 0; i < 4; i++) rec.timestamp |= (uint32_t)*p++ << (8 * i);
+    for (int i = 0; i < 3; i++) rec.micros |= (uint32_t)*p++ << (8 * i);
+
+    while (p < end) {
+        if (end - p < 2 || end - p - 2 < p[1]) {
+            reader.pos = reader.len;
+            return BIN_MALFORMED;
+        }
+        uint8_t type = p[0];
+        uint8_t len = p[1];
+        const uint8_t *v = p + 2;
+        switch (type) {
+            case BLE_BIN_TLV_TX_POWER:
+                if (len != 1) break;
+                rec.txPower = (int8_t)v[0];
+                rec.flags |= BLE_REC_HAVE_TX_POWER;
+                break;
+            case BLE_BIN_TLV_APPEARANCE:
+                if (len != 2) break;
+                rec.appearance = v[0] | (v[1] << 8);
+                rec.flags |= BLE_REC_HAVE_APPEARANCE;
+                break;
+            case BLE_BIN_TLV_NAME:
+                bleRecSetName(rec, (const char *)v, len);
+                break;
+            case BLE_BIN_TLV_MANUF_DATA:
+                bleRecSetManufData(rec, v, len);
+                break;
+            case BLE_BIN_TLV_SERVICE_UUID:
+                bleRecSetServiceUUID(rec, v, len);
+                break;
+            case BLE_BIN_TLV_STATS:
+                if (len != BLE_BIN_STATS_LEN) break;
+                rec.count = v[0] | (v[1] << 8);
+                rec.rssiMin = (int8_t)v[2];
+                rec.rssiMax = (int8_t)v[3];
+                for (int i = 0; i < 4; i++) rec.firstTimestamp |= (uint32_t)v[4 + i] << (8 * i);
+                for (int i = 0; i < 3; i++) rec.firstMicros |= (uint32_t)v[8 + i] << (8 * i);
+                rec.flags |= BLE_REC_HAVE_STATS;
+                break;
+            case BLE_BIN_TLV_FRAME:
+                if (len < 1) break;
+                bleRecSetFrame(rec, v[0], v + 1, len - 1);
+                break;
+            case BLE_BIN_TLV_DELTA:
+                if (len != 1) break;
+                // address type and payload length are always part of the record
+                rec.delta = BLE_DELTA_RECORD | BLE_DELTA_SAME_META;
+                rec.removed = v[0];
+                break;
+            default:
+                // unknown field of a newer encoder, skip
+                break;
+        }
+        p += 2 + len;
+    }
+    reader.pos += 1 + recLen;
+    return BIN_OK;
+}
+
+#endif  // BLE_BINARY_KD_H
@@ -0,0 +1,125 @@
+/**
+ * Capture format for raw BLE advertisements (record and replay).
+ *
+ * File:
+ *   u8[4]  magic "KDCP"
+ *   u8     version (0x01)
+ *   u8[3]  reserved (0)
+ *   u64    epoch time of capture start in us (little endian, 0 if unknown)
+ *   records
+ *
+ * Record:
+ *   varint time since previous record in us (LEB128, first record: since capture start)
+ *   u8[6]  address (as esp_bd_addr_t)
+ *   u8     address type
+ *   i8     rssi
+ *   u8     length of data
+ *   u8[]   advertising data followed by scan response
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_CAPTURE_KD_H
+#define BLE_CAPTURE_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_record.h"
+
+#define BLE_CAPTURE_VERSION 0x01
+#define BLE_CAPTURE_HEADER_LEN 16
+// varint of 64 bit, address, type, rssi, length, data
+#define BLE_CAPTURE_MAX_RECORD_LEN (10 + BLE_ADDR_LEN + 3 + BLE_MAX_PAYLOAD_LEN)
+
+// one advertisement as delivered by the GAP scan result event
+struct BleRawAdv {
+    uint64_t timeUs;  // capture time (monotonic)
+    uint8_t address[BLE_ADDR_LEN];
+    uint8_t addrType;
+    int8_t rssi;
+    uint8_t len;
+    uint8_t data[BLE_MAX_PAYLOAD_LEN];
+};
+
+inline void captureSetRawAdv(BleRawAdv &adv, uint64_t timeUs, const uint8_t *address, uint8_t addrType, int rssi,
+                             const uint8_t *data, size_t len) {
+    adv.timeUs = timeUs;
+    memcpy(adv.address, address, BLE_ADDR_LEN);
+    adv.addrType = addrType;
+    adv.rssi = (int8_t)rssi;
+    adv.len = (uint8_t)(len > BLE_MAX_PAYLOAD_LEN ? BLE_MAX_PAYLOAD_LEN : len);
+    memcpy(adv.data, data, adv.len);
+}
+
+inline size_t captureEncodeHeader(uint8_t *buf, uint64_t startEpochUs) {
+    memcpy(buf, "KDCP", 4);
+    buf[4] = BLE_CAPTURE_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    for (int i = 0; i < 8; i++) buf[8 + i] = (uint8_t)(startEpochUs >> (8 * i));
+    return BLE_CAPTURE_HEADER_LEN;
+}
+
+inline bool captureDecodeHeader(const uint8_t *buf, size_t len, uint64_t &startEpochUs) {
+    if (len < BLE_CAPTURE_HEADER_LEN || memcmp(buf, "KDCP", 4) != 0 || buf[4] != BLE_CAPTURE_VERSION)
+        return false;
+    startEpochUs = 0;
+    for (int i = 0; i < 8; i++) startEpochUs |= (uint64_t)buf[8 + i] << (8 * i);
+    return true;
+}
+
+/**
+ * prevUs is the time of previous record (start time for first one) and updated.
+ * Returns bytes written or 0 if buf is too small.
+ */
+inline size_t captureEncodeRecord(uint8_t *buf, size_t size, uint64_t &prevUs, const BleRawAdv &adv) {
+    uint8_t tmp[BLE_CAPTURE_MAX_RECORD_LEN];
+    size_t n = 0;
+    uint64_t delta = adv.timeUs >= prevUs ? adv.timeUs - prevUs : 0;
+    do {
+        uint8_t b = delta & 0x7f;
+        delta >>= 7;
+        tmp[n++] = b | (delta ? 0x80 : 0);
+    } while (delta);
+    memcpy(tmp + n, adv.address, BLE_ADDR_LEN);
+    n += BLE_ADDR_LEN;
+    tmp[n++] = adv.addrType;
+    tmp[n++] = (uint8_t)adv.rssi;
+    tmp[n++] = adv.len;
+    memcpy(tmp + n, adv.data, adv.len);
+    n += adv.len;
+    if (n > size) return 0;
+    memcpy(buf, tmp, n);
+    prevUs = adv.timeUs;
+    return n;
+}
+
+/**
+ * Decodes record at buf. prevUs as for encoding.
+ * Returns bytes consumed or 0 if incomplete/malformed.
+ */
+inline size_t captureDecodeRecord(const uint8_t *buf, size_t len, uint64_t &prevUs, BleRawAdv &adv) {
+    size_t n = 0;
+    uint64_t delta = 0;
+    for (int shift = 0;; shift += 7) {
+        if (n >= len || shift > 63) return 0;
+        uint8_t b = buf[n++];
+        delta |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    if (len - n < BLE_ADDR_LEN + 3) return 0;
+    memcpy(adv.address, buf + n, BLE_ADDR_LEN);
+    n += BLE_ADDR_LEN;
+    adv.addrType = buf[n++];
+    adv.rssi = (int8_t)buf[n++];
+    adv.len = buf[n++];
+    if (adv.len > BLE_MAX_PAYLOAD_LEN || len - n < adv.len) return 0;
+    memcpy(adv.data, buf + n, adv.len);
+    n += adv.len;
+    adv.timeUs = prevUs + delta;
+    prevUs = adv.timeUs;
+    return n;
+}
+
+#endif  // BLE_CAPTURE_KD_H
@@ -0,0 +1,192 @@
+/**
+ * Delta encoding of BleAdvRecords against what was last sent per device.
+ *
+ * Most devices advertise the same name, manufacturer data, service UUID etc. in every window,
+ * only RSSI and time change. BleDeltaCache remembers per address what was sent last and strips
+ * the optional fields that did not change, so a record carries address, RSSI, timestamp
+ * and only the fields that changed:
+ *   - delta records have rec.delta set (BLE_DELTA_RECORD), rec.removed holds BLE_REC_HAVE_* of
+ *     fields the device does not advertise anymore
+ *   - BLE_DELTA_SAME_META: address type and payload length did not change either
+ *     (JSON omits "addrType" and "payloadLength" then, binary always carries them)
+ *   - keyframes are plain full records: first record of a device, after keyframeIntervalS seconds
+ *     (record timestamps), after the device was evicted from the cache and after reset()
+ *
+ * Fields covered: name, appearance, manufData, serviceUUID, txPower and frame. RSSI and statistics
+ * are always sent. To save memory, variable length fields are remembered as 32 bit hashes only,
+ * so a change hidden by a hash collision is sent with the next keyframe.
+ *
+ * Memory is fixed to N entries (~40 bytes each). A device is stored at most MaxProbe slots behind
+ * its home slot, if all of them are taken the least recently used one is evicted.
+ *
+ * Not thread-safe, to be used by the context serializing records only.
+ * The receiver needs the same stream in order to reconstruct full records
+ * (see host_tools/lib/ble_delta_decoder), so call reset() whenever a message got lost.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_DELTA_KD_H
+#define BLE_DELTA_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_aggregate.h"
+#include "ble_record.h"
+
+// optional fields subject to delta encoding
+#define BLE_DELTA_FIELDS (BLE_REC_HAVE_NAME | BLE_REC_HAVE_APPEARANCE | BLE_REC_HAVE_MANUF_DATA | \
+                          BLE_REC_HAVE_SERVICE_UUID | BLE_REC_HAVE_TX_POWER | BLE_REC_HAVE_FRAME)
+
+inline uint32_t bleDeltaHash(const uint8_t *data, size_t len, uint8_t extra = 0) {
+    uint32_t h = 2166136261u;  // FNV-1a, length included so "" and "\0" differ
+    h = (h ^ (uint8_t)len) * 16777619u;
+    h = (h ^ extra) * 16777619u;
+    for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+template <size_t N, size_t MaxProbe = 8>
+class BleDeltaCache {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "BleDeltaCache size needs to be a power of two");
+    static_assert(MaxProbe > 0 && MaxProbe <= N, "MaxProbe needs to be within 1..N");
+
+    struct Entry {
+        uint8_t address[BLE_ADDR_LEN];
+        bool used;
+        uint8_t flags;  // optional fields last sent
+        uint8_t addrType;
+        int8_t txPower;
+        uint16_t appearance;
+        uint16_t payloadLength;
+        uint32_t keyframeTimestamp;
+        uint32_t lastUsed;  // for eviction
+        uint32_t nameHash;
+        uint32_t manufDataHash;
+        uint32_t serviceUUIDHash;
+        uint32_t frameHash;
+    };
+
+   public:
+    explicit BleDeltaCache(uint32_t keyframeIntervalS = 300) : keyframeIntervalS(keyframeIntervalS) {}
+
+    /**
+     * Strips unchanged fields off rec and remembers the fields sent.
+     * Returns true if rec stays a full record (keyframe).
+     */
+    bool encode(BleAdvRecord &rec) {
+        tick++;
+        rec.delta = 0;
+        rec.removed = 0;
+        Entry cur;
+        remember(cur, rec);
+        cur.lastUsed = tick;
+
+        bool keyframe = false;
+        Entry *e = lookup(rec.address, keyframe);
+        if (!keyframe && (rec.timestamp - e->keyframeTimestamp >= keyframeIntervalS || rec.timestamp < e->keyframeTimestamp))
+            keyframe = true;
+        if (keyframe) {
+            cur.keyframeTimestamp = rec.timestamp;
+            *e = cur;
+            keyframes++;
+            return true;
+        }
+
+        uint8_t same = unchangedFields(*e, cur);
+        rec.flags &= ~same;
+        rec.removed = e->flags & ~cur.flags & BLE_DELTA_FIELDS;
+        rec.delta = BLE_DELTA_RECORD;
+        if (e->addrType == cur.addrType && e->payloadLength == cur.payloadLength)
+            rec.delta |= BLE_DELTA_SAME_META;
+
+        cur.keyframeTimestamp = e->keyframeTimestamp;
+        *e = cur;
+        deltas++;
+        return false;
+    }
+
+    /**
+     * Forgets all devices, so each gets a keyframe next.
+     */
+    void reset() {
+        for (size_t i = 0; i < N; i++) entries[i].used = false;
+        resets++;
+    }
+
+    static constexpr size_t capacity() { return N; }
+    // totals since start
+    uint32_t keyframeCount() const { return keyframes; }
+    uint32_t deltaCount() const { return deltas; }
+    uint32_t evictedCount() const { return evicted; }
+    uint32_t resetCount() const { return resets; }
+
+   private:
+    static void remember(Entry &e, const BleAdvRecord &rec) {
+        memcpy(e.address, rec.address, BLE_ADDR_LEN);
+        e.used = true;
+        e.flags = rec.flags & BLE_DELTA_FIELDS;
+        e.addrType = rec.addrType;
+        e.payloadLength = rec.payloadLength;
+        e.txPower = bleRecHas(rec, BLE_REC_HAVE_TX_POWER) ? rec.txPower : 0;
+        e.appearance = bleRecHas(rec, BLE_REC_HAVE_APPEARANCE) ? rec.appearance : 0;
+        e.nameHash = bleRecHas(rec, BLE_REC_HAVE_NAME) ? bleDeltaHash((const uint8_t *)rec.name, strnlen(rec.name, BLE_MAX_NAME_LEN)) : 0;
+        e.manufDataHash = bleRecHas(rec, BLE_REC_HAVE_MANUF_DATA) ? bleDeltaHash(rec.manufData, rec.manufDataLen) : 0;
+        e.serviceUUIDHash = bleRecHas(rec, BLE_REC_HAVE_SERVICE_UUID) ? bleDeltaHash(rec.serviceUUID, rec.serviceUUIDLen) : 0;
+        e.frameHash = bleRecHas(rec, BLE_REC_HAVE_FRAME) ? bleDeltaHash(rec.frame, rec.frameLen, rec.frameType) : 0;
+    }
+
+    /**
+     * BLE_REC_HAVE_* of fields present in both with the same value.
+     */
+    static uint8_t unchangedFields(const Entry &last, const Entry &cur) {
+        uint8_t both = last.flags & cur.flags;
+        uint8_t same = 0;
+        if (last.nameHash == cur.nameHash) same |= BLE_REC_HAVE_NAME;
+        if (last.appearance == cur.appearance) same |= BLE_REC_HAVE_APPEARANCE;
+        if (last.manufDataHash == cur.manufDataHash) same |= BLE_REC_HAVE_MANUF_DATA;
+        if (last.serviceUUIDHash == cur.serviceUUIDHash) same |= BLE_REC_HAVE_SERVICE_UUID;
+        if (last.txPower == cur.txPower) same |= BLE_REC_HAVE_TX_POWER;
+        if (last.frameHash == cur.frameHash) same |= BLE_REC_HAVE_FRAME;
+        return both & same;
+    }
+
+    /**
+     * Entry of address, sets keyframe if it was not known (new or evicted entry).
+     */
+    Entry *lookup(const uint8_t *address, bool &keyframe) {
+        uint32_t home = bleAddrHash(address) & (N - 1);
+        Entry *victim = nullptr;
+        for (size_t i = 0; i < MaxProbe; i++) {
+            Entry &e = entries[(home + i) & (N - 1)];
+            if (!e.used) {
+                keyframe = true;
+                e.lastUsed = tick;
+                return &e;
+            }
+            if (memcmp(e.address, address, BLE_ADDR_LEN) == 0) {
+                e.lastUsed = tick;
+                return &e;
+            }
+            // unsigned difference copes with wrapping tick
+            if (victim == nullptr || tick - e.lastUsed > tick - victim->lastUsed)
+                victim = &e;
+        }
+        evicted++;
+        keyframe = true;
+        victim->lastUsed = tick;
+        return victim;
+    }
+
+    Entry entries[N] = {};
+    uint32_t keyframeIntervalS;
+    uint32_t tick = 0;
+    uint32_t keyframes = 0;
+    uint32_t deltas = 0;
+    uint32_t evicted = 0;
+    uint32_t resets = 0;
+};
+
+#endif  // BLE_DELTA_KD_H
@@ -0,0 +1,126 @@
+/**
+ * Rules to drop or truncate advertisements before they are queued and serialized.
+ *
+ * Rules (all optional):
+ * - RSSI floor: weaker sightings are dropped
+ * - address types: bit n of dropAddrTypes drops address type n (0 public, 1 random, 2 RPA public, 3 RPA random)
+ * - payload length: outside minPayloadLen..maxPayloadLen is dropped
+ * - company ID of manufacturer data: keep, truncate or drop, others get defaultAction
+ *
+ * Truncated records keep address, rssi, times, company ID (first 2 bytes of manufData) and a decoded frame,
+ * but no name and no further manufacturer data.
+ *
+ * Company rules are kept in a small hash table with bounded probing, so evaluating
+ * an advertisement costs the same for any number of rules.
+ * Evaluating a BleAdView checks the cheap rules first, so AD structures are parsed
+ * only if the company ID is needed.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_FILTER_KD_H
+#define BLE_FILTER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_adv_parser.h"
+#include "ble_frames.h"
+#include "ble_record.h"
+
+// ordered by severity
+enum BleFilterAction : uint8_t {
+    BLE_FILTER_KEEP,
+    BLE_FILTER_TRUNCATE,
+    BLE_FILTER_DROP
+};
+
+struct BleCompanyRule {
+    uint16_t companyId;
+    BleFilterAction action;
+};
+
+/**
+ * Strips record as described above.
+ */
+inline void bleFilterTruncate(BleAdvRecord &rec) {
+    rec.flags &= ~BLE_REC_HAVE_NAME;
+    rec.name[0] = '\0';
+    if (rec.manufDataLen > 2) rec.manufDataLen = 2;
+}
+
+template <size_t N = 32, size_t MaxProbe = 4>
+class BleFilter {
+    static_assert(N > 0 && N <= 256 && (N & (N - 1)) == 0, "BleFilter size needs to be a power of two up to 256");
+    static_assert(MaxProbe > 0 && MaxProbe <= N, "MaxProbe needs to be within 1..N");
+
+    struct Slot {
+        uint16_t companyId;
+        BleFilterAction action;
+        bool used;
+    };
+
+   public:
+    int8_t rssiFloor = -128;
+    uint8_t dropAddrTypes = 0;
+    uint16_t minPayloadLen = 0;
+    uint16_t maxPayloadLen = 0xffff;
+    BleFilterAction defaultAction = BLE_FILTER_KEEP;
+
+    /**
+     * Returns false if there is no free slot in reach (use a larger N).
+     */
+    bool addCompanyRule(uint16_t companyId, BleFilterAction action) {
+        size_t home = slotOf(companyId);
+        for (size_t i = 0; i < MaxProbe; i++) {
+            Slot &s = slots[(home + i) & (N - 1)];
+            if (!s.used || s.companyId == companyId) {
+                if (!s.used) rules++;
+                s.companyId = companyId;
+                s.action = action;
+                s.used = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    BleFilterAction evaluate(const BleAdvRecord &rec) const {
+        if (bleRecHas(rec, BLE_REC_HAVE_RSSI) && rec.rssi < rssiFloor) return BLE_FILTER_DROP;
+        if (rec.addrType < 8 && (dropAddrTypes & (1 << rec.addrType))) return BLE_FILTER_DROP;
+        if (rec.payloadLength < minPayloadLen || rec.payloadLength > maxPayloadLen) return BLE_FILTER_DROP;
+        return evaluateCompany(bleCompanyId(rec));
+    }
+
+    BleFilterAction evaluate(const BleAdView &view) const {
+        if (view.rssi() < rssiFloor) return BLE_FILTER_DROP;
+        if (view.addrType() < 8 && (dropAddrTypes & (1 << view.addrType()))) return BLE_FILTER_DROP;
+        if (view.payloadLength() < minPayloadLen || view.payloadLength() > maxPayloadLen) return BLE_FILTER_DROP;
+        // no need to parse
+        if (rules == 0) return defaultAction;
+        return evaluateCompany(view.companyId());
+    }
+
+   private:
+    BleFilterAction evaluateCompany(int32_t companyId) const {
+        if (companyId < 0) return defaultAction;
+        size_t home = slotOf((uint16_t)companyId);
+        for (size_t i = 0; i < MaxProbe; i++) {
+            const Slot &s = slots[(home + i) & (N - 1)];
+            if (!s.used) break;
+            if (s.companyId == companyId) return s.action;
+        }
+        return defaultAction;
+    }
+
+    static size_t slotOf(uint16_t companyId) {
+        // Fibonacci hashing, company IDs are mostly small and consecutive
+        return ((uint32_t)companyId * 2654435769u) >> 24 & (N - 1);
+    }
+
+    Slot slots[N] = {};
+    size_t rules = 0;
+};
+
+#endif  // BLE_FILTER_KD_H
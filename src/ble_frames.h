@@ -0,0 +1,175 @@
+/**
+ * Decoding of common beacon frames from raw advertising data.
+ *
+ * Frames are validated and their fields are kept in BleAdvRecord::frame, so serializers
+ * can emit them as structured fields instead of the backend parsing manufData:
+ *
+ *   BLE_FRAME_IBEACON        manufacturer data 0x004c 02 15
+ *                            u8[16] proximity UUID, u16 major, u16 minor (big endian), i8 measured power
+ *   BLE_FRAME_EDDYSTONE_UID  service data 0xfeaa, frame 0x00
+ *                            i8 ranging data (tx power at 0 m), u8[10] namespace, u8[6] instance
+ *   BLE_FRAME_EDDYSTONE_URL  service data 0xfeaa, frame 0x10
+ *                            i8 ranging data, u8 scheme, encoded URL (up to 17 bytes)
+ *   BLE_FRAME_EDDYSTONE_TLM  service data 0xfeaa, frame 0x20 (unencrypted)
+ *                            u8 version, u16 battery (mV), i16 temperature (8.8 fixed point, 0x8000 if n/a),
+ *                            u32 advertisement count, u32 time since power-on (0.1 s), all big endian
+ *   BLE_FRAME_APPLE          manufacturer data 0x004c (other than iBeacon)
+ *                            u8 continuity type, u8 length of it
+ *   BLE_FRAME_MICROSOFT      manufacturer data 0x0006
+ *                            u8 scenario type, u8 version and device type
+ *
+ * https://github.com/google/eddystone/blob/master/protocol-specification.md
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_FRAMES_KD_H
+#define BLE_FRAMES_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_adv_parser.h"
+#include "ble_record.h"
+
+#define BLE_AD_SERVICE_DATA16 0x16
+
+#define BLE_COMPANY_MICROSOFT 0x0006
+#define BLE_COMPANY_APPLE 0x004c
+#define BLE_UUID_EDDYSTONE 0xfeaa
+
+#define BLE_FRAME_IBEACON 1
+#define BLE_FRAME_EDDYSTONE_UID 2
+#define BLE_FRAME_EDDYSTONE_URL 3
+#define BLE_FRAME_EDDYSTONE_TLM 4
+#define BLE_FRAME_APPLE 5
+#define BLE_FRAME_MICROSOFT 6
+
+#define BLE_EDDYSTONE_URL_MAX_LEN 17
+
+/**
+ * Company ID of manufacturer data (little endian) or -1 if there is none.
+ */
+inline int32_t bleCompanyId(const BleAdvRecord &rec) {
+    if (!bleRecHas(rec, BLE_REC_HAVE_MANUF_DATA) || rec.manufDataLen < 2) return -1;
+    return rec.manufData[0] | (rec.manufData[1] << 8);
+}
+
+/**
+ * v: value of AD type 0xff (company ID first).
+ */
+inline bool bleDecodeManufFrame(BleAdvRecord &rec, const uint8_t *v, size_t len) {
+    if (len < 4) return false;
+    uint16_t company = v[0] | (v[1] << 8);
+    if (company == BLE_COMPANY_APPLE) {
+        if (v[2] == 0x02 && v[3] == 0x15) {
+            if (len < 25) return false;
+            bleRecSetFrame(rec, BLE_FRAME_IBEACON, v + 4, 21);
+        } else {
+            bleRecSetFrame(rec, BLE_FRAME_APPLE, v + 2, 2);
+        }
+        return true;
+    }
+    if (company == BLE_COMPANY_MICROSOFT) {
+        bleRecSetFrame(rec, BLE_FRAME_MICROSOFT, v + 2, 2);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * v: value of AD type 0x16 (16 bit service UUID first).
+ */
+inline bool bleDecodeServiceDataFrame(BleAdvRecord &rec, const uint8_t *v, size_t len) {
+    if (len < 3 || (v[0] | (v[1] << 8)) != BLE_UUID_EDDYSTONE) return false;
+    const uint8_t *f = v + 3;
+    size_t fLen = len - 3;
+    switch (v[2]) {
+        case 0x00:
+            // 2 reserved bytes at the end are optional
+            if (fLen < 17) return false;
+            bleRecSetFrame(rec, BLE_FRAME_EDDYSTONE_UID, f, 17);
+            return true;
+        case 0x10:
+            if (fLen < 2 || fLen > 2 + BLE_EDDYSTONE_URL_MAX_LEN) return false;
+            bleRecSetFrame(rec, BLE_FRAME_EDDYSTONE_URL, f, fLen);
+            return true;
+        case 0x20:
+            // version 0x01 would be encrypted
+            if (fLen < 13 || f[0] != 0x00) return false;
+            bleRecSetFrame(rec, BLE_FRAME_EDDYSTONE_TLM, f, 13);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Decodes frames of raw advertising data (as for fillBleAdvRecordFromRaw()).
+ * Like other fields, the last frame wins.
+ */
+inline bool bleDecodeFrames(BleAdvRecord &rec, const uint8_t *data, size_t len) {
+    bool found = false;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t adLen = data[pos];
+        if (adLen == 0 || pos + 1 + adLen > len) break;
+        const uint8_t *v = data + pos + 2;
+        size_t vLen = adLen - 1;
+        if (data[pos + 1] == BLE_AD_MANUFACTURER)
+            found |= bleDecodeManufFrame(rec, v, vLen);
+        else if (data[pos + 1] == BLE_AD_SERVICE_DATA16)
+            found |= bleDecodeServiceDataFrame(rec, v, vLen);
+        pos += 1 + adLen;
+    }
+    return found;
+}
+
+inline uint16_t bleFrameU16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+inline uint32_t bleFrameU32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Expands encoded Eddystone-URL (scheme byte and URL bytes) into out (zero terminated).
+ * Bytes that are not printable (or would need escaping in JSON) are written as %xx.
+ * Returns length or 0 if out was too small.
+ */
+inline size_t bleEddystoneUrl(char *out, size_t size, const uint8_t *encoded, size_t len) {
+    static const char *const SCHEMES[] = {"http://www.", "https://www.", "http://", "https://"};
+    static const char *const SUFFIXES[] = {".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+                                           ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"};
+    if (len < 1 || encoded[0] > 3 || size == 0) return 0;
+    size_t n = strlen(SCHEMES[encoded[0]]);
+    if (n >= size) return 0;
+    memcpy(out, SCHEMES[encoded[0]], n);
+    for (size_t i = 1; i < len; i++) {
+        uint8_t c = encoded[i];
+        char tmp[4];
+        const char *part = tmp;
+        size_t partLen;
+        if (c < sizeof(SUFFIXES) / sizeof(SUFFIXES[0])) {
+            part = SUFFIXES[c];
+            partLen = strlen(part);
+        } else if (c > 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '%') {
+            tmp[0] = (char)c;
+            partLen = 1;
+        } else {
+            tmp[0] = '%';
+            tmp[1] = "0123456789abcdef"[c >> 4];
+            tmp[2] = "0123456789abcdef"[c & 0x0f];
+            partLen = 3;
+        }
+        if (n + partLen >= size) return 0;
+        memcpy(out + n, part, partLen);
+        n += partLen;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+#endif  // BLE_FRAMES_KD_H
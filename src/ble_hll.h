@@ -0,0 +1,294 @@
+/**
+ * HyperLogLog sketch of distinct addresses (COUNT_ONLY), its messages and their decoder.
+ *
+ * 2^P registers of one byte each. An address is hashed to 64 bits: the top P bits select
+ * the register, which keeps the max. position of the first 1 bit in the remaining bits.
+ * Standard error of the estimate is 1.04 / sqrt(2^P), e.g. 3.3% for P = 10.
+ * Sketches of the same P are merged by register-wise max, which gives the sketch of the union.
+ * So windows add up to rollups and loggers to sites without counting a device twice.
+ * Note that randomized addresses count as distinct devices.
+ *
+ * Hash: fmix64 of MurmurHash3 on the address as 48-bit number (most significant byte first).
+ * Estimate: improved raw estimator of Ertl ("New cardinality estimation algorithms for
+ * HyperLogLog sketches", 2017), unbiased over the whole range without correction tables.
+ *
+ * Registers are sent dense (6 bits each, four in three bytes, most significant bits first)
+ * or sparse (for each register != 0: index << 6 | value in (P + 6 + 7) / 8 bytes big endian,
+ * by index), whichever is shorter.
+ *
+ * JSON message:
+ *   {"hll": {"start": 1651042690, "seconds": 10, "p": 10, "estimate": 123, "sparse": "<hex>"}}
+ *   ("dense" instead of "sparse")
+ * Binary message (BINARY_PAYLOAD):
+ *   u8  type (0x02, records start with BLE_BIN_VERSION 0x01)
+ *   u8  P
+ *   u8  0 dense, 1 sparse
+ *   u32 start (epoch seconds), u32 seconds, u32 estimate (little endian)
+ *   registers
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_HLL_KD_H
+#define BLE_HLL_KD_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_json.h"
+#include "ble_record.h"
+
+#define BLE_HLL_MIN_P 4
+#define BLE_HLL_MAX_P 16
+#define BLE_HLL_BIN_TYPE 0x02
+#define BLE_HLL_BIN_HEADER_LEN 15
+
+inline uint64_t bleHllHash(const uint8_t *address) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) h = h << 8 | address[i];
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline void bleHllAddHash(uint8_t *registers, uint8_t p, uint64_t h) {
+    size_t index = h >> (64 - p);
+    uint64_t w = h << p;
+    uint8_t rho = w == 0 ? 65 - p : __builtin_clzll(w) + 1;
+    if (rho > registers[index]) registers[index] = rho;
+}
+
+inline void bleHllMerge(uint8_t *registers, const uint8_t *other, uint8_t p) {
+    for (size_t i = 0; i < ((size_t)1 << p); i++)
+        if (other[i] > registers[i]) registers[i] = other[i];
+}
+
+//----------------------------
+// ESTIMATE
+//----------------------------
+inline double bleHllSigma(double x) {
+    if (x == 1) return INFINITY;
+    double y = 1, z = x, prev;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (z != prev);
+    return z;
+}
+
+inline double bleHllTau(double x) {
+    if (x == 0 || x == 1) return 0;
+    double y = 1, z = 1 - x, prev;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (z != prev);
+    return z / 3;
+}
+
+inline double bleHllEstimate(const uint8_t *registers, uint8_t p) {
+    size_t m = (size_t)1 << p;
+    int q = 64 - p;
+    uint32_t counts[66] = {};
+    for (size_t i = 0; i < m; i++) counts[registers[i]]++;
+    double z = m * bleHllTau(1 - (double)counts[q + 1] / m);
+    for (int k = q; k >= 1; k--) z = 0.5 * (z + counts[k]);
+    z += m * bleHllSigma((double)counts[0] / m);
+    // alpha for m -> infinity: 1 / (2 ln 2)
+    return 0.5 / log(2.0) * m * m / z;
+}
+
+//----------------------------
+// REGISTER ENCODING
+//----------------------------
+inline size_t bleHllDenseLen(uint8_t p) {
+    return (((size_t)1 << p) * 6 + 7) / 8;
+}
+
+inline size_t bleHllSparseEntryLen(uint8_t p) {
+    return (p + 6 + 7) / 8;
+}
+
+/**
+ * Writes registers dense or sparse, whichever is shorter (bleHllDenseLen() at most).
+ * Returns length (0 for an empty sketch) or 0 if buf was too small.
+ */
+inline size_t bleHllEncode(uint8_t *buf, size_t size, const uint8_t *registers, uint8_t p, bool &sparse) {
+    size_t m = (size_t)1 << p, used = 0;
+    for (size_t i = 0; i < m; i++) used += registers[i] != 0;
+    size_t entryLen = bleHllSparseEntryLen(p);
+    sparse = used * entryLen < bleHllDenseLen(p);
+    size_t len = sparse ? used * entryLen : bleHllDenseLen(p);
+    if (len > size) return 0;
+    if (sparse) {
+        uint8_t *out = buf;
+        for (size_t i = 0; i < m; i++) {
+            if (registers[i] == 0) continue;
+            uint32_t e = (uint32_t)i << 6 | registers[i];
+            for (size_t b = 0; b < entryLen; b++) *out++ = (uint8_t)(e >> (8 * (entryLen - 1 - b)));
+        }
+    } else {
+        memset(buf, 0, len);
+        for (size_t i = 0; i < m; i++) {
+            size_t bit = i * 6;
+            // spans at most two bytes
+            uint16_t v = (uint16_t)(registers[i] & 0x3f) << (10 - bit % 8);
+            buf[bit / 8] |= (uint8_t)(v >> 8);
+            if (bit / 8 + 1 < len) buf[bit / 8 + 1] |= (uint8_t)v;
+        }
+    }
+    return len;
+}
+
+/**
+ * Reads registers written by bleHllEncode() (2^p bytes). Returns false if malformed.
+ */
+inline bool bleHllDecode(uint8_t *registers, uint8_t p, const uint8_t *buf, size_t len, bool sparse) {
+    size_t m = (size_t)1 << p;
+    memset(registers, 0, m);
+    if (sparse) {
+        size_t entryLen = bleHllSparseEntryLen(p);
+        if (len % entryLen != 0) return false;
+        for (size_t pos = 0; pos < len; pos += entryLen) {
+            uint32_t e = 0;
+            for (size_t b = 0; b < entryLen; b++) e = e << 8 | buf[pos + b];
+            size_t index = e >> 6;
+            if (index >= m || (e & 0x3f) > (uint32_t)(65 - p)) return false;
+            registers[index] = e & 0x3f;
+        }
+        return true;
+    }
+    if (len != bleHllDenseLen(p)) return false;
+    for (size_t i = 0; i < m; i++) {
+        size_t bit = i * 6;
+        uint16_t v = (uint16_t)buf[bit / 8] << 8 | (bit / 8 + 1 < len ? buf[bit / 8 + 1] : 0);
+        registers[i] = (v >> (10 - bit % 8)) & 0x3f;
+        if (registers[i] > 65 - p) return false;
+    }
+    return true;
+}
+
+//----------------------------
+// SKETCH
+//----------------------------
+template <uint8_t P>
+class BleHll {
+    static_assert(P >= BLE_HLL_MIN_P && P <= BLE_HLL_MAX_P, "HLL precision needs to be within 4..16");
+
+   public:
+    static const size_t size = (size_t)1 << P;
+    // registers, as dense is the longest
+    static const size_t maxEncodedLen = (size * 6 + 7) / 8;
+
+    void clear() { memset(regs, 0, sizeof(regs)); }
+    void add(const uint8_t *address) { bleHllAddHash(regs, P, bleHllHash(address)); }
+    void merge(const BleHll &other) { bleHllMerge(regs, other.regs, P); }
+    double estimate() const { return bleHllEstimate(regs, P); }
+    size_t encode(uint8_t *buf, size_t len, bool &sparse) const { return bleHllEncode(buf, len, regs, P, sparse); }
+    bool decode(const uint8_t *buf, size_t len, bool sparse) { return bleHllDecode(regs, P, buf, len, sparse); }
+    const uint8_t *registers() const { return regs; }
+
+   private:
+    uint8_t regs[size] = {};
+};
+
+//----------------------------
+// MESSAGES
+//----------------------------
+// '{"hll": {"start": , "seconds": , "p": , "estimate": , "sparse": ""}}' and numbers
+#define BLE_HLL_JSON_OVERHEAD 120
+
+template <uint8_t P>
+inline size_t bleHllJsonLen() {
+    return BLE_HLL_JSON_OVERHEAD + 2 * BleHll<P>::maxEncodedLen;
+}
+
+template <uint8_t P>
+inline size_t bleHllBinLen() {
+    return BLE_HLL_BIN_HEADER_LEN + BleHll<P>::maxEncodedLen;
+}
+
+/**
+ * JSON message of sketch over [start, start + seconds). Returns length (without '\0') or 0 if buf was too small.
+ */
+template <uint8_t P>
+inline size_t bleHllSerializeJson(char *buf, size_t size, const BleHll<P> &sketch, uint32_t start, uint32_t seconds) {
+    uint8_t regs[BleHll<P>::maxEncodedLen];
+    bool sparse;
+    size_t n = sketch.encode(regs, sizeof(regs), sparse);
+    JsonBuf jb;
+    jsonInit(jb, buf, size);
+    jsonPut(jb, "{\"hll\": {\"start\": ");
+    jsonPutUInt(jb, start);
+    jsonPut(jb, ", \"seconds\": ");
+    jsonPutUInt(jb, seconds);
+    jsonPut(jb, ", \"p\": ");
+    jsonPutUInt(jb, P);
+    jsonPut(jb, ", \"estimate\": ");
+    jsonPutUInt(jb, (uint32_t)lround(sketch.estimate()));
+    jsonPutKeyValueHex(jb, sparse ? "sparse" : "dense", regs, n);
+    jsonPut(jb, "}}");
+    return jsonFinish(jb);
+}
+
+inline void bleHllPutU32(uint8_t *p, uint32_t v) {
+    for (size_t i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+/**
+ * Binary message of sketch over [start, start + seconds). Returns length or 0 if buf was too small.
+ */
+template <uint8_t P>
+inline size_t bleHllSerializeBin(uint8_t *buf, size_t size, const BleHll<P> &sketch, uint32_t start, uint32_t seconds) {
+    if (size < bleHllBinLen<P>()) return 0;
+    bool sparse;
+    size_t n = sketch.encode(buf + BLE_HLL_BIN_HEADER_LEN, size - BLE_HLL_BIN_HEADER_LEN, sparse);
+    buf[0] = BLE_HLL_BIN_TYPE;
+    buf[1] = P;
+    buf[2] = sparse ? 1 : 0;
+    bleHllPutU32(buf + 3, start);
+    bleHllPutU32(buf + 7, seconds);
+    bleHllPutU32(buf + 11, (uint32_t)lround(sketch.estimate()));
+    return BLE_HLL_BIN_HEADER_LEN + n;
+}
+
+struct BleHllMessage {
+    uint32_t start;
+    uint32_t seconds;
+    uint32_t estimate;
+    uint8_t p;
+    bool sparse;
+    const uint8_t *data;  // encoded registers, within the message
+    size_t dataLen;
+};
+
+inline uint32_t bleHllGetU32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Reads header of a binary message. Returns false if it is none or malformed.
+ */
+inline bool bleHllParseBin(const uint8_t *buf, size_t len, BleHllMessage &msg) {
+    if (len < BLE_HLL_BIN_HEADER_LEN || buf[0] != BLE_HLL_BIN_TYPE || buf[1] < BLE_HLL_MIN_P || buf[1] > BLE_HLL_MAX_P || buf[2] > 1)
+        return false;
+    msg.p = buf[1];
+    msg.sparse = buf[2] == 1;
+    msg.start = bleHllGetU32(buf + 3);
+    msg.seconds = bleHllGetU32(buf + 7);
+    msg.estimate = bleHllGetU32(buf + 11);
+    msg.data = buf + BLE_HLL_BIN_HEADER_LEN;
+    msg.dataLen = len - BLE_HLL_BIN_HEADER_LEN;
+    return true;
+}
+
+#endif  // BLE_HLL_KD_H
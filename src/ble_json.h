@@ -0,0 +1,217 @@
+/**
+ * Heap-free JSON serializer for BleAdvRecord.
+ *
+ * Writes into a caller-provided buffer (usually MAX_MQTT_MESSAGE_SIZE bytes on the stack).
+ * Output is the same as of the former stringstream/addKeyValuePair implementation:
+ * {"address": "38:2f:a6:xx:xx:xx", "name": "...", ..., "timestamp": "1651042693", "micros": "123"}
+ * Which fields a record has is set by its schema (see ble_schema.h).
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_JSON_KD_H
+#define BLE_JSON_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_frames.h"
+#include "ble_record.h"
+
+static const char HEX_CHARS[] = "0123456789abcdef";
+
+// Bounded output buffer. Once overflowed all further writes are ignored.
+struct JsonBuf {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+inline void jsonInit(JsonBuf &jb, char *buf, size_t size) {
+    jb.buf = buf;
+    jb.size = size;
+    jb.len = 0;
+    jb.overflow = size == 0;
+}
+
+inline void jsonPut(JsonBuf &jb, const char *s, size_t n) {
+    // keep one byte for terminating '\0'
+    if (jb.overflow || jb.len + n >= jb.size) {
+        jb.overflow = true;
+        return;
+    }
+    memcpy(jb.buf + jb.len, s, n);
+    jb.len += n;
+}
+
+inline void jsonPut(JsonBuf &jb, const char *s) {
+    jsonPut(jb, s, strlen(s));
+}
+
+inline void jsonPutChar(JsonBuf &jb, char c) {
+    jsonPut(jb, &c, 1);
+}
+
+inline void jsonPutInt(JsonBuf &jb, int32_t value) {
+    char tmp[12];
+    size_t pos = sizeof(tmp);
+    // work on negative values to handle INT32_MIN as well
+    bool neg = value < 0;
+    int32_t v = neg ? value : -value;
+    do {
+        tmp[--pos] = (char)('0' - (v % 10));
+        v /= 10;
+    } while (v != 0);
+    if (neg) tmp[--pos] = '-';
+    jsonPut(jb, tmp + pos, sizeof(tmp) - pos);
+}
+
+inline void jsonPutUInt(JsonBuf &jb, uint32_t value) {
+    char tmp[11];
+    size_t pos = sizeof(tmp);
+    do {
+        tmp[--pos] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+    jsonPut(jb, tmp + pos, sizeof(tmp) - pos);
+}
+
+// lowercase hex, two chars per byte (as BLEUtils::buildHexData)
+inline void jsonPutHex(JsonBuf &jb, const uint8_t *data, size_t n) {
+    if (jb.overflow || jb.len + 2 * n >= jb.size) {
+        jb.overflow = true;
+        return;
+    }
+    char *p = jb.buf + jb.len;
+    for (size_t i = 0; i < n; i++) {
+        *p++ = HEX_CHARS[data[i] >> 4];
+        *p++ = HEX_CHARS[data[i] & 0x0f];
+    }
+    jb.len += 2 * n;
+}
+
+inline void jsonPutKey(JsonBuf &jb, const char *key, bool first) {
+    if (!first) jsonPut(jb, ", ", 2);
+    jsonPutChar(jb, '"');
+    jsonPut(jb, key);
+    jsonPut(jb, "\": \"", 4);
+}
+
+inline void jsonPutKeyValue(JsonBuf &jb, const char *key, const char *value, bool first = false) {
+    jsonPutKey(jb, key, first);
+    jsonPut(jb, value);
+    jsonPutChar(jb, '"');
+}
+
+inline void jsonPutKeyValue(JsonBuf &jb, const char *key, int32_t value, bool first = false) {
+    jsonPutKey(jb, key, first);
+    jsonPutInt(jb, value);
+    jsonPutChar(jb, '"');
+}
+
+inline void jsonPutKeyValueUInt(JsonBuf &jb, const char *key, uint32_t value) {
+    jsonPutKey(jb, key, false);
+    jsonPutUInt(jb, value);
+    jsonPutChar(jb, '"');
+}
+
+inline void jsonPutKeyValueHex(JsonBuf &jb, const char *key, const uint8_t *data, size_t n) {
+    jsonPutKey(jb, key, false);
+    jsonPutHex(jb, data, n);
+    jsonPutChar(jb, '"');
+}
+
+// "38:2f:a6:xx:xx:xx" (as BLEAddress::toString)
+inline void jsonPutAddress(JsonBuf &jb, const uint8_t *address) {
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) {
+        if (i > 0) jsonPutChar(jb, ':');
+        jsonPutHex(jb, address + i, 1);
+    }
+}
+
+// "0000180f-0000-1000-8000-00805f9b34fb" (as BLEUUID::toString)
+inline void jsonPutUUID(JsonBuf &jb, const uint8_t *uuid, size_t len) {
+    if (len == 2 || len == 4) {
+        // 16 and 32 bit UUIDs are padded to the Bluetooth base UUID
+        uint8_t be[4] = {0, 0, 0, 0};
+        for (size_t i = 0; i < len; i++) be[3 - i] = uuid[i];
+        jsonPutHex(jb, be, 4);
+        jsonPut(jb, "-0000-1000-8000-00805f9b34fb");
+        return;
+    }
+    // 128 bit, printed from most significant byte
+    for (size_t i = 0; i < len; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) jsonPutChar(jb, '-');
+        jsonPutHex(jb, uuid + len - 1 - i, 1);
+    }
+}
+
+/**
+ * Fields of decoded frame (see ble_frames.h), appended after the other fields.
+ */
+inline void jsonPutBleFrame(JsonBuf &jb, const BleAdvRecord &rec) {
+    const uint8_t *f = rec.frame;
+    switch (rec.frameType) {
+        case BLE_FRAME_IBEACON:
+            jsonPutKeyValue(jb, "frame", "ibeacon");
+            // proximity UUID is transmitted most significant byte first
+            jsonPutKey(jb, "beaconUUID", false);
+            for (size_t i = 0; i < 16; i++) {
+                if (i == 4 || i == 6 || i == 8 || i == 10) jsonPutChar(jb, '-');
+                jsonPutHex(jb, f + i, 1);
+            }
+            jsonPutChar(jb, '"');
+            jsonPutKeyValueUInt(jb, "major", bleFrameU16(f + 16));
+            jsonPutKeyValueUInt(jb, "minor", bleFrameU16(f + 18));
+            jsonPutKeyValue(jb, "measuredPower", (int32_t)(int8_t)f[20]);
+            break;
+        case BLE_FRAME_EDDYSTONE_UID:
+            jsonPutKeyValue(jb, "frame", "eddystoneUid");
+            jsonPutKeyValue(jb, "measuredPower", (int32_t)(int8_t)f[0]);
+            jsonPutKeyValueHex(jb, "namespace", f + 1, 10);
+            jsonPutKeyValueHex(jb, "instance", f + 11, 6);
+            break;
+        case BLE_FRAME_EDDYSTONE_URL: {
+            jsonPutKeyValue(jb, "frame", "eddystoneUrl");
+            jsonPutKeyValue(jb, "measuredPower", (int32_t)(int8_t)f[0]);
+            // up to 7 chars per encoded byte
+            char url[16 + 7 * BLE_EDDYSTONE_URL_MAX_LEN];
+            if (bleEddystoneUrl(url, sizeof(url), f + 1, rec.frameLen - 1) > 0)
+                jsonPutKeyValue(jb, "url", url);
+            break;
+        }
+        case BLE_FRAME_EDDYSTONE_TLM:
+            jsonPutKeyValue(jb, "frame", "eddystoneTlm");
+            jsonPutKeyValueUInt(jb, "battery", bleFrameU16(f + 1));
+            if (bleFrameU16(f + 3) != 0x8000)
+                // 8.8 fixed point, published in 1/100 degree Celsius
+                jsonPutKeyValue(jb, "temperature", (int32_t)(int16_t)bleFrameU16(f + 3) * 100 / 256);
+            jsonPutKeyValueUInt(jb, "advCount", bleFrameU32(f + 5));
+            jsonPutKeyValueUInt(jb, "secCount", bleFrameU32(f + 9));
+            break;
+        case BLE_FRAME_APPLE:
+            jsonPutKeyValue(jb, "frame", "apple");
+            jsonPutKeyValueUInt(jb, "appleType", f[0]);
+            break;
+        case BLE_FRAME_MICROSOFT:
+            jsonPutKeyValue(jb, "frame", "microsoft");
+            jsonPutKeyValueUInt(jb, "msScenario", f[0]);
+            jsonPutKeyValueUInt(jb, "msDeviceType", f[1] & 0x1f);
+            break;
+        default:
+            break;
+    }
+}
+
+inline size_t jsonFinish(JsonBuf &jb) {
+    if (jb.overflow) {
+        if (jb.size > 0) jb.buf[0] = '\0';
+        return 0;
+    }
+    jb.buf[jb.len] = '\0';
+    return jb.len;
+}
+
+#endif  // BLE_JSON_KD_H
@@ -0,0 +1,108 @@
+/**
+ * Fixed-size, heap-free representation of one BLE advertisement.
+ *
+ * Filled once in the scan callback (see fillBleAdvRecord() in ble.h) and
+ * afterwards handed around by value, so no std::string or BLEUUID objects
+ * are needed on the way to the serializer.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_RECORD_KD_H
+#define BLE_RECORD_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLE_ADDR_LEN 6
+// legacy advertising + scan response carry at most 2x31 bytes
+#define BLE_MAX_PAYLOAD_LEN 62
+#define BLE_MAX_NAME_LEN 31
+#define BLE_MAX_MANUF_DATA_LEN BLE_MAX_PAYLOAD_LEN
+#define BLE_MAX_UUID_LEN 16
+// decoded beacon frame (iBeacon is the largest), see ble_frames.h
+#define BLE_MAX_FRAME_LEN 21
+
+// flags for optional fields
+#define BLE_REC_HAVE_NAME 0x01
+#define BLE_REC_HAVE_APPEARANCE 0x02
+#define BLE_REC_HAVE_MANUF_DATA 0x04
+#define BLE_REC_HAVE_SERVICE_UUID 0x08
+#define BLE_REC_HAVE_TX_POWER 0x10
+#define BLE_REC_HAVE_RSSI 0x20
+#define BLE_REC_HAVE_STATS 0x40  // aggregated over a scan window, rssi holds the mean
+#define BLE_REC_HAVE_FRAME 0x80  // decoded manufacturer/service data frame
+
+// delta records (see ble_delta.h)
+#define BLE_DELTA_RECORD 0x01     // unchanged optional fields are omitted
+#define BLE_DELTA_SAME_META 0x02  // addrType and payloadLength unchanged
+
+struct BleAdvRecord {
+    uint8_t address[BLE_ADDR_LEN];  // as printed, most significant byte first
+    uint8_t addrType;
+    uint8_t flags;  // BLE_REC_HAVE_*
+    int8_t rssi;
+    int8_t txPower;
+    uint16_t appearance;
+    uint16_t payloadLength;
+    uint8_t manufDataLen;
+    uint8_t serviceUUIDLen;  // 2, 4 or 16 bytes
+    uint32_t timestamp;      // epoch seconds
+    uint32_t micros;
+    char name[BLE_MAX_NAME_LEN + 1];  // zero terminated
+    uint8_t manufData[BLE_MAX_MANUF_DATA_LEN];
+    uint8_t serviceUUID[BLE_MAX_UUID_LEN];  // little endian (as esp_bt_uuid_t)
+    // window statistics (with BLE_REC_HAVE_STATS)
+    uint16_t count;  // sightings
+    int8_t rssiMin;
+    int8_t rssiMax;
+    uint32_t firstTimestamp;
+    uint32_t firstMicros;
+    // decoded frame (with BLE_REC_HAVE_FRAME)
+    uint8_t frameType;  // BLE_FRAME_*
+    uint8_t frameLen;
+    uint8_t frame[BLE_MAX_FRAME_LEN];
+    // delta against last record sent for this address (see ble_delta.h)
+    uint8_t delta;    // BLE_DELTA_*, 0 for full records
+    uint8_t removed;  // BLE_REC_HAVE_* of fields not advertised anymore
+};
+
+inline bool bleRecHas(const BleAdvRecord &rec, uint8_t flag) {
+    return (rec.flags & flag) != 0;
+}
+
+/**
+ * Copies name up to first '\0' (same as std::string::c_str() did before) and truncates to BLE_MAX_NAME_LEN.
+ */
+inline void bleRecSetName(BleAdvRecord &rec, const char *name, size_t len) {
+    size_t n = 0;
+    while (n < len && n < BLE_MAX_NAME_LEN && name[n] != '\0') n++;
+    memcpy(rec.name, name, n);
+    rec.name[n] = '\0';
+    rec.flags |= BLE_REC_HAVE_NAME;
+}
+
+inline void bleRecSetManufData(BleAdvRecord &rec, const uint8_t *data, size_t len) {
+    if (len > BLE_MAX_MANUF_DATA_LEN) len = BLE_MAX_MANUF_DATA_LEN;
+    memcpy(rec.manufData, data, len);
+    rec.manufDataLen = (uint8_t)len;
+    rec.flags |= BLE_REC_HAVE_MANUF_DATA;
+}
+
+inline void bleRecSetFrame(BleAdvRecord &rec, uint8_t type, const uint8_t *data, size_t len) {
+    if (len > BLE_MAX_FRAME_LEN) return;
+    rec.frameType = type;
+    memcpy(rec.frame, data, len);
+    rec.frameLen = (uint8_t)len;
+    rec.flags |= BLE_REC_HAVE_FRAME;
+}
+
+inline void bleRecSetServiceUUID(BleAdvRecord &rec, const uint8_t *uuid, size_t len) {
+    if (len != 2 && len != 4 && len != 16) return;
+    memcpy(rec.serviceUUID, uuid, len);
+    rec.serviceUUIDLen = (uint8_t)len;
+    rec.flags |= BLE_REC_HAVE_SERVICE_UUID;
+}
+
+#endif  // BLE_RECORD_KD_H
@@ -0,0 +1,380 @@
+/**
+ * Compile-time record schema: which fields of a BleAdvRecord are serialized to JSON,
+ * in which order and how.
+ *
+ * A schema is a list of field types, e.g.
+ *   BleRecordSchema<BleFieldAddress, BleFieldRssi<BLE_JSON_NUMBER>, BleFieldTimeMs<BLE_JSON_NUMBER>>
+ * writes {"address": "38:2f:a6:xx:xx:xx", "rssi": -60, "ts": 1651042693123}.
+ * Fields not listed produce no code at all. Fields that are always there (address, time)
+ * are written without any check, optional fields check their BLE_REC_HAVE_* flag only.
+ *
+ * Each field knows its worst-case length, so the one of a whole record is known at
+ * compile time (maxJsonLen) and can be checked against buffer sizes with static_assert.
+ * flags holds the BLE_REC_HAVE_* of all fields written, e.g. to skip parsing the others.
+ *
+ * Integer fields take an encoding: BLE_JSON_STRING quotes values as the serializer always
+ * did ("rssi": "-60"), BLE_JSON_NUMBER writes JSON numbers ("rssi": -60).
+ * BleLegacySchema is the record as published before (all fields, quoted values).
+ *
+ * Written for C++11 (as the Arduino core builds), so recursion instead of fold expressions.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_SCHEMA_KD_H
+#define BLE_SCHEMA_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <type_traits>
+
+#include "ble_frames.h"
+#include "ble_json.h"
+#include "ble_record.h"
+
+enum BleJsonEnc : uint8_t {
+    BLE_JSON_STRING,  // "rssi": "-60"
+    BLE_JSON_NUMBER   // "rssi": -60
+};
+
+// max. chars of printed integers
+#define BLE_JSON_INT8_LEN 4
+#define BLE_JSON_UINT8_LEN 3
+#define BLE_JSON_UINT16_LEN 5
+#define BLE_JSON_INT32_LEN 11
+#define BLE_JSON_UINT32_LEN 10
+
+constexpr size_t bleSchemaStrLen(const char *s) {
+    return *s == '\0' ? 0 : 1 + bleSchemaStrLen(s + 1);
+}
+
+/**
+ * Length of ', "key": "value"' (or ', "key": value') with value of valueLen chars.
+ */
+constexpr size_t bleSchemaFieldLen(const char *key, size_t valueLen, BleJsonEnc enc = BLE_JSON_STRING) {
+    return 2 + 1 + bleSchemaStrLen(key) + 3 + (enc == BLE_JSON_STRING ? 2 : 0) + valueLen;
+}
+
+constexpr size_t bleSchemaMax(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+template <BleJsonEnc E>
+inline void jsonPutKeyInt(JsonBuf &jb, const char *key, int32_t value, bool first) {
+    if (E == BLE_JSON_STRING) {
+        jsonPutKeyValue(jb, key, value, first);
+        return;
+    }
+    if (!first) jsonPut(jb, ", ", 2);
+    jsonPutChar(jb, '"');
+    jsonPut(jb, key);
+    jsonPut(jb, "\": ", 3);
+    jsonPutInt(jb, value);
+}
+
+/*
+ * Fields. Each one provides:
+ *   optional    - false if written for every record (may be the first field then)
+ *   flags       - BLE_REC_HAVE_* needed
+ *   maxJsonLen  - worst case including leading ", "
+ *   present()   - whether rec has the field
+ *   put<First>()
+ */
+
+struct BleFieldAddress {
+    static constexpr bool optional = false;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("address", 3 * BLE_ADDR_LEN - 1);
+    static bool present(const BleAdvRecord &) { return true; }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKey(jb, "address", First);
+        jsonPutAddress(jb, rec.address);
+        jsonPutChar(jb, '"');
+    }
+};
+
+// delta record (see ble_delta.h), value: fields removed (BLE_REC_HAVE_*)
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldDelta {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("delta", BLE_JSON_UINT8_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return rec.delta != 0; }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "delta", rec.removed, First);
+    }
+};
+
+struct BleFieldName {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_NAME;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("name", BLE_MAX_NAME_LEN);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyValue(jb, "name", rec.name, First);
+    }
+};
+
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldAppearance {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_APPEARANCE;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("appearance", BLE_JSON_UINT16_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "appearance", rec.appearance, First);
+    }
+};
+
+// lowercase hex
+struct BleFieldManufData {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_MANUF_DATA;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("manufData", 2 * BLE_MAX_MANUF_DATA_LEN);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKey(jb, "manufData", First);
+        jsonPutHex(jb, rec.manufData, rec.manufDataLen);
+        jsonPutChar(jb, '"');
+    }
+};
+
+// 128 bit notation
+struct BleFieldServiceUUID {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_SERVICE_UUID;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("serviceUUID", 36);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKey(jb, "serviceUUID", First);
+        jsonPutUUID(jb, rec.serviceUUID, rec.serviceUUIDLen);
+        jsonPutChar(jb, '"');
+    }
+};
+
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldTxPower {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_TX_POWER;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("txPower", BLE_JSON_INT8_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "txPower", rec.txPower, First);
+    }
+};
+
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldRssi {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_RSSI;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("rssi", BLE_JSON_INT8_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "rssi", rec.rssi, First);
+    }
+};
+
+// payloadLength and addrType, omitted by delta records if unchanged
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldMeta {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen =
+        bleSchemaFieldLen("payloadLength", BLE_JSON_UINT16_LEN, E) + bleSchemaFieldLen("addrType", BLE_JSON_UINT8_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return !(rec.delta & BLE_DELTA_SAME_META); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "payloadLength", rec.payloadLength, First);
+        jsonPutKeyInt<E>(jb, "addrType", rec.addrType, false);
+    }
+};
+
+// epoch seconds and micros as separate fields
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldTime {
+    static constexpr bool optional = false;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen =
+        bleSchemaFieldLen("timestamp", BLE_JSON_INT32_LEN, E) + bleSchemaFieldLen("micros", BLE_JSON_INT32_LEN, E);
+    static bool present(const BleAdvRecord &) { return true; }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "timestamp", (int32_t)rec.timestamp, First);
+        jsonPutKeyInt<E>(jb, "micros", (int32_t)rec.micros, false);
+    }
+};
+
+// epoch milliseconds as one field "ts"
+template <BleJsonEnc E = BLE_JSON_NUMBER>
+struct BleFieldTimeMs {
+    static constexpr bool optional = false;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen = bleSchemaFieldLen("ts", BLE_JSON_UINT32_LEN + 3, E);
+    static bool present(const BleAdvRecord &) { return true; }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        if (!First) jsonPut(jb, ", ", 2);
+        jsonPut(jb, E == BLE_JSON_STRING ? "\"ts\": \"" : "\"ts\": ");
+        uint32_t ms = rec.micros / 1000;
+        if (rec.timestamp == 0) {
+            jsonPutUInt(jb, ms);
+        } else {
+            // seconds followed by three digits, no 64 bit division
+            jsonPutUInt(jb, rec.timestamp);
+            char digits[3] = {(char)('0' + ms / 100), (char)('0' + ms / 10 % 10), (char)('0' + ms % 10)};
+            jsonPut(jb, digits, 3);
+        }
+        if (E == BLE_JSON_STRING) jsonPutChar(jb, '"');
+    }
+};
+
+// window statistics (see AGGREGATE_WINDOW)
+template <BleJsonEnc E = BLE_JSON_STRING>
+struct BleFieldStats {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_STATS;
+    static constexpr size_t maxJsonLen =
+        bleSchemaFieldLen("count", BLE_JSON_UINT16_LEN, E) + bleSchemaFieldLen("rssiMin", BLE_JSON_INT8_LEN, E) +
+        bleSchemaFieldLen("rssiMax", BLE_JSON_INT8_LEN, E) + bleSchemaFieldLen("firstTimestamp", BLE_JSON_INT32_LEN, E) +
+        bleSchemaFieldLen("firstMicros", BLE_JSON_INT32_LEN, E);
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutKeyInt<E>(jb, "count", rec.count, First);
+        jsonPutKeyInt<E>(jb, "rssiMin", rec.rssiMin, false);
+        jsonPutKeyInt<E>(jb, "rssiMax", rec.rssiMax, false);
+        jsonPutKeyInt<E>(jb, "firstTimestamp", (int32_t)rec.firstTimestamp, false);
+        jsonPutKeyInt<E>(jb, "firstMicros", (int32_t)rec.firstMicros, false);
+    }
+};
+
+// decoded frame (see DECODE_FRAMES), fields as of jsonPutBleFrame()
+struct BleFieldFrame {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = BLE_REC_HAVE_FRAME;
+    static constexpr size_t IBEACON_LEN = bleSchemaFieldLen("frame", 7) + bleSchemaFieldLen("beaconUUID", 36) +
+                                          bleSchemaFieldLen("major", BLE_JSON_UINT16_LEN) + bleSchemaFieldLen("minor", BLE_JSON_UINT16_LEN) +
+                                          bleSchemaFieldLen("measuredPower", BLE_JSON_INT8_LEN);
+    static constexpr size_t EDDYSTONE_UID_LEN = bleSchemaFieldLen("frame", 12) + bleSchemaFieldLen("measuredPower", BLE_JSON_INT8_LEN) +
+                                                bleSchemaFieldLen("namespace", 20) + bleSchemaFieldLen("instance", 12);
+    // up to 7 chars per encoded byte, as buffer in jsonPutBleFrame()
+    static constexpr size_t EDDYSTONE_URL_LEN = bleSchemaFieldLen("frame", 12) + bleSchemaFieldLen("measuredPower", BLE_JSON_INT8_LEN) +
+                                                bleSchemaFieldLen("url", 15 + 7 * BLE_EDDYSTONE_URL_MAX_LEN);
+    static constexpr size_t EDDYSTONE_TLM_LEN = bleSchemaFieldLen("frame", 12) + bleSchemaFieldLen("battery", BLE_JSON_UINT16_LEN) +
+                                                bleSchemaFieldLen("temperature", 6) + bleSchemaFieldLen("advCount", BLE_JSON_UINT32_LEN) +
+                                                bleSchemaFieldLen("secCount", BLE_JSON_UINT32_LEN);
+    static constexpr size_t APPLE_LEN = bleSchemaFieldLen("frame", 5) + bleSchemaFieldLen("appleType", BLE_JSON_UINT8_LEN);
+    static constexpr size_t MICROSOFT_LEN = bleSchemaFieldLen("frame", 9) + bleSchemaFieldLen("msScenario", BLE_JSON_UINT8_LEN) +
+                                            bleSchemaFieldLen("msDeviceType", BLE_JSON_UINT8_LEN);
+    static constexpr size_t maxJsonLen = bleSchemaMax(
+        bleSchemaMax(bleSchemaMax(IBEACON_LEN, EDDYSTONE_UID_LEN), bleSchemaMax(EDDYSTONE_URL_LEN, EDDYSTONE_TLM_LEN)),
+        bleSchemaMax(APPLE_LEN, MICROSOFT_LEN));
+    static bool present(const BleAdvRecord &rec) { return bleRecHas(rec, flags); }
+    template <bool First>
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        static_assert(!First, "BleFieldFrame cannot be the first field");
+        jsonPutBleFrame(jb, rec);
+    }
+};
+
+// placeholder for a field left out (see BleFieldIf), writes nothing
+struct BleFieldNone {
+    static constexpr bool optional = true;
+    static constexpr uint8_t flags = 0;
+    static constexpr size_t maxJsonLen = 0;
+};
+
+// Field if Enabled, none otherwise. E.g. BleFieldIf<HAVE_STATS, BleFieldStats<>>
+template <bool Enabled, typename Field>
+using BleFieldIf = typename std::conditional<Enabled, Field, BleFieldNone>::type;
+
+/**
+ * Fields after the first one, each preceded by ", ".
+ */
+template <typename... Fields>
+struct BleFieldList {
+    static constexpr size_t maxJsonLen = 0;
+    static constexpr uint8_t flags = 0;
+    static void put(JsonBuf &, const BleAdvRecord &) {}
+};
+
+template <typename Field, typename... Rest>
+struct BleFieldList<Field, Rest...> {
+    static constexpr size_t maxJsonLen = Field::maxJsonLen + BleFieldList<Rest...>::maxJsonLen;
+    static constexpr uint8_t flags = Field::flags | BleFieldList<Rest...>::flags;
+    static void put(JsonBuf &jb, const BleAdvRecord &rec) {
+        // constant true for fields always present, so no check is left
+        if (!Field::optional || Field::present(rec)) Field::template put<false>(jb, rec);
+        BleFieldList<Rest...>::put(jb, rec);
+    }
+};
+
+template <typename... Rest>
+struct BleFieldList<BleFieldNone, Rest...> : BleFieldList<Rest...> {};
+
+template <typename First, typename... Rest>
+struct BleRecordSchema {
+    static_assert(!First::optional, "First field of a schema has to be present in every record (e.g. BleFieldAddress)");
+
+    // worst case of one record, without '\0'
+    static constexpr size_t maxJsonLen = 2 + (First::maxJsonLen - 2) + BleFieldList<Rest...>::maxJsonLen;
+    // BLE_REC_HAVE_* written
+    static constexpr uint8_t flags = First::flags | BleFieldList<Rest...>::flags;
+
+    /**
+     * Appends rec as JSON object.
+     */
+    static void putJson(JsonBuf &jb, const BleAdvRecord &rec) {
+        jsonPutChar(jb, '{');
+        First::template put<true>(jb, rec);
+        BleFieldList<Rest...>::put(jb, rec);
+        jsonPutChar(jb, '}');
+    }
+
+    /**
+     * Serializes rec into buf (zero terminated).
+     * Returns length without '\0' or 0 if buf was too small.
+     */
+    static size_t serialize(char *buf, size_t size, const BleAdvRecord &rec) {
+        JsonBuf jb;
+        jsonInit(jb, buf, size);
+        putJson(jb, rec);
+        return jsonFinish(jb);
+    }
+};
+
+/**
+ * Record as always published. Field order has to stay the same, since consumers may rely on it.
+ * Fields that cannot be set in a configuration may be left out.
+ */
+template <bool Delta = true, bool Stats = true, bool Frame = true>
+using BleLegacySchema =
+    BleRecordSchema<BleFieldAddress, BleFieldIf<Delta, BleFieldDelta<>>, BleFieldName, BleFieldAppearance<>, BleFieldManufData,
+                    BleFieldServiceUUID, BleFieldTxPower<>, BleFieldRssi<>, BleFieldMeta<>, BleFieldTime<>,
+                    BleFieldIf<Stats, BleFieldStats<>>, BleFieldIf<Frame, BleFieldFrame>>;
+
+/**
+ * Appends fields of rec as JSON object (all fields of BleLegacySchema).
+ */
+inline void jsonPutBleAdvRecord(JsonBuf &jb, const BleAdvRecord &rec) {
+    BleLegacySchema<>::putJson(jb, rec);
+}
+
+/**
+ * Serializes rec into buf (zero terminated).
+ * Returns length without '\0' or 0 if buf was too small.
+ */
+inline size_t serializeBleAdvRecord(char *buf, size_t size, const BleAdvRecord &rec) {
+    return BleLegacySchema<>::serialize(buf, size, rec);
+}
+
+#endif  // BLE_SCHEMA_KD_H
@@ -0,0 +1,72 @@
+/**
+ * Fixed-size set of addresses seen within the current window.
+ *
+ * Replaces the results map of BLEScan for duplicate filtering in continuous scan mode.
+ * Entries are tagged with the window they were seen in, so starting a new window
+ * needs no clearing. Tags are 32 bit, so they do not repeat within the lifetime of a logger
+ * (bleSeenWindow() of 10 s windows wraps after 1361 years). If all slots in reach are taken by the current window, the address
+ * is treated as seen and counted as overflow: it is not reported in this window, but it
+ * does not flood the queue by being reported on each of its sightings either.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_SEEN_SET_KD_H
+#define BLE_SEEN_SET_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_aggregate.h"
+#include "ble_record.h"
+
+/**
+ * Tag of the window timeUs is in, windows of windowUs start at 0. Never 0 (unused entries).
+ */
+inline uint32_t bleSeenWindow(int64_t timeUs, int64_t windowUs) {
+    return (uint32_t)(timeUs / windowUs) + 1;
+}
+
+template <size_t N, size_t MaxProbe = 16>
+class BleSeenSet {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "BleSeenSet size needs to be a power of two");
+    static_assert(MaxProbe > 0 && MaxProbe <= N, "MaxProbe needs to be within 1..N");
+
+    struct Entry {
+        uint8_t address[BLE_ADDR_LEN];
+        uint32_t window;  // 0 = unused
+    };
+
+   public:
+    /**
+     * Returns true if address was not seen in window before (and remembers it),
+     * false if it was or the set is full around its slot. window must not be 0.
+     */
+    bool markSeen(const uint8_t *address, uint32_t window) {
+        uint32_t home = bleAddrHash(address) & (N - 1);
+        for (size_t i = 0; i < MaxProbe; i++) {
+            Entry &e = entries[(home + i) & (N - 1)];
+            if (e.window != window) {
+                // free or stale slot, probing of entries of current window is not affected
+                // since they were inserted into the first free/stale slot as well
+                memcpy(e.address, address, BLE_ADDR_LEN);
+                e.window = window;
+                return true;
+            }
+            if (memcmp(e.address, address, BLE_ADDR_LEN) == 0)
+                return false;
+        }
+        overflows++;
+        return false;
+    }
+
+    // sightings of addresses that did not fit (not reported)
+    uint32_t overflowCount() const { return overflows; }
+
+   private:
+    Entry entries[N] = {};
+    uint32_t overflows = 0;
+};
+
+#endif  // BLE_SEEN_SET_KD_H
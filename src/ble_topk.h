@@ -0,0 +1,229 @@
+/**
+ * Most frequent company IDs, service UUIDs and name prefixes of a window (TOP_K), by Space-Saving
+ * (Metwally et al., "Efficient computation of frequent and top-k elements in data streams", 2005).
+ *
+ * N counters per kind (about N * (key length + 12) bytes), so memory is the same for any crowd.
+ * A key without counter takes the one with the smallest count c, starting at c + 1 with error c.
+ * So a count is never below the true count and at most error above it, and any key with a true
+ * count above total / N has a counter.
+ * Each step compares the key with all N counters, fine for N in the tens at a few hundred
+ * devices per second.
+ *
+ * Names are cut to the prefix length, quotes, backslashes and control characters become '?'.
+ *
+ * JSON message (admin topic), k most frequent per kind:
+ *   {"topK": {"start": 1651042690, "seconds": 60,
+ *    "company": {"total": 812, "bound": 3, "top": [{"key": 76, "count": 420, "error": 0}, ...]},
+ *    "uuid": {... "key": "0000fe9f-0000-1000-8000-00805f9b34fb" ...}, "name": {... "key": "Galaxy W" ...}}}
+ * total: devices counted (with the kind), bound: max. true count of any key not in top.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BLE_TOPK_KD_H
+#define BLE_TOPK_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ble_adv_parser.h"
+#include "ble_json.h"
+#include "ble_record.h"
+
+template <size_t N, size_t KeyLen>
+class BleSpaceSaving {
+    static_assert(N > 0 && N <= 255, "BleSpaceSaving needs 1..255 counters");
+    static_assert(KeyLen > 0 && KeyLen <= 255, "BleSpaceSaving keys need to be 1..255 bytes");
+
+   public:
+    struct Entry {
+        uint32_t count;
+        uint32_t error;  // count - error <= true count <= count
+        uint8_t keyLen;
+        uint8_t key[KeyLen];
+    };
+
+    void clear() {
+        used = 0;
+        totalCount = 0;
+        evictions = 0;
+    }
+
+    /**
+     * Counts key (cut to KeyLen bytes).
+     */
+    void add(const uint8_t *key, size_t len) {
+        if (len > KeyLen) len = KeyLen;
+        totalCount++;
+        size_t min = 0;
+        for (size_t i = 0; i < used; i++) {
+            Entry &e = entries[i];
+            if (e.keyLen == len && memcmp(e.key, key, len) == 0) {
+                e.count++;
+                return;
+            }
+            if (e.count < entries[min].count) min = i;
+        }
+        Entry *e;
+        if (used < N) {
+            e = &entries[used++];
+            e->count = 1;
+            e->error = 0;
+        } else {
+            // take over counter with the smallest count
+            e = &entries[min];
+            e->error = e->count;
+            e->count++;
+            evictions++;
+        }
+        e->keyLen = (uint8_t)len;
+        memcpy(e->key, key, len);
+    }
+
+    /**
+     * Sorts counters by count, most frequent first.
+     */
+    void sort() {
+        // insertion sort, mostly sorted already for skewed crowds
+        for (size_t i = 1; i < used; i++) {
+            Entry e = entries[i];
+            size_t j = i;
+            for (; j > 0 && entries[j - 1].count < e.count; j--) entries[j] = entries[j - 1];
+            entries[j] = e;
+        }
+    }
+
+    /**
+     * Max. true count of any key not within the first k counters (after sort()).
+     */
+    uint32_t bound(size_t k) const {
+        if (k < used) return entries[k].count;
+        // untracked keys were counted at most as often as the smallest counter
+        return evictions > 0 && used > 0 ? entries[used - 1].count : 0;
+    }
+
+    size_t size() const { return used; }
+    const Entry &entry(size_t i) const { return entries[i]; }
+    uint32_t total() const { return totalCount; }
+    uint32_t evictedCount() const { return evictions; }
+
+   private:
+    Entry entries[N];
+    size_t used = 0;
+    uint32_t totalCount = 0;
+    uint32_t evictions = 0;
+};
+
+template <size_t N, size_t NamePrefixLen>
+class BleTopK {
+   public:
+    void clear() {
+        company.clear();
+        uuid.clear();
+        name.clear();
+    }
+
+    /**
+     * Counts one device, companyId < 0 and nullptr mark missing fields.
+     */
+    void add(int32_t companyId, const uint8_t *serviceUUID, size_t uuidLen, const char *deviceName, size_t nameLen) {
+        if (companyId >= 0) {
+            uint8_t key[2] = {(uint8_t)(companyId >> 8), (uint8_t)companyId};
+            company.add(key, sizeof(key));
+        }
+        if (serviceUUID != nullptr && (uuidLen == 2 || uuidLen == 4 || uuidLen == 16)) uuid.add(serviceUUID, uuidLen);
+        if (deviceName != nullptr && nameLen > 0) {
+            uint8_t key[NamePrefixLen];
+            size_t n = nameLen < NamePrefixLen ? nameLen : NamePrefixLen;
+            // don't cut within an UTF-8 sequence
+            if (n < nameLen)
+                while (n > 0 && ((uint8_t)deviceName[n] & 0xc0) == 0x80) n--;
+            for (size_t i = 0; i < n; i++) {
+                char c = deviceName[i];
+                key[i] = (uint8_t)(c == '"' || c == '\\' || (uint8_t)c < 0x20 || c == 0x7f ? '?' : c);
+            }
+            if (n > 0) name.add(key, n);
+        }
+    }
+
+    void add(const BleAdView &view) {
+        size_t uuidLen, nameLen;
+        const uint8_t *u = view.serviceUUID(uuidLen);
+        const char *n = view.name(nameLen);
+        add(view.companyId(), u, uuidLen, n, nameLen);
+    }
+
+    void add(const BleAdvRecord &rec) {
+        int32_t companyId = bleRecHas(rec, BLE_REC_HAVE_MANUF_DATA) && rec.manufDataLen >= 2 ? rec.manufData[0] | rec.manufData[1] << 8 : -1;
+        bool haveName = bleRecHas(rec, BLE_REC_HAVE_NAME);
+        add(companyId, bleRecHas(rec, BLE_REC_HAVE_SERVICE_UUID) ? rec.serviceUUID : nullptr, rec.serviceUUIDLen,
+            haveName ? rec.name : nullptr, haveName ? strlen(rec.name) : 0);
+    }
+
+    /**
+     * JSON message of the k most frequent keys per kind over [start, start + seconds), sorts counters.
+     * Returns length (without '\0') or 0 if buf was too small.
+     */
+    size_t serializeJson(char *buf, size_t size, uint32_t start, uint32_t seconds, size_t k) {
+        JsonBuf jb;
+        jsonInit(jb, buf, size);
+        jsonPut(jb, "{\"topK\": {\"start\": ");
+        jsonPutUInt(jb, start);
+        jsonPut(jb, ", \"seconds\": ");
+        jsonPutUInt(jb, seconds);
+        putKind(jb, "company", company, k, KEY_COMPANY);
+        putKind(jb, "uuid", uuid, k, KEY_UUID);
+        putKind(jb, "name", name, k, KEY_NAME);
+        jsonPut(jb, "}}");
+        return jsonFinish(jb);
+    }
+
+    // max. JSON length of serializeJson(), UUID keys are the longest
+    static constexpr size_t maxJsonLen(size_t k) {
+        return 64 + 3 * (96 + k * (64 + 36));
+    }
+
+    BleSpaceSaving<N, 2> company;  // big endian
+    BleSpaceSaving<N, 16> uuid;    // little endian (as esp_bt_uuid_t)
+    BleSpaceSaving<N, NamePrefixLen> name;
+
+   private:
+    static_assert(NamePrefixLen <= 36, "Name prefix needs to be within UUID length for maxJsonLen()");
+
+    enum KeyFormat { KEY_COMPANY, KEY_UUID, KEY_NAME };
+
+    template <typename Counters>
+    static void putKind(JsonBuf &jb, const char *kind, Counters &c, size_t k, KeyFormat format) {
+        c.sort();
+        jsonPut(jb, ", \"");
+        jsonPut(jb, kind);
+        jsonPut(jb, "\": {\"total\": ");
+        jsonPutUInt(jb, c.total());
+        jsonPut(jb, ", \"bound\": ");
+        jsonPutUInt(jb, c.bound(k));
+        jsonPut(jb, ", \"top\": [");
+        for (size_t i = 0; i < k && i < c.size(); i++) {
+            const typename Counters::Entry &e = c.entry(i);
+            jsonPut(jb, i == 0 ? "{\"key\": " : ", {\"key\": ");
+            if (format == KEY_COMPANY) {
+                jsonPutUInt(jb, (uint32_t)e.key[0] << 8 | e.key[1]);
+            } else {
+                jsonPutChar(jb, '"');
+                if (format == KEY_UUID)
+                    jsonPutUUID(jb, e.key, e.keyLen);
+                else
+                    jsonPut(jb, (const char *)e.key, e.keyLen);
+                jsonPutChar(jb, '"');
+            }
+            jsonPut(jb, ", \"count\": ");
+            jsonPutUInt(jb, e.count);
+            jsonPut(jb, ", \"error\": ");
+            jsonPutUInt(jb, e.error);
+            jsonPutChar(jb, '}');
+        }
+        jsonPut(jb, "]}");
+    }
+};
+
+#endif  // BLE_TOPK_KD_H
@@ -0,0 +1,91 @@
+/**
+ * Holds records captured before wall-clock time is known (see FAST_BOOT).
+ *
+ * Until NTP synced, records are stamped with monotonic time since boot (esp_timer) instead of
+ * epoch time. Such stamps are told apart by their value: anything below BOOT_STAMP_EPOCH_MIN
+ * (September 2001) cannot be a synced epoch time. Once the offset between both clocks is known,
+ * drain() re-stamps the records (and the first sighting of aggregated ones) and hands them
+ * on in capture order. Records arriving while the buffer is full are dropped and counted.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BOOT_BUFFER_KD_H
+#define BOOT_BUFFER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ble_record.h"
+
+#define BOOT_STAMP_EPOCH_MIN 1000000000UL
+
+inline bool bootStampIsMonotonic(uint32_t seconds) {
+    return seconds < BOOT_STAMP_EPOCH_MIN;
+}
+
+/**
+ * Adds offsetUs (wall-clock minus monotonic time) to a monotonic stamp, others are kept.
+ */
+inline void bootRestamp(uint32_t &seconds, uint32_t &micros, int64_t offsetUs) {
+    if (!bootStampIsMonotonic(seconds)) return;
+    int64_t us = (int64_t)seconds * 1000000 + micros + offsetUs;
+    if (us < 0) us = 0;
+    seconds = (uint32_t)(us / 1000000);
+    micros = (uint32_t)(us % 1000000);
+}
+
+inline void bleRecRestamp(BleAdvRecord &rec, int64_t offsetUs) {
+    bootRestamp(rec.timestamp, rec.micros, offsetUs);
+    if (bleRecHas(rec, BLE_REC_HAVE_STATS)) bootRestamp(rec.firstTimestamp, rec.firstMicros, offsetUs);
+}
+
+inline bool bleRecIsMonotonic(const BleAdvRecord &rec) {
+    return bootStampIsMonotonic(rec.timestamp) ||
+           (bleRecHas(rec, BLE_REC_HAVE_STATS) && bootStampIsMonotonic(rec.firstTimestamp));
+}
+
+template <size_t N>
+class BootBuffer {
+    static_assert(N > 0, "BootBuffer needs room for records");
+
+   public:
+    /**
+     * Returns false if full (record is dropped).
+     */
+    bool push(const BleAdvRecord &rec) {
+        if (count >= N) {
+            dropped++;
+            return false;
+        }
+        records[count++] = rec;
+        return true;
+    }
+
+    /**
+     * Re-stamps all records and hands them to emit(const BleAdvRecord &) in capture order.
+     * Returns number of records emitted, buffer is empty afterwards.
+     */
+    template <typename F>
+    size_t drain(int64_t offsetUs, F emit) {
+        size_t n = count;
+        for (size_t i = 0; i < n; i++) {
+            bleRecRestamp(records[i], offsetUs);
+            emit(records[i]);
+        }
+        count = 0;
+        return n;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    static constexpr size_t capacity() { return N; }
+    uint32_t droppedCount() const { return dropped; }
+
+   private:
+    BleAdvRecord records[N];
+    size_t count = 0;
+    uint32_t dropped = 0;
+};
+
+#endif  // BOOT_BUFFER_KD_H
@@ -0,0 +1,97 @@
+/**
+ * Start and end time (millis()) of the boot phases and time to the first published sample.
+ *
+ * With FAST_BOOT the phases overlap: BLE scanning starts first, WiFi, MQTT and NTP
+ * come up meanwhile. Phases are ended from different tasks (e.g. NTP by the SNTP callback,
+ * first sample by the publisher task), so all values are atomics.
+ * Only the first end of a phase counts, e.g. later NTP resyncs are ignored.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef BOOT_TIMELINE_KD_H
+#define BOOT_TIMELINE_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+enum BootPhase : uint8_t {
+    BOOT_BLE,   // BLE stack up and scan started
+    BOOT_WIFI,  // associated and got IP
+    BOOT_MQTT,  // connected to broker
+    BOOT_NTP,   // wall-clock time synced
+    BOOT_PHASE_COUNT
+};
+
+static const char *const BOOT_PHASE_NAMES[BOOT_PHASE_COUNT] = {"ble", "wifi", "mqtt", "ntp"};
+
+class BootTimeline {
+   public:
+    void begin(BootPhase phase, uint32_t nowMs) {
+        if (started(phase)) return;
+        beginMs[phase] = nowMs;
+        startedMask.fetch_or(1 << phase);
+    }
+
+    void end(BootPhase phase, uint32_t nowMs) {
+        if (done(phase)) return;
+        if (!started(phase)) begin(phase, nowMs);
+        endMs[phase] = nowMs;
+        doneMask.fetch_or(1 << phase);
+    }
+
+    bool started(BootPhase phase) const { return (startedMask.load() & (1 << phase)) != 0; }
+    bool done(BootPhase phase) const { return (doneMask.load() & (1 << phase)) != 0; }
+    bool allDone() const { return doneMask.load() == (1 << BOOT_PHASE_COUNT) - 1; }
+
+    uint32_t beginTimeMs(BootPhase phase) const { return beginMs[phase]; }
+    uint32_t endTimeMs(BootPhase phase) const { return endMs[phase]; }
+    uint32_t durationMs(BootPhase phase) const { return endMs[phase] - beginMs[phase]; }
+
+    /**
+     * Remembers the first call only. nowMs must not be 0.
+     */
+    void sample(uint32_t nowMs) {
+        if (firstSample.load(std::memory_order_relaxed) != 0) return;
+        uint32_t none = 0;
+        firstSample.compare_exchange_strong(none, nowMs);
+    }
+
+    // 0 if no sample was published yet
+    uint32_t firstSampleMs() const { return firstSample.load(); }
+
+    /**
+     * Writes e.g. "ble 412 ms (at 105), wifi 2298 ms (at 517), mqtt pending (at 2815), ntp 1230 ms (at 2815)".
+     * Returns length written (without '\0'), 0 if it did not fit.
+     */
+    size_t format(char *buf, size_t size) const {
+        size_t len = 0;
+        for (uint8_t p = 0; p < BOOT_PHASE_COUNT; p++) {
+            BootPhase phase = (BootPhase)p;
+            const char *sep = p > 0 ? ", " : "";
+            int n;
+            if (!started(phase))
+                n = snprintf(buf + len, size - len, "%s%s not started", sep, BOOT_PHASE_NAMES[p]);
+            else if (!done(phase))
+                n = snprintf(buf + len, size - len, "%s%s pending (at %u)", sep, BOOT_PHASE_NAMES[p], (unsigned)beginMs[phase]);
+            else
+                n = snprintf(buf + len, size - len, "%s%s %u ms (at %u)", sep, BOOT_PHASE_NAMES[p], (unsigned)durationMs(phase),
+                             (unsigned)beginMs[phase]);
+            if (n < 0 || (size_t)n >= size - len) return 0;
+            len += n;
+        }
+        return len;
+    }
+
+   private:
+    std::atomic<uint32_t> beginMs[BOOT_PHASE_COUNT] = {};
+    std::atomic<uint32_t> endMs[BOOT_PHASE_COUNT] = {};
+    std::atomic<uint8_t> startedMask{0};
+    std::atomic<uint8_t> doneMask{0};
+    std::atomic<uint32_t> firstSample{0};
+};
+
+#endif  // BOOT_TIMELINE_KD_H
@@ -0,0 +1,89 @@
+/**
+ * Client wrapper between PubSubClient and WiFiClientSecure, which gathers outgoing
+ * MQTT packets into fewer TLS records (see write_coalescer.h).
+ *
+ * Reading is passed through. available() is polled by PubSubClient while waiting for
+ * CONNACK or PINGRESP and in each loop(), so it passes pending bytes on once they are due.
+ * Hence a request waits at most maxDelayMs for being sent.
+ *
+ * Note: a publish counts as sent once it is buffered. If the TLS write fails later,
+ * the connection is stopped, so PubSubClient reconnects, but those messages are lost.
+ * */
+
+#ifndef BUFFERED_CLIENT_KD_H
+#define BUFFERED_CLIENT_KD_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#include "write_coalescer.h"
+
+template <size_t Size>
+class BufferedClient : public Client {
+   public:
+    BufferedClient(Client &inner, uint32_t maxDelayMs) : inner(inner), coalescer(maxDelayMs) {}
+
+    int connect(IPAddress ip, uint16_t port) override {
+        coalescer.clear();
+        return inner.connect(ip, port);
+    }
+    int connect(const char *host, uint16_t port) override {
+        coalescer.clear();
+        return inner.connect(host, port);
+    }
+
+    size_t write(uint8_t b) override {
+        return write(&b, 1);
+    }
+    size_t write(const uint8_t *buf, size_t size) override {
+        size_t n = coalescer.write(inner, buf, size, millis());
+        if (n == 0 && size > 0) failed();
+        return n;
+    }
+
+    int available() override {
+        poll();
+        return inner.available();
+    }
+    int read() override { return inner.read(); }
+    int read(uint8_t *buf, size_t size) override { return inner.read(buf, size); }
+    int peek() override { return inner.peek(); }
+
+    /**
+     * Passes all pending bytes on, e.g. at the end of a scan window.
+     * Not forwarded, since WiFiClient::flush() discards received bytes instead.
+     */
+    void flush() override {
+        if (!coalescer.flush(inner)) failed();
+    }
+
+    void stop() override {
+        // e.g. DISCONNECT of PubSubClient
+        coalescer.flush(inner);
+        inner.stop();
+    }
+
+    uint8_t connected() override { return inner.connected(); }
+    operator bool() override { return (bool)inner; }
+
+    /**
+     * Passes pending bytes on if they waited maxDelayMs.
+     */
+    void poll() {
+        if (coalescer.due(millis())) flush();
+    }
+
+    const WriteCoalescer<Size> &stats() const { return coalescer; }
+
+   private:
+    void failed() {
+        Serial.println("- ERR: Buffered write failed, stop connection.");
+        coalescer.clear();
+        inner.stop();
+    }
+
+    Client &inner;
+    WriteCoalescer<Size> coalescer;
+};
+
+#endif  // BUFFERED_CLIENT_KD_H
@@ -0,0 +1,118 @@
+/**
+ * Capture of raw advertisements for replay on a host (see ble_capture.h and host_tools/).
+ *
+ * CAPTURE_SERIAL prints each advertisement as line "CAP <hex>" (first line holds the file header).
+ * Note: at 115200 baud this is limited to roughly 150 advertisements per second.
+ *
+ * CAPTURE_FLASH appends advertisements to a ring log in the data partition (instead of STORE_AND_FORWARD).
+ * On boot, the captures of previous runs are printed as "CAP" lines before capturing goes on.
+ *
+ * Requires CONTINUOUS_SCAN, since only the GAP event holds the raw data.
+ * */
+
+#ifndef CAPTURE_KD_H
+#define CAPTURE_KD_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#include "ble_capture.h"
+#include "globals_kd.h"
+
+// forward declaration from get_time
+bool timeSynced();
+int64_t getClockOffsetUs();
+
+#if (defined CAPTURE_SERIAL || defined CAPTURE_FLASH) && !defined CONTINUOUS_SCAN
+#error "CAPTURE_SERIAL and CAPTURE_FLASH require CONTINUOUS_SCAN"
+#endif
+
+#if defined CAPTURE_FLASH && defined STORE_AND_FORWARD
+#error "CAPTURE_FLASH and STORE_AND_FORWARD share the data partition"
+#endif
+
+#if defined CAPTURE_SERIAL || defined CAPTURE_FLASH
+static uint64_t capturePrevUs = 0;
+
+void printCaptureLine(const uint8_t *data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char line[4 + 2 * BLE_CAPTURE_MAX_RECORD_LEN + 2];
+    size_t n = 0;
+    memcpy(line, "CAP ", 4);
+    n = 4;
+    for (size_t i = 0; i < len; i++) {
+        line[n++] = hex[data[i] >> 4];
+        line[n++] = hex[data[i] & 0x0f];
+    }
+    line[n++] = '\n';
+    Serial.write((const uint8_t *)line, n);
+}
+
+void printCaptureHeader() {
+    // epoch of monotonic time 0, unknown as long as time is not synced
+    uint64_t startEpochUs = timeSynced() ? getClockOffsetUs() : 0;
+    uint8_t header[BLE_CAPTURE_HEADER_LEN];
+    captureEncodeHeader(header, startEpochUs);
+    printCaptureLine(header, sizeof(header));
+    capturePrevUs = 0;
+}
+#endif  // CAPTURE_SERIAL || CAPTURE_FLASH
+
+#ifdef CAPTURE_FLASH
+#include "flash_log.h"
+#include "partition_flash_io.h"
+
+static PartitionFlashIo captureFlash;
+static FlashLog captureLog(captureFlash);
+static bool captureReady = false;
+
+void initCapture() {
+    Serial.println("Setup capture to flash...");
+    if (!captureFlash.begin() || !captureLog.begin()) {
+        Serial.println("- ERR: No data partition, will not capture.");
+        return;
+    }
+    // dump previous captures (flash records hold absolute times)
+    printCaptureHeader();
+    uint8_t buf[BLE_CAPTURE_MAX_RECORD_LEN];
+    size_t len;
+    uint32_t count = 0;
+    while ((len = captureLog.peek(buf, sizeof(buf))) > 0) {
+        BleRawAdv adv;
+        uint64_t absolute = 0;
+        if (captureDecodeRecord(buf, len, absolute, adv) > 0) {
+            uint8_t out[BLE_CAPTURE_MAX_RECORD_LEN];
+            size_t n = captureEncodeRecord(out, sizeof(out), capturePrevUs, adv);
+            printCaptureLine(out, n);
+            count++;
+        }
+        captureLog.consume();
+    }
+    Serial.printf("- Dumped %u captured advertisements.\n", count);
+    captureReady = true;
+}
+
+void captureRawAdv(const BleRawAdv &adv) {
+    if (!captureReady) return;
+    uint8_t buf[BLE_CAPTURE_MAX_RECORD_LEN];
+    uint64_t absolute = 0;
+    size_t n = captureEncodeRecord(buf, sizeof(buf), absolute, adv);
+    captureLog.append(buf, n);
+}
+#elif defined CAPTURE_SERIAL
+void initCapture() {
+    Serial.println("Setup capture to serial...");
+    printCaptureHeader();
+}
+
+void captureRawAdv(const BleRawAdv &adv) {
+    uint8_t buf[BLE_CAPTURE_MAX_RECORD_LEN];
+    size_t n = captureEncodeRecord(buf, sizeof(buf), capturePrevUs, adv);
+    printCaptureLine(buf, n);
+}
+#else
+void initCapture() {}
+void captureRawAdv(const BleRawAdv &adv) {}
+#endif  // CAPTURE_FLASH
+
+#endif  // CAPTURE_KD_H
@@ -0,0 +1,225 @@
+/**
+ * Maps monotonic time (esp_timer, microseconds since boot) to epoch time without steps.
+ *
+ * SNTP steps the system clock on each sync, so timestamps taken by gettimeofday() jump
+ * back and forth by the drift gathered since the last sync (tens of ms per hour for a
+ * crystal off by 10-40 ppm). Instead, records are stamped with monotonic time and mapped
+ * to epoch time by this discipline:
+ *   - each sync adds a sample (monotonic time, epoch time) to a window of the last N samples,
+ *   - offset and drift are estimated by least squares over the window, so the jitter
+ *     of single syncs is averaged out,
+ *   - the mapping is changed continuously: the new drift applies right away, the remaining
+ *     phase error is slewed in at most maxSlewPpm (like adjtime()), so mapped time never
+ *     steps and never runs backwards.
+ * Only the first sync and a sync off by more than stepThresholdUs (e.g. a wrong server)
+ * set the time directly, the latter also clears the window.
+ *
+ * errorBoundUs() estimates how far mapped time may be off: three standard errors of the
+ * fitted offset at that time plus the phase not slewed in yet. Until three samples are
+ * known, the jitter of a sync is assumed to be defaultJitterUs and the drift up to maxDriftPpm.
+ *
+ * Not thread-safe. Mapping is integer only, the fit (floating point) runs on sync only.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef CLOCK_DISCIPLINE_KD_H
+#define CLOCK_DISCIPLINE_KD_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum ClockSyncKind : uint8_t {
+    CLOCK_SYNC_FIRST,  // time set
+    CLOCK_SYNC_STEP,   // off by more than step threshold, time set
+    CLOCK_SYNC_SLEW    // estimate updated, phase error slewed in
+};
+
+template <size_t N = 6>
+class ClockDiscipline {
+    static_assert(N >= 3, "ClockDiscipline needs three samples at least to estimate jitter");
+
+    struct Sample {
+        int64_t monoUs;
+        int64_t offsetUs;  // epoch minus monotonic
+    };
+
+   public:
+    explicit ClockDiscipline(uint32_t maxSlewPpm = 500, uint32_t stepThresholdUs = 1000000, uint32_t defaultJitterUs = 10000,
+                             uint32_t maxDriftPpm = 50)
+        : maxSlewPpm(maxSlewPpm), stepThresholdUs(stepThresholdUs), defaultJitterUs(defaultJitterUs), maxDriftPpm(maxDriftPpm) {}
+
+    /**
+     * Adds a sync: epochUs is the time received at monotonic time monoUs.
+     */
+    ClockSyncKind sync(int64_t monoUs, int64_t epochUs) {
+        syncs++;
+        lastSyncMonoUs = monoUs;
+        if (!synced()) {
+            setTime(monoUs, epochUs);
+            return CLOCK_SYNC_FIRST;
+        }
+        int64_t mapped = toEpochUs(monoUs);
+        lastErrorUs = epochUs - mapped;
+        if (absUs(lastErrorUs) > stepThresholdUs) {
+            steps++;
+            setTime(monoUs, epochUs);
+            return CLOCK_SYNC_STEP;
+        }
+        addSample(monoUs, epochUs - monoUs);
+        fit();
+        // continue from mapped time, drift from now on, phase slewed in
+        int64_t target = monoUs + fittedOffsetUs(monoUs);
+        baseMonoUs = monoUs;
+        baseEpochUs = mapped;
+        ratePpb = (int64_t)llround(drift * 1e9);
+        phaseUs = target - mapped;
+        slewUs = absUs(phaseUs) * 1000000 / maxSlewPpm;
+        return CLOCK_SYNC_SLEW;
+    }
+
+    bool synced() const { return count > 0; }
+
+    /**
+     * Epoch time at monoUs (monoUs itself if not synced yet).
+     */
+    int64_t toEpochUs(int64_t monoUs) const {
+        if (!synced()) return monoUs;
+        int64_t dt = monoUs - baseMonoUs;
+        int64_t t = baseEpochUs + dt + dt * ratePpb / 1000000000;
+        if (dt <= 0) return t;
+        return t + (dt < slewUs ? phaseUs * dt / slewUs : phaseUs);
+    }
+
+    /**
+     * Estimated max. error of toEpochUs(monoUs) in microseconds.
+     */
+    uint32_t errorBoundUs(int64_t monoUs) const {
+        if (!synced()) return UINT32_MAX;
+        double bound;
+        if (count < 3) {
+            double age = (double)(monoUs - lastSyncMonoUs);
+            bound = defaultJitterUs + (age > 0 ? age * maxDriftPpm / 1e6 : 0);
+        } else {
+            double x = (double)(monoUs - meanMonoUs);
+            bound = 3 * jitter * sqrt(1.0 / count + x * x / sxx);
+        }
+        bound += (double)absUs(pendingSlewUs(monoUs));
+        return bound >= UINT32_MAX ? UINT32_MAX : (uint32_t)bound;
+    }
+
+    /**
+     * Phase error not slewed in at monoUs yet.
+     */
+    int64_t pendingSlewUs(int64_t monoUs) const {
+        int64_t dt = monoUs - baseMonoUs;
+        if (dt <= 0) return phaseUs;
+        return dt < slewUs ? phaseUs - phaseUs * dt / slewUs : 0;
+    }
+
+    // estimated drift of monotonic clock against epoch time (parts per billion, positive if slow)
+    int32_t driftPpb() const { return (int32_t)ratePpb; }
+    // standard deviation of syncs around fitted line (defaultJitterUs until three samples are known)
+    uint32_t jitterUs() const { return count < 3 ? defaultJitterUs : (uint32_t)jitter; }
+    // received time minus mapped time at last sync
+    int64_t lastSyncErrorUs() const { return lastErrorUs; }
+    int64_t lastSyncMonotonicUs() const { return lastSyncMonoUs; }
+    size_t sampleCount() const { return count; }
+    uint32_t syncCount() const { return syncs; }
+    uint32_t stepCount() const { return steps; }
+
+   private:
+    static int64_t absUs(int64_t v) { return v < 0 ? -v : v; }
+
+    void setTime(int64_t monoUs, int64_t epochUs) {
+        count = 0;
+        next = 0;
+        addSample(monoUs, epochUs - monoUs);
+        baseMonoUs = monoUs;
+        baseEpochUs = epochUs;
+        ratePpb = 0;
+        phaseUs = 0;
+        slewUs = 0;
+        drift = 0;
+        jitter = defaultJitterUs;
+        lastErrorUs = 0;
+    }
+
+    void addSample(int64_t monoUs, int64_t offsetUs) {
+        samples[next] = {monoUs, offsetUs};
+        next = (next + 1) % N;
+        if (count < N) count++;
+    }
+
+    /**
+     * Least squares of offset over monotonic time, relative to newest sample for precision.
+     */
+    void fit() {
+        const Sample &ref = samples[(next + N - 1) % N];
+        double mx = 0, my = 0;
+        for (size_t i = 0; i < count; i++) {
+            mx += (double)(samples[i].monoUs - ref.monoUs);
+            my += (double)(samples[i].offsetUs - ref.offsetUs);
+        }
+        mx /= count;
+        my /= count;
+        double sxy = 0;
+        sxx = 0;
+        for (size_t i = 0; i < count; i++) {
+            double dx = (double)(samples[i].monoUs - ref.monoUs) - mx;
+            double dy = (double)(samples[i].offsetUs - ref.offsetUs) - my;
+            sxx += dx * dx;
+            sxy += dx * dy;
+        }
+        drift = sxx > 0 ? sxy / sxx : 0;
+        // implausible beyond what can be slewed
+        double limit = maxSlewPpm / 1e6;
+        if (drift > limit) drift = limit;
+        if (drift < -limit) drift = -limit;
+        meanMonoUs = ref.monoUs + (int64_t)llround(mx);
+        meanOffsetUs = ref.offsetUs + (int64_t)llround(my);
+        if (count >= 3) {
+            double ssr = 0;
+            for (size_t i = 0; i < count; i++) {
+                double dx = (double)(samples[i].monoUs - ref.monoUs) - mx;
+                double dy = (double)(samples[i].offsetUs - ref.offsetUs) - my;
+                double r = dy - drift * dx;
+                ssr += r * r;
+            }
+            jitter = sqrt(ssr / (count - 2));
+        }
+    }
+
+    int64_t fittedOffsetUs(int64_t monoUs) const {
+        return meanOffsetUs + (int64_t)llround(drift * (double)(monoUs - meanMonoUs));
+    }
+
+    uint32_t maxSlewPpm;
+    uint32_t stepThresholdUs;
+    uint32_t defaultJitterUs;
+    uint32_t maxDriftPpm;
+
+    Sample samples[N];
+    size_t count = 0;
+    size_t next = 0;
+    // fit
+    double drift = 0;
+    double jitter = 0;
+    double sxx = 0;
+    int64_t meanMonoUs = 0;
+    int64_t meanOffsetUs = 0;
+    // mapping
+    int64_t baseMonoUs = 0;
+    int64_t baseEpochUs = 0;
+    int64_t ratePpb = 0;
+    int64_t phaseUs = 0;
+    int64_t slewUs = 0;
+
+    int64_t lastSyncMonoUs = 0;
+    int64_t lastErrorUs = 0;
+    uint32_t syncs = 0;
+    uint32_t steps = 0;
+};
+
+#endif  // CLOCK_DISCIPLINE_KD_H
@@ -0,0 +1,271 @@
+/**
+ * Streaming patcher for delta OTA updates (see OTA_DELTA and host_tools/src/ota_diff.cpp).
+ *
+ * A patch rebuilds the new firmware image from the running one (base). Format, little endian:
+ *   header:  "KDP1", base size (u32), new size (u32), SHA-256 of base, SHA-256 of new image
+ *   blocks:  until new size is reached, each
+ *              diff length, extra length (varint), seek (zigzag varint)
+ *              diff:  diff length bytes of new = base + diff, as tokens (varint)
+ *                     (n << 1)     n bytes unchanged (diff is zero)
+ *                     (n << 1) | 1 n diff bytes follow
+ *              extra: extra length bytes taken as they are
+ *            the base position moves on by diff length plus seek after each block.
+ * Like bsdiff, but diff runs of zero (most of a patch) are coded as runs instead of being
+ * left to a compressor, so the device needs neither bzip2 nor inflate.
+ *
+ * Patch bytes are fed as they arrive, in chunks of any size. The patcher reads base bytes and
+ * writes new bytes through a target:
+ *   bool begin(const DeltaPatchHeader &header)   // after header, e.g. check base and open output
+ *   bool readBase(uint32_t offset, uint8_t *buf, size_t len)
+ *   bool writeNew(const uint8_t *buf, size_t len)
+ * and hashes the new image itself, so DELTA_PATCH_DONE means it matches the header.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef DELTA_PATCH_KD_H
+#define DELTA_PATCH_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+
+#define DELTA_PATCH_MAGIC "KDP1"
+#define DELTA_PATCH_HEADER_LEN (4 + 4 + 4 + 2 * SHA256_LEN)
+
+struct DeltaPatchHeader {
+    uint32_t baseSize;
+    uint32_t newSize;
+    uint8_t baseSha256[SHA256_LEN];
+    uint8_t newSha256[SHA256_LEN];
+};
+
+enum DeltaPatchStatus : uint8_t { DELTA_PATCH_MORE, DELTA_PATCH_DONE, DELTA_PATCH_ERROR };
+
+enum DeltaPatchError : uint8_t {
+    DELTA_ERR_NONE,
+    DELTA_ERR_MAGIC,   // no patch
+    DELTA_ERR_BEGIN,   // rejected by target, e.g. other base
+    DELTA_ERR_FORMAT,  // corrupt block
+    DELTA_ERR_RANGE,   // base or new image exceeded
+    DELTA_ERR_READ,
+    DELTA_ERR_WRITE,
+    DELTA_ERR_HASH,    // new image differs from header
+    DELTA_ERR_TRAILING,
+    DELTA_ERR_COUNT
+};
+
+static const char *const DELTA_PATCH_ERROR_NAMES[DELTA_ERR_COUNT] = {"none", "magic", "begin", "format", "range",
+                                                                     "read", "write", "hash",  "trailing"};
+
+inline void deltaPatchPutU32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+inline uint32_t deltaPatchGetU32(const uint8_t *p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+
+inline void deltaPatchPutHeader(uint8_t *p, const DeltaPatchHeader &h) {
+    memcpy(p, DELTA_PATCH_MAGIC, 4);
+    deltaPatchPutU32(p + 4, h.baseSize);
+    deltaPatchPutU32(p + 8, h.newSize);
+    memcpy(p + 12, h.baseSha256, SHA256_LEN);
+    memcpy(p + 12 + SHA256_LEN, h.newSha256, SHA256_LEN);
+}
+
+/**
+ * Buf must hold DELTA_PATCH_HEADER_LEN bytes. Returns false if magic does not match.
+ */
+inline bool deltaPatchGetHeader(const uint8_t *p, DeltaPatchHeader &h) {
+    if (memcmp(p, DELTA_PATCH_MAGIC, 4) != 0) return false;
+    h.baseSize = deltaPatchGetU32(p + 4);
+    h.newSize = deltaPatchGetU32(p + 8);
+    memcpy(h.baseSha256, p + 12, SHA256_LEN);
+    memcpy(h.newSha256, p + 12 + SHA256_LEN, SHA256_LEN);
+    return true;
+}
+
+template <typename Target, size_t BufLen = 512>
+class DeltaPatcher {
+   public:
+    explicit DeltaPatcher(Target &target) : target(target) {}
+
+    /**
+     * Consumes len patch bytes. Returns DELTA_PATCH_MORE until the new image is complete and
+     * verified, DELTA_PATCH_ERROR (see error()) from then on if anything fails.
+     */
+    DeltaPatchStatus feed(const uint8_t *data, size_t len) {
+        if (status == DELTA_PATCH_ERROR) return status;
+        if (status == DELTA_PATCH_DONE) return len > 0 ? fail(DELTA_ERR_TRAILING) : status;
+        const uint8_t *end = data + len;
+        while (status == DELTA_PATCH_MORE) {
+            switch (state) {
+                case S_HEADER: {
+                    size_t n = DELTA_PATCH_HEADER_LEN - fill < (size_t)(end - data) ? DELTA_PATCH_HEADER_LEN - fill : (size_t)(end - data);
+                    memcpy(buf + fill, data, n);
+                    fill += n;
+                    data += n;
+                    if (fill < DELTA_PATCH_HEADER_LEN) return status;
+                    fill = 0;
+                    if (!deltaPatchGetHeader(buf, hdr)) return fail(DELTA_ERR_MAGIC);
+                    if (!target.begin(hdr)) return fail(DELTA_ERR_BEGIN);
+                    state = S_CTRL;
+                    if (hdr.newSize == 0) finish();
+                    break;
+                }
+                case S_CTRL:
+                    // diff length, extra length, seek
+                    if (!readVarint(data, end)) return status;
+                    ctrl[ctrlIndex++] = value;
+                    if (ctrlIndex < 3) break;
+                    ctrlIndex = 0;
+                    if (ctrl[0] + ctrl[1] > hdr.newSize - written - fill) return fail(DELTA_ERR_RANGE);
+                    diffLeft = (uint32_t)ctrl[0];
+                    extraLeft = (uint32_t)ctrl[1];
+                    state = diffLeft > 0 ? S_TOKEN : S_EXTRA;
+                    break;
+                case S_TOKEN:
+                    if (!readVarint(data, end)) return status;
+                    // checked before narrowing, a run of 2^32 + 1 is no run of 1
+                    if (value >> 1 == 0 || value >> 1 > diffLeft) return fail(DELTA_ERR_FORMAT);
+                    runLeft = (uint32_t)(value >> 1);
+                    diffLeft -= runLeft;
+                    state = (value & 1) ? S_DIFF : S_SAME;
+                    break;
+                case S_SAME:
+                case S_DIFF: {
+                    if (state == S_DIFF && data == end) return status;
+                    size_t n = room() < runLeft ? room() : runLeft;
+                    if (state == S_DIFF && n > (size_t)(end - data)) n = end - data;
+                    if ((uint64_t)basePos + n > hdr.baseSize) return fail(DELTA_ERR_RANGE);
+                    if (!target.readBase(basePos, buf + fill, n)) return fail(DELTA_ERR_READ);
+                    if (state == S_DIFF) {
+                        for (size_t i = 0; i < n; i++) buf[fill + i] += data[i];
+                        data += n;
+                    }
+                    basePos += n;
+                    runLeft -= n;
+                    if (!put(n)) return status;
+                    if (runLeft == 0) state = diffLeft > 0 ? S_TOKEN : S_EXTRA;
+                    break;
+                }
+                case S_EXTRA: {
+                    if (extraLeft > 0) {
+                        if (data == end) return status;
+                        size_t n = room() < extraLeft ? room() : extraLeft;
+                        if (n > (size_t)(end - data)) n = end - data;
+                        memcpy(buf + fill, data, n);
+                        data += n;
+                        extraLeft -= n;
+                        if (!put(n)) return status;
+                        if (extraLeft > 0) break;
+                    }
+                    int64_t pos = (int64_t)basePos + unzigzag(ctrl[2]);
+                    if (pos < 0 || pos > (int64_t)hdr.baseSize) return fail(DELTA_ERR_RANGE);
+                    basePos = (uint32_t)pos;
+                    state = S_CTRL;
+                    if (written + fill == hdr.newSize) finish();
+                    break;
+                }
+            }
+        }
+        if (status == DELTA_PATCH_DONE && data != end) return fail(DELTA_ERR_TRAILING);
+        return status;
+    }
+
+    DeltaPatchStatus getStatus() const { return status; }
+    DeltaPatchError error() const { return err; }
+    // valid once status is not DELTA_PATCH_MORE or target.begin() was called
+    const DeltaPatchHeader &header() const { return hdr; }
+    // new image bytes handed to target
+    uint32_t writtenBytes() const { return written; }
+
+   private:
+    enum State : uint8_t { S_HEADER, S_CTRL, S_TOKEN, S_SAME, S_DIFF, S_EXTRA };
+
+    static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    size_t room() const { return BufLen - fill; }
+
+    DeltaPatchStatus fail(DeltaPatchError e) {
+        err = e;
+        status = DELTA_PATCH_ERROR;
+        return status;
+    }
+
+    /**
+     * Accumulates a varint over chunks. True once value is complete.
+     */
+    bool readVarint(const uint8_t *&data, const uint8_t *end) {
+        while (data < end) {
+            uint8_t b = *data++;
+            if (shift > 35) {
+                fail(DELTA_ERR_FORMAT);
+                return false;
+            }
+            acc |= (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+            if (!(b & 0x80)) {
+                value = acc;
+                acc = 0;
+                shift = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Takes n new bytes from buf into output, writes buffer when full.
+     */
+    bool put(size_t n) {
+        fill += n;
+        if (fill < BufLen) return true;
+        return flush();
+    }
+
+    bool flush() {
+        if (fill == 0) return true;
+        sha.update(buf, fill);
+        if (!target.writeNew(buf, fill)) {
+            fail(DELTA_ERR_WRITE);
+            return false;
+        }
+        written += fill;
+        fill = 0;
+        return true;
+    }
+
+    void finish() {
+        if (!flush()) return;
+        uint8_t digest[SHA256_LEN];
+        sha.finish(digest);
+        if (memcmp(digest, hdr.newSha256, SHA256_LEN) != 0) {
+            fail(DELTA_ERR_HASH);
+            return;
+        }
+        status = DELTA_PATCH_DONE;
+    }
+
+    Target &target;
+    DeltaPatchHeader hdr;
+    Sha256 sha;
+    uint8_t buf[BufLen < DELTA_PATCH_HEADER_LEN ? DELTA_PATCH_HEADER_LEN : BufLen];
+    size_t fill = 0;
+    State state = S_HEADER;
+    DeltaPatchStatus status = DELTA_PATCH_MORE;
+    DeltaPatchError err = DELTA_ERR_NONE;
+    uint64_t acc = 0;
+    uint8_t shift = 0;
+    uint64_t value = 0;
+    uint64_t ctrl[3];
+    uint8_t ctrlIndex = 0;
+    uint32_t diffLeft = 0;
+    uint32_t extraLeft = 0;
+    uint32_t runLeft = 0;
+    uint32_t basePos = 0;
+    uint32_t written = 0;
+};
+
+#endif  // DELTA_PATCH_KD_H
@@ -0,0 +1,279 @@
+/**
+ * Append-only ring log on raw flash, used to store messages while offline.
+ *
+ * The flash area is split into sectors (segments). Each sector starts with
+ * a header (magic, sequence number), followed by records:
+ *   u16 length, u8 state (0xff unread, 0x00 replayed), u8 reserved, u32 crc32, payload
+ * Records are 4-byte aligned and never span sectors.
+ *
+ * Writes only clear bits (as flash does), a sector is erased right before it is reused.
+ * So each byte is written once, plus one state byte per record when replayed.
+ * If the ring is full, the oldest sector is erased and its unread records are counted as dropped.
+ * Records with wrong CRC (e.g. power loss while writing) are skipped. After power loss while a
+ * payload was written (header still erased), appending continues in the next sector.
+ *
+ * Flash access goes through FlashIo, so the log can be run natively against a file
+ * (see host_tools/lib/flash_file and test/test_flash_log).
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef FLASH_LOG_KD_H
+#define FLASH_LOG_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FLASH_LOG_SECTOR_SIZE 4096
+#define FLASH_LOG_MAGIC 0x4b44464cUL  // "KDFL"
+#define FLASH_LOG_SECTOR_HEADER_LEN 8
+#define FLASH_LOG_RECORD_HEADER_LEN 8
+#define FLASH_LOG_MAX_RECORD_LEN (FLASH_LOG_SECTOR_SIZE - FLASH_LOG_SECTOR_HEADER_LEN - FLASH_LOG_RECORD_HEADER_LEN)
+
+#define FLASH_LOG_STATE_UNREAD 0xff
+#define FLASH_LOG_STATE_READ 0x00
+
+class FlashIo {
+   public:
+    virtual ~FlashIo() {}
+    // multiple of FLASH_LOG_SECTOR_SIZE
+    virtual size_t size() = 0;
+    virtual bool read(size_t offset, void *buf, size_t len) = 0;
+    // may only clear bits of erased (0xff) flash
+    virtual bool write(size_t offset, const void *buf, size_t len) = 0;
+    virtual bool eraseSector(size_t offset) = 0;
+};
+
+inline uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len) {
+    // nibble table, small enough for flash and fast enough for a few kB
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+class FlashLog {
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t seq;
+    };
+    struct RecordHeader {
+        uint16_t len;
+        uint8_t state;
+        uint8_t reserved;
+        uint32_t crc;
+    };
+
+   public:
+    explicit FlashLog(FlashIo &io) : io(io) {}
+
+    /**
+     * Recovers head and tail from flash, formats if nothing valid is found.
+     */
+    bool begin() {
+        sectors = io.size() / FLASH_LOG_SECTOR_SIZE;
+        if (sectors < 2) return false;
+
+        bool found = false;
+        uint32_t minSeq = 0, maxSeq = 0;
+        for (size_t s = 0; s < sectors; s++) {
+            SectorHeader sh;
+            if (!io.read(s * FLASH_LOG_SECTOR_SIZE, &sh, sizeof(sh))) return false;
+            if (sh.magic != FLASH_LOG_MAGIC) continue;
+            if (!found || sh.seq > maxSeq) {
+                maxSeq = sh.seq;
+                headSector = s;
+            }
+            if (!found || sh.seq < minSeq) {
+                minSeq = sh.seq;
+                readSector = s;
+            }
+            found = true;
+        }
+        if (!found) {
+            headSector = 0;
+            readSector = 0;
+            if (!startSector(0, 1)) return false;
+        }
+        headSeq = maxSeq > 0 ? maxSeq : 1;
+        readOffset = FLASH_LOG_SECTOR_HEADER_LEN;
+        headOffset = endOfRecords(headSector);
+        // payload of a record cut by power loss, not erased anymore: continue in next sector
+        if (!erasedFrom(headSector, headOffset)) headOffset = FLASH_LOG_SECTOR_SIZE;
+        ready = true;
+        return true;
+    }
+
+    /**
+     * Appends one record. Erases the oldest sector if the ring is full.
+     */
+    bool append(const uint8_t *data, size_t len) {
+        if (!ready || len == 0 || len > FLASH_LOG_MAX_RECORD_LEN) return false;
+        size_t total = align(FLASH_LOG_RECORD_HEADER_LEN + len);
+        if (headOffset + total > FLASH_LOG_SECTOR_SIZE) {
+            size_t next = (headSector + 1) % sectors;
+            if (next == readSector) {
+                // ring full, oldest data has to go
+                droppedRecords += countUnread(next);
+                readSector = (next + 1) % sectors;
+                readOffset = FLASH_LOG_SECTOR_HEADER_LEN;
+                // record of last peek() may be gone
+                peeked = false;
+            }
+            if (!startSector(next, headSeq + 1)) return false;
+            headSector = next;
+            headSeq++;
+            headOffset = FLASH_LOG_SECTOR_HEADER_LEN;
+        }
+        RecordHeader rh;
+        rh.len = (uint16_t)len;
+        rh.state = FLASH_LOG_STATE_UNREAD;
+        rh.reserved = 0xff;
+        rh.crc = crc32Update(0, data, len);
+        size_t base = headSector * FLASH_LOG_SECTOR_SIZE + headOffset;
+        // payload first, so a record with valid header always has its payload written
+        if (!io.write(base + FLASH_LOG_RECORD_HEADER_LEN, data, len)) return false;
+        if (!io.write(base, &rh, sizeof(rh))) return false;
+        headOffset += total;
+        appendedRecords++;
+        return true;
+    }
+
+    /**
+     * Copies oldest unread record into buf without consuming it.
+     * Returns its length or 0 if log is empty. Records larger than size are skipped.
+     */
+    size_t peek(uint8_t *buf, size_t size) {
+        if (!ready) return 0;
+        for (;;) {
+            if (readOffset + FLASH_LOG_RECORD_HEADER_LEN > FLASH_LOG_SECTOR_SIZE) {
+                if (!nextReadSector()) return 0;
+                continue;
+            }
+            RecordHeader rh;
+            size_t base = readSector * FLASH_LOG_SECTOR_SIZE + readOffset;
+            if (!io.read(base, &rh, sizeof(rh))) return 0;
+            if (rh.len == 0xffff) {
+                // end of written records
+                if (readSector == headSector || !nextReadSector()) return 0;
+                continue;
+            }
+            if (rh.len == 0 || readOffset + FLASH_LOG_RECORD_HEADER_LEN + rh.len > FLASH_LOG_SECTOR_SIZE) {
+                // broken header, rest of sector cannot be trusted
+                corruptRecords++;
+                readOffset = FLASH_LOG_SECTOR_SIZE;
+                continue;
+            }
+            if (rh.state == FLASH_LOG_STATE_UNREAD && rh.len <= size &&
+                io.read(base + FLASH_LOG_RECORD_HEADER_LEN, buf, rh.len) &&
+                crc32Update(0, buf, rh.len) == rh.crc) {
+                peeked = true;
+                return rh.len;
+            }
+            if (rh.state == FLASH_LOG_STATE_UNREAD) corruptRecords++;
+            readOffset += align(FLASH_LOG_RECORD_HEADER_LEN + rh.len);
+        }
+    }
+
+    /**
+     * Marks the record returned by last peek() as replayed.
+     * Does nothing if append() dropped it meanwhile (ring full).
+     */
+    void consume() {
+        RecordHeader rh;
+        size_t base = readSector * FLASH_LOG_SECTOR_SIZE + readOffset;
+        if (!ready || !peeked || !io.read(base, &rh, sizeof(rh)) || rh.len == 0xffff) return;
+        peeked = false;
+        uint8_t state = FLASH_LOG_STATE_READ;
+        io.write(base + offsetof(RecordHeader, state), &state, 1);
+        readOffset += align(FLASH_LOG_RECORD_HEADER_LEN + rh.len);
+        replayedRecords++;
+    }
+
+    uint32_t appendedCount() const { return appendedRecords; }
+    uint32_t replayedCount() const { return replayedRecords; }
+    // unread records lost since ring was full
+    uint32_t droppedCount() const { return droppedRecords; }
+    uint32_t corruptCount() const { return corruptRecords; }
+
+   private:
+    static size_t align(size_t len) { return (len + 3) & ~(size_t)3; }
+
+    bool startSector(size_t s, uint32_t seq) {
+        if (!io.eraseSector(s * FLASH_LOG_SECTOR_SIZE)) return false;
+        // magic last, so a sector with valid magic has its whole sequence number
+        SectorHeader sh = {FLASH_LOG_MAGIC, seq};
+        return io.write(s * FLASH_LOG_SECTOR_SIZE + offsetof(SectorHeader, seq), &sh.seq, sizeof(sh.seq)) &&
+               io.write(s * FLASH_LOG_SECTOR_SIZE, &sh.magic, sizeof(sh.magic));
+    }
+
+    bool nextReadSector() {
+        if (readSector == headSector) return false;
+        readSector = (readSector + 1) % sectors;
+        readOffset = FLASH_LOG_SECTOR_HEADER_LEN;
+        return true;
+    }
+
+    // walks the records of sector s, calls fn(header) for each valid one and returns offset behind last
+    template <typename Fn>
+    size_t walk(size_t s, Fn fn) {
+        size_t offset = FLASH_LOG_SECTOR_HEADER_LEN;
+        while (offset + FLASH_LOG_RECORD_HEADER_LEN <= FLASH_LOG_SECTOR_SIZE) {
+            RecordHeader rh;
+            if (!io.read(s * FLASH_LOG_SECTOR_SIZE + offset, &rh, sizeof(rh))) break;
+            if (rh.len == 0xffff) break;
+            if (rh.len == 0 || offset + FLASH_LOG_RECORD_HEADER_LEN + rh.len > FLASH_LOG_SECTOR_SIZE) {
+                // broken, treat sector as full
+                return FLASH_LOG_SECTOR_SIZE;
+            }
+            fn(rh);
+            offset += align(FLASH_LOG_RECORD_HEADER_LEN + rh.len);
+        }
+        return offset;
+    }
+
+    size_t endOfRecords(size_t s) {
+        return walk(s, [](const RecordHeader &) {});
+    }
+
+    bool erasedFrom(size_t s, size_t offset) {
+        uint8_t buf[64];
+        while (offset < FLASH_LOG_SECTOR_SIZE) {
+            size_t n = FLASH_LOG_SECTOR_SIZE - offset < sizeof(buf) ? FLASH_LOG_SECTOR_SIZE - offset : sizeof(buf);
+            if (!io.read(s * FLASH_LOG_SECTOR_SIZE + offset, buf, n)) return false;
+            for (size_t i = 0; i < n; i++)
+                if (buf[i] != 0xff) return false;
+            offset += n;
+        }
+        return true;
+    }
+
+    uint32_t countUnread(size_t s) {
+        uint32_t n = 0;
+        walk(s, [&n](const RecordHeader &rh) {
+            if (rh.state == FLASH_LOG_STATE_UNREAD) n++;
+        });
+        return n;
+    }
+
+    FlashIo &io;
+    bool ready = false;
+    size_t sectors = 0;
+    size_t headSector = 0;
+    size_t headOffset = 0;
+    uint32_t headSeq = 0;
+    size_t readSector = 0;
+    size_t readOffset = 0;
+    bool peeked = false;  // record at read position was returned by peek()
+    uint32_t appendedRecords = 0;
+    uint32_t replayedRecords = 0;
+    uint32_t droppedRecords = 0;
+    uint32_t corruptRecords = 0;
+};
+
+#endif  // FLASH_LOG_KD_H
@@ -1,23 +1,130 @@
+/**
+ * Time for timestamps: monotonic time (esp_timer) mapped to epoch time by a clock discipline
+ * (see clock_discipline.h), which is fed by SNTP syncs every CLOCK_SYNC_INTERVAL_S seconds.
+ * So timestamps neither step on syncs nor run backwards.
+ * Until the first sync, time is monotonic time since boot (see boot_buffer.h).
+ * */
+
 #ifndef GET_TIME_KD_H
 #define GET_TIME_KD_H
 
 #include <Arduino.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
 #include <sys/time.h>
 
+#include <atomic>
+
+#include "ble_json.h"
+#include "boot_buffer.h"
+#include "clock_discipline.h"
+#include "globals_kd.h"
+#include "metrics.h"
+
 #define NTP_SERVER "pool.ntp.org"
 
 // FORWARD DECLARATIONS
 bool getTimeInSecAndUsec(unsigned long& seconds, unsigned long& microseconds);
 
-void initTimeNTP() {
-    Serial.print("Wait for timesync...");
+// fed by SNTP callback (lwIP task), read by scan callback and others
+static ClockDiscipline<> clockDiscipline;
+static portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<bool> clockSynced{false};
+
+/**
+ * True once time was synced by NTP.
+ */
+bool timeSynced() {
+    return clockSynced;
+}
+
+/**
+ * Epoch time in microseconds (monotonic time since boot until synced).
+ */
+int64_t getEpochTimeUs() {
+    int64_t monotonicUs = esp_timer_get_time();
+    portENTER_CRITICAL(&clockMux);
+    int64_t epochUs = clockDiscipline.toEpochUs(monotonicUs);
+    portEXIT_CRITICAL(&clockMux);
+    return epochUs;
+}
+
+/**
+ * Epoch minus monotonic time (esp_timer) in microseconds, valid once time is synced.
+ */
+int64_t getClockOffsetUs() {
+    int64_t monotonicUs = esp_timer_get_time();
+    portENTER_CRITICAL(&clockMux);
+    int64_t epochUs = clockDiscipline.toEpochUs(monotonicUs);
+    portEXIT_CRITICAL(&clockMux);
+    return epochUs - monotonicUs;
+}
+
+// runs in lwIP task on each sync, tv is the time just received
+void onTimeSynced(struct timeval *tv) {
+    int64_t monotonicUs = esp_timer_get_time();
+    int64_t receivedUs = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    portENTER_CRITICAL(&clockMux);
+    ClockSyncKind kind = clockDiscipline.sync(monotonicUs, receivedUs);
+    int64_t errorUs = clockDiscipline.lastSyncErrorUs();
+    int32_t driftPpb = clockDiscipline.driftPpb();
+    portEXIT_CRITICAL(&clockMux);
+    clockSynced = true;
+    bootPhaseEnd(BOOT_NTP);
+    if (kind == CLOCK_SYNC_SLEW)
+        Serial.printf("- Time sync: off by %d us, drift %d ppb.\n", (int)errorUs, driftPpb);
+    else if (kind == CLOCK_SYNC_STEP)
+        Serial.printf("- Time sync: off by %d ms, time set.\n", (int)(errorUs / 1000));
+}
+
+/**
+ * Clock discipline state for metrics report:
+ * "clock": {"syncs": 12, "steps": 0, "driftPpb": 17143, "jitterUs": 8120, "errorBoundUs": 23300, "lastErrorUs": -5210, "lastSyncS": 310}
+ */
+void jsonPutClock(JsonBuf &jb) {
+    int64_t monotonicUs = esp_timer_get_time();
+    portENTER_CRITICAL(&clockMux);
+    ClockDiscipline<> c = clockDiscipline;
+    portEXIT_CRITICAL(&clockMux);
+    int64_t lastErrorUs = c.lastSyncErrorUs();
+    jsonPut(jb, "\"clock\": {\"syncs\": ");
+    jsonPutUInt(jb, c.syncCount());
+    jsonPut(jb, ", \"steps\": ");
+    jsonPutUInt(jb, c.stepCount());
+    jsonPut(jb, ", \"driftPpb\": ");
+    jsonPutInt(jb, c.driftPpb());
+    jsonPut(jb, ", \"jitterUs\": ");
+    jsonPutUInt(jb, c.jitterUs());
+    jsonPut(jb, ", \"errorBoundUs\": ");
+    jsonPutUInt(jb, c.errorBoundUs(monotonicUs));
+    jsonPut(jb, ", \"lastErrorUs\": ");
+    jsonPutInt(jb, lastErrorUs < INT32_MIN ? INT32_MIN : lastErrorUs > INT32_MAX ? INT32_MAX : (int32_t)lastErrorUs);
+    jsonPut(jb, ", \"lastSyncS\": ");
+    jsonPutUInt(jb, c.synced() ? (uint32_t)((monotonicUs - c.lastSyncMonotonicUs()) / 1000000) : 0);
+    jsonPutChar(jb, '}');
+}
+
+/**
+ * Starts NTP sync. If wait is set, blocks until time is synced.
+ * Otherwise syncing goes on in background, see timeSynced().
+ */
+void initTimeNTP(bool wait = true) {
+    bootPhaseBegin(BOOT_NTP);
+    sntp_set_time_sync_notification_cb(onTimeSynced);
+    // more samples for drift estimation than the hourly default
+    sntp_set_sync_interval(CLOCK_SYNC_INTERVAL_S * 1000UL);
     // The first and second arguments correspond to the GMT time offset and daylight saving time
     // choose 0,0 for epoch
     configTime(0, 0, NTP_SERVER);
-    // after this call, time is syncing periodically each hour 
+    // after this call, time is syncing periodically
     // (see https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-reference/system/system_time.html#sntp-time-synchronization)
+    if (!wait) {
+        Serial.println("Timesync started in background.");
+        return;
+    }
 
-    while (time(nullptr) < 10000) {
+    Serial.print("Wait for timesync...");
+    while (!timeSynced()) {
         delay(100);
         Serial.print(".");
     }
@@ -33,13 +140,9 @@ void initTimeNTP() {
 }
 
 bool getTimeInSecAndUsec(unsigned long& seconds, unsigned long& microseconds) {
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0) {
-        Serial.println("Failed to obtain time");
-        return false;
-    }
-    seconds = tv.tv_sec;
-    microseconds = tv.tv_usec;
+    int64_t us = getEpochTimeUs();
+    seconds = us / 1000000;
+    microseconds = us % 1000000;
     return true;
 }
 
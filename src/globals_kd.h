@@ -19,6 +19,86 @@
 #define SCAN_ACTIVE 1  // true=1, false=0
 #define SCAN_INTERVAL_MS 100
 #define SCAN_WINDOW_MS 100 // less or equal SCAN_INTERVAL_MS value
+// Scan without restarts and without BLEScan results (heap stays flat), windows are logical only
+#define CONTINUOUS_SCAN  // Comment this line to restart BLEScan each SCAN_TIME_IN_SECONDS
+// Uncomment to adapt interval, window and active mode each scan window to density and back-pressure (see src/scan_controller.h)
+// SCAN_INTERVAL_MS, SCAN_WINDOW_MS and SCAN_ACTIVE are the initial values then, needs CONTINUOUS_SCAN or AGGREGATE_WINDOW
+//#define ADAPTIVE_SCAN
+#define SCAN_MIN_INTERVAL_MS 100
+#define SCAN_MAX_INTERVAL_MS 1280
+#define SCAN_MIN_WINDOW_MS 20
+#define SCAN_MAX_WINDOW_MS 100
+#define SCAN_QUIET_DEVICES_PER_MIN 60     // fewer devices per minute ...
+#define SCAN_QUIET_DUPLICATE_PERCENT 80   // ... seen as often: lower duty cycle
+#define SCAN_FLOOD_SIGHTINGS_PER_S 300    // passive above
+#define SCAN_QUEUE_HIGH_PERCENT 50        // back off above this publish queue fill
+#define SCAN_MIN_FREE_HEAP 40000          // back off below (bytes)
+#define SCAN_HOLD_WINDOWS 3               // windows without pressure between quiet/demand steps
+#define SEEN_SET_SIZE 1024  // addresses per window for duplicate filtering, power of two (12 bytes each)
+// Uncomment one to record raw advertisements for replay on a host (see host_tools/)
+//#define CAPTURE_SERIAL  // as "CAP <hex>" lines
+//#define CAPTURE_FLASH   // to data partition (instead of STORE_AND_FORWARD), dumped as "CAP" lines on boot
+// Uncomment to publish one record with RSSI statistics per device and scan window
+// instead of the first sighting only (adds "count", "rssiMin", "rssiMax", "firstTimestamp", "firstMicros")
+//#define AGGREGATE_WINDOW
+#define AGG_TABLE_SIZE 128      // devices per window, power of two (~200 bytes each, two tables)
+#define AGG_FLUSH_WAIT_MS 2000  // max. wait for space in publish queue at window end, records are dropped afterwards
+// Uncomment to publish a HyperLogLog sketch of distinct addresses per scan window and per rollup
+// instead of records (changes sensor message format, see src/ble_hll.h)
+//#define COUNT_ONLY
+#define HLL_PRECISION 10   // 2^p registers of one byte, standard error 1.04 / sqrt(2^p), 3.3% here
+#define HLL_ROLLUP_S 3600  // rollup window aligned to epoch, multiple of SCAN_TIME_IN_SECONDS
+// Uncomment to report most frequent company IDs, service UUIDs and name prefixes on admin topic (see src/ble_topk.h)
+// counted once per device and scan window, records are published as configured otherwise
+//#define TOP_K
+#define TOPK_COUNTERS 32        // per kind, more counters give lower error bounds (~25 bytes each)
+#define TOPK_PUBLISH 10         // keys per kind in report, at most TOPK_COUNTERS
+#define TOPK_NAME_PREFIX_LEN 8  // bytes
+#define TOPK_WINDOW_S 60        // report interval, multiple of SCAN_TIME_IN_SECONDS
+// Uncomment to decode iBeacon, Eddystone, Apple and Microsoft frames into fields (adds "frame", see src/ble_frames.h)
+//#define DECODE_FRAMES
+// Uncomment to drop or truncate advertisements by rules before publishing (see src/ble_filter.h)
+//#define FILTER_RULES
+#define FILTER_RSSI_FLOOR -128      // drop weaker sightings (dBm)
+#define FILTER_DROP_ADDR_TYPES 0x0  // bit mask, e.g. 0x2 drops random addresses
+#define FILTER_MIN_PAYLOAD_LEN 0
+#define FILTER_MAX_PAYLOAD_LEN 62
+// manufacturer data by company ID, e.g. {{0x0006, BLE_FILTER_DROP}, {0x004c, BLE_FILTER_TRUNCATE}}
+#define FILTER_COMPANY_RULES {{0x0006, BLE_FILTER_DROP}}
+#define FILTER_DEFAULT_ACTION BLE_FILTER_KEEP
+#define FILTER_COMPANY_TABLE_SIZE 32  // power of two, keep about twice the number of company rules
+
+//----------------------------
+// PUBLISH
+//----------------------------
+#define ASYNC_PUBLISH  // Comment this line to publish directly from the BLE scan callback
+#define PUBLISH_QUEUE_LEN 64  // records in queue, power of two
+#define PUBLISH_TASK_STACK 8192
+#define PUBLISH_TASK_PRIO 1
+// Uncomment to pack records into JSON arrays (changes sensor message format)
+//#define BATCH_PUBLISH
+#define BATCH_DEADLINE_MS 2000  // publish batch at latest after this time
+// Uncomment to publish sensor data in binary format (see src/ble_binary.h)
+//#define BINARY_PAYLOAD
+// Uncomment to publish only fields that changed since last record per device (changes sensor message format, see src/ble_delta.h)
+//#define DELTA_ENCODING
+#define DELTA_CACHE_SIZE 256  // devices, power of two (~40 bytes each)
+#define DELTA_KEYFRAME_S 300  // full record per device at least this often
+// Uncomment to select fields, their order and encodings of JSON records at compile time (see src/ble_schema.h)
+// default: all fields as before, e.g. "address", "rssi" and epoch milliseconds as JSON numbers only:
+//#define RECORD_SCHEMA BleRecordSchema<BleFieldAddress, BleFieldRssi<BLE_JSON_NUMBER>, BleFieldTimeMs<BLE_JSON_NUMBER>>
+// Uncomment to start scanning before WiFi, MQTT and NTP are up (requires ASYNC_PUBLISH and CONTINUOUS_SCAN, see src/boot_buffer.h)
+//#define FAST_BOOT
+#define BOOT_BUFFER_LEN 128  // records held until time is synced (~180 bytes each, released afterwards)
+// Store sensor messages in flash (spiffs partition) if publishing fails, replay when online again
+#define STORE_AND_FORWARD  // Comment this line to drop messages that could not be published
+#define STORE_REPLAY_PER_SECOND 20
+#define STORE_REPLAY_ATTEMPTS 3  // a stored message failing as often while connected is discarded
+// SNTP syncs feed the clock discipline (drift estimation, see src/clock_discipline.h)
+#define CLOCK_SYNC_INTERVAL_S 900
+// Publish counters, latency histograms, heap and stack usage on admin topic
+#define PUBLISH_METRICS  // Comment this line to disable metrics reports
+#define METRICS_INTERVAL_S 60
 
 //----------------------------
 // WIFI
@@ -38,9 +118,34 @@
 //----------------------------
 #define SECURE_MQTT  // Comment this line if you are not using MQTT over SSL
 #define MQTT_HOST_CN "example.com"
+// Uncomment to gather MQTT packets into fewer TLS records (see src/buffered_client.h)
+//#define COALESCE_WRITES
+#define COALESCE_BUFFER_SIZE 2048  // bytes, larger packets are written directly
+#define COALESCE_MAX_DELAY_MS 100  // max. time a packet waits in buffer
+// Reconnect attempts wait a random time between half and full backoff, which doubles up to max.
+#define MQTT_RECONNECT_MIN_MS 1000
+#define MQTT_RECONNECT_MAX_MS 60000
+#define MQTT_SOCKET_TIMEOUT_S 5     // wait for CONNACK
+#define MQTT_LOCK_WAIT_MS 500       // sensor messages wait as long for a publish of another task, fail (stored) otherwise
+#define TLS_HANDSHAKE_TIMEOUT_S 10
+// Uncomment to resume TLS sessions on reconnect instead of full handshakes (see src/tls_session_client.h)
+//#define TLS_SESSION_RESUMPTION
 
 // TODO: max packet size: https://github.com/knolleary/pubsubclient#limitations
+// includes header and topic
+#ifdef BATCH_PUBLISH
+#define MAX_MQTT_MESSAGE_SIZE 4096  // room for ~15 records per batch
+#elif defined COUNT_ONLY
+#define MAX_MQTT_MESSAGE_SIZE 2048  // JSON sketch of HLL_PRECISION 10 (checked in ble.h)
+#elif defined DELTA_ENCODING || defined AGGREGATE_WINDOW || defined DECODE_FRAMES
+#define MAX_MQTT_MESSAGE_SIZE 1024  // worst-case record with delta, stats and frame fields (checked in publisher.h)
+#else
 #define MAX_MQTT_MESSAGE_SIZE 512
+#endif  // BATCH_PUBLISH
+// prefix, SSID (up to 32) and device ID
+#define MQTT_MAX_TOPIC_LEN 64
+// reserved in messages besides payload: fixed header, topic length and topic (MQTT_MAX_HEADER_SIZE from PubSubClient)
+#define MQTT_MESSAGE_OVERHEAD (MQTT_MAX_HEADER_SIZE + 2 + MQTT_MAX_TOPIC_LEN)
 
 #define SENSOR_TOPIC_PRE "sensor/BLE/Scanner/"
 #define ADMIN_TOPIC_PRE "admin/BLE/Scanner/"
@@ -58,6 +163,19 @@
 //----------------------------
 #define OTA_UPDATE  // Comment this line if you are not using OTA
 
+// Uncomment to accept delta updates: messages with "base" and "sha256" point to a patch from the
+// running version made by host_tools ota_diff (see README)
+//#define OTA_DELTA
+// Uncomment to download full images in background while scanning and publishing go on, in chunks
+// of range requests. Progress survives reboots, messages need "sha256" of the image (see README)
+//#define OTA_RESUME
+#define OTA_CHUNK_BYTES 32768          // per request and progress update, multiple of 4096
+#define OTA_RATE_BYTES_PER_SEC 16384   // mean download rate
+#define OTA_MAX_RETRIES 20             // failed chunks in a row before giving up until reboot
+#define OTA_RETRY_DELAY_MS 2000        // doubled per failed chunk, up to 64 times
+#define OTA_TASK_STACK 12288           // TLS handshake runs on it
+#define OTA_TASK_PRIO 1
+
 //----------------------------
 // TLS
 //----------------------------
@@ -5,6 +5,9 @@
  * ESP/system-info on:
  * "admin/BLE/Scanner/"<connected_SSID>"/"<KD_DEVICE_ID>"
  *
+ * With FAST_BOOT BLE scanning starts first and records are buffered until WiFi, MQTT and NTP are up.
+ * The "Up now" message on admin topic reports the boot phases and time to the first published sample.
+ *
  * WifiMulti example from: https://github.com/espressif/arduino-esp32/blob/master/libraries/WiFi/examples/WiFiMulti/WiFiMulti.ino
  * Based on example "BLE_scan"
  *
@@ -21,8 +24,10 @@
 #include "get_time.h"
 #include "globals_kd.h"
 #include "led_blink.h"
+#include "metrics.h"
 #include "mqtts.h"
 #include "ota.h"
+#include "store_forward.h"
 
 // WiFi
 #include <WiFi.h>
@@ -38,11 +43,13 @@ WiFiMulti wifiMulti;
 //----------------------------
 // FORWARD DECLARATIONS
 //----------------------------
-bool sendMessage(const char *msg, bool admin);                  // mqtts
+bool sendMessage(const char *msg, bool admin, bool store);      // mqtts
+bool sendMessage(const uint8_t *payload, size_t length, bool admin, bool store);  // mqtts
 bool connectWiFi();                                             // main
 bool initDeviceNameFromFlash();                                 // main
 void initWiFi();                                                // main
 bool transmitAdminInfo(const char *msg);                        // main
+void reportBoot();                                              // main
 void onIncomingOtaMessage(byte *payload, unsigned int length);  // ota
 
 //----------------------------
@@ -57,6 +64,8 @@ char KD_DEVICE_ID[MAX_DEVICE_ID_LEN+1];
 char *FULL_DEVICE_NAME;
 char *getDeviceId() { return KD_DEVICE_ID; }
 char *getFullDeviceName() { return FULL_DEVICE_NAME; }
+// millis() at end of setup()
+static uint32_t setupDoneMs = 0;
 
 //----------------------------
 // SETUP
@@ -68,37 +77,83 @@ void setup() {
     initLed(true);
 
     initDeviceNameFromFlash();
+    metricsWatchTask("loopTask", xTaskGetCurrentTaskHandle());
     delay(100);
 
+#ifdef FAST_BOOT
+    // WiFi mode first and afterwards BLE ("strange issue"), connecting comes later
+    initWiFi();
+
+    // needs to be ready before first publish may fail
+    initStoreForward();
+
+    // publisher task holds records until time is synced
+    initPublisher();
+
+    // before scan starts
+    initCapture();
+
+    // scan runs in background from now on
+    initBLE();
+
+    // connect WiFi while scanning
+    bootPhaseBegin(BOOT_WIFI);
+    if (!connectWiFi()) {
+        ledBlinkTimes(indicator::WIFI_ERROR);  // WiFi error
+        ESP.restart();
+    }
+    bootPhaseEnd(BOOT_WIFI);
+
+    // sync time while connecting MQTT
+    initTimeNTP(false);
+
+    // WiFi connection is needed, loop() retries if it fails
+    bootPhaseBegin(BOOT_MQTT);
+    initMQTT();
+    if (!loopMQTT()) {
+        ledBlinkTimes(indicator::MQTT_ERROR);  // MQTT error
+    }
+#else
     // connect WiFi (first before BLE)
     initWiFi();
+    bootPhaseBegin(BOOT_WIFI);
     if (!connectWiFi()) {
         ledBlinkTimes(indicator::WIFI_ERROR);  // WiFi error
         ESP.restart();
     }
+    bootPhaseEnd(BOOT_WIFI);
     delay(100);
 
     // WiFi connection is needed
+    bootPhaseBegin(BOOT_MQTT);
     initMQTT();
     if (!loopMQTT()) {
         ledBlinkTimes(indicator::MQTT_ERROR);  // MQTT error
     }
     delay(100);
 
-    // Note to start WiFi first and afterwards BLE ("strange issue")
-    initBLE();
+    // needs to be ready before first publish may fail
+    initStoreForward();
+
+    // publisher task has to run before first scan results arrive
+    initPublisher();
     delay(100);
 
-    // Sync time (blocks until sync)
+    // before scan starts
+    initCapture();
+
+    // Sync time (blocks until sync), before scanning so each record has a valid timestamp
     initTimeNTP();
     delay(100);
 
-    // Inform about restart with unix epoch
-    std::stringstream helloMsg;
-    helloMsg << "Up now " << getTime();
-    helloMsg << " (v" << FW_VERSION << ")";
-    helloMsg << " after " << millis() / 1000 << " seconds of booting.";
-    transmitAdminInfo(helloMsg.str().c_str());
+    // Note to start WiFi first and afterwards BLE ("strange issue")
+    initBLE();
+    delay(100);
+#endif  // FAST_BOOT
+
+    // "Up now" is sent from loop() once first sample is published
+    setupDoneMs = millis();
+    reportBoot();
 
     ledOff();
 
@@ -122,9 +177,20 @@ void loop() {
     // NORMAL LOOP
     if (!isUpdateAvailable()) {
         loopMQTT();
+        reportBoot();
+#ifdef OTA_RESUME
+        // download runs in background, reboots once image is verified
+        loopOtaDownload();
+#endif  // OTA_RESUME
+#ifndef ASYNC_PUBLISH
+        // otherwise done by publisher task
+        replayStoredMessages();
+#endif  // ASYNC_PUBLISH
 
         // scan for x seconds
         scanBleDevicesForXSeconds(SCAN_TIME_IN_SECONDS);
+        reportStoreStats();
+        reportMetrics();
 
         // feed/reset watchdog
         esp_task_wdt_reset();
@@ -229,6 +295,7 @@ bool connectWiFi() {
         }
         Serial.println("!");
         Serial.println("- WiFi connected");
+        metricInc(MC_WIFI_CONNECTS);
         Serial.print("- IP address: ");
         Serial.println(WiFi.localIP());
 
@@ -252,11 +319,38 @@ bool connectWiFi() {
 //----------------------------
 // MESSAGES
 //----------------------------
-bool transmitSensorsData(const char *msg) {
-    return sendMessage(msg, false);
+bool transmitSensorsData(const char *msg, bool store) {
+    return sendMessage(msg, false, store);
+}
+bool transmitSensorsData(const uint8_t *payload, size_t length, bool store) {
+    return sendMessage(payload, length, false, store);
 }
 enum adminInfo { INFO,
                  ERR };
 bool transmitAdminInfo(const char *msg) {  //, adminInfo infoLevel) {
     return sendMessage(msg, true);
+}
+
+/**
+ * Informs about restart with unix epoch, durations of boot phases and time to first published sample.
+ * Waits for time sync and first sample, but at most one scan window longer (maybe no devices around).
+ */
+void reportBoot() {
+    static bool reported = false;
+    if (reported || !bootTimeline.done(BOOT_NTP) || !isConnectedMQTT()) return;
+    uint32_t firstSampleMs = bootTimeline.firstSampleMs();
+    if (firstSampleMs == 0 && millis() - bootTimeline.endTimeMs(BOOT_NTP) < SCAN_TIME_IN_SECONDS * 1000UL) return;
+
+    char phases[192];
+    bootTimeline.format(phases, sizeof(phases));
+    std::stringstream helloMsg;
+    helloMsg << "Up now " << getTime();
+    helloMsg << " (v" << FW_VERSION << ")";
+    helloMsg << " after " << setupDoneMs / 1000 << " seconds of booting.";
+    helloMsg << " Phases: " << phases << ".";
+    if (firstSampleMs > 0)
+        helloMsg << " First sample published after " << firstSampleMs << " ms.";
+    else
+        helloMsg << " No sample published yet.";
+    reported = transmitAdminInfo(helloMsg.str().c_str());
 }
\ No newline at end of file
@@ -0,0 +1,132 @@
+/**
+ * Collects pipeline metrics (see pipeline_metrics.h) and publishes them on the admin topic
+ * every METRICS_INTERVAL_S seconds:
+ * {"metrics": {"uptime": 600, "counters": {...}, "histograms": {...}, "clock": {...},
+ *  "heap": {"free": 123456, "minFree": 98765, "maxBlock": 65524}, "stackFree": {"loopTask": 5120, ...}}}
+ *
+ * Stack values are the high-water marks of free stack in bytes per task.
+ * */
+
+#ifndef METRICS_KD_H
+#define METRICS_KD_H
+
+#include <Arduino.h>
+
+#include "ble_json.h"
+#include "ble_record.h"
+#include "boot_timeline.h"
+#include "globals_kd.h"
+#include "pipeline_metrics.h"
+
+// forward declaration from main
+bool transmitAdminInfo(const char *msg);
+// forward declaration from get_time
+int64_t getEpochTimeUs();
+void jsonPutClock(JsonBuf &jb);
+
+#define METRICS_MAX_TASKS 4
+
+static Metrics metrics;
+static const char *metricsTaskNames[METRICS_MAX_TASKS];
+static TaskHandle_t metricsTasks[METRICS_MAX_TASKS];
+static size_t metricsTaskCount = 0;
+static uint32_t lastMetricsMs = 0;
+// reported on admin topic with "Up now" message
+static BootTimeline bootTimeline;
+
+inline void metricInc(MetricCounter c, uint32_t n = 1) {
+    metricAdd(metrics, c, n);
+}
+
+inline void metricLatency(MetricHistogram h, uint32_t us) {
+    metricRecord(metrics, h, us);
+}
+
+/**
+ * Time since record was captured (by its timestamp).
+ */
+uint32_t recordAgeUs(const BleAdvRecord &rec) {
+    int64_t age = getEpochTimeUs() - ((int64_t)rec.timestamp * 1000000 + rec.micros);
+    // time may have been set meanwhile
+    if (age < 0) return 0;
+    return age > UINT32_MAX ? UINT32_MAX : (uint32_t)age;
+}
+
+inline void bootPhaseBegin(BootPhase phase) {
+    bootTimeline.begin(phase, millis());
+}
+
+inline void bootPhaseEnd(BootPhase phase) {
+    bootTimeline.end(phase, millis());
+}
+
+/**
+ * First record published after boot (later calls are ignored).
+ */
+inline void bootSample() {
+    bootTimeline.sample(millis());
+}
+
+/**
+ * Adds task to stack reports, call once per task.
+ */
+void metricsWatchTask(const char *name, TaskHandle_t task) {
+    if (metricsTaskCount >= METRICS_MAX_TASKS || task == nullptr) return;
+    metricsTaskNames[metricsTaskCount] = name;
+    metricsTasks[metricsTaskCount] = task;
+    metricsTaskCount++;
+}
+
+#ifdef PUBLISH_METRICS
+// worst case: all histogram buckets in use
+static char metricsBuf[3072];
+
+/**
+ * Called from loop(), publishes if METRICS_INTERVAL_S passed since last report.
+ */
+void reportMetrics() {
+    uint32_t now = millis();
+    if (now - lastMetricsMs < METRICS_INTERVAL_S * 1000UL) return;
+    lastMetricsMs = now;
+
+    JsonBuf jb;
+    jsonInit(jb, metricsBuf, sizeof(metricsBuf));
+    jsonPut(jb, "{\"metrics\": {\"uptime\": ");
+    jsonPutUInt(jb, now / 1000);
+    jsonPut(jb, ", ");
+    jsonPutMetrics(jb, metrics);
+    jsonPut(jb, ", ");
+    jsonPutClock(jb);
+
+    jsonPut(jb, ", \"heap\": {\"free\": ");
+    jsonPutUInt(jb, ESP.getFreeHeap());
+    jsonPut(jb, ", \"minFree\": ");
+    jsonPutUInt(jb, ESP.getMinFreeHeap());
+    jsonPut(jb, ", \"maxBlock\": ");
+    jsonPutUInt(jb, ESP.getMaxAllocHeap());
+
+    // ESP-IDF reports stack in bytes
+    jsonPut(jb, "}, \"stackFree\": {");
+    for (size_t i = 0; i < metricsTaskCount; i++) {
+        if (i > 0) jsonPut(jb, ", ", 2);
+        jsonPutChar(jb, '"');
+        jsonPut(jb, metricsTaskNames[i]);
+        jsonPut(jb, "\": ");
+        jsonPutUInt(jb, uxTaskGetStackHighWaterMark(metricsTasks[i]));
+    }
+    jsonPut(jb, "}}}");
+    if (jb.overflow) {
+        Serial.println("- ERR: Metrics exceed buffer, skip.");
+        return;
+    }
+    jb.buf[jb.len] = '\0';
+    Serial.printf("- Metrics: %u received, %u published, %u dropped, %u failed, heap %u (min %u).\n",
+                  metricGet(metrics, MC_ADV_RECEIVED), metricGet(metrics, MC_REC_PUBLISHED), metricGet(metrics, MC_ADV_DROPPED),
+                  metricGet(metrics, MC_MSG_FAILED), ESP.getFreeHeap(), ESP.getMinFreeHeap());
+    transmitAdminInfo(metricsBuf);
+}
+#else
+void reportMetrics() {}
+#endif  // PUBLISH_METRICS
+
+#endif  // METRICS_KD_H
@@ -5,8 +5,6 @@ https://github.com/knolleary/pubsubclient/pull/851/commits/c2098031d1e6d4144cc86
 check: https://github.com/knolleary/pubsubclient/issues/462#issuecomment-542911896
 */
 
-// TODO: check for MAX_MESSAGE_SIZE and handle long messages in sendMessage()
-
 #ifndef MQTTS_KD_H
 #define MQTTS_KD_H
 
@@ -14,17 +12,28 @@ check: https://github.com/knolleary/pubsubclient/issues/462#issuecomment-5429118
 
 #include <sstream>
 
+#include "buffered_client.h"
 #include "globals_kd.h"
 #include "led_blink.h"
+#include "metrics.h"
+#include "reconnect_backoff.h"
 
 #ifdef SECURE_MQTT
+#ifdef TLS_SESSION_RESUMPTION
+#include "tls_session_client.h"
+#else
 #include <WiFiClientSecure.h>
+#endif  // TLS_SESSION_RESUMPTION
 #else
 #include <WiFiClient.h>
 #endif  // SECURE_MQTT
 
 #ifdef SECURE_MQTT
+#ifdef TLS_SESSION_RESUMPTION
+TlsSessionClient client;
+#else
 WiFiClientSecure client;
+#endif  // TLS_SESSION_RESUMPTION
 uint16_t MQTT_PORT = 8883;
 #else
 WiFiClient client;
@@ -37,18 +46,51 @@ char *getFullDeviceName();                                        // from main
 char *getDeviceId();                                              // from main
 void onIncomingOtaMessage(byte *payload, unsigned int length);    // from main from ota
 void onMessage(char *topic, byte *payload, unsigned int length);  // from below
-bool sendMessage(const char *msg, bool admin);                    // from below
+bool sendMessage(const char *msg, bool admin, bool store = true);  // from below
+bool sendMessage(const uint8_t *payload, size_t length, bool admin, bool store = true);  // from below
+bool storeSensorMessage(const uint8_t *payload, size_t length);   // from store_forward
 
 char *MQTT_CLIENT_ID;
 const char *MQTT_HOST = MQTT_HOST_CN;
 
+#ifdef COALESCE_WRITES
+// gathers MQTT packets into fewer TLS records
+BufferedClient<COALESCE_BUFFER_SIZE> bufferedClient(client, COALESCE_MAX_DELAY_MS);
+PubSubClient mqtt_client(bufferedClient);
+#else
 PubSubClient mqtt_client(client);
+#endif  // COALESCE_WRITES
 
 char *sensorsTopic = nullptr;
 char *adminTopic = nullptr;
 
 char *otaTopic = nullptr;
 
+// PubSubClient is not thread-safe, but publisher task and loop() are using it
+// recursive, since sendMessage() may call itself and connectMQTT() sends as well
+SemaphoreHandle_t mqttMutex = nullptr;
+
+// connects are made one attempt at a time, so loop() goes on while broker is unreachable
+static ReconnectBackoff mqttBackoff(MQTT_RECONNECT_MIN_MS, MQTT_RECONNECT_MAX_MS);
+static bool mqttWasConnected = false;
+
+void lockMQTT() {
+    if (mqttMutex != nullptr) xSemaphoreTakeRecursive(mqttMutex, portMAX_DELAY);
+}
+
+/**
+ * Takes mutex if it gets free within waitMs. A connect attempt holds it for seconds,
+ * so publishing fails fast meanwhile instead of waiting for it.
+ */
+bool tryLockMQTT(uint32_t waitMs = 0) {
+    if (mqttMutex == nullptr) return true;
+    return xSemaphoreTakeRecursive(mqttMutex, pdMS_TO_TICKS(waitMs)) == pdTRUE;
+}
+
+void unlockMQTT() {
+    if (mqttMutex != nullptr) xSemaphoreGiveRecursive(mqttMutex);
+}
+
 bool subscribeToTopics() {
 #ifdef OTA_UPDATE
     return mqtt_client.subscribe(otaTopic);
@@ -68,6 +110,8 @@ void setTopicStrings() {
     adminTopic = new char[ss.str().size() + 1];
     strcpy(adminTopic, ss.str().c_str());
     Serial.printf("- Set up topics to \"%s\" and \"%s\".\n", sensorsTopic, adminTopic);
+    if (strlen(sensorsTopic) > MQTT_MAX_TOPIC_LEN || strlen(adminTopic) > MQTT_MAX_TOPIC_LEN)
+        Serial.printf("- ERR: Topics longer than MQTT_MAX_TOPIC_LEN, worst-case records may not fit into messages.\n");
 
     std::stringstream().swap(ss);
     ss << OTA_TOPIC_PRE << getDeviceId();
@@ -77,48 +121,92 @@ void setTopicStrings() {
     Serial.printf("- Set up ota topic \"%s\".\n", otaTopic);
 }
 
-void connectMQTT() {
-    while (!mqtt_client.connected()) {
-        Serial.println("Connecting MQTT...");
+/**
+ * Counts TLS handshake of last connect attempt.
+ */
+void countHandshake(bool connected) {
+#ifdef SECURE_MQTT
+#ifdef TLS_SESSION_RESUMPTION
+    if (client.lastHandshakeKind() == TLS_HANDSHAKE_FULL) metricInc(MC_TLS_HANDSHAKES);
+    if (client.lastHandshakeKind() == TLS_HANDSHAKE_RESUMED) metricInc(MC_TLS_RESUMED);
+#else
+    // WiFiClientSecure does not tell, at least each connect had a full one
+    if (connected) metricInc(MC_TLS_HANDSHAKES);
+#endif  // TLS_SESSION_RESUMPTION
+#endif  // SECURE_MQTT
+}
+
+/**
+ * Makes one connect attempt (blocks for it only). Call with mutex held.
+ * Returns true if connected.
+ */
+bool connectMQTT() {
+    Serial.println("Connecting MQTT...");
+    uint32_t start = millis();
 #ifdef MQTT_USERNAME
-        // topics are setup already here
-        bool connected = mqtt_client.connect(MQTT_CLIENT_ID, MQTT_USERNAME, MQTT_PASSWD, adminTopic, 0, false, MQTT_LAST_WILL_MSG);
+    // topics are setup already here
+    bool connected = mqtt_client.connect(MQTT_CLIENT_ID, MQTT_USERNAME, MQTT_PASSWD, adminTopic, 0, false, MQTT_LAST_WILL_MSG);
 #else
-        bool connected = mqtt_client.connect(MQTT_CLIENT_ID);
+    bool connected = mqtt_client.connect(MQTT_CLIENT_ID);
 #endif  // MQTT_USERNAME
-        if (!connected) {
-            Serial.print("- Failed with rc=");
-            Serial.print(mqtt_client.state());
-            Serial.println(" retrying...");
-            ledBlinkTimes(indicator::MQTT_ERROR);  // MQTT error
-        }
+    uint32_t now = millis();
+    metricLatency(MH_CONNECT_MS, now - start);
+    countHandshake(connected);
+    if (!connected) {
+        metricInc(MC_MQTT_CONNECT_FAILED);
+        mqttBackoff.failed(now, esp_random());
+        Serial.printf("- Failed with rc=%d after %u ms, retry in %u ms.\n", mqtt_client.state(), now - start, mqttBackoff.waitTimeMs());
+        return false;
     }
-    Serial.println("- MQTT Connected!");
+    uint32_t outage = mqttBackoff.succeeded(now);
+    // first connect after boot is no reconnect
+    if (mqttWasConnected) metricLatency(MH_RECONNECT_MS, outage);
+    mqttWasConnected = true;
+    bootPhaseEnd(BOOT_MQTT);
+    Serial.printf("- MQTT Connected after %u ms!\n", now - start);
+    metricInc(MC_MQTT_CONNECTS);
     sendMessage(MQTT_CONNECT_MSG, true);
     if (!subscribeToTopics()) {
         // TODO: Handle this case
         Serial.println("- ERR: Could not subscribe topics!");
     }
+    return true;
 }
 
+/**
+ * Keeps connection alive. If it is down, makes a connect attempt once the backoff delay passed.
+ * Returns false if not connected.
+ */
 bool loopMQTT() {
+    lockMQTT();
     if (!mqtt_client.connected()) {
-        connectMQTT();
+        uint32_t now = millis();
+        mqttBackoff.lost(now);
+        if (mqttBackoff.due(now)) connectMQTT();
     }
-    return mqtt_client.loop();
+    bool ok = mqtt_client.connected() && mqtt_client.loop();
+    unlockMQTT();
+    return ok;
 }
 
 void initMQTT() {
     Serial.println("Setup MQTT...");
+    mqttMutex = xSemaphoreCreateRecursiveMutex();
 #ifdef SECURE_MQTT
     // Set up the root ca certificate
     client.setCACert((char *)ROOT_CERT);
+    client.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT_S);
     Serial.println("- With CA cert");
+#ifdef TLS_SESSION_RESUMPTION
+    Serial.println("- With TLS session resumption");
+#endif  // TLS_SESSION_RESUMPTION
 #endif  // SECURE_MQTT
     Serial.printf("- Connect MQTT to \"%s\" on port \"%d\"\n", MQTT_HOST, MQTT_PORT);
     mqtt_client.setServer(MQTT_HOST, MQTT_PORT);
     mqtt_client.setBufferSize(MAX_MQTT_MESSAGE_SIZE);
     mqtt_client.setCallback(onMessage);
+    // bound a single connect attempt
+    mqtt_client.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
 
     MQTT_CLIENT_ID = getFullDeviceName();
     Serial.printf("- Client id: \"%s\".\n", MQTT_CLIENT_ID);
@@ -129,17 +217,103 @@ void initMQTT() {
     setTopicStrings();
 }
 
-bool sendMessage(const char *msg, bool admin = false) {
+/**
+ * Max. payload length for one publish, since PubSubClient buffer holds header and topic as well.
+ */
+size_t getMaxPayloadSize(bool admin) {
+    const char *topic = admin ? adminTopic : sensorsTopic;
+    size_t overhead = MQTT_MAX_HEADER_SIZE + 2 + (topic != nullptr ? strlen(topic) : 0);
+    return MAX_MQTT_MESSAGE_SIZE > overhead ? MAX_MQTT_MESSAGE_SIZE - overhead : 0;
+}
+
+/**
+ * Publishes in one packet, streams payloads exceeding the buffer of PubSubClient (e.g. metrics).
+ * Call with mutex held.
+ */
+static bool publishPayload(const char *topic, const uint8_t *payload, size_t length, bool admin) {
+    if (length <= getMaxPayloadSize(admin)) return mqtt_client.publish(topic, payload, length);
+    return mqtt_client.beginPublish(topic, length, false) && mqtt_client.write(payload, length) == length && mqtt_client.endPublish();
+}
+
+/**
+ * Sensor messages that fail are stored (if STORE_AND_FORWARD), unless store is false.
+ */
+bool sendMessage(const uint8_t *payload, size_t length, bool admin = false, bool store) {
+    if (!tryLockMQTT(MQTT_LOCK_WAIT_MS)) {
+        // e.g. connect attempt of other task in progress, don't wait for it
+        if (!admin) {
+            metricInc(MC_MSG_FAILED);
+            if (store) storeSensorMessage(payload, length);
+        }
+        return false;
+    }
     ledOn();
     char *topic = admin ? adminTopic : sensorsTopic;
 
+    uint32_t start = micros();
+    bool sent = publishPayload(topic, payload, length, admin);
+#ifdef COALESCE_WRITES
+    // admin messages are rare and may precede a restart
+    if (admin) bufferedClient.flush();
+#endif  // COALESCE_WRITES
+    if (!admin) {
+        metricLatency(MH_PUBLISH_US, micros() - start);
+        if (sent) {
+            metricInc(MC_MSG_PUBLISHED);
+            metricInc(MC_BYTES_PUBLISHED, length);
+        } else {
+            metricInc(MC_MSG_FAILED);
+            // keep it for later (if STORE_AND_FORWARD)
+            if (store) storeSensorMessage(payload, length);
+            sendMessage("Publish failed!", true);
+        }
+    }
+    ledOff();
+    unlockMQTT();
+    return sent;
+}
+
+bool sendMessage(const char *msg, bool admin = false, bool store) {
     // only send messages from info level upwards
     if (CORE_DEBUG_LEVEL > 2) Serial.println(msg);
 
-    bool sent = mqtt_client.publish(topic, msg);
-    if (!admin && !sent)
-        sendMessage("Publish failed!", true);
-    ledOff();
+    return sendMessage((const uint8_t *)msg, strlen(msg), admin, store);
+}
+
+/**
+ * Sends buffered MQTT packets now (COALESCE_WRITES), e.g. at the end of a scan window.
+ */
+void flushMQTT() {
+#ifdef COALESCE_WRITES
+    // done with next flush or poll otherwise
+    if (!tryLockMQTT()) return;
+    bufferedClient.flush();
+    unlockMQTT();
+#endif  // COALESCE_WRITES
+}
+
+/**
+ * Sends buffered MQTT packets that waited COALESCE_MAX_DELAY_MS.
+ */
+void pollMQTT() {
+#ifdef COALESCE_WRITES
+    if (!tryLockMQTT()) return;
+    bufferedClient.poll();
+    unlockMQTT();
+#endif  // COALESCE_WRITES
+}
+
+bool isConnectedMQTT() {
+    return mqtt_client.connected();
+}
+
+/**
+ * Publishes a message replayed from store. Does not store it again on failure.
+ */
+bool publishStoredMessage(const uint8_t *payload, size_t length) {
+    if (!tryLockMQTT(MQTT_LOCK_WAIT_MS)) return false;
+    bool sent = publishPayload(sensorsTopic, payload, length, false);
+    unlockMQTT();
     return sent;
 }
 
@@ -1,6 +1,17 @@
 /**
  *
  * https://github.com/espressif/arduino-esp32/blob/master/libraries/Update/examples/HTTPS_OTA_Update/HTTPS_OTA_Update.ino
+ *
+ * With OTA_DELTA a message containing "base" is a delta update: "url" points to a patch made by
+ * host_tools ota_diff from the running version "base" to "version". The patch is streamed and
+ * applied into the inactive OTA partition (see delta_patch.h), reading the base from the running
+ * partition. Before writing, the running image is hashed and compared to the patch; the new image
+ * is checked against "sha256" of the message before it is made bootable.
+ *
+ * With OTA_RESUME a full update ("sha256" required) does not stop scanning. A task fetches the
+ * image in chunks of range requests at OTA_RATE_BYTES_PER_SEC into the inactive partition (see
+ * ota_download.h) and saves progress, url and version in NVS. An interrupted download goes on
+ * after reboot. The logger restarts into the new image once it is hashed and validated.
  * */
 
 #ifndef OTA_KD_H
@@ -12,12 +23,58 @@
 
 #include "globals_kd.h"
 
+#if defined OTA_DELTA && !defined OTA_UPDATE
+#error "OTA_DELTA requires OTA_UPDATE"
+#endif
+#if defined OTA_RESUME && !defined OTA_UPDATE
+#error "OTA_RESUME requires OTA_UPDATE"
+#endif
+
+#if defined OTA_DELTA || defined OTA_RESUME
+#include <esp_http_client.h>
+#include <esp_ota_ops.h>
+
+#include "sha256.h"
+#endif  // OTA_DELTA || OTA_RESUME
+
+#ifdef OTA_DELTA
+#include "delta_patch.h"
+#endif  // OTA_DELTA
+
+#ifdef OTA_RESUME
+#include <Preferences.h>
+
+#include "ota_download.h"
+#endif  // OTA_RESUME
+
 static HttpsOTAStatus_t otastatus;
 
 static bool updateAvailable = false;
 static bool updateInProgress = false;
 
-static StaticJsonDocument<256> doc;
+// url, version, base and sha256
+static StaticJsonDocument<512> doc;
+
+#ifdef OTA_DELTA
+enum DeltaOtaState : uint8_t { DELTA_OTA_RUNNING, DELTA_OTA_SUCCESS, DELTA_OTA_FAIL };
+
+static bool deltaUpdate = false;
+static volatile DeltaOtaState deltaOtaState = DELTA_OTA_RUNNING;
+#endif  // OTA_DELTA
+
+#if defined OTA_DELTA || defined OTA_RESUME
+static uint8_t otaSha256[SHA256_LEN];
+#endif  // OTA_DELTA || OTA_RESUME
+
+#ifdef OTA_RESUME
+enum OtaResumeState : uint8_t { OTA_RESUME_IDLE, OTA_RESUME_PENDING, OTA_RESUME_RUNNING, OTA_RESUME_DONE, OTA_RESUME_FAILED };
+
+static volatile OtaResumeState otaResumeState = OTA_RESUME_IDLE;
+static volatile OtaDownloadError otaResumeError = OTA_DL_ERR_NONE;
+// copies, doc is overwritten by the next message
+static char otaUrl[256];
+static char otaVersion[16];
+#endif  // OTA_RESUME
 
 bool transmitAdminInfo(const char* msg);             // main
 int versionCompare(const char* v1, const char* v2);  // ota
@@ -26,6 +83,12 @@ bool isUpdateAvailable() { return updateAvailable; }
 bool isUpdating() { return updateInProgress; }
 
 void onIncomingOtaMessage(byte* payload, unsigned int length) {
+#ifdef OTA_RESUME
+    if (otaResumeState != OTA_RESUME_IDLE && otaResumeState != OTA_RESUME_FAILED) {
+        Serial.println("- OTA download in progress, ignore.");
+        return;
+    }
+#endif  // OTA_RESUME
     // make sure there will be no race condition
     if (!updateAvailable) {
         deserializeJson(doc, (const byte*)payload, length);
@@ -54,6 +117,23 @@ void onIncomingOtaMessage(byte* payload, unsigned int length) {
             Serial.printf("- Older version remote (%s) than local (%s), ignore.\n", version, FW_VERSION);
             return;
         }
+        if (doc.containsKey("base")) {
+#ifdef OTA_DELTA
+            const char* base = doc["base"];
+            if (versionCompare(base, FW_VERSION) != 0) {
+                Serial.printf("- Patch for base %s, but running %s, ignore.\n", base, FW_VERSION);
+                return;
+            }
+            if (!sha256FromHex(doc["sha256"], otaSha256)) {
+                Serial.println("- No valid key \"sha256\" contained, ignore.");
+                return;
+            }
+            deltaUpdate = true;
+#else
+            Serial.println("- Delta update, but OTA_DELTA not enabled, ignore.");
+            return;
+#endif  // OTA_DELTA
+        }
         Serial.printf("- Newer version remote (%s) than local (%s), will prepare update.\n", version, FW_VERSION);
 
         std::stringstream ss;
@@ -62,6 +142,24 @@ void onIncomingOtaMessage(byte* payload, unsigned int length) {
            << "version \"" << version << "\"";
         ss << "\n - "
            << "url \"" << url << "\"";
+        if (doc.containsKey("base")) {
+            ss << "\n - "
+               << "delta from base \"" << doc["base"].as<const char*>() << "\"";
+        }
+#ifdef OTA_RESUME
+        if (!doc.containsKey("base")) {
+            if (!sha256FromHex(doc["sha256"], otaSha256)) {
+                Serial.println("- No valid key \"sha256\" contained, ignore.");
+                return;
+            }
+            strncpy(otaUrl, url, sizeof(otaUrl) - 1);
+            strncpy(otaVersion, version, sizeof(otaVersion) - 1);
+            ss << "\n Will download in background now.";
+            transmitAdminInfo(ss.str().c_str());
+            otaResumeState = OTA_RESUME_PENDING;
+            return;
+        }
+#endif  // OTA_RESUME
         ss << "\n Will start update now.";
         transmitAdminInfo(ss.str().c_str());
 
@@ -94,9 +192,123 @@ void HttpEvent(HttpEvent_t* event) {
     }
 }
 
+#ifdef OTA_DELTA
+/**
+ * Patcher target: base is the running partition, new image goes to the next OTA partition.
+ */
+class OtaPartitionTarget {
+   public:
+    bool begin(const DeltaPatchHeader& h) {
+        if (memcmp(h.newSha256, otaSha256, SHA256_LEN) != 0) {
+            Serial.println("- Patch does not build the image of the OTA message.");
+            return false;
+        }
+        base = esp_ota_get_running_partition();
+        next = esp_ota_get_next_update_partition(nullptr);
+        if (base == nullptr || next == nullptr || h.baseSize > base->size || h.newSize > next->size) {
+            Serial.println("- Patch does not fit the partitions.");
+            return false;
+        }
+        // running image must be the one the patch was made from
+        Sha256 sha;
+        uint8_t chunk[1024];
+        for (uint32_t offset = 0; offset < h.baseSize; offset += sizeof(chunk)) {
+            size_t n = h.baseSize - offset < sizeof(chunk) ? h.baseSize - offset : sizeof(chunk);
+            if (esp_partition_read(base, offset, chunk, n) != ESP_OK) return false;
+            sha.update(chunk, n);
+            // let idle task run
+            if (offset % (64 * sizeof(chunk)) == 0) vTaskDelay(1);
+        }
+        uint8_t digest[SHA256_LEN];
+        sha.finish(digest);
+        if (memcmp(digest, h.baseSha256, SHA256_LEN) != 0) {
+            Serial.println("- Running image differs from base of patch.");
+            return false;
+        }
+        Serial.printf("- Patching %u bytes into partition %s...\n", h.newSize, next->label);
+        return esp_ota_begin(next, h.newSize, &handle) == ESP_OK;
+    }
+
+    bool readBase(uint32_t offset, uint8_t* buf, size_t len) { return esp_partition_read(base, offset, buf, len) == ESP_OK; }
+
+    bool writeNew(const uint8_t* buf, size_t len) { return esp_ota_write(handle, buf, len) == ESP_OK; }
+
+    /**
+     * Validates the written image and boots it next time.
+     */
+    bool end() {
+        esp_ota_handle_t h = handle;
+        handle = 0;
+        return esp_ota_end(h) == ESP_OK && esp_ota_set_boot_partition(next) == ESP_OK;
+    }
+
+    void abort() {
+        if (handle != 0) esp_ota_abort(handle);
+        handle = 0;
+    }
+
+   private:
+    const esp_partition_t* base = nullptr;
+    const esp_partition_t* next = nullptr;
+    esp_ota_handle_t handle = 0;
+};
+
+/**
+ * Downloads the patch and applies it while it arrives.
+ */
+static void deltaOtaTask(void* parameter) {
+    esp_http_client_config_t config = {};
+    config.url = doc["url"];
+    config.cert_pem = (const char*)ROOT_CERT;
+    config.timeout_ms = 10000;
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+
+    OtaPartitionTarget target;
+    DeltaPatcher<OtaPartitionTarget> patcher(target);
+    size_t received = 0;
+    if (client != nullptr && esp_http_client_open(client, 0) == ESP_OK) {
+        esp_http_client_fetch_headers(client);
+        int status = esp_http_client_get_status_code(client);
+        if (status == 200) {
+            uint8_t chunk[1024];
+            int n;
+            while ((n = esp_http_client_read(client, (char*)chunk, sizeof(chunk))) > 0) {
+                received += n;
+                if (patcher.feed(chunk, n) != DELTA_PATCH_MORE) break;
+            }
+        } else {
+            Serial.printf("- Http status %d\n", status);
+        }
+        esp_http_client_close(client);
+    }
+    if (client != nullptr) esp_http_client_cleanup(client);
+
+    bool ok = patcher.getStatus() == DELTA_PATCH_DONE;
+    if (ok) {
+        ok = target.end();
+        Serial.printf("- Patch of %u bytes applied, %u bytes written, image %s.\n", received, patcher.writtenBytes(), ok ? "valid" : "invalid");
+    } else {
+        target.abort();
+        Serial.printf("- Patch failed after %u bytes: %s\n", received,
+                      patcher.getStatus() == DELTA_PATCH_ERROR ? DELTA_PATCH_ERROR_NAMES[patcher.error()] : "incomplete");
+    }
+    deltaOtaState = ok ? DELTA_OTA_SUCCESS : DELTA_OTA_FAIL;
+    vTaskDelete(nullptr);
+}
+#endif  // OTA_DELTA
+
 void initOta() {
     // make sure to call this only once
     if (!updateInProgress) {
+#ifdef OTA_DELTA
+        if (deltaUpdate) {
+            Serial.printf("Starting delta OTA from \"%s\"...\n", doc["url"].as<const char*>());
+            xTaskCreate(deltaOtaTask, "delta_ota", 8192, nullptr, 1, nullptr);
+            Serial.println("- Please wait, OTA takes some time...");
+            updateInProgress = true;
+            return;
+        }
+#endif  // OTA_DELTA
         HttpsOTA.onHttpEvent(HttpEvent);
         const char* url = doc["url"];
         Serial.printf("Starting OTA from \"%s\"...\n", url);
@@ -106,7 +318,203 @@ void initOta() {
     }
 }
 
+#ifdef OTA_RESUME
+/**
+ * Ranged GETs with esp_http_client, a new request per chunk.
+ */
+class OtaHttpClient {
+   public:
+    explicit OtaHttpClient(const char* url) {
+        esp_http_client_config_t config = {};
+        config.url = url;
+        config.cert_pem = (const char*)ROOT_CERT;
+        config.timeout_ms = 10000;
+        config.event_handler = onEvent;
+        config.user_data = this;
+        client = esp_http_client_init(&config);
+    }
+
+    ~OtaHttpClient() {
+        if (client != nullptr) esp_http_client_cleanup(client);
+    }
+
+    int get(uint32_t offset, uint32_t len, OtaRange& range) {
+        if (client == nullptr) return -1;
+        char value[32];
+        snprintf(value, sizeof(value), "bytes=%u-%u", offset, offset + len - 1);
+        esp_http_client_set_header(client, "Range", value);
+        contentRange[0] = '\0';
+        if (esp_http_client_open(client, 0) != ESP_OK) return -1;
+        if (esp_http_client_fetch_headers(client) < 0) return -1;
+        parseContentRange(contentRange, range);
+        return esp_http_client_get_status_code(client);
+    }
+
+    int read(uint8_t* buf, size_t len) { return esp_http_client_read(client, (char*)buf, len); }
+
+    void close() {
+        if (client != nullptr) esp_http_client_close(client);
+    }
+
+   private:
+    static esp_err_t onEvent(esp_http_client_event_t* event) {
+        // response headers are only passed here
+        if (event->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(event->header_key, "Content-Range") == 0) {
+            OtaHttpClient* self = (OtaHttpClient*)event->user_data;
+            strncpy(self->contentRange, event->header_value, sizeof(self->contentRange) - 1);
+            self->contentRange[sizeof(self->contentRange) - 1] = '\0';
+        }
+        return ESP_OK;
+    }
+
+    esp_http_client_handle_t client = nullptr;
+    char contentRange[48];
+};
+
+/**
+ * Inactive OTA partition, written directly so chunks survive a reboot (esp_ota_begin would erase).
+ */
+class OtaPartitionFlash {
+   public:
+    explicit OtaPartitionFlash(const esp_partition_t* partition) : partition(partition) {}
+
+    bool erase(uint32_t offset, uint32_t len) {
+        len = (len + OTA_SECTOR_BYTES - 1) / OTA_SECTOR_BYTES * OTA_SECTOR_BYTES;
+        return esp_partition_erase_range(partition, offset, len) == ESP_OK;
+    }
+    bool write(uint32_t offset, const uint8_t* buf, size_t len) { return esp_partition_write(partition, offset, buf, len) == ESP_OK; }
+    bool read(uint32_t offset, uint8_t* buf, size_t len) { return esp_partition_read(partition, offset, buf, len) == ESP_OK; }
+    uint32_t capacity() const { return partition != nullptr ? partition->size : 0; }
+
+   private:
+    const esp_partition_t* partition;
+};
+
+/**
+ * Progress in NVS, valid for the partition it was written to only.
+ */
+class OtaProgressStore {
+   public:
+    explicit OtaProgressStore(const esp_partition_t* partition) : address(partition != nullptr ? partition->address : 0) {}
+
+    bool load(OtaProgress& progress) {
+        prefs.begin("kd_ota", true);
+        bool ok = prefs.getUInt("part", 0) == address && prefs.getBytes("progress", &progress, sizeof(progress)) == sizeof(progress);
+        prefs.end();
+        return ok;
+    }
+
+    bool save(const OtaProgress& progress) {
+        prefs.begin("kd_ota", false);
+        bool ok = prefs.putUInt("part", address) > 0 && prefs.putBytes("progress", &progress, sizeof(progress)) == sizeof(progress);
+        prefs.end();
+        return ok;
+    }
+
+   private:
+    Preferences prefs;
+    uint32_t address;
+};
+
+static void otaDownloadTask(void* parameter) {
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(nullptr);
+    OtaHttpClient http(otaUrl);
+    OtaPartitionFlash flash(partition);
+    OtaProgressStore store(partition);
+    static const OtaDownloadConfig CONFIG = {OTA_CHUNK_BYTES, OTA_RATE_BYTES_PER_SEC, OTA_MAX_RETRIES, OTA_RETRY_DELAY_MS};
+    OtaDownloader<OtaHttpClient, OtaPartitionFlash, OtaProgressStore> download(http, flash, store, CONFIG);
+
+    uint32_t done = download.begin(otaSha256);
+    Serial.printf("- OTA download of %s %s at %u bytes.\n", otaVersion, done > 0 ? "resumes" : "starts", done);
+    uint8_t lastTenth = 0;
+    OtaDownloadState state;
+    while ((state = download.step(millis())) != OTA_DL_DONE && state != OTA_DL_FAILED) {
+        const OtaProgress& p = download.getProgress();
+        uint8_t tenth = p.size > 0 ? (uint8_t)((uint64_t)p.done * 10 / p.size) : 0;
+        if (tenth != lastTenth) {
+            Serial.printf("- OTA download %u/%u bytes, %u retries.\n", p.done, p.size, download.retryCount());
+            lastTenth = tenth;
+        }
+        vTaskDelay(pdMS_TO_TICKS(download.waitMs(millis())) + 1);
+    }
+    // boot partition is only set for a valid image
+    if (state == OTA_DL_DONE && esp_ota_set_boot_partition(partition) == ESP_OK) {
+        otaResumeState = OTA_RESUME_DONE;
+    } else {
+        otaResumeError = state == OTA_DL_DONE ? OTA_DL_ERR_HASH : download.error();
+        otaResumeState = OTA_RESUME_FAILED;
+    }
+    vTaskDelete(nullptr);
+}
+
+/**
+ * Resumes a download saved before reboot, if its version is newer than the running one.
+ */
+static void resumeSavedOtaDownload() {
+    Preferences prefs;
+    prefs.begin("kd_ota", false);
+    OtaProgress p;
+    bool saved = prefs.getString("version", otaVersion, sizeof(otaVersion)) > 0 && prefs.getString("url", otaUrl, sizeof(otaUrl)) > 0 &&
+                 prefs.getBytes("progress", &p, sizeof(p)) == sizeof(p);
+    if (saved && versionCompare(otaVersion, FW_VERSION) > 0) {
+        memcpy(otaSha256, p.sha256, SHA256_LEN);
+        otaResumeState = OTA_RESUME_PENDING;
+    } else {
+        // finished or outdated
+        prefs.clear();
+    }
+    prefs.end();
+}
+
+/**
+ * Called from loop: starts, resumes and finishes background downloads.
+ */
+void loopOtaDownload() {
+    static bool checked = false;
+    if (!checked) {
+        checked = true;
+        resumeSavedOtaDownload();
+    }
+    if (otaResumeState == OTA_RESUME_PENDING) {
+        Preferences prefs;
+        prefs.begin("kd_ota", false);
+        prefs.putString("url", otaUrl);
+        prefs.putString("version", otaVersion);
+        prefs.end();
+        otaResumeState = OTA_RESUME_RUNNING;
+        xTaskCreatePinnedToCore(otaDownloadTask, "ota_download", OTA_TASK_STACK, nullptr, OTA_TASK_PRIO, nullptr, 1);
+    } else if (otaResumeState == OTA_RESUME_DONE) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "OTA image of version %s verified. Will reboot now...", otaVersion);
+        transmitAdminInfo(msg);
+        delay(1000);
+        ESP.restart();
+    } else if (otaResumeState == OTA_RESUME_FAILED && otaResumeError != OTA_DL_ERR_NONE) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "OTA download of version %s failed (%s). Continue old firmware, resumes after reboot.", otaVersion,
+                 OTA_DL_ERROR_NAMES[otaResumeError]);
+        transmitAdminInfo(msg);
+        // report once
+        otaResumeError = OTA_DL_ERR_NONE;
+    }
+}
+#endif  // OTA_RESUME
+
 bool loopOta() {
+#ifdef OTA_DELTA
+    if (deltaUpdate) {
+        if (deltaOtaState == DELTA_OTA_SUCCESS) {
+            Serial.println("- Firmware written successfully. Restart...");
+            ESP.restart();
+        } else if (deltaOtaState == DELTA_OTA_FAIL) {
+            Serial.println("- Upgrade failed!");
+            delay(1000);
+            return false;
+        }
+        delay(1000);
+        return true;
+    }
+#endif  // OTA_DELTA
     otastatus = HttpsOTA.status();
     if (otastatus == HTTPS_OTA_SUCCESS) {
         Serial.println("- Firmware written successfully. Restart...");
@@ -0,0 +1,262 @@
+/**
+ * Resumable OTA download in chunks of HTTP range requests (see OTA_RESUME).
+ *
+ * The image is written chunk by chunk into a flash partition at its offset. After each complete
+ * chunk the progress (SHA-256 of the image, size, bytes done) is saved, so after a disconnect or
+ * reboot the download goes on with the first missing chunk. A chunk is only counted once it is
+ * written completely, a broken one is erased and fetched again.
+ *
+ * Each step() fetches one chunk (or hashes one chunk while verifying) and returns; the next one
+ * is due so that bytesPerSec is not exceeded on average, failed chunks are retried with doubling
+ * delays. Once all bytes are there, the partition is read back and hashed. Only if it matches,
+ * state is OTA_DL_DONE and the image may be booted. Otherwise the download starts over once.
+ *
+ * Transport, flash and progress store are template parameters:
+ *   Http:  int get(uint32_t offset, uint32_t len, OtaRange &range)  // ranged GET, HTTP status or < 0
+ *          int read(uint8_t *buf, size_t len)                        // body bytes, <= 0 on end or error
+ *          void close()
+ *   Flash: bool erase(uint32_t offset, uint32_t len)                 // offset at sector, len rounded up
+ *          bool write(uint32_t offset, const uint8_t *buf, size_t len)
+ *          bool read(uint32_t offset, uint8_t *buf, size_t len)
+ *          uint32_t capacity()
+ *   Store: bool load(OtaProgress &progress)
+ *          bool save(const OtaProgress &progress)
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef OTA_DOWNLOAD_KD_H
+#define OTA_DOWNLOAD_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha256.h"
+
+#define OTA_SECTOR_BYTES 4096
+
+struct OtaProgress {
+    uint8_t sha256[SHA256_LEN];
+    uint32_t size;  // 0 until first response
+    uint32_t done;  // bytes written, multiple of chunk size unless complete
+};
+
+struct OtaRange {
+    uint32_t first;
+    uint32_t last;
+    uint32_t total;
+};
+
+struct OtaDownloadConfig {
+    uint32_t chunkBytes;   // rounded to sectors
+    uint32_t bytesPerSec;  // 0 for no limit
+    uint16_t maxRetries;   // failed chunks in a row
+    uint32_t retryDelayMs;
+};
+
+enum OtaDownloadState : uint8_t { OTA_DL_DOWNLOAD, OTA_DL_VERIFY, OTA_DL_DONE, OTA_DL_FAILED };
+
+enum OtaDownloadError : uint8_t {
+    OTA_DL_ERR_NONE,
+    OTA_DL_ERR_HTTP,      // no connection or unexpected status
+    OTA_DL_ERR_NO_RANGE,  // server ignores range requests
+    OTA_DL_ERR_RANGE,     // wrong content range
+    OTA_DL_ERR_SIZE,      // image does not fit
+    OTA_DL_ERR_READ,      // connection lost within chunk
+    OTA_DL_ERR_FLASH,
+    OTA_DL_ERR_HASH,
+    OTA_DL_ERR_COUNT
+};
+
+static const char *const OTA_DL_ERROR_NAMES[OTA_DL_ERR_COUNT] = {"none", "http", "no range", "range", "size", "read", "flash", "hash"};
+
+/**
+ * Parses a Content-Range header value "bytes <first>-<last>/<total>".
+ */
+inline bool parseContentRange(const char *value, OtaRange &range) {
+    if (value == nullptr || strncmp(value, "bytes ", 6) != 0) return false;
+    char *end;
+    unsigned long first = strtoul(value + 6, &end, 10);
+    if (*end != '-') return false;
+    unsigned long last = strtoul(end + 1, &end, 10);
+    if (*end != '/') return false;
+    unsigned long total = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || first > last || last >= total || total > UINT32_MAX) return false;
+    range.first = (uint32_t)first;
+    range.last = (uint32_t)last;
+    range.total = (uint32_t)total;
+    return true;
+}
+
+template <typename Http, typename Flash, typename Store, size_t BufLen = 2048>
+class OtaDownloader {
+   public:
+    OtaDownloader(Http &http, Flash &flash, Store &store, const OtaDownloadConfig &config) : http(http), flash(flash), store(store), cfg(config) {
+        cfg.chunkBytes = (cfg.chunkBytes + OTA_SECTOR_BYTES - 1) / OTA_SECTOR_BYTES * OTA_SECTOR_BYTES;
+        if (cfg.chunkBytes == 0) cfg.chunkBytes = OTA_SECTOR_BYTES;
+    }
+
+    /**
+     * Starts the download of the image with given hash, or resumes it if the store holds
+     * progress for it. Returns bytes already done.
+     */
+    uint32_t begin(const uint8_t sha256[SHA256_LEN]) {
+        OtaProgress saved;
+        if (store.load(saved) && memcmp(saved.sha256, sha256, SHA256_LEN) == 0 && saved.done <= saved.size && saved.size <= flash.capacity()) {
+            progress = saved;
+        } else {
+            memcpy(progress.sha256, sha256, SHA256_LEN);
+            progress.size = 0;
+            progress.done = 0;
+            store.save(progress);
+        }
+        resumedAt = progress.done;
+        if (progress.size > 0 && progress.done == progress.size) startVerify();
+        return progress.done;
+    }
+
+    /**
+     * Fetches or verifies the next chunk if it is due at nowMs.
+     */
+    OtaDownloadState step(uint32_t nowMs) {
+        if (state == OTA_DL_DONE || state == OTA_DL_FAILED) return state;
+        if ((int32_t)(nowMs - nextMs) < 0) return state;
+        if (state == OTA_DL_VERIFY) {
+            verifyChunk();
+            return state;
+        }
+        OtaDownloadError e = fetchChunk(nowMs);
+        if (e == OTA_DL_ERR_NONE) {
+            failures = 0;
+            if (progress.done == progress.size) startVerify();
+        } else if (e == OTA_DL_ERR_NO_RANGE || e == OTA_DL_ERR_SIZE || ++failures > cfg.maxRetries) {
+            fail(e);
+        } else {
+            err = e;
+            retries++;
+            uint8_t shift = failures - 1 < 6 ? failures - 1 : 6;
+            nextMs = nowMs + (cfg.retryDelayMs << shift);
+        }
+        return state;
+    }
+
+    /**
+     * Milliseconds until next step is due.
+     */
+    uint32_t waitMs(uint32_t nowMs) const {
+        if (state == OTA_DL_DONE || state == OTA_DL_FAILED) return 0;
+        int32_t d = (int32_t)(nextMs - nowMs);
+        return d > 0 ? (uint32_t)d : 0;
+    }
+
+    OtaDownloadState getState() const { return state; }
+    // last error, also of retried chunks
+    OtaDownloadError error() const { return err; }
+    const OtaProgress &getProgress() const { return progress; }
+    uint32_t resumedAtBytes() const { return resumedAt; }
+    // body bytes received, including those of failed chunks
+    uint32_t fetchedBytes() const { return fetched; }
+    uint32_t retryCount() const { return retries; }
+
+   private:
+    OtaDownloadError fetchChunk(uint32_t nowMs) {
+        uint32_t offset = progress.done;
+        uint32_t len = progress.size > 0 && progress.size - offset < cfg.chunkBytes ? progress.size - offset : cfg.chunkBytes;
+        OtaRange range = {0, 0, 0};
+        int status = http.get(offset, len, range);
+        if (status == 200) return closeWith(OTA_DL_ERR_NO_RANGE);
+        if (status != 206) return closeWith(OTA_DL_ERR_HTTP);
+        if (range.first != offset || range.last >= offset + len || (progress.size > 0 && range.total != progress.size)) return closeWith(OTA_DL_ERR_RANGE);
+        if (progress.size == 0) {
+            if (range.total > flash.capacity()) return closeWith(OTA_DL_ERR_SIZE);
+            progress.size = range.total;
+            // first response of a short image may be shorter than a chunk
+            if (range.last + 1 < offset + len && range.last + 1 != range.total) return closeWith(OTA_DL_ERR_RANGE);
+        } else if (range.last + 1 != offset + len) {
+            return closeWith(OTA_DL_ERR_RANGE);
+        }
+        uint32_t count = range.last - range.first + 1;
+        if (!flash.erase(offset, count)) return closeWith(OTA_DL_ERR_FLASH);
+        uint32_t got = 0;
+        while (got < count) {
+            size_t want = count - got < BufLen ? count - got : BufLen;
+            int n = http.read(buf, want);
+            if (n <= 0) return closeWith(OTA_DL_ERR_READ);
+            if ((size_t)n > want) n = (int)want;
+            fetched += n;
+            if (!flash.write(offset + got, buf, n)) return closeWith(OTA_DL_ERR_FLASH);
+            got += n;
+        }
+        http.close();
+        progress.done += count;
+        store.save(progress);
+        if (cfg.bytesPerSec > 0) nextMs = nowMs + (uint32_t)((uint64_t)count * 1000 / cfg.bytesPerSec);
+        return OTA_DL_ERR_NONE;
+    }
+
+    OtaDownloadError closeWith(OtaDownloadError e) {
+        http.close();
+        return e;
+    }
+
+    void startVerify() {
+        state = OTA_DL_VERIFY;
+        verified = 0;
+        sha.reset();
+    }
+
+    void verifyChunk() {
+        uint32_t end = progress.size - verified < cfg.chunkBytes ? progress.size : verified + cfg.chunkBytes;
+        while (verified < end) {
+            size_t n = end - verified < BufLen ? end - verified : BufLen;
+            if (!flash.read(verified, buf, n)) {
+                fail(OTA_DL_ERR_FLASH);
+                return;
+            }
+            sha.update(buf, n);
+            verified += n;
+        }
+        if (verified < progress.size) return;
+        uint8_t digest[SHA256_LEN];
+        sha.finish(digest);
+        if (memcmp(digest, progress.sha256, SHA256_LEN) == 0) {
+            state = OTA_DL_DONE;
+            return;
+        }
+        // some chunk is corrupt, which one is unknown
+        err = OTA_DL_ERR_HASH;
+        progress.done = 0;
+        store.save(progress);
+        if (++hashFailures > 1) {
+            fail(OTA_DL_ERR_HASH);
+            return;
+        }
+        state = OTA_DL_DOWNLOAD;
+    }
+
+    void fail(OtaDownloadError e) {
+        err = e;
+        state = OTA_DL_FAILED;
+    }
+
+    Http &http;
+    Flash &flash;
+    Store &store;
+    OtaDownloadConfig cfg;
+    OtaProgress progress = {};
+    OtaDownloadState state = OTA_DL_DOWNLOAD;
+    OtaDownloadError err = OTA_DL_ERR_NONE;
+    Sha256 sha;
+    uint8_t buf[BufLen];
+    uint32_t nextMs = 0;
+    uint32_t verified = 0;
+    uint32_t resumedAt = 0;
+    uint32_t fetched = 0;
+    uint32_t retries = 0;
+    uint16_t failures = 0;
+    uint8_t hashFailures = 0;
+};
+
+#endif  // OTA_DOWNLOAD_KD_H
@@ -0,0 +1,35 @@
+/**
+ * FlashIo on the data partition (spiffs partition of min_spiffs.csv).
+ * */
+
+#ifndef PARTITION_FLASH_IO_KD_H
+#define PARTITION_FLASH_IO_KD_H
+
+#include <esp_partition.h>
+
+#include "flash_log.h"
+
+class PartitionFlashIo : public FlashIo {
+   public:
+    bool begin() {
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+        return partition != nullptr;
+    }
+    size_t size() override {
+        return partition->size / FLASH_LOG_SECTOR_SIZE * FLASH_LOG_SECTOR_SIZE;
+    }
+    bool read(size_t offset, void *buf, size_t len) override {
+        return esp_partition_read(partition, offset, buf, len) == ESP_OK;
+    }
+    bool write(size_t offset, const void *buf, size_t len) override {
+        return esp_partition_write(partition, offset, buf, len) == ESP_OK;
+    }
+    bool eraseSector(size_t offset) override {
+        return esp_partition_erase_range(partition, offset, FLASH_LOG_SECTOR_SIZE) == ESP_OK;
+    }
+
+   private:
+    const esp_partition_t *partition = nullptr;
+};
+
+#endif  // PARTITION_FLASH_IO_KD_H
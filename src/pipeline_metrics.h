@@ -0,0 +1,193 @@
+/**
+ * Pipeline metrics: counters and log-bucketed latency histograms.
+ *
+ * Recording is a single relaxed atomic add, so it can be done from the BT task,
+ * the publisher task and loop() alike. Counters are totals since boot.
+ * Histograms are taken (and cleared) with each report, so they cover one interval.
+ *
+ * Histogram bucket i holds values v with 2^(i-1) <= v < 2^i (bucket 0 holds v = 0),
+ * so bucket 10 is about 1 ms and bucket 20 about 1 s for microseconds.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef PIPELINE_METRICS_KD_H
+#define PIPELINE_METRICS_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "ble_json.h"
+
+enum MetricCounter {
+    MC_ADV_RECEIVED,         // advertisements delivered by the controller
+    MC_ADV_REPORTED,         // after filter rules and duplicate filter
+    MC_ADV_FILTERED,         // dropped by filter rules
+    MC_ADV_TRUNCATED,        // truncated by filter rules
+    MC_ADV_DROPPED,          // publish queue full
+    MC_REC_SERIALIZED,       // records encoded into a message
+    MC_REC_DELTA,            // records encoded as delta (DELTA_ENCODING)
+    MC_REC_PUBLISHED,        // records in published messages
+    MC_MSG_PUBLISHED,        // sensor messages
+    MC_MSG_FAILED,           // sensor messages not published
+    MC_BYTES_PUBLISHED,      // sensor payload bytes
+    MC_MQTT_CONNECTS,        // successful MQTT connects (first one included)
+    MC_MQTT_CONNECT_FAILED,  // failed MQTT connect attempts
+    MC_TLS_HANDSHAKES,       // full TLS handshakes
+    MC_TLS_RESUMED,          // abbreviated TLS handshakes (TLS_SESSION_RESUMPTION)
+    MC_WIFI_CONNECTS,        // successful WiFi connects (first one included)
+    MC_AGG_DROPPED,          // aggregated records not queued (AGGREGATE_WINDOW, publish queue full)
+    MC_SEEN_OVERFLOW,        // sightings not reported, since duplicate filter was full (CONTINUOUS_SCAN)
+    MC_COUNT
+};
+
+static const char *const METRIC_COUNTER_NAMES[MC_COUNT] = {
+    "advReceived", "advReported", "advFiltered", "advTruncated", "advDropped", "recSerialized", "recDelta", "recPublished",
+    "msgPublished", "msgFailed", "bytesPublished", "mqttConnects", "mqttConnectFailed", "tlsHandshakes", "tlsResumed",
+    "wifiConnects", "aggDropped", "seenOverflow"};
+
+#define LOG_HIST_BUCKETS 33
+
+class LogHistogram {
+   public:
+    static uint8_t bucketOf(uint32_t value) {
+        return value == 0 ? 0 : (uint8_t)(32 - __builtin_clz(value));
+    }
+    // lower bound of values in bucket
+    static uint32_t bucketLow(uint8_t bucket) {
+        return bucket == 0 ? 0 : (uint32_t)1 << (bucket - 1);
+    }
+
+    void record(uint32_t value) {
+        buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        uint32_t m = maximum.load(std::memory_order_relaxed);
+        // rarely taken, max. only grows
+        while (value > m && !maximum.compare_exchange_weak(m, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    /**
+     * Moves counts into out (LOG_HIST_BUCKETS entries) and clears histogram.
+     * Returns max. value recorded.
+     */
+    uint32_t take(uint32_t *out) {
+        for (size_t i = 0; i < LOG_HIST_BUCKETS; i++)
+            out[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+        return maximum.exchange(0, std::memory_order_relaxed);
+    }
+
+   private:
+    std::atomic<uint32_t> buckets[LOG_HIST_BUCKETS] = {};
+    std::atomic<uint32_t> maximum{0};
+};
+
+enum MetricHistogram {
+    MH_QUEUE_US,      // capture to dequeue by publisher
+    MH_E2E_US,        // capture to publish returned
+    MH_PUBLISH_US,    // duration of one publish (broker round-trip)
+    MH_CONNECT_MS,    // duration of one MQTT connect attempt (TLS handshake included)
+    MH_RECONNECT_MS,  // connection lost to connected again
+    MH_COUNT
+};
+
+static const char *const METRIC_HISTOGRAM_NAMES[MH_COUNT] = {"queueUs", "e2eUs", "publishUs", "connectMs", "reconnectMs"};
+
+struct Metrics {
+    std::atomic<uint32_t> counters[MC_COUNT] = {};
+    LogHistogram histograms[MH_COUNT];
+};
+
+inline void metricAdd(Metrics &m, MetricCounter c, uint32_t n = 1) {
+    m.counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline uint32_t metricGet(const Metrics &m, MetricCounter c) {
+    return m.counters[c].load(std::memory_order_relaxed);
+}
+
+inline void metricRecord(Metrics &m, MetricHistogram h, uint32_t value) {
+    m.histograms[h].record(value);
+}
+
+/**
+ * Upper bound of the bucket holding the p-th percentile (p in 0..100).
+ */
+inline uint32_t histPercentile(const uint32_t *buckets, uint32_t total, uint32_t p) {
+    if (total == 0) return 0;
+    // rank of percentile, rounded up
+    uint32_t rank = (uint32_t)(((uint64_t)total * p + 99) / 100);
+    if (rank == 0) rank = 1;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LOG_HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) return i == 0 ? 0 : (i >= 32 ? UINT32_MAX : ((uint32_t)1 << i) - 1);
+    }
+    return UINT32_MAX;
+}
+
+/**
+ * "name": {"n": 12, "p50": 1023, "p99": 8191, "max": 5000, "lo": 9, "b": [3, 8, 1]}
+ * "b" holds the counts of buckets "lo" up to the last non-empty one.
+ * Takes (and clears) the histogram.
+ */
+inline void jsonPutHistogram(JsonBuf &jb, const char *name, LogHistogram &hist) {
+    uint32_t buckets[LOG_HIST_BUCKETS];
+    uint32_t maximum = hist.take(buckets);
+    uint32_t total = 0;
+    int lo = -1, hi = -1;
+    for (int i = 0; i < LOG_HIST_BUCKETS; i++) {
+        if (buckets[i] == 0) continue;
+        total += buckets[i];
+        if (lo < 0) lo = i;
+        hi = i;
+    }
+    jsonPutChar(jb, '"');
+    jsonPut(jb, name);
+    jsonPut(jb, "\": {\"n\": ");
+    jsonPutUInt(jb, total);
+    if (total > 0) {
+        // bucket bound may exceed max. seen
+        uint32_t p50 = histPercentile(buckets, total, 50);
+        uint32_t p99 = histPercentile(buckets, total, 99);
+        jsonPut(jb, ", \"p50\": ");
+        jsonPutUInt(jb, p50 < maximum ? p50 : maximum);
+        jsonPut(jb, ", \"p99\": ");
+        jsonPutUInt(jb, p99 < maximum ? p99 : maximum);
+        jsonPut(jb, ", \"max\": ");
+        jsonPutUInt(jb, maximum);
+        jsonPut(jb, ", \"lo\": ");
+        jsonPutUInt(jb, lo);
+        jsonPut(jb, ", \"b\": [");
+        for (int i = lo; i <= hi; i++) {
+            if (i > lo) jsonPut(jb, ", ", 2);
+            jsonPutUInt(jb, buckets[i]);
+        }
+        jsonPutChar(jb, ']');
+    }
+    jsonPutChar(jb, '}');
+}
+
+/**
+ * "counters": {"advReceived": 1234, ...}, "histograms": {"queueUs": {...}, ...}
+ * Caller writes surrounding braces and further members.
+ */
+inline void jsonPutMetrics(JsonBuf &jb, Metrics &m) {
+    jsonPut(jb, "\"counters\": {");
+    for (int c = 0; c < MC_COUNT; c++) {
+        if (c > 0) jsonPut(jb, ", ", 2);
+        jsonPutChar(jb, '"');
+        jsonPut(jb, METRIC_COUNTER_NAMES[c]);
+        jsonPut(jb, "\": ");
+        jsonPutUInt(jb, metricGet(m, (MetricCounter)c));
+    }
+    jsonPut(jb, "}, \"histograms\": {");
+    for (int h = 0; h < MH_COUNT; h++) {
+        if (h > 0) jsonPut(jb, ", ", 2);
+        jsonPutHistogram(jb, METRIC_HISTOGRAM_NAMES[h], m.histograms[h]);
+    }
+    jsonPutChar(jb, '}');
+}
+
+#endif  // PIPELINE_METRICS_KD_H
@@ -0,0 +1,477 @@
+/**
+ * Publishing of scanned BLE records.
+ *
+ * With ASYNC_PUBLISH the scan callback only copies each record into a lock-free queue.
+ * A dedicated FreeRTOS task drains the queue, serializes and publishes via MQTT.
+ * So a slow broker round-trip does not stall the BLE host callback anymore.
+ * If the queue is full, records are dropped and counted.
+ *
+ * With BATCH_PUBLISH (requires ASYNC_PUBLISH) the task packs as many records as fit
+ * into one JSON array message. A batch is published when it is full, when
+ * BATCH_DEADLINE_MS passed since its first record, or at the end of a scan window.
+ *
+ * With DELTA_ENCODING records are stripped of fields unchanged since the last record
+ * of the same device right before serialization. If a message cannot be published,
+ * the cache is reset and records are sent in full until a message is published again.
+ * Since stored messages (STORE_AND_FORWARD) are replayed after newer ones, they must not
+ * depend on others: a failed message holding deltas is stored with the full records instead
+ * (a batch is kept in full alongside for this).
+ *
+ * With FAST_BOOT (requires ASYNC_PUBLISH) the task holds records in a boot buffer until
+ * time is synced. Then it re-stamps them with wall-clock time and publishes them in order.
+ * The buffer is released afterwards.
+ *
+ * Fields of records are set by RecordSchema at compile time (see RECORD_SCHEMA and ble_schema.h).
+ * Its worst case has to fit into one message, checked by static_assert.
+ * */
+
+#ifndef PUBLISHER_KD_H
+#define PUBLISHER_KD_H
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+
+#include <atomic>
+
+#include "ble_batch.h"
+#include "ble_binary.h"
+#include "ble_delta.h"
+#include "ble_json.h"
+#include "ble_record.h"
+#include "ble_schema.h"
+#include "boot_buffer.h"
+#include "globals_kd.h"
+#include "metrics.h"
+#include "spsc_queue.h"
+
+// forward declaration from main
+bool transmitSensorsData(const char *msg, bool store = true);
+bool transmitSensorsData(const uint8_t *payload, size_t length, bool store = true);
+bool transmitAdminInfo(const char *msg);
+// forward declaration from mqtts
+size_t getMaxPayloadSize(bool admin);
+void flushMQTT();
+void pollMQTT();
+// forward declaration from store_forward
+void replayStoredMessages();
+bool storeSensorMessage(const uint8_t *payload, size_t length);
+// forward declaration from get_time
+bool timeSynced();
+int64_t getClockOffsetUs();
+
+#if defined BATCH_PUBLISH && !defined ASYNC_PUBLISH
+#error "BATCH_PUBLISH requires ASYNC_PUBLISH"
+#endif
+#if defined FAST_BOOT && !defined ASYNC_PUBLISH
+#error "FAST_BOOT requires ASYNC_PUBLISH"
+#endif
+
+#ifdef RECORD_SCHEMA
+typedef RECORD_SCHEMA RecordSchema;
+#else
+// fields as always, without those that cannot be set in this configuration
+#ifdef DELTA_ENCODING
+#define RECORD_HAVE_DELTA true
+#else
+#define RECORD_HAVE_DELTA false
+#endif  // DELTA_ENCODING
+#ifdef AGGREGATE_WINDOW
+#define RECORD_HAVE_STATS true
+#else
+#define RECORD_HAVE_STATS false
+#endif  // AGGREGATE_WINDOW
+#ifdef DECODE_FRAMES
+#define RECORD_HAVE_FRAME true
+#else
+#define RECORD_HAVE_FRAME false
+#endif  // DECODE_FRAMES
+typedef BleLegacySchema<RECORD_HAVE_DELTA, RECORD_HAVE_STATS, RECORD_HAVE_FRAME> RecordSchema;
+#endif  // RECORD_SCHEMA
+
+#ifndef BINARY_PAYLOAD
+#ifdef BATCH_PUBLISH
+// '[', record, ']' and '\0', besides header and topic
+static_assert(RecordSchema::maxJsonLen + 3 + MQTT_MESSAGE_OVERHEAD <= MAX_MQTT_MESSAGE_SIZE,
+              "Worst-case record of RecordSchema exceeds MAX_MQTT_MESSAGE_SIZE");
+#else
+static_assert(RecordSchema::maxJsonLen + 1 + MQTT_MESSAGE_OVERHEAD <= MAX_MQTT_MESSAGE_SIZE,
+              "Worst-case record of RecordSchema exceeds MAX_MQTT_MESSAGE_SIZE");
+#endif  // BATCH_PUBLISH
+#endif  // BINARY_PAYLOAD
+
+#ifdef DELTA_ENCODING
+// used by the publishing context only (publisher task, or scan callback without ASYNC_PUBLISH)
+static BleDeltaCache<DELTA_CACHE_SIZE> deltaCache(DELTA_KEYFRAME_S);
+// set while messages fail, records are sent in full meanwhile
+static bool deltaPaused = false;
+#endif  // DELTA_ENCODING
+
+/**
+ * Strips fields unchanged since last record of this device (if DELTA_ENCODING).
+ */
+void deltaEncode(BleAdvRecord &rec) {
+#ifdef DELTA_ENCODING
+    if (deltaPaused) return;
+    if (!deltaCache.encode(rec)) metricInc(MC_REC_DELTA);
+#endif  // DELTA_ENCODING
+}
+
+/**
+ * If a message got lost, receiver misses the base of following deltas.
+ */
+void deltaPublished(bool sent) {
+#ifdef DELTA_ENCODING
+    if (!sent) deltaCache.reset();
+    deltaPaused = !sent;
+#endif  // DELTA_ENCODING
+}
+
+/**
+ * Stores full record instead of a message with its delta (STORE_AND_FORWARD), buf is reused for it.
+ */
+void storeFullRecord(const BleAdvRecord &full, uint8_t *buf, size_t size) {
+#ifdef STORE_AND_FORWARD
+#ifdef BINARY_PAYLOAD
+    size_t len = binEncodeMessage(buf, size, full);
+#else
+    size_t len = RecordSchema::serialize((char *)buf, size, full);
+#endif  // BINARY_PAYLOAD
+    if (len > 0) storeSensorMessage(buf, len);
+#endif  // STORE_AND_FORWARD
+}
+
+bool publishBleAdvRecord(const BleAdvRecord &full) {
+    BleAdvRecord rec = full;
+    deltaEncode(rec);
+    bool delta = rec.delta & BLE_DELTA_RECORD;
+    bool sent;
+#ifdef BINARY_PAYLOAD
+    uint8_t bin[1 + BLE_BIN_MAX_RECORD_LEN];
+    size_t len = binEncodeMessage(bin, sizeof(bin), rec);
+    if (len == 0) return false;
+    metricInc(MC_REC_SERIALIZED);
+    sent = transmitSensorsData(bin, len, !delta);
+    uint8_t *buf = bin;
+    size_t size = sizeof(bin);
+#else
+    // serialize on stack, no heap involved
+    char msg[MAX_MQTT_MESSAGE_SIZE];
+    if (RecordSchema::serialize(msg, sizeof(msg), rec) == 0) {
+        Serial.println("- ERR: Record exceeds MAX_MQTT_MESSAGE_SIZE, skip.");
+        return false;
+    }
+    metricInc(MC_REC_SERIALIZED);
+    // Serial.print("Found device:");
+    // Serial.println(msg);
+    sent = transmitSensorsData(msg, !delta);
+    uint8_t *buf = (uint8_t *)msg;
+    size_t size = sizeof(msg);
+#endif  // BINARY_PAYLOAD
+    deltaPublished(sent);
+    if (!sent) {
+        if (delta) storeFullRecord(full, buf, size);
+        return false;
+    }
+    metricInc(MC_REC_PUBLISHED);
+    metricLatency(MH_E2E_US, recordAgeUs(rec));
+    bootSample();
+    return true;
+}
+
+#ifdef ASYNC_PUBLISH
+static SpscQueue<BleAdvRecord, PUBLISH_QUEUE_LEN> publishQueue;
+static TaskHandle_t publisherTaskHandle = nullptr;
+// values of last report
+static uint32_t reportedPushed = 0;
+static uint32_t reportedDropped = 0;
+static std::atomic<bool> flushRequested{false};
+
+#ifdef BATCH_PUBLISH
+static char batchBuf[MAX_MQTT_MESSAGE_SIZE];
+static BleBatch batch;
+#if defined DELTA_ENCODING && defined STORE_AND_FORWARD
+// same records in full, stored instead of batch if it fails
+#define BATCH_KEEP_FULL
+static char fullBatchBuf[MAX_MQTT_MESSAGE_SIZE];
+static BleBatch fullBatch;
+#endif  // DELTA_ENCODING && STORE_AND_FORWARD
+static uint32_t batchesSent = 0;
+static uint32_t batchesFailed = 0;
+static uint32_t reportedBatchesSent = 0;
+static uint32_t reportedBatchesFailed = 0;
+// capture time of records in batch (micros(), wrapping) for latency metrics
+// sized for smallest records possible (binary without optional fields)
+static uint32_t batchCaptureUs[MAX_MQTT_MESSAGE_SIZE / (1 + BLE_BIN_FIXED_LEN)];
+
+/**
+ * Returns false if batch could not be published.
+ */
+bool flushBatch() {
+    size_t len = batchFinish(batch);
+    if (len == 0) return true;
+#ifdef BATCH_KEEP_FULL
+    bool sent = transmitSensorsData((const uint8_t *)batch.buf, len, false);
+    if (!sent) storeSensorMessage((const uint8_t *)fullBatch.buf, batchFinish(fullBatch));
+    batchReset(fullBatch);
+#else
+    bool sent = transmitSensorsData((const uint8_t *)batch.buf, len);
+#endif  // BATCH_KEEP_FULL
+    deltaPublished(sent);
+    if (sent) {
+        metricInc(MC_REC_PUBLISHED, batch.count);
+        uint32_t now = micros();
+        for (size_t i = 0; i < batch.count; i++)
+            metricLatency(MH_E2E_US, now - batchCaptureUs[i]);
+        bootSample();
+        batchesSent++;
+    } else {
+        batchesFailed++;
+    }
+    batchReset(batch);
+    return sent;
+}
+
+/**
+ * rec as delta encoded, full as before.
+ */
+bool batchAddRecord(const BleAdvRecord &rec, const BleAdvRecord &full) {
+    size_t index = batch.count;
+#ifdef BATCH_KEEP_FULL
+    // both have to take it, so they are flushed together
+    BleBatch before = fullBatch;
+    if (!batchAdd<RecordSchema>(fullBatch, full, millis())) return false;
+    if (!batchAdd<RecordSchema>(batch, rec, millis())) {
+        fullBatch = before;
+        return false;
+    }
+#else
+    if (!batchAdd<RecordSchema>(batch, rec, millis())) return false;
+#endif  // BATCH_KEEP_FULL
+    metricInc(MC_REC_SERIALIZED);
+    batchCaptureUs[index] = micros() - recordAgeUs(rec);
+    return true;
+}
+
+void batchBleAdvRecord(const BleAdvRecord &full) {
+    BleAdvRecord rec = full;
+    deltaEncode(rec);
+    if (batchAddRecord(rec, full)) return;
+    // full, send and start next one
+    if (!flushBatch()) {
+        // base of rec may have been in there, send in full
+        rec = full;
+        deltaEncode(rec);
+    }
+    if (!batchAddRecord(rec, full))
+        Serial.println("- ERR: Record exceeds MAX_MQTT_MESSAGE_SIZE, skip.");
+}
+#endif  // BATCH_PUBLISH
+
+void publishQueuedRecord(const BleAdvRecord &rec) {
+#ifdef BATCH_PUBLISH
+    batchBleAdvRecord(rec);
+#else
+    publishBleAdvRecord(rec);
+#endif  // BATCH_PUBLISH
+}
+
+#ifdef FAST_BOOT
+// released once drained
+static BootBuffer<BOOT_BUFFER_LEN> *bootBuffer = nullptr;
+static int64_t bootOffsetUs = 0;
+
+/**
+ * Keeps records until time is synced.
+ * Returns true if rec was taken into boot buffer.
+ */
+bool holdBootRecord(BleAdvRecord &rec) {
+    if (bootBuffer != nullptr) {
+        if (!bootBuffer->push(rec)) metricInc(MC_ADV_DROPPED);
+        return true;
+    }
+    // captured before sync, but taken from queue after buffer was drained
+    bleRecRestamp(rec, bootOffsetUs);
+    return false;
+}
+
+/**
+ * Once time is synced, re-stamps and publishes buffered records.
+ */
+void pollBootBuffer() {
+    if (bootBuffer == nullptr || !timeSynced()) return;
+    bootOffsetUs = getClockOffsetUs();
+    size_t n = bootBuffer->drain(bootOffsetUs, publishQueuedRecord);
+    Serial.printf("- Time synced, published %u records captured before (%u dropped, buffer of %u).\n",
+                  n, bootBuffer->droppedCount(), bootBuffer->capacity());
+    delete bootBuffer;
+    bootBuffer = nullptr;
+}
+#endif  // FAST_BOOT
+
+void publisherTask(void *param) {
+#ifdef BATCH_PUBLISH
+    // topic is part of the MQTT packet as well
+    size_t limit = getMaxPayloadSize(false);
+#ifdef BINARY_PAYLOAD
+    bool binary = true;
+#else
+    bool binary = false;
+#endif  // BINARY_PAYLOAD
+    batchInit(batch, batchBuf, limit < sizeof(batchBuf) ? limit + 1 : sizeof(batchBuf), binary);
+#ifdef BATCH_KEEP_FULL
+    batchInit(fullBatch, fullBatchBuf, batch.size, binary);
+#endif  // BATCH_KEEP_FULL
+#endif  // BATCH_PUBLISH
+    BleAdvRecord rec;
+    for (;;) {
+#ifdef FAST_BOOT
+        pollBootBuffer();
+#endif  // FAST_BOOT
+        while (publishQueue.pop(rec)) {
+#ifdef FAST_BOOT
+            if (holdBootRecord(rec)) continue;
+#endif  // FAST_BOOT
+            metricLatency(MH_QUEUE_US, recordAgeUs(rec));
+            publishQueuedRecord(rec);
+        }
+        bool flush = flushRequested.exchange(false);
+#ifdef BATCH_PUBLISH
+        if (flush || batchDeadlinePassed(batch, millis(), BATCH_DEADLINE_MS))
+            flushBatch();
+#endif  // BATCH_PUBLISH
+        // buffered MQTT packets (COALESCE_WRITES)
+        if (flush)
+            flushMQTT();
+        else
+            pollMQTT();
+        // stored messages only if there is no live data
+        if (publishQueue.empty())
+            replayStoredMessages();
+        // sleep until producer notifies (or timeout as fallback)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+}
+
+void initPublisher() {
+    Serial.println("Setup publisher task...");
+#ifdef FAST_BOOT
+    bootBuffer = new BootBuffer<BOOT_BUFFER_LEN>();
+    Serial.printf("- With boot buffer of %d records (%u bytes).\n", BOOT_BUFFER_LEN, sizeof(*bootBuffer));
+#endif  // FAST_BOOT
+    xTaskCreatePinnedToCore(publisherTask, "publisher", PUBLISH_TASK_STACK, nullptr, PUBLISH_TASK_PRIO, &publisherTaskHandle, 1);
+    metricsWatchTask("publisher", publisherTaskHandle);
+    Serial.printf("- With queue of %d records (%u bytes).\n", PUBLISH_QUEUE_LEN, sizeof(publishQueue));
+}
+#else
+void initPublisher() {}
+#endif  // ASYNC_PUBLISH
+
+/**
+ * Called from scan callback.
+ * Returns false if record was dropped or could not be published.
+ */
+bool enqueueBleAdvRecord(const BleAdvRecord &rec) {
+#ifdef ASYNC_PUBLISH
+    bool queued = publishQueue.push(rec);
+    if (!queued) metricInc(MC_ADV_DROPPED);
+    if (publisherTaskHandle != nullptr)
+        xTaskNotifyGive(publisherTaskHandle);
+    return queued;
+#else
+    return publishBleAdvRecord(rec);
+#endif  // ASYNC_PUBLISH
+}
+
+/**
+ * As enqueueBleAdvRecord(), but waits up to waitMs for free space before dropping.
+ * Not to be used in scan callback. producerMutex is held by the scan callback while it enqueues,
+ * here it is taken for each push only, never while waiting.
+ */
+bool enqueueBleAdvRecordWait(const BleAdvRecord &rec, uint32_t waitMs, SemaphoreHandle_t producerMutex) {
+#ifdef ASYNC_PUBLISH
+    uint32_t start = millis();
+    for (;;) {
+        xSemaphoreTake(producerMutex, portMAX_DELAY);
+        // only the consumer changes the queue meanwhile, so a free slot stays free
+        bool queued = publishQueue.size() < publishQueue.capacity() && enqueueBleAdvRecord(rec);
+        xSemaphoreGive(producerMutex);
+        if (queued) return true;
+        if (millis() - start >= waitMs) {
+            metricInc(MC_ADV_DROPPED);
+            return false;
+        }
+        if (publisherTaskHandle != nullptr)
+            xTaskNotifyGive(publisherTaskHandle);
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+#else
+    return enqueueBleAdvRecord(rec);
+#endif  // ASYNC_PUBLISH
+}
+
+/**
+ * Called at the end of a scan window to publish pending batch and buffered MQTT packets.
+ */
+void requestPublisherFlush() {
+#ifdef ASYNC_PUBLISH
+    flushRequested = true;
+    if (publisherTaskHandle != nullptr)
+        xTaskNotifyGive(publisherTaskHandle);
+#else
+    flushMQTT();
+#endif  // ASYNC_PUBLISH
+}
+
+/**
+ * Records waiting in publish queue (0 without ASYNC_PUBLISH).
+ */
+size_t publishQueueDepth() {
+#ifdef ASYNC_PUBLISH
+    return publishQueue.size();
+#else
+    return 0;
+#endif  // ASYNC_PUBLISH
+}
+
+/**
+ * Records dropped by publish queue since boot (0 without ASYNC_PUBLISH).
+ */
+uint32_t publishQueueDropped() {
+#ifdef ASYNC_PUBLISH
+    return publishQueue.droppedCount();
+#else
+    return 0;
+#endif  // ASYNC_PUBLISH
+}
+
+/**
+ * Prints queue statistics since last call and informs admin topic about drops.
+ */
+void reportPublisherStats() {
+#ifdef ASYNC_PUBLISH
+    uint32_t pushed = publishQueue.pushedCount();
+    uint32_t dropped = publishQueue.droppedCount();
+    uint32_t newPushed = pushed - reportedPushed;
+    uint32_t newDropped = dropped - reportedDropped;
+    reportedPushed = pushed;
+    reportedDropped = dropped;
+
+    Serial.printf("- Publish queue: %u queued, %u dropped, %u pending, high-water %u/%u.\n",
+                  newPushed, newDropped, publishQueue.size(), publishQueue.highWaterMark(), PUBLISH_QUEUE_LEN);
+#ifdef BATCH_PUBLISH
+    uint32_t sent = batchesSent;
+    uint32_t failed = batchesFailed;
+    Serial.printf("- Published %u batches, %u failed.\n", sent - reportedBatchesSent, failed - reportedBatchesFailed);
+    reportedBatchesSent = sent;
+    reportedBatchesFailed = failed;
+#endif  // BATCH_PUBLISH
+    if (newDropped > 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "{\"publishQueue\": {\"dropped\": %u, \"droppedTotal\": %u, \"highWater\": %u, \"capacity\": %u}}",
+                 newDropped, dropped, publishQueue.highWaterMark(), PUBLISH_QUEUE_LEN);
+        transmitAdminInfo(msg);
+    }
+#endif  // ASYNC_PUBLISH
+}
+
+#endif  // PUBLISHER_KD_H
@@ -0,0 +1,93 @@
+/**
+ * Non-blocking reconnect state machine with exponential backoff and jitter.
+ *
+ *   UP ---lost()---> DOWN ---due(), attempt failed()---> BACKOFF ---delay passed---> DOWN
+ *    ^                 |                                                              |
+ *    +---succeeded()---+--------------------------------------------------------------+
+ *
+ * The first attempt after losing the link is made right away. After each failed attempt the
+ * next one waits a random time in [d/2, d] ("equal jitter"), where d starts at minMs and
+ * doubles up to maxMs. So a fleet of loggers does not hit the broker in lockstep after a blip.
+ * The caller polls due() and makes one (blocking) attempt at a time, so it can go on with
+ * other work in between.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef RECONNECT_BACKOFF_KD_H
+#define RECONNECT_BACKOFF_KD_H
+
+#include <stdint.h>
+
+enum ReconnectState : uint8_t {
+    RECONNECT_UP,
+    RECONNECT_DOWN,     // next attempt due
+    RECONNECT_BACKOFF   // waiting for next attempt
+};
+
+class ReconnectBackoff {
+   public:
+    ReconnectBackoff(uint32_t minMs, uint32_t maxMs) : minMs(minMs), maxMs(maxMs < minMs ? minMs : maxMs), delayMs(minMs) {}
+
+    /**
+     * True if an attempt is to be made now.
+     */
+    bool due(uint32_t nowMs) {
+        if (state == RECONNECT_BACKOFF && nowMs - backoffStartMs >= waitMs) state = RECONNECT_DOWN;
+        return state == RECONNECT_DOWN;
+    }
+
+    /**
+     * Link went down (or first connect), attempt right away.
+     */
+    void lost(uint32_t nowMs) {
+        if (outageStarted) return;
+        state = RECONNECT_DOWN;
+        outageStartMs = nowMs;
+        outageStarted = true;
+        delayMs = minMs;
+    }
+
+    /**
+     * Attempt failed, random is any random number (e.g. esp_random()).
+     */
+    void failed(uint32_t nowMs, uint32_t random) {
+        if (!outageStarted) lost(nowMs);
+        state = RECONNECT_BACKOFF;
+        backoffStartMs = nowMs;
+        uint32_t half = delayMs / 2;
+        waitMs = delayMs - half + (half > 0 ? random % (half + 1) : 0);
+        delayMs = delayMs > maxMs / 2 ? maxMs : delayMs * 2;
+        failures++;
+    }
+
+    /**
+     * Attempt succeeded. Returns time since link was lost in ms.
+     */
+    uint32_t succeeded(uint32_t nowMs) {
+        uint32_t outage = outageStarted ? nowMs - outageStartMs : 0;
+        state = RECONNECT_UP;
+        outageStarted = false;
+        delayMs = minMs;
+        return outage;
+    }
+
+    ReconnectState getState() const { return state; }
+    // time to wait after last failure
+    uint32_t waitTimeMs() const { return waitMs; }
+    // failed attempts since start
+    uint32_t failureCount() const { return failures; }
+
+   private:
+    uint32_t minMs;
+    uint32_t maxMs;
+    uint32_t delayMs;
+    uint32_t waitMs = 0;
+    uint32_t backoffStartMs = 0;
+    uint32_t outageStartMs = 0;
+    bool outageStarted = false;
+    ReconnectState state = RECONNECT_DOWN;
+    uint32_t failures = 0;
+};
+
+#endif  // RECONNECT_BACKOFF_KD_H
@@ -0,0 +1,213 @@
+/**
+ * Adapts scan interval, window and active/passive mode once per scan window (see ADAPTIVE_SCAN).
+ *
+ * Inputs per window: sightings (advertising events received), devices (first sightings),
+ * sightings dropped by filter rules, publish queue depth and drops, free heap. Duplicates are
+ * sightings that passed the filter rules beyond the first one per device, so sightings need to
+ * include repeated ones (not so BLEScan without AGGREGATE_WINDOW). Rules, first match wins:
+ *   - pressure: queue above queueHighPercent, records dropped or heap below minFreeHeap.
+ *     Scan responses are given up first (passive), then duty cycle is halved. Applies at once.
+ *   - flood: more sightings per second than floodSightingsPerSec while active, go passive at once.
+ *   - quiet: few devices (quietDevicesPerMin) seen again and again (quietDuplicatePercent),
+ *     duty cycle is halved. Few devices seen rarely keep the duty cycle.
+ *   - demand: more than twice as many devices, duty cycle is doubled up to the max. bounds,
+ *     then scanning gets active again (if sightings are below half of floodSightingsPerSec).
+ * Quiet and demand steps need holdWindows windows in a row without pressure since the last
+ * change, so the controller does not oscillate. If a demand step is followed by pressure or
+ * flood, the next one waits twice as long (up to 16 times holdWindows). The wait is halved
+ * again after each four times its length without pressure.
+ *
+ * Duty cycle goes down by a shorter window first, then by a longer interval, and up the other
+ * way round. Window never exceeds interval, both stay within the bounds of the config.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef SCAN_CONTROLLER_KD_H
+#define SCAN_CONTROLLER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ScanParams {
+    uint16_t intervalMs;
+    uint16_t windowMs;
+    bool active;
+};
+
+struct ScanControlConfig {
+    uint16_t minIntervalMs;
+    uint16_t maxIntervalMs;
+    uint16_t minWindowMs;
+    uint16_t maxWindowMs;
+    uint16_t quietDevicesPerMin;
+    uint8_t quietDuplicatePercent;
+    uint16_t floodSightingsPerSec;
+    uint8_t queueHighPercent;
+    uint32_t minFreeHeap;
+    uint8_t holdWindows;
+};
+
+struct ScanWindowInput {
+    uint32_t windowMs;
+    uint32_t sightings;
+    uint32_t devices;
+    uint32_t filtered;  // sightings dropped by filter rules, neither devices nor duplicates
+    uint32_t queueDepth;
+    uint32_t queueCapacity;  // 0 without queue
+    uint32_t queueDropped;   // in this window
+    uint32_t freeHeap;
+};
+
+enum ScanReason : uint8_t {
+    SCAN_REASON_KEEP,
+    SCAN_REASON_QUEUE,
+    SCAN_REASON_HEAP,
+    SCAN_REASON_FLOOD,
+    SCAN_REASON_QUIET,
+    SCAN_REASON_DEMAND,
+    SCAN_REASON_COUNT
+};
+
+static const char *const SCAN_REASON_NAMES[SCAN_REASON_COUNT] = {"keep", "queue", "heap", "flood", "quiet", "demand"};
+
+struct ScanDecision {
+    ScanParams params;
+    ScanReason reason;  // of change, or why nothing changed
+    bool changed;
+    // inputs as rates
+    uint32_t devicesPerMin;
+    uint32_t sightingsPerSec;
+    uint8_t duplicatePercent;
+};
+
+class ScanController {
+   public:
+    ScanController(const ScanControlConfig &config, const ScanParams &initial) : cfg(config) {
+        if (cfg.maxIntervalMs < cfg.minIntervalMs) cfg.maxIntervalMs = cfg.minIntervalMs;
+        if (cfg.minWindowMs > cfg.minIntervalMs) cfg.minWindowMs = cfg.minIntervalMs;
+        if (cfg.maxWindowMs < cfg.minWindowMs) cfg.maxWindowMs = cfg.minWindowMs;
+        cur.intervalMs = clamp(initial.intervalMs, cfg.minIntervalMs, cfg.maxIntervalMs);
+        cur.windowMs = clamp(initial.windowMs, cfg.minWindowMs, limitWindow(cfg.maxWindowMs));
+        cur.active = initial.active;
+        if (cfg.holdWindows == 0) cfg.holdWindows = 1;
+        hold = cfg.holdWindows;
+    }
+
+    /**
+     * Decides on params for the next window.
+     */
+    ScanDecision update(const ScanWindowInput &in) {
+        ScanDecision d;
+        uint32_t windowMs = in.windowMs > 0 ? in.windowMs : 1;
+        d.devicesPerMin = (uint32_t)((uint64_t)in.devices * 60000 / windowMs);
+        d.sightingsPerSec = (uint32_t)((uint64_t)in.sightings * 1000 / windowMs);
+        uint32_t passed = in.sightings > in.filtered ? in.sightings - in.filtered : 0;
+        d.duplicatePercent = passed > in.devices ? (uint8_t)(100 - (uint64_t)in.devices * 100 / passed) : 0;
+        d.reason = SCAN_REASON_KEEP;
+        d.changed = false;
+
+        ScanReason pressure = SCAN_REASON_KEEP;
+        if (in.queueDropped > 0 || (in.queueCapacity > 0 && (uint64_t)in.queueDepth * 100 >= (uint64_t)in.queueCapacity * cfg.queueHighPercent))
+            pressure = SCAN_REASON_QUEUE;
+        else if (in.freeHeap < cfg.minFreeHeap)
+            pressure = SCAN_REASON_HEAP;
+
+        bool flood = cur.active && d.sightingsPerSec > cfg.floodSightingsPerSec;
+        if (pressure != SCAN_REASON_KEEP || flood) {
+            // last step up was one too many
+            if (lastUp) hold = hold * 2 > maxHold() ? maxHold() : hold * 2;
+            lastUp = false;
+            calm = 0;
+        }
+        if (pressure != SCAN_REASON_KEEP) {
+            d.reason = pressure;
+            d.changed = cur.active ? setPassive() : dutyDown();
+        } else if (flood) {
+            d.reason = SCAN_REASON_FLOOD;
+            d.changed = setPassive();
+        } else if ((calm < UINT16_MAX ? ++calm : calm) >= cfg.holdWindows) {
+            if (d.devicesPerMin <= cfg.quietDevicesPerMin) {
+                // fewer duplicates at lower duty cycle, so below the threshold it is kept
+                if (d.duplicatePercent >= cfg.quietDuplicatePercent) {
+                    d.reason = SCAN_REASON_QUIET;
+                    d.changed = dutyDown();
+                }
+            } else if (d.devicesPerMin > 2 * (uint32_t)cfg.quietDevicesPerMin && calm >= hold) {
+                // in between, nothing changes
+                d.reason = SCAN_REASON_DEMAND;
+                d.changed = dutyUp();
+                if (!d.changed && !cur.active && d.sightingsPerSec < cfg.floodSightingsPerSec / 2) {
+                    cur.active = true;
+                    d.changed = true;
+                }
+            }
+            if (d.changed) {
+                calm = 0;
+                lastUp = d.reason == SCAN_REASON_DEMAND;
+            } else if (calm >= 4 * hold && hold > cfg.holdWindows) {
+                hold /= 2;
+                calm = 0;
+            }
+        }
+        if (d.changed) changes++;
+        d.params = cur;
+        return d;
+    }
+
+    const ScanParams &params() const { return cur; }
+    // window per interval in percent
+    uint8_t dutyPercent() const { return (uint8_t)((uint32_t)cur.windowMs * 100 / cur.intervalMs); }
+    uint32_t changeCount() const { return changes; }
+    // windows without pressure needed before next step up
+    uint16_t holdWindows() const { return hold; }
+
+   private:
+    static uint16_t clamp(uint16_t v, uint16_t lo, uint16_t hi) { return v < lo ? lo : v > hi ? hi : v; }
+
+    uint16_t maxHold() const { return 16 * cfg.holdWindows; }
+
+    uint16_t limitWindow(uint16_t windowMs) const { return windowMs < cur.intervalMs ? windowMs : cur.intervalMs; }
+
+    bool setPassive() {
+        cur.active = false;
+        return true;
+    }
+
+    bool dutyDown() {
+        if (cur.windowMs > cfg.minWindowMs) {
+            cur.windowMs = clamp(cur.windowMs / 2, cfg.minWindowMs, cur.windowMs);
+            return true;
+        }
+        if (cur.intervalMs < cfg.maxIntervalMs) {
+            uint32_t interval = (uint32_t)cur.intervalMs * 2;
+            cur.intervalMs = interval > cfg.maxIntervalMs ? cfg.maxIntervalMs : (uint16_t)interval;
+            return true;
+        }
+        return false;
+    }
+
+    bool dutyUp() {
+        if (cur.intervalMs > cfg.minIntervalMs) {
+            cur.intervalMs = clamp(cur.intervalMs / 2, cfg.minIntervalMs, cur.intervalMs);
+            cur.windowMs = limitWindow(cur.windowMs);
+            return true;
+        }
+        uint16_t max = limitWindow(cfg.maxWindowMs);
+        if (cur.windowMs < max) {
+            uint32_t window = (uint32_t)cur.windowMs * 2;
+            cur.windowMs = window > max ? max : (uint16_t)window;
+            return true;
+        }
+        return false;
+    }
+
+    ScanControlConfig cfg;
+    ScanParams cur;
+    uint16_t calm = 0;  // windows without pressure since last change
+    uint16_t hold = 1;
+    bool lastUp = false;
+    uint32_t changes = 0;
+};
+
+#endif  // SCAN_CONTROLLER_KD_H
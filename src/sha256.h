@@ -0,0 +1,135 @@
+/**
+ * SHA-256 (FIPS 180-4), incremental, for verifying firmware images (see delta_patch.h).
+ *
+ * The same code hashes on the device and in host tools, so no mbedTLS is needed natively.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef SHA256_KD_H
+#define SHA256_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_LEN 32
+
+class Sha256 {
+   public:
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t INIT[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(h, INIT, sizeof(h));
+        total = 0;
+        used = 0;
+    }
+
+    void update(const uint8_t *data, size_t len) {
+        total += len;
+        if (used > 0) {
+            size_t n = len < 64 - used ? len : 64 - used;
+            memcpy(block + used, data, n);
+            used += n;
+            data += n;
+            len -= n;
+            if (used < 64) return;
+            compress(block);
+            used = 0;
+        }
+        for (; len >= 64; data += 64, len -= 64) compress(data);
+        memcpy(block, data, len);
+        used = len;
+    }
+
+    void finish(uint8_t digest[SHA256_LEN]) {
+        uint64_t bits = total * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (used != 56) update(&pad, 1);
+        uint8_t len[8];
+        for (int i = 0; i < 8; i++) len[i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(len, 8);
+        for (int i = 0; i < 8; i++)
+            for (int j = 0; j < 4; j++) digest[4 * i + j] = (uint8_t)(h[i] >> (24 - 8 * j));
+    }
+
+   private:
+    static uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t *p) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be,
+            0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa,
+            0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+            0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+            0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+            0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = k + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += k;
+    }
+
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t total;
+    size_t used;
+};
+
+/**
+ * Lowercase hex of digest into out (65 bytes with '\0').
+ */
+inline void sha256Hex(const uint8_t digest[SHA256_LEN], char *out) {
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < SHA256_LEN; i++) {
+        out[2 * i] = HEX[digest[i] >> 4];
+        out[2 * i + 1] = HEX[digest[i] & 0x0f];
+    }
+    out[2 * SHA256_LEN] = '\0';
+}
+
+/**
+ * Parses 64 hex chars (any case). Returns false if malformed.
+ */
+inline bool sha256FromHex(const char *hex, uint8_t digest[SHA256_LEN]) {
+    if (hex == nullptr) return false;
+    for (size_t i = 0; i < 2 * SHA256_LEN; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (v < 0) return false;
+        if (i % 2 == 0)
+            digest[i / 2] = (uint8_t)(v << 4);
+        else
+            digest[i / 2] |= (uint8_t)v;
+    }
+    return hex[2 * SHA256_LEN] == '\0';
+}
+
+#endif  // SHA256_KD_H
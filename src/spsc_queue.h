@@ -0,0 +1,74 @@
+/**
+ * Bounded lock-free single-producer/single-consumer ring buffer.
+ *
+ * Producer is the BLE scan callback, consumer is the publisher task.
+ * Records are copied in and out, so T should be a plain fixed-size struct.
+ * When full, new items are dropped (and counted), the producer never blocks.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef SPSC_QUEUE_KD_H
+#define SPSC_QUEUE_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscQueue size needs to be a power of two");
+
+   public:
+    // producer side
+    bool push(const T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t h = head.load(std::memory_order_acquire);
+        if (t - h >= N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        pushed.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t used = t + 1 - h;
+        if (used > highWater.load(std::memory_order_relaxed))
+            highWater.store(used, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer side
+    bool pop(T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t t = tail.load(std::memory_order_acquire);
+        if (h == t)
+            return false;
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // approximate when called concurrently
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    bool empty() const { return size() == 0; }
+    static constexpr size_t capacity() { return N; }
+
+    uint32_t pushedCount() const { return pushed.load(std::memory_order_relaxed); }
+    uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+    // max. number of items queued at once since start
+    uint32_t highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+
+   private:
+    T items[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> pushed{0};
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<uint32_t> highWater{0};
+};
+
+#endif  // SPSC_QUEUE_KD_H
@@ -0,0 +1,134 @@
+/**
+ * Store-and-forward of sensor messages.
+ *
+ * If a sensor message cannot be published (broker or WiFi down), it is appended to a
+ * ring log in the data partition (spiffs partition of min_spiffs.csv, not used otherwise).
+ * Once MQTT is connected again, stored messages are replayed in order, limited to
+ * STORE_REPLAY_PER_SECOND so live data keeps priority.
+ * A stored message that fails STORE_REPLAY_ATTEMPTS times while connected (e.g. rejected by the
+ * broker) is discarded, so it does not block the ones behind it.
+ *
+ * The log has its own mutex, so messages can be stored without MQTT lock (connect attempt in
+ * progress). Lock order is MQTT lock first, it is never held while publishing.
+ * */
+
+#ifndef STORE_FORWARD_KD_H
+#define STORE_FORWARD_KD_H
+
+#include <Arduino.h>
+
+#include "flash_log.h"
+#include "globals_kd.h"
+#include "partition_flash_io.h"
+
+#ifdef STORE_AND_FORWARD
+
+// forward declaration from mqtts
+bool publishStoredMessage(const uint8_t *payload, size_t length);
+bool isConnectedMQTT();
+bool tryLockMQTT(uint32_t waitMs);
+void unlockMQTT();
+bool transmitAdminInfo(const char *msg);  // main
+
+static PartitionFlashIo storeFlash;
+static FlashLog storeLog(storeFlash);
+static SemaphoreHandle_t storeMutex = nullptr;
+static bool storeReady = false;
+static uint8_t replayBuf[MAX_MQTT_MESSAGE_SIZE];
+static uint32_t replayTokens = 0;
+static uint32_t lastReplayMs = 0;
+static uint32_t replayAttempts = 0;
+// too large to replay or failed too often
+static uint32_t storeDiscarded = 0;
+static uint32_t reportedStoreDropped = 0;
+static uint32_t reportedStoreDiscarded = 0;
+
+void initStoreForward() {
+    Serial.println("Setup store-and-forward...");
+    if (!storeFlash.begin()) {
+        Serial.println("- ERR: No data partition found, messages will not be stored.");
+        return;
+    }
+    storeMutex = xSemaphoreCreateMutex();
+    storeReady = storeMutex != nullptr && storeLog.begin();
+    Serial.printf("- Log with %u bytes %s.\n", storeFlash.size(), storeReady ? "ready" : "failed");
+}
+
+/**
+ * Called when a sensor message could not be published, with or without MQTT lock.
+ */
+bool storeSensorMessage(const uint8_t *payload, size_t length) {
+    if (!storeReady) return false;
+    xSemaphoreTake(storeMutex, portMAX_DELAY);
+    bool stored = false;
+    if (length <= sizeof(replayBuf)) {
+        stored = storeLog.append(payload, length);
+    } else {
+        // could never be read back for replay
+        storeDiscarded++;
+    }
+    xSemaphoreGive(storeMutex);
+    return stored;
+}
+
+/**
+ * Publishes stored messages in order, at most STORE_REPLAY_PER_SECOND.
+ */
+void replayStoredMessages() {
+    if (!storeReady) return;
+    // token bucket, refill by time passed
+    uint32_t now = millis();
+    uint32_t refill = (now - lastReplayMs) * STORE_REPLAY_PER_SECOND / 1000;
+    if (refill > 0) {
+        replayTokens = min<uint32_t>(replayTokens + refill, STORE_REPLAY_PER_SECOND);
+        lastReplayMs = now;
+    }
+    // not while a connect attempt holds it
+    if (!tryLockMQTT(0)) return;
+    while (replayTokens > 0 && isConnectedMQTT()) {
+        xSemaphoreTake(storeMutex, portMAX_DELAY);
+        size_t len = storeLog.peek(replayBuf, sizeof(replayBuf));
+        xSemaphoreGive(storeMutex);
+        if (len == 0) break;
+        bool sent = publishStoredMessage(replayBuf, len);
+        if (!sent) {
+            // keep message if connection was lost, it fails again otherwise
+            if (!isConnectedMQTT() || ++replayAttempts < STORE_REPLAY_ATTEMPTS) break;
+            storeDiscarded++;
+        }
+        replayAttempts = 0;
+        xSemaphoreTake(storeMutex, portMAX_DELAY);
+        storeLog.consume();
+        xSemaphoreGive(storeMutex);
+        replayTokens--;
+    }
+    unlockMQTT();
+}
+
+void reportStoreStats() {
+    if (!storeReady) return;
+    xSemaphoreTake(storeMutex, portMAX_DELAY);
+    uint32_t stored = storeLog.appendedCount();
+    uint32_t replayed = storeLog.replayedCount();
+    uint32_t dropped = storeLog.droppedCount();
+    uint32_t discarded = storeDiscarded;
+    xSemaphoreGive(storeMutex);
+    if (stored == 0 && dropped == 0 && discarded == 0) return;
+    Serial.printf("- Store-and-forward: %u stored, %u replayed, %u oldest dropped, %u discarded (since boot).\n", stored, replayed, dropped, discarded);
+    if (dropped != reportedStoreDropped || discarded != reportedStoreDiscarded) {
+        char msg[160];
+        snprintf(msg, sizeof(msg), "{\"storeForward\": {\"stored\": %u, \"replayed\": %u, \"oldestDropped\": %u, \"discarded\": %u}}", stored, replayed, dropped,
+                 discarded);
+        transmitAdminInfo(msg);
+        reportedStoreDropped = dropped;
+        reportedStoreDiscarded = discarded;
+    }
+}
+#else
+void initStoreForward() {}
+bool storeSensorMessage(const uint8_t *payload, size_t length) { return false; }
+void replayStoredMessages() {}
+void reportStoreStats() {}
+#endif  // STORE_AND_FORWARD
+
+#endif  // STORE_FORWARD_KD_H
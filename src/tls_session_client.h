@@ -0,0 +1,258 @@
+/**
+ * TLS client (mbedTLS over WiFiClient) that resumes its last session on reconnect.
+ *
+ * WiFiClientSecure sets up a new mbedTLS context for every connect and performs a full
+ * handshake (certificate chain verification, key exchange) each time, which takes
+ * seconds of CPU on the ESP32. This client keeps the session of the last successful
+ * handshake (session ID and, if the server issues one, session ticket) and offers it
+ * on the next connect. If the server accepts, only an abbreviated handshake is needed.
+ * If not, mbedTLS falls back to a full handshake on its own.
+ *
+ * Same interface as WiFiClientSecure for what mqtts.h uses (setCACert(), setHandshakeTimeout()).
+ * The server certificate is verified against the root CA and the host name on every full handshake.
+ * */
+
+#ifndef TLS_SESSION_CLIENT_KD_H
+#define TLS_SESSION_CLIENT_KD_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <WiFiClient.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+enum TlsHandshakeKind : uint8_t {
+    TLS_HANDSHAKE_NONE,  // TCP connect or handshake failed
+    TLS_HANDSHAKE_FULL,
+    TLS_HANDSHAKE_RESUMED
+};
+
+class TlsSessionClient : public Client {
+   public:
+    TlsSessionClient() {
+        mbedtls_ssl_init(&ssl);
+        mbedtls_ssl_config_init(&conf);
+        mbedtls_x509_crt_init(&ca);
+        mbedtls_ctr_drbg_init(&drbg);
+        mbedtls_entropy_init(&entropy);
+        mbedtls_ssl_session_init(&session);
+    }
+
+    ~TlsSessionClient() {
+        stop();
+        mbedtls_ssl_session_free(&session);
+        mbedtls_ssl_free(&ssl);
+        mbedtls_ssl_config_free(&conf);
+        mbedtls_x509_crt_free(&ca);
+        mbedtls_ctr_drbg_free(&drbg);
+        mbedtls_entropy_free(&entropy);
+    }
+
+    void setCACert(const char *rootCA) { this->rootCA = rootCA; }
+    void setHandshakeTimeout(unsigned long seconds) { handshakeTimeoutMs = seconds * 1000; }
+
+    int connect(IPAddress ip, uint16_t port) override {
+        return connect(ip.toString().c_str(), port);
+    }
+
+    int connect(const char *host, uint16_t port) override {
+        stop();
+        lastHandshake = TLS_HANDSHAKE_NONE;
+        if (!setup() || !tcp.connect(host, port)) return 0;
+        if (mbedtls_ssl_session_reset(&ssl) != 0 || mbedtls_ssl_set_hostname(&ssl, host) != 0) {
+            tcp.stop();
+            return 0;
+        }
+        mbedtls_ssl_set_bio(&ssl, &tcp, sendTcp, recvTcp, nullptr);
+
+        // session ID is echoed by the server if it resumes
+        uint8_t offeredId[sizeof(session.id)];
+        size_t offeredIdLen = 0;
+        if (haveSession && mbedtls_ssl_set_session(&ssl, &session) == 0) {
+            offeredIdLen = session.id_len;
+            memcpy(offeredId, session.id, offeredIdLen);
+        }
+
+        uint32_t start = millis();
+        int ret;
+        while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+            if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > handshakeTimeoutMs) {
+                Serial.printf("- ERR: TLS handshake failed (-0x%04x).\n", (unsigned)-ret);
+                // maybe the offered session is not accepted anymore
+                forgetSession();
+                tcp.stop();
+                return 0;
+            }
+            delay(2);
+        }
+        lastHandshakeMs = millis() - start;
+
+        const mbedtls_ssl_session *current = mbedtls_ssl_get_session_pointer(&ssl);
+        bool resumed = offeredIdLen > 0 && current != nullptr && current->id_len == offeredIdLen &&
+                       memcmp(current->id, offeredId, offeredIdLen) == 0;
+        lastHandshake = resumed ? TLS_HANDSHAKE_RESUMED : TLS_HANDSHAKE_FULL;
+
+        // keep (possibly new) session for next connect
+        forgetSession();
+        haveSession = mbedtls_ssl_get_session(&ssl, &session) == 0;
+        established = true;
+        return 1;
+    }
+
+    size_t write(uint8_t b) override {
+        return write(&b, 1);
+    }
+
+    size_t write(const uint8_t *buf, size_t size) override {
+        if (!established) return 0;
+        size_t done = 0;
+        uint32_t start = millis();
+        while (done < size) {
+            int ret = mbedtls_ssl_write(&ssl, buf + done, size - done);
+            if (ret > 0) {
+                done += ret;
+                continue;
+            }
+            if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > handshakeTimeoutMs) {
+                close();
+                return 0;
+            }
+            delay(1);
+        }
+        return done;
+    }
+
+    int available() override {
+        int n = peeked >= 0 ? 1 : 0;
+        if (!established) return n;
+        // processes a pending record, if any
+        int ret = mbedtls_ssl_read(&ssl, nullptr, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            close();
+            return n;
+        }
+        return n + (int)mbedtls_ssl_get_bytes_avail(&ssl);
+    }
+
+    int read() override {
+        uint8_t b;
+        return read(&b, 1) == 1 ? b : -1;
+    }
+
+    int read(uint8_t *buf, size_t size) override {
+        if (size == 0) return 0;
+        if (peeked >= 0) {
+            buf[0] = (uint8_t)peeked;
+            peeked = -1;
+            return 1;
+        }
+        return readTls(buf, size);
+    }
+
+    int peek() override {
+        if (peeked < 0) {
+            uint8_t b;
+            if (readTls(&b, 1) == 1) peeked = b;
+        }
+        return peeked;
+    }
+
+    void flush() override {}
+
+    void stop() override {
+        if (established) mbedtls_ssl_close_notify(&ssl);
+        close();
+    }
+
+    uint8_t connected() override {
+        if (established && !tcp.connected() && mbedtls_ssl_get_bytes_avail(&ssl) == 0 && peeked < 0) close();
+        return established;
+    }
+
+    operator bool() override { return connected(); }
+
+    TlsHandshakeKind lastHandshakeKind() const { return lastHandshake; }
+    uint32_t lastHandshakeTimeMs() const { return lastHandshakeMs; }
+
+   private:
+    bool setup() {
+        if (configured) return true;
+        static const char PERS[] = "kd_tls_client";
+        if (rootCA == nullptr ||
+            mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)PERS, sizeof(PERS) - 1) != 0 ||
+            mbedtls_x509_crt_parse(&ca, (const unsigned char *)rootCA, strlen(rootCA) + 1) != 0 ||
+            mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+            Serial.println("- ERR: TLS setup failed.");
+            return false;
+        }
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&conf, &ca, nullptr);
+        mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+        mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+        if (mbedtls_ssl_setup(&ssl, &conf) != 0) {
+            Serial.println("- ERR: TLS setup failed.");
+            return false;
+        }
+        configured = true;
+        return true;
+    }
+
+    int readTls(uint8_t *buf, size_t size) {
+        if (!established) return -1;
+        int ret = mbedtls_ssl_read(&ssl, buf, size);
+        if (ret > 0) return ret;
+        // 0 is end of stream
+        if (ret == 0 || (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)) close();
+        return -1;
+    }
+
+    void close() {
+        established = false;
+        peeked = -1;
+        tcp.stop();
+    }
+
+    void forgetSession() {
+        mbedtls_ssl_session_free(&session);
+        mbedtls_ssl_session_init(&session);
+        haveSession = false;
+    }
+
+    static int sendTcp(void *ctx, const unsigned char *buf, size_t len) {
+        WiFiClient *tcp = (WiFiClient *)ctx;
+        if (!tcp->connected()) return MBEDTLS_ERR_NET_CONN_RESET;
+        size_t n = tcp->write(buf, len);
+        return n > 0 && n <= len ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+
+    static int recvTcp(void *ctx, unsigned char *buf, size_t len) {
+        WiFiClient *tcp = (WiFiClient *)ctx;
+        int avail = tcp->available();
+        if (avail <= 0) return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+        int n = tcp->read(buf, len < (size_t)avail ? len : (size_t)avail);
+        return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    WiFiClient tcp;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_entropy_context entropy;
+    mbedtls_ssl_session session;
+    const char *rootCA = nullptr;
+    uint32_t handshakeTimeoutMs = 10000;
+    bool configured = false;
+    bool established = false;
+    bool haveSession = false;
+    int peeked = -1;
+    TlsHandshakeKind lastHandshake = TLS_HANDSHAKE_NONE;
+    uint32_t lastHandshakeMs = 0;
+};
+
+#endif  // TLS_SESSION_CLIENT_KD_H
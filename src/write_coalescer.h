@@ -0,0 +1,106 @@
+/**
+ * Coalesces small writes into fewer, larger writes to a sink (e.g. a TLS client).
+ *
+ * PubSubClient writes each MQTT packet with one write() call. Over TLS every call becomes
+ * at least one TLS record with its own header, MAC and encryption setup, so many small
+ * publishes cost far more than their payload. WriteCoalescer collects them in a buffer of
+ * Size bytes and passes them on in one write when
+ *   - the next write would not fit anymore,
+ *   - the oldest byte waited maxDelayMs (checked on write() and due()),
+ *   - flush() is called (e.g. at the end of a scan window).
+ * Writes of Size bytes or more are passed on directly (after pending bytes).
+ *
+ * Sink is anything with size_t write(const uint8_t *buf, size_t size), e.g. Arduino's Client.
+ * If the sink fails, pending bytes are dropped and write() returns 0,
+ * since the connection is broken anyway and gets re-established by the caller.
+ *
+ * This header does not depend on Arduino and can be build natively.
+ * */
+
+#ifndef WRITE_COALESCER_KD_H
+#define WRITE_COALESCER_KD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template <size_t Size>
+class WriteCoalescer {
+    static_assert(Size > 0, "WriteCoalescer needs a buffer");
+
+   public:
+    explicit WriteCoalescer(uint32_t maxDelayMs = 100) : maxDelayMs(maxDelayMs) {}
+
+    /**
+     * Returns len or 0 if sink failed.
+     */
+    template <typename Sink>
+    size_t write(Sink &sink, const uint8_t *buf, size_t len, uint32_t nowMs) {
+        if (len == 0) return 0;
+        if (used + len > Size && !flush(sink)) return 0;
+        if (len >= Size) {
+            return writeAll(sink, buf, len) ? len : 0;
+        }
+        if (used == 0) firstMs = nowMs;
+        memcpy(buffer + used, buf, len);
+        used += len;
+        coalesced++;
+        if (due(nowMs) && !flush(sink)) return 0;
+        return len;
+    }
+
+    /**
+     * True if pending bytes waited long enough.
+     */
+    bool due(uint32_t nowMs) const {
+        return used > 0 && nowMs - firstMs >= maxDelayMs;
+    }
+
+    /**
+     * Passes pending bytes on. Returns false if sink failed (pending bytes are dropped).
+     */
+    template <typename Sink>
+    bool flush(Sink &sink) {
+        if (used == 0) return true;
+        bool ok = writeAll(sink, buffer, used);
+        if (!ok) droppedBytes += used;
+        used = 0;
+        return ok;
+    }
+
+    /**
+     * Drops pending bytes, e.g. when connection is closed.
+     */
+    void clear() { used = 0; }
+
+    size_t pending() const { return used; }
+    static constexpr size_t capacity() { return Size; }
+    // totals since start
+    uint32_t coalescedCount() const { return coalesced; }  // writes taken into buffer
+    uint32_t sinkWriteCount() const { return sinkWrites; }
+    uint32_t droppedByteCount() const { return droppedBytes; }
+
+   private:
+    template <typename Sink>
+    bool writeAll(Sink &sink, const uint8_t *buf, size_t len) {
+        while (len > 0) {
+            size_t n = sink.write(buf, len);
+            sinkWrites++;
+            // some clients return (size_t)-1 on error
+            if (n == 0 || n > len) return false;
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    uint8_t buffer[Size];
+    size_t used = 0;
+    uint32_t maxDelayMs;
+    uint32_t firstMs = 0;
+    uint32_t coalesced = 0;
+    uint32_t sinkWrites = 0;
+    uint32_t droppedBytes = 0;
+};
+
+#endif  // WRITE_COALESCER_KD_H
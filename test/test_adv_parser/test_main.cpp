@@ -0,0 +1,177 @@
+/**
+ * Raw advertisement parser (src/ble_adv_parser.h) on malformed AD lengths: a corpus of known
+ * bad structures, every truncation of a valid advertisement and random bytes. Data is copied
+ * to buffers of exactly its length, so reads past the end show up with -fsanitize=address.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <vector>
+
+#include "ble_adv_parser.h"
+#include "ble_frames.h"
+
+static std::mt19937 rng(16);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static const uint8_t ADDRESS[BLE_ADDR_LEN] = {0xc0, 0x01, 0x02, 0x03, 0x04, 0x05};
+
+// valid advertisement with every field the parser looks up
+static const std::vector<uint8_t> VALID = {
+    0x02, BLE_AD_FLAGS,        0x06,                                            // flags
+    0x05, BLE_AD_NAME_CMPL,    't',  'a',  'g',  '1',                           // name
+    0x02, BLE_AD_TX_PWR,       0xf4,                                            // tx power
+    0x03, BLE_AD_APPEARANCE,   0x40, 0x02,                                      // appearance
+    0x03, BLE_AD_16SRV_CMPL,   0xaa, 0xfe,                                      // service UUID
+    0x07, BLE_AD_MANUFACTURER, 0x4c, 0x00, 0x01, 0x02, 0x03, 0x04,              // manufacturer data
+};
+
+// (end of) value of a field found has to be within the data
+static void assertWithin(const std::vector<uint8_t> &adv, const uint8_t *base, const uint8_t *v, size_t n) {
+    if (v == nullptr) return;
+    TEST_ASSERT_TRUE(v >= base + 2);
+    TEST_ASSERT_TRUE(v + n <= base + adv.size());
+}
+
+/**
+ * Parses adv from a copy of exactly its length: field bounds, structures counted as a plain walk
+ * over the lengths does, and a filled record within its limits. Frames are decoded as well.
+ */
+static BleAdvRecord parse(const std::vector<uint8_t> &adv, bool &malformed) {
+    uint8_t *data = new uint8_t[adv.size()];
+    if (!adv.empty()) memcpy(data, adv.data(), adv.size());
+    BleAdView view(ADDRESS, 1, -60, data, adv.size());
+
+    size_t n;
+    const uint8_t *v = view.manufData(n);
+    assertWithin(adv, data, v, n);
+    v = (const uint8_t *)view.name(n);
+    assertWithin(adv, data, v, n);
+    v = view.serviceUUID(n);
+    assertWithin(adv, data, v, n);
+    if (v != nullptr) TEST_ASSERT_TRUE(n == 2 || n == 4 || n == 16);
+    int8_t tx;
+    uint16_t appearance;
+    view.txPower(tx);
+    view.appearance(appearance);
+
+    size_t pos = 0, count = 0;
+    bool overrun = false;
+    while (pos < adv.size() && adv[pos] != 0) {
+        if (pos + 1 + adv[pos] > adv.size()) {
+            overrun = true;
+            break;
+        }
+        count++;
+        pos += 1 + adv[pos];
+    }
+    TEST_ASSERT_EQUAL_size_t(count, view.structureCount());
+    TEST_ASSERT_EQUAL(overrun, view.malformed());
+    malformed = view.malformed();
+
+    BleAdvRecord rec;
+    view.fill(rec);
+    bleDecodeFrames(rec, data, adv.size());
+    TEST_ASSERT_TRUE(strlen(rec.name) <= BLE_MAX_NAME_LEN);
+    TEST_ASSERT_TRUE(rec.manufDataLen <= BLE_MAX_MANUF_DATA_LEN);
+    TEST_ASSERT_TRUE(rec.frameLen <= BLE_MAX_FRAME_LEN);
+    TEST_ASSERT_EQUAL_UINT16(adv.size(), rec.payloadLength);
+    delete[] data;
+    return rec;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_valid() {
+    bool malformed;
+    BleAdvRecord rec = parse(VALID, malformed);
+    TEST_ASSERT_FALSE(malformed);
+    TEST_ASSERT_EQUAL_STRING("tag1", rec.name);
+    TEST_ASSERT_EQUAL_INT8(-12, rec.txPower);
+    TEST_ASSERT_EQUAL_UINT16(0x0240, rec.appearance);
+    TEST_ASSERT_EQUAL_UINT8(2, rec.serviceUUIDLen);
+    TEST_ASSERT_EQUAL_UINT8(6, rec.manufDataLen);
+}
+
+// known bad structures: none may be read past, values too short for their type are ignored
+void test_corpus() {
+    struct Case {
+        std::vector<uint8_t> adv;
+        bool malformed;
+        uint8_t flags;  // BLE_REC_HAVE_* expected besides RSSI
+    };
+    const Case cases[] = {
+        {{}, false, 0},
+        {{0x01}, true, 0},                                           // type missing
+        {{0x05}, true, 0},                                           // length only
+        {{0xff, BLE_AD_NAME_CMPL, 'a'}, true, 0},                    // length far past end
+        {{0x03, BLE_AD_NAME_CMPL, 'a'}, true, 0},                    // one byte past end
+        {{0x02, BLE_AD_NAME_CMPL, 'a', 0x09, BLE_AD_MANUFACTURER, 0x4c}, true, BLE_REC_HAVE_NAME},  // field before kept
+        {{0x01, BLE_AD_NAME_CMPL}, false, BLE_REC_HAVE_NAME},        // empty name
+        {{0x01, BLE_AD_MANUFACTURER}, false, BLE_REC_HAVE_MANUF_DATA},
+        {{0x01, BLE_AD_TX_PWR}, false, 0},                           // value too short
+        {{0x02, BLE_AD_APPEARANCE, 0x40}, false, 0},
+        {{0x02, BLE_AD_16SRV_CMPL, 0xaa}, false, 0},
+        {{0x03, BLE_AD_32SRV_CMPL, 0xaa, 0xfe}, false, 0},
+        {{0x0f, BLE_AD_128SRV_CMPL, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14}, false, 0},
+        {{0x00, 0xff, 0xff, 0xff}, false, 0},                        // zero length ends, rest is padding
+        {{0x02, BLE_AD_TX_PWR, 0x04, 0x00, 0x05}, false, BLE_REC_HAVE_TX_POWER},
+        {std::vector<uint8_t>(62, 0xff), true, 0},
+    };
+    for (const Case &c : cases) {
+        bool malformed;
+        BleAdvRecord rec = parse(c.adv, malformed);
+        TEST_ASSERT_EQUAL(c.malformed, malformed);
+        TEST_ASSERT_EQUAL_HEX8(c.flags | BLE_REC_HAVE_RSSI, rec.flags & ~BLE_REC_HAVE_FRAME);
+    }
+}
+
+// advertisement cut at every length: fields completely before the cut are found, no others
+void test_truncated() {
+    bool malformed;
+    BleAdvRecord full = parse(VALID, malformed);
+    for (size_t cut = 0; cut < VALID.size(); cut++) {
+        std::vector<uint8_t> adv(VALID.begin(), VALID.begin() + cut);
+        BleAdvRecord rec = parse(adv, malformed);
+        bool name = cut >= 9, tx = cut >= 12, appearance = cut >= 16, uuid = cut >= 20;
+        TEST_ASSERT_EQUAL(name, (rec.flags & BLE_REC_HAVE_NAME) != 0);
+        TEST_ASSERT_EQUAL(tx, (rec.flags & BLE_REC_HAVE_TX_POWER) != 0);
+        TEST_ASSERT_EQUAL(appearance, (rec.flags & BLE_REC_HAVE_APPEARANCE) != 0);
+        TEST_ASSERT_EQUAL(uuid, (rec.flags & BLE_REC_HAVE_SERVICE_UUID) != 0);
+        TEST_ASSERT_FALSE(rec.flags & BLE_REC_HAVE_MANUF_DATA);
+        if (name) TEST_ASSERT_EQUAL_STRING(full.name, rec.name);
+    }
+}
+
+// random bytes, lengths up to more than advertising data and scan response carry
+void test_random() {
+    uint32_t malformedCount = 0;
+    for (int i = 0; i < 100000; i++) {
+        std::vector<uint8_t> adv(rnd(i % 100 == 0 ? 300 : BLE_MAX_PAYLOAD_LEN + 1));
+        for (uint8_t &b : adv) {
+            // small lengths and known types now and then, so structures get past the first one
+            uint32_t r = rnd(4);
+            b = r == 0 ? (uint8_t)rnd(8) : r == 1 ? (uint8_t)(BLE_AD_FLAGS + rnd(10)) : (uint8_t)rnd(256);
+        }
+        bool malformed;
+        parse(adv, malformed);
+        if (malformed) malformedCount++;
+    }
+    TEST_ASSERT_TRUE(malformedCount > 1000);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_valid);
+    RUN_TEST(test_corpus);
+    RUN_TEST(test_truncated);
+    RUN_TEST(test_random);
+    return UNITY_END();
+}
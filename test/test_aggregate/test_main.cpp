@@ -0,0 +1,232 @@
+/**
+ * Per window aggregation (src/ble_aggregate.h): hard cap with 10k distinct addresses, eviction of the
+ * device seen least recently within the probe window, RSSI statistics, timestamps and latest payload,
+ * and no sighting lost or counted twice while scan callback and flush swap tables (as flushAggregates()
+ * in ble.h does).
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "ble_aggregate.h"
+
+static std::mt19937 rng(5);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static uint64_t key(const uint8_t *address) {
+    uint64_t k = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) k = k << 8 | address[i];
+    return k;
+}
+
+static BleAdvRecord sighting(uint32_t n, uint64_t timeUs, int8_t rssi) {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.address[0] = 0xc0;
+    for (size_t i = 0; i < 4; i++) rec.address[2 + i] = (uint8_t)(n >> (8 * i));
+    rec.timestamp = (uint32_t)(timeUs / 1000000);
+    rec.micros = (uint32_t)(timeUs % 1000000);
+    rec.rssi = rssi;
+    rec.flags = BLE_REC_HAVE_RSSI;
+    return rec;
+}
+
+// addresses (as numbers for sighting()) with the same home slot in a table of N entries
+template <size_t N>
+static std::vector<uint32_t> sameHome(size_t count) {
+    std::vector<uint32_t> found;
+    uint32_t home = bleAddrHash(sighting(0, 0, 0).address) & (N - 1);
+    for (uint32_t n = 0; found.size() < count; n++) {
+        if ((bleAddrHash(sighting(n, 0, 0).address) & (N - 1)) == home) found.push_back(n);
+    }
+    return found;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_10k_distinct_addresses() {
+    static BleAggTable<1024> table;
+    const uint32_t ADDRESSES = 10000;
+    std::map<uint64_t, uint32_t> counts;
+    auto emit = [&counts](const BleAdvRecord &rec) { counts[key(rec.address)] += rec.count; };
+    for (uint32_t n = 0; n < ADDRESSES; n++) {
+        table.add(sighting(n, 1000000ULL * n, -60), emit);
+        TEST_ASSERT_TRUE(table.size() <= table.capacity());
+    }
+    TEST_ASSERT_EQUAL_UINT32(ADDRESSES, table.size() + table.evictedCount());
+    TEST_ASSERT_EQUAL_size_t(table.evictedCount(), counts.size());
+    table.flush(emit);
+    TEST_ASSERT_EQUAL_size_t(0, table.size());
+    // each sighting emitted once
+    TEST_ASSERT_EQUAL_size_t(ADDRESSES, counts.size());
+    for (const auto &c : counts) TEST_ASSERT_EQUAL_UINT32(1, c.second);
+}
+
+void test_evicts_least_recently_seen() {
+    static BleAggTable<8, 2> table;
+    std::vector<uint32_t> n = sameHome<8>(3);
+    std::vector<BleAdvRecord> emitted;
+    auto emit = [&emitted](const BleAdvRecord &rec) { emitted.push_back(rec); };
+    table.add(sighting(n[0], 1000, -50), emit);
+    table.add(sighting(n[1], 2000, -50), emit);
+    table.add(sighting(n[0], 3000, -50), emit);
+    TEST_ASSERT_EQUAL_size_t(0, emitted.size());
+    // probe window of 2 is full, n[1] was seen least recently
+    table.add(sighting(n[2], 4000, -50), emit);
+    TEST_ASSERT_EQUAL_size_t(1, emitted.size());
+    TEST_ASSERT_EQUAL_UINT32(1, table.evictedCount());
+    TEST_ASSERT_EQUAL_MEMORY(sighting(n[1], 0, 0).address, emitted[0].address, BLE_ADDR_LEN);
+    TEST_ASSERT_EQUAL_UINT16(1, emitted[0].count);
+    TEST_ASSERT_TRUE(emitted[0].flags & BLE_REC_HAVE_STATS);
+
+    emitted.clear();
+    table.flush(emit);
+    TEST_ASSERT_EQUAL_size_t(2, emitted.size());
+    for (const BleAdvRecord &rec : emitted)
+        TEST_ASSERT_EQUAL_UINT16(key(rec.address) == key(sighting(n[0], 0, 0).address) ? 2 : 1, rec.count);
+}
+
+void test_rssi_statistics() {
+    static BleAggTable<64> table;
+    std::vector<BleAdvRecord> out;
+    auto emit = [&out](const BleAdvRecord &rec) { out.push_back(rec); };
+    table.add(sighting(1, 1000, -50), emit);
+    table.add(sighting(1, 2000, -61), emit);
+    table.add(sighting(1, 3000, -70), emit);
+    // sighting without RSSI is counted, not part of statistics
+    BleAdvRecord noRssi = sighting(1, 4000, 0);
+    noRssi.flags &= ~BLE_REC_HAVE_RSSI;
+    table.add(noRssi, emit);
+    // mean of -51 and -52 rounds away from zero
+    table.add(sighting(2, 1000, -51), emit);
+    table.add(sighting(2, 2000, -52), emit);
+    table.flush(emit);
+    TEST_ASSERT_EQUAL_size_t(2, out.size());
+    for (const BleAdvRecord &rec : out) {
+        TEST_ASSERT_TRUE(rec.flags & BLE_REC_HAVE_RSSI);
+        if (rec.address[2] == 1) {
+            TEST_ASSERT_EQUAL_UINT16(4, rec.count);
+            TEST_ASSERT_EQUAL_INT8(-70, rec.rssiMin);
+            TEST_ASSERT_EQUAL_INT8(-50, rec.rssiMax);
+            // -181 / 3
+            TEST_ASSERT_EQUAL_INT8(-60, rec.rssi);
+        } else {
+            TEST_ASSERT_EQUAL_UINT16(2, rec.count);
+            TEST_ASSERT_EQUAL_INT8(-52, rec.rssiMin);
+            TEST_ASSERT_EQUAL_INT8(-51, rec.rssiMax);
+            TEST_ASSERT_EQUAL_INT8(-52, rec.rssi);
+        }
+    }
+}
+
+void test_timestamps_and_latest_payload() {
+    static BleAggTable<64> table;
+    std::vector<BleAdvRecord> out;
+    auto emit = [&out](const BleAdvRecord &rec) { out.push_back(rec); };
+    BleAdvRecord first = sighting(7, 1651042690123456ULL, -60);
+    bleRecSetName(first, "old", 3);
+    BleAdvRecord last = sighting(7, 1651042699654321ULL, -62);
+    bleRecSetName(last, "new", 3);
+    uint8_t data[4] = {0x4c, 0x00, 0x01, 0x02};
+    bleRecSetManufData(last, data, sizeof(data));
+    table.add(first, emit);
+    table.add(last, emit);
+    table.flush(emit);
+    TEST_ASSERT_EQUAL_size_t(1, out.size());
+    TEST_ASSERT_EQUAL_UINT32(first.timestamp, out[0].firstTimestamp);
+    TEST_ASSERT_EQUAL_UINT32(first.micros, out[0].firstMicros);
+    TEST_ASSERT_EQUAL_UINT32(last.timestamp, out[0].timestamp);
+    TEST_ASSERT_EQUAL_UINT32(last.micros, out[0].micros);
+    TEST_ASSERT_EQUAL_STRING("new", out[0].name);
+    TEST_ASSERT_EQUAL_UINT8(sizeof(data), out[0].manufDataLen);
+    TEST_ASSERT_EQUAL_MEMORY(data, out[0].manufData, sizeof(data));
+}
+
+// sightings of the scan callback while a table is flushed go to the other table
+void test_adds_during_flush() {
+    static BleAggDoubleBuffer<64> buffer;
+    auto none = [](const BleAdvRecord &) {};
+    for (uint32_t n = 0; n < 20; n++) buffer.add(sighting(n, 1000000, -60), none);
+    uint32_t flushed = 0;
+    buffer.swap().flush([&](const BleAdvRecord &rec) {
+        TEST_ASSERT_EQUAL_UINT32(1, rec.timestamp);
+        buffer.add(sighting(100 + flushed++, 2000000, -60), none);
+    });
+    TEST_ASSERT_EQUAL_UINT32(20, flushed);
+    uint32_t next = 0;
+    buffer.swap().flush([&](const BleAdvRecord &rec) {
+        TEST_ASSERT_EQUAL_UINT32(2, rec.timestamp);
+        next++;
+    });
+    TEST_ASSERT_EQUAL_UINT32(20, next);
+}
+
+/**
+ * Scan callback adds under a lock while the loop task swaps tables under the lock and flushes the
+ * taken one without it. Counts of all records emitted (flushed or evicted) add up per device.
+ */
+void test_flush_and_swap() {
+    static BleAggDoubleBuffer<256> buffer;
+    std::mutex lock;
+    const uint32_t ADDRESSES = 2000, SIGHTINGS = 300000;
+    std::vector<uint32_t> expected(ADDRESSES), emitted(ADDRESSES);
+    std::vector<uint32_t> order(SIGHTINGS);
+    for (uint32_t &n : order) {
+        n = rnd(ADDRESSES);
+        expected[n]++;
+    }
+    // evicted records are emitted by the scan callback, flushed ones by the loop task
+    std::mutex emittedLock;
+    auto emit = [&emitted, &emittedLock](const BleAdvRecord &rec) {
+        std::lock_guard<std::mutex> g(emittedLock);
+        emitted[rec.address[2] | rec.address[3] << 8] += rec.count;
+    };
+    bool done = false;
+    uint32_t flushes = 0;
+    std::thread scan([&]() {
+        for (uint32_t i = 0; i < SIGHTINGS; i++) {
+            std::lock_guard<std::mutex> g(lock);
+            buffer.add(sighting(order[i], 1000ULL * i, -60), emit);
+        }
+        std::lock_guard<std::mutex> g(lock);
+        done = true;
+    });
+    for (;;) {
+        bool last;
+        BleAggDoubleBuffer<256>::Table *taken;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            last = done;
+            taken = &buffer.swap();
+        }
+        taken->flush(emit);
+        flushes++;
+        if (last) break;
+        std::this_thread::yield();
+    }
+    scan.join();
+    TEST_ASSERT_TRUE(flushes > 1);
+    for (uint32_t n = 0; n < ADDRESSES; n++) TEST_ASSERT_EQUAL_UINT32(expected[n], emitted[n]);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_10k_distinct_addresses);
+    RUN_TEST(test_evicts_least_recently_seen);
+    RUN_TEST(test_rssi_statistics);
+    RUN_TEST(test_timestamps_and_latest_payload);
+    RUN_TEST(test_adds_during_flush);
+    RUN_TEST(test_flush_and_swap);
+    return UNITY_END();
+}
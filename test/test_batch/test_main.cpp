@@ -0,0 +1,173 @@
+/**
+ * Batch boundaries of BleBatch (src/ble_batch.h): records are never split or lost when a
+ * batch runs full, for JSON arrays and binary messages.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_batch.h"
+
+static std::mt19937 rng(3);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+// records of random length, as a crowd advertises them
+static BleAdvRecord randomRecord(uint32_t seq) {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    // sequence number in address, to find each record again
+    rec.address[0] = 0xc0;
+    for (size_t i = 0; i < 4; i++) rec.address[2 + i] = (uint8_t)(seq >> (8 * (3 - i)));
+    rec.payloadLength = (uint16_t)rnd(BLE_MAX_PAYLOAD_LEN + 1);
+    rec.timestamp = 1651042690 + seq;
+    rec.micros = rnd(1000000);
+    rec.rssi = (int8_t)(-30 - (int)rnd(70));
+    rec.flags |= BLE_REC_HAVE_RSSI;
+    if (rnd(3) == 0) {
+        char name[BLE_MAX_NAME_LEN];
+        size_t len = 1 + rnd(BLE_MAX_NAME_LEN);
+        for (size_t i = 0; i < len; i++) name[i] = (char)('a' + rnd(26));
+        bleRecSetName(rec, name, len);
+    }
+    if (rnd(3) != 0) {
+        uint8_t data[BLE_MAX_MANUF_DATA_LEN];
+        size_t len = rnd(BLE_MAX_MANUF_DATA_LEN + 1);
+        for (size_t i = 0; i < len; i++) data[i] = (uint8_t)rnd(256);
+        bleRecSetManufData(rec, data, len);
+    }
+    return rec;
+}
+
+static std::string json(const BleAdvRecord &rec) {
+    char buf[BleLegacySchema<>::maxJsonLen + 1];
+    size_t len = serializeBleAdvRecord(buf, sizeof(buf), rec);
+    return std::string(buf, len);
+}
+
+/**
+ * Adds records as the publisher does (flush when full, add again) and returns the messages.
+ */
+static std::vector<std::string> batchAll(BleBatch &batch, const std::vector<BleAdvRecord> &records, std::vector<std::vector<uint32_t>> &perMessage) {
+    std::vector<std::string> messages;
+    std::vector<uint32_t> current;
+    auto flush = [&]() {
+        size_t len = batchFinish(batch);
+        if (len == 0) return;
+        TEST_ASSERT_LESS_OR_EQUAL(batch.size - 1, len);
+        messages.push_back(std::string(batch.buf, len));
+        perMessage.push_back(current);
+        current.clear();
+        batchReset(batch);
+    };
+    for (uint32_t i = 0; i < records.size(); i++) {
+        if (batchAdd(batch, records[i], i)) {
+            current.push_back(i);
+            continue;
+        }
+        TEST_ASSERT_TRUE(batch.count > 0);
+        flush();
+        TEST_ASSERT_TRUE(batchAdd(batch, records[i], i));
+        current.push_back(i);
+    }
+    flush();
+    return messages;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_json_boundaries() {
+    for (size_t size : {(size_t)BleLegacySchema<>::maxJsonLen + 3, (size_t)513, (size_t)1024, (size_t)4097}) {
+        std::vector<BleAdvRecord> records;
+        for (uint32_t i = 0; i < 3000; i++) records.push_back(randomRecord(i));
+        std::vector<char> buf(size);
+        BleBatch batch;
+        batchInit(batch, buf.data(), size);
+        std::vector<std::vector<uint32_t>> perMessage;
+        std::vector<std::string> messages = batchAll(batch, records, perMessage);
+
+        uint32_t next = 0;
+        for (size_t m = 0; m < messages.size(); m++) {
+            // exactly the records added, whole and in order
+            std::string expected = "[";
+            for (size_t r = 0; r < perMessage[m].size(); r++) {
+                TEST_ASSERT_EQUAL_UINT32(next++, perMessage[m][r]);
+                if (r > 0) expected += ", ";
+                expected += json(records[perMessage[m][r]]);
+            }
+            expected += "]";
+            TEST_ASSERT_EQUAL_STRING(expected.c_str(), messages[m].c_str());
+            // the next record did not fit anymore
+            if (m + 1 < messages.size())
+                TEST_ASSERT_TRUE(expected.size() + 2 + json(records[next]).size() > size - 1);
+        }
+        TEST_ASSERT_EQUAL_UINT32(records.size(), next);
+    }
+}
+
+void test_binary_boundaries() {
+    for (size_t size : {(size_t)BLE_BIN_MAX_RECORD_LEN + 2, (size_t)513, (size_t)4097}) {
+        std::vector<BleAdvRecord> records;
+        for (uint32_t i = 0; i < 3000; i++) records.push_back(randomRecord(i));
+        std::vector<char> buf(size);
+        BleBatch batch;
+        batchInit(batch, buf.data(), size, true);
+        std::vector<std::vector<uint32_t>> perMessage;
+        std::vector<std::string> messages = batchAll(batch, records, perMessage);
+
+        uint32_t next = 0;
+        for (size_t m = 0; m < messages.size(); m++) {
+            BinReader reader;
+            TEST_ASSERT_TRUE(binDecodeBegin(reader, (const uint8_t *)messages[m].data(), messages[m].size()));
+            BleAdvRecord rec;
+            for (uint32_t index : perMessage[m]) {
+                TEST_ASSERT_EQUAL_UINT32(next++, index);
+                TEST_ASSERT_EQUAL(BIN_OK, binDecodeRecord(reader, rec));
+                TEST_ASSERT_EQUAL_STRING(json(records[index]).c_str(), json(rec).c_str());
+            }
+            TEST_ASSERT_EQUAL(BIN_END, binDecodeRecord(reader, rec));
+        }
+        TEST_ASSERT_EQUAL_UINT32(records.size(), next);
+    }
+}
+
+void test_record_larger_than_batch() {
+    char buf[64];
+    BleBatch batch;
+    batchInit(batch, buf, sizeof(buf));
+    BleAdvRecord rec = randomRecord(1);
+    uint8_t data[BLE_MAX_MANUF_DATA_LEN] = {0};
+    bleRecSetManufData(rec, data, sizeof(data));
+    TEST_ASSERT_FALSE(batchAdd(batch, rec, 0));
+    TEST_ASSERT_EQUAL(0, batch.count);
+    TEST_ASSERT_EQUAL_size_t(0, batch.len);
+    TEST_ASSERT_EQUAL_size_t(0, batchFinish(batch));
+}
+
+void test_deadline() {
+    char buf[1024];
+    BleBatch batch;
+    batchInit(batch, buf, sizeof(buf));
+    TEST_ASSERT_FALSE(batchDeadlinePassed(batch, 100000, 1000));
+    TEST_ASSERT_TRUE(batchAdd(batch, randomRecord(1), 0xfffffe00u));
+    TEST_ASSERT_FALSE(batchDeadlinePassed(batch, 0xffffff00u, 1000));
+    // millis() wrapped
+    TEST_ASSERT_TRUE(batchDeadlinePassed(batch, 0x00000200u, 1000));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_json_boundaries);
+    RUN_TEST(test_binary_boundaries);
+    RUN_TEST(test_record_larger_than_batch);
+    RUN_TEST(test_deadline);
+    return UNITY_END();
+}
@@ -0,0 +1,239 @@
+/**
+ * Binary encoding (src/ble_binary.h): encode/decode round trips with every optional field and
+ * the decoder on truncated and corrupted input.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <vector>
+
+#include "ble_binary.h"
+#include "ble_frames.h"
+
+static std::mt19937 rng(4);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static void randomBytes(uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (uint8_t)rnd(256);
+}
+
+/**
+ * Record with each optional field present with probability `optional` (1 for all of them),
+ * values as the decoder gives them back.
+ */
+static BleAdvRecord randomRecord(double optional) {
+    std::bernoulli_distribution have(optional);
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    randomBytes(rec.address, BLE_ADDR_LEN);
+    rec.addrType = (uint8_t)rnd(256);
+    rec.payloadLength = (uint16_t)rnd(256);
+    rec.timestamp = (uint32_t)rng();
+    rec.micros = rnd(1 << 24);
+    if (have(rng)) {
+        // 127 is reserved for "not available"
+        rec.rssi = (int8_t)(rnd(255) - 128);
+        rec.flags |= BLE_REC_HAVE_RSSI;
+    }
+    if (have(rng)) {
+        rec.txPower = (int8_t)(rnd(256) - 128);
+        rec.flags |= BLE_REC_HAVE_TX_POWER;
+    }
+    if (have(rng)) {
+        rec.appearance = (uint16_t)rnd(65536);
+        rec.flags |= BLE_REC_HAVE_APPEARANCE;
+    }
+    if (have(rng)) {
+        char name[BLE_MAX_NAME_LEN];
+        size_t len = rnd(BLE_MAX_NAME_LEN + 1);
+        for (size_t i = 0; i < len; i++) name[i] = (char)(1 + rnd(255));
+        bleRecSetName(rec, name, len);
+    }
+    if (have(rng)) {
+        uint8_t data[BLE_MAX_MANUF_DATA_LEN];
+        size_t len = rnd(BLE_MAX_MANUF_DATA_LEN + 1);
+        randomBytes(data, len);
+        bleRecSetManufData(rec, data, len);
+    }
+    if (have(rng)) {
+        static const size_t LENS[] = {2, 4, 16};
+        uint8_t uuid[BLE_MAX_UUID_LEN];
+        randomBytes(uuid, sizeof(uuid));
+        bleRecSetServiceUUID(rec, uuid, LENS[rnd(3)]);
+    }
+    if (have(rng)) {
+        rec.count = (uint16_t)rnd(65536);
+        rec.rssiMin = (int8_t)(rnd(256) - 128);
+        rec.rssiMax = (int8_t)(rnd(256) - 128);
+        rec.firstTimestamp = (uint32_t)rng();
+        rec.firstMicros = rnd(1 << 24);
+        rec.flags |= BLE_REC_HAVE_STATS;
+    }
+    if (have(rng)) {
+        uint8_t frame[BLE_MAX_FRAME_LEN];
+        size_t len = rnd(BLE_MAX_FRAME_LEN + 1);
+        randomBytes(frame, len);
+        bleRecSetFrame(rec, (uint8_t)(1 + rnd(6)), frame, len);
+    }
+    if (have(rng)) {
+        // binary records always carry address type and payload length
+        rec.delta = BLE_DELTA_RECORD | BLE_DELTA_SAME_META;
+        rec.removed = (uint8_t)rnd(256);
+    }
+    return rec;
+}
+
+static void assertSameRecord(const BleAdvRecord &expected, const BleAdvRecord &actual) {
+    TEST_ASSERT_EQUAL_MEMORY(expected.address, actual.address, BLE_ADDR_LEN);
+    TEST_ASSERT_EQUAL_UINT8(expected.flags, actual.flags);
+    // both zeroed before, so all other bytes have to be equal as well
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, sizeof(BleAdvRecord));
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_round_trip_all_fields() {
+    for (int i = 0; i < 5000; i++) {
+        BleAdvRecord rec = randomRecord(1);
+        uint8_t buf[1 + BLE_BIN_MAX_RECORD_LEN];
+        size_t len = binEncodeMessage(buf, sizeof(buf), rec);
+        TEST_ASSERT_TRUE(len > 0);
+        BinReader reader;
+        BleAdvRecord out;
+        TEST_ASSERT_TRUE(binDecodeBegin(reader, buf, len));
+        TEST_ASSERT_EQUAL(BIN_OK, binDecodeRecord(reader, out));
+        assertSameRecord(rec, out);
+        TEST_ASSERT_EQUAL(BIN_END, binDecodeRecord(reader, out));
+    }
+}
+
+void test_max_record_len() {
+    BleAdvRecord rec = randomRecord(1);
+    char name[BLE_MAX_NAME_LEN];
+    memset(name, 'n', sizeof(name));
+    bleRecSetName(rec, name, sizeof(name));
+    uint8_t data[BLE_MAX_MANUF_DATA_LEN] = {0};
+    bleRecSetManufData(rec, data, sizeof(data));
+    uint8_t uuid[BLE_MAX_UUID_LEN] = {0};
+    bleRecSetServiceUUID(rec, uuid, sizeof(uuid));
+    uint8_t frame[BLE_MAX_FRAME_LEN] = {0};
+    bleRecSetFrame(rec, BLE_FRAME_IBEACON, frame, sizeof(frame));
+    uint8_t buf[BLE_BIN_MAX_RECORD_LEN];
+    TEST_ASSERT_EQUAL_size_t(BLE_BIN_MAX_RECORD_LEN, binEncodeRecord(buf, sizeof(buf), rec));
+    TEST_ASSERT_EQUAL_size_t(0, binEncodeRecord(buf, sizeof(buf) - 1, rec));
+}
+
+void test_round_trip_message_of_many() {
+    std::vector<BleAdvRecord> records;
+    std::vector<uint8_t> msg(1, BLE_BIN_VERSION);
+    for (int i = 0; i < 500; i++) {
+        records.push_back(randomRecord(0.5));
+        uint8_t buf[BLE_BIN_MAX_RECORD_LEN];
+        size_t len = binEncodeRecord(buf, sizeof(buf), records.back());
+        TEST_ASSERT_TRUE(len > 0);
+        msg.insert(msg.end(), buf, buf + len);
+    }
+    BinReader reader;
+    BleAdvRecord out;
+    TEST_ASSERT_TRUE(binDecodeBegin(reader, msg.data(), msg.size()));
+    for (const BleAdvRecord &rec : records) {
+        TEST_ASSERT_EQUAL(BIN_OK, binDecodeRecord(reader, out));
+        assertSameRecord(rec, out);
+    }
+    TEST_ASSERT_EQUAL(BIN_END, binDecodeRecord(reader, out));
+}
+
+void test_unknown_tlv_skipped() {
+    BleAdvRecord rec = randomRecord(0);
+    uint8_t buf[64];
+    size_t len = binEncodeMessage(buf, sizeof(buf), rec);
+    // append TLV of a newer encoder to the record
+    const uint8_t tlv[] = {0x7f, 3, 1, 2, 3};
+    memcpy(buf + len, tlv, sizeof(tlv));
+    buf[1] += sizeof(tlv);
+    BinReader reader;
+    BleAdvRecord out;
+    TEST_ASSERT_TRUE(binDecodeBegin(reader, buf, len + sizeof(tlv)));
+    TEST_ASSERT_EQUAL(BIN_OK, binDecodeRecord(reader, out));
+    assertSameRecord(rec, out);
+}
+
+void test_wrong_version() {
+    uint8_t buf[1 + BLE_BIN_MAX_RECORD_LEN];
+    size_t len = binEncodeMessage(buf, sizeof(buf), randomRecord(1));
+    BinReader reader;
+    TEST_ASSERT_FALSE(binDecodeBegin(reader, buf, 0));
+    buf[0] = '{';
+    TEST_ASSERT_FALSE(binDecodeBegin(reader, buf, len));
+}
+
+// every prefix of a message decodes its whole records and reports the cut one as malformed
+void test_truncated_input() {
+    for (int i = 0; i < 200; i++) {
+        BleAdvRecord first = randomRecord(0.7), second = randomRecord(0.7);
+        uint8_t buf[1 + 2 * BLE_BIN_MAX_RECORD_LEN];
+        size_t firstLen = binEncodeMessage(buf, sizeof(buf), first);
+        size_t len = firstLen + binEncodeRecord(buf + firstLen, sizeof(buf) - firstLen, second);
+        for (size_t cut = 1; cut < len; cut++) {
+            // copy, so reads beyond the cut are caught by the address sanitizer
+            std::vector<uint8_t> part(buf, buf + cut);
+            BinReader reader;
+            BleAdvRecord out;
+            TEST_ASSERT_TRUE(binDecodeBegin(reader, part.data(), part.size()));
+            binDecodeResult r = binDecodeRecord(reader, out);
+            if (cut == 1) {
+                // version byte only
+                TEST_ASSERT_EQUAL(BIN_END, r);
+            } else if (cut < firstLen) {
+                TEST_ASSERT_EQUAL(BIN_MALFORMED, r);
+            } else {
+                TEST_ASSERT_EQUAL(BIN_OK, r);
+                assertSameRecord(first, out);
+                TEST_ASSERT_EQUAL(cut == firstLen ? BIN_END : BIN_MALFORMED, binDecodeRecord(reader, out));
+            }
+            // reader stops after malformed input
+            TEST_ASSERT_EQUAL(BIN_END, binDecodeRecord(reader, out));
+        }
+    }
+}
+
+void test_corrupted_lengths() {
+    for (int i = 0; i < 2000; i++) {
+        uint8_t buf[1 + BLE_BIN_MAX_RECORD_LEN];
+        size_t len = binEncodeMessage(buf, sizeof(buf), randomRecord(0.7));
+        std::vector<uint8_t> msg(buf, buf + len);
+        // random byte anywhere after the version, often a record or TLV length
+        msg[1 + rnd((uint32_t)len - 1)] = (uint8_t)rnd(256);
+        BinReader reader;
+        BleAdvRecord out;
+        TEST_ASSERT_TRUE(binDecodeBegin(reader, msg.data(), msg.size()));
+        size_t records = 0;
+        binDecodeResult r;
+        while ((r = binDecodeRecord(reader, out)) == BIN_OK) {
+            TEST_ASSERT_TRUE(++records <= msg.size());
+            TEST_ASSERT_TRUE(out.manufDataLen <= BLE_MAX_MANUF_DATA_LEN);
+            TEST_ASSERT_TRUE(strlen(out.name) <= BLE_MAX_NAME_LEN);
+            TEST_ASSERT_TRUE(out.frameLen <= BLE_MAX_FRAME_LEN);
+        }
+        TEST_ASSERT_TRUE(r == BIN_END || r == BIN_MALFORMED);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip_all_fields);
+    RUN_TEST(test_max_record_len);
+    RUN_TEST(test_round_trip_message_of_many);
+    RUN_TEST(test_unknown_tlv_skipped);
+    RUN_TEST(test_wrong_version);
+    RUN_TEST(test_truncated_input);
+    RUN_TEST(test_corrupted_lengths);
+    return UNITY_END();
+}
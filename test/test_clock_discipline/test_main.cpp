@@ -0,0 +1,146 @@
+/**
+ * Clock discipline (src/clock_discipline.h): mapped time never runs backwards while slewing, slew
+ * is capped at maxSlewPpm, the step threshold, and the error against true time (and its estimated
+ * bound) under a drifting crystal and jittery syncs, as host_tools/src/clock_sim.cpp simulates.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <math.h>
+
+#include <random>
+
+#include "clock_discipline.h"
+
+static const int64_t EPOCH_US = 1651042693LL * 1000000;
+
+void setUp() {}
+void tearDown() {}
+
+void test_first_sync_sets_time() {
+    ClockDiscipline<> d;
+    TEST_ASSERT_FALSE(d.synced());
+    TEST_ASSERT_EQUAL(CLOCK_SYNC_FIRST, d.sync(5000000, EPOCH_US));
+    TEST_ASSERT_TRUE(d.toEpochUs(5000000) == EPOCH_US);
+    TEST_ASSERT_TRUE(d.toEpochUs(6000000) == EPOCH_US + 1000000);
+}
+
+/**
+ * Syncs off by up to the step threshold (both directions) are slewed in: mapped time goes on
+ * forward, the phase pending changes by at most 500 ppm of elapsed time, and is done in the end.
+ */
+void test_slew_forward_and_capped() {
+    const int64_t errors[] = {-900000, 900000, -50000, 300000};
+    for (int64_t error : errors) {
+        ClockDiscipline<> d(500);
+        int64_t mono = 1000000;
+        d.sync(mono, EPOCH_US);
+        // consistent syncs, no drift
+        for (int i = 1; i <= 4; i++) TEST_ASSERT_EQUAL(CLOCK_SYNC_SLEW, d.sync(mono + i * 60000000LL, EPOCH_US + i * 60000000LL));
+        mono += 5 * 60000000LL;
+        TEST_ASSERT_EQUAL(CLOCK_SYNC_SLEW, d.sync(mono, EPOCH_US + 5 * 60000000LL + error));
+        TEST_ASSERT_TRUE(d.pendingSlewUs(mono) != 0);
+        // drift estimate is capped as well
+        TEST_ASSERT_TRUE(abs(d.driftPpb()) <= 500000);
+        int64_t prev = d.toEpochUs(mono), prevPending = d.pendingSlewUs(mono);
+        const int64_t STEP_US = 10000;
+        // 900 ms at 500 ppm take 30 min
+        for (int64_t t = mono + STEP_US; t <= mono + 2000LL * 1000000; t += STEP_US) {
+            int64_t mapped = d.toEpochUs(t), pending = d.pendingSlewUs(t);
+            TEST_ASSERT_TRUE(mapped > prev);
+            TEST_ASSERT_TRUE(llabs(pending - prevPending) <= STEP_US * 500 / 1000000 + 1);
+            // rate of mapped time within drift estimate and slew
+            int64_t rateDev = llabs((mapped - prev) - STEP_US);
+            TEST_ASSERT_TRUE(rateDev <= STEP_US * (500000 + abs(d.driftPpb())) / 1000000000 + 1);
+            prev = mapped;
+            prevPending = pending;
+        }
+        TEST_ASSERT_TRUE(d.pendingSlewUs(mono + 2000LL * 1000000) == 0);
+        TEST_ASSERT_EQUAL_UINT32(0, d.stepCount());
+    }
+}
+
+// mapped time is not stepped back by a sync behind it
+void test_never_backwards_across_syncs() {
+    ClockDiscipline<> d;
+    std::mt19937 rng(15);
+    std::normal_distribution<double> jitter(0, 200000);
+    int64_t prev = INT64_MIN;
+    for (int64_t mono = 0; mono < 3600LL * 1000000; mono += 100000) {
+        if (mono % (60LL * 1000000) == 0) d.sync(mono, EPOCH_US + mono + (int64_t)llround(jitter(rng)));
+        int64_t mapped = d.toEpochUs(mono);
+        if (d.syncCount() > 1) TEST_ASSERT_TRUE(mapped >= prev);
+        prev = mapped;
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, d.stepCount());
+}
+
+void test_step_threshold() {
+    ClockDiscipline<> d(500, 1000000);
+    d.sync(0, EPOCH_US);
+    d.sync(60000000, EPOCH_US + 60000000);
+    // just within threshold: slewed
+    TEST_ASSERT_EQUAL(CLOCK_SYNC_SLEW, d.sync(120000000, EPOCH_US + 120000000 - 999000));
+    TEST_ASSERT_EQUAL_UINT32(0, d.stepCount());
+    // beyond: set directly and window cleared
+    int64_t mono = 180000000;
+    int64_t epoch = d.toEpochUs(mono) + 1001000;
+    TEST_ASSERT_EQUAL(CLOCK_SYNC_STEP, d.sync(mono, epoch));
+    TEST_ASSERT_TRUE(d.toEpochUs(mono) == epoch);
+    TEST_ASSERT_TRUE(d.pendingSlewUs(mono) == 0);
+    TEST_ASSERT_EQUAL_UINT32(1, d.stepCount());
+    TEST_ASSERT_EQUAL_size_t(1, d.sampleCount());
+    // and backwards
+    mono += 60000000;
+    epoch = d.toEpochUs(mono) - 5000000;
+    TEST_ASSERT_EQUAL(CLOCK_SYNC_STEP, d.sync(mono, epoch));
+    TEST_ASSERT_TRUE(d.toEpochUs(mono) == epoch);
+    TEST_ASSERT_EQUAL_UINT32(2, d.stepCount());
+}
+
+/**
+ * 48 h, crystal 25 ppm slow wandering 1 ppm per hour, syncs every 15 min with 10 ms jitter.
+ * After the first hour the error stays well below what stepping on each sync gives (max 44 ms),
+ * errorBoundUs() holds for most timestamps, and the drift is found.
+ */
+void test_error_within_bound() {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> jitter(0, 10000);
+    std::normal_distribution<double> wander(0, 1);
+    ClockDiscipline<> d;
+    double drift = 25, mono = 0;
+    const int64_t STEP_US = 1000000, INTERVAL_US = 900LL * 1000000, HOUR_US = 3600LL * 1000000;
+    uint64_t counted = 0, withinBound = 0;
+    int64_t maxError = 0, prev = INT64_MIN;
+    for (int64_t t = 0; t <= 48 * HOUR_US; t += STEP_US) {
+        if (t > 0) mono += STEP_US * (1 - drift / 1e6);
+        if (t > 0 && t % HOUR_US == 0) drift += wander(rng);
+        int64_t monoUs = (int64_t)mono;
+        if ((t - 5000000) % INTERVAL_US == 0) d.sync(monoUs, EPOCH_US + t + (int64_t)llround(jitter(rng)));
+        if (!d.synced()) continue;
+        int64_t mapped = d.toEpochUs(monoUs);
+        TEST_ASSERT_TRUE(mapped >= prev);
+        prev = mapped;
+        if (t < HOUR_US) continue;
+        int64_t error = llabs(mapped - (EPOCH_US + t));
+        if (error > maxError) maxError = error;
+        if (error <= (int64_t)d.errorBoundUs(monoUs)) withinBound++;
+        counted++;
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, d.stepCount());
+    TEST_ASSERT_TRUE(maxError < 35000);
+    TEST_ASSERT_TRUE(withinBound >= counted * 90 / 100);
+    TEST_ASSERT_TRUE(fabs(d.driftPpb() / 1000.0 - drift) < 3);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_first_sync_sets_time);
+    RUN_TEST(test_slew_forward_and_capped);
+    RUN_TEST(test_never_backwards_across_syncs);
+    RUN_TEST(test_step_threshold);
+    RUN_TEST(test_error_within_bound);
+    return UNITY_END();
+}
@@ -0,0 +1,359 @@
+/**
+ * Collector (host_tools/lib/ble_collector): parser of single JSON records, JSON batches and binary
+ * messages, topics and admin kinds, and the store fed line by line in arbitrary chunks, where
+ * sightings found by index and by scan match what was sent, also after a writer left a segment
+ * unsealed.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_batch.h"
+#include "ble_schema.h"
+#include "collector_ingest.h"
+#include "collector_store.h"
+
+static std::mt19937 rng(21);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+struct Sink {
+    std::vector<CollectorRecord> records;
+    void operator()(const CollectorRecord &r) { records.push_back(r); }
+};
+
+static size_t parse(const std::string &payload, Sink &sink, bool &malformed) {
+    return collectorParseSensor((const uint8_t *)payload.data(), payload.size(), 7, sink, malformed);
+}
+
+static BleAdvRecord record(uint32_t n, uint32_t second) {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.address[0] = 0x38;
+    for (size_t i = 0; i < 4; i++) rec.address[2 + i] = (uint8_t)(n >> (8 * (3 - i)));
+    rec.addrType = 1;
+    rec.rssi = -40 - (int8_t)(n % 50);
+    rec.flags |= BLE_REC_HAVE_RSSI;
+    rec.timestamp = second;
+    rec.micros = n * 7919 % 1000000;
+    if (n % 2 == 0) {
+        const uint8_t data[] = {0x4c, 0x00, 0x02, 0x15};
+        bleRecSetManufData(rec, data, sizeof(data));
+    }
+    return rec;
+}
+
+static uint64_t addressOf(const BleAdvRecord &rec) {
+    uint64_t a = 0;
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) a = a << 8 | rec.address[i];
+    return a;
+}
+
+static void assertSame(const BleAdvRecord &b, const CollectorRecord &r) {
+    TEST_ASSERT_TRUE(addressOf(b) == r.address);
+    TEST_ASSERT_TRUE((int64_t)b.timestamp * 1000 + b.micros / 1000 == r.tsMs);
+    TEST_ASSERT_EQUAL_INT8(b.rssi, r.rssi);
+    TEST_ASSERT_EQUAL_UINT8(b.addrType, r.addrType);
+    TEST_ASSERT_EQUAL_UINT16(bleRecHas(b, BLE_REC_HAVE_MANUF_DATA) ? 0x004c : CR_COMPANY_NA, r.companyId);
+    TEST_ASSERT_EQUAL_UINT32(7, r.logger);
+}
+
+static void assertText(const char *want, const char *s, size_t len) {
+    TEST_ASSERT_EQUAL_STRING(want, std::string(s, len).c_str());
+}
+
+// removed after each test
+static std::string tempParent;
+
+void setUp() {}
+void tearDown() {
+    if (!tempParent.empty() && system(("rm -rf '" + tempParent + "'").c_str()) == 0) tempParent.clear();
+}
+
+// quoted or not, time as timestamp/micros or ts, unknown and nested values skipped
+void test_parse_json_record() {
+    Sink sink;
+    bool malformed;
+    std::string msg = "{\"address\": \"38:2f:a6:01:02:03\", \"rssi\": \"-67\", \"timestamp\": 1651042693, \"micros\": \"250999\","
+                      " \"name\": \"Tag \\\"x\\\"\", \"frame\": {\"type\": [1, 2]}, \"manufData\": \"4c000215\", \"txPower\": -8,"
+                      " \"count\": 3, \"other\": null}";
+    TEST_ASSERT_EQUAL_size_t(1, parse(msg, sink, malformed));
+    TEST_ASSERT_FALSE(malformed);
+    const CollectorRecord &r = sink.records[0];
+    TEST_ASSERT_TRUE(r.address == 0x382fa6010203ULL);
+    TEST_ASSERT_TRUE(r.tsMs == 1651042693250LL);
+    TEST_ASSERT_EQUAL_INT8(-67, r.rssi);
+    TEST_ASSERT_EQUAL_INT8(-8, r.txPower);
+    TEST_ASSERT_EQUAL_UINT16(0x004c, r.companyId);
+    TEST_ASSERT_EQUAL_UINT16(3, r.count);
+    TEST_ASSERT_EQUAL_UINT8(BLE_REC_HAVE_RSSI | BLE_REC_HAVE_NAME | BLE_REC_HAVE_FRAME | BLE_REC_HAVE_MANUF_DATA |
+                                BLE_REC_HAVE_TX_POWER | BLE_REC_HAVE_STATS,
+                            r.flags);
+
+    sink.records.clear();
+    TEST_ASSERT_EQUAL_size_t(1, parse("{\"ts\": 1651042693001, \"address\": \"38:2F:A6:01:02:03\"}", sink, malformed));
+    TEST_ASSERT_TRUE(sink.records[0].tsMs == 1651042693001LL);
+    TEST_ASSERT_EQUAL_INT8(CR_RSSI_NA, sink.records[0].rssi);
+    TEST_ASSERT_EQUAL_UINT16(CR_COMPANY_NA, sink.records[0].companyId);
+    TEST_ASSERT_EQUAL_UINT16(1, sink.records[0].count);
+}
+
+void test_parse_malformed() {
+    const char *bad[] = {"", "{}", "{\"rssi\": -60}", "{\"address\": \"38:2f:a6:01:02\"}", "{\"address\": \"38:2f:a6:01:02:0g\"}",
+                         "{\"address\": \"38:2f:a6:01:02:03\", \"rssi\": }", "{\"address\": \"38:2f:a6:01:02:03\"", "not json"};
+    for (const char *msg : bad) {
+        Sink sink;
+        bool malformed;
+        TEST_ASSERT_EQUAL_size_t(0, parse(msg, sink, malformed));
+        TEST_ASSERT_TRUE(malformed);
+    }
+    // records before the broken one are kept
+    Sink sink;
+    bool malformed;
+    TEST_ASSERT_EQUAL_size_t(1, parse("[{\"address\": \"38:2f:a6:01:02:03\"}, {\"rssi\": 1}]", sink, malformed));
+    TEST_ASSERT_TRUE(malformed);
+    TEST_ASSERT_EQUAL_size_t(0, parse("[ ]", sink, malformed));
+    TEST_ASSERT_FALSE(malformed);
+}
+
+// as the firmware serializes them: single records, JSON and binary batches
+void test_parse_firmware_messages() {
+    char buf[512];
+    for (int mode = 0; mode < 3; mode++) {
+        std::vector<BleAdvRecord> sent;
+        std::string msg;
+        if (mode == 0) {
+            sent.push_back(record(1, 1651042693));
+            msg.assign(buf, serializeBleAdvRecord(buf, sizeof(buf), sent[0]));
+        } else {
+            BleBatch batch;
+            batchInit(batch, buf, sizeof(buf), mode == 2);
+            for (uint32_t n = 0; n < 100; n++) {
+                BleAdvRecord rec = record(n, 1651042693 + n);
+                if (!batchAdd(batch, rec, 0)) break;
+                sent.push_back(rec);
+            }
+            msg.assign(buf, batchFinish(batch));
+        }
+        TEST_ASSERT_TRUE(sent.size() > (mode == 0 ? 0u : 2u));
+        Sink sink;
+        bool malformed;
+        TEST_ASSERT_EQUAL_size_t(sent.size(), parse(msg, sink, malformed));
+        TEST_ASSERT_FALSE(malformed);
+        for (size_t i = 0; i < sent.size(); i++) assertSame(sent[i], sink.records[i]);
+    }
+}
+
+void test_topics_and_admin_kind() {
+    const char *logger;
+    size_t len;
+    const char *topic = "sensor/BLE/Scanner/ssid_from_AP_1/esp32_ble_scan_0001";
+    TEST_ASSERT_EQUAL(CT_SENSOR, collectorSplitTopic(topic, strlen(topic), logger, len));
+    assertText("ssid_from_AP_1/esp32_ble_scan_0001", logger, len);
+    topic = "admin/BLE/Scanner/a/b";
+    TEST_ASSERT_EQUAL(CT_ADMIN, collectorSplitTopic(topic, strlen(topic), logger, len));
+    assertText("a/b", logger, len);
+    // prefix only has no logger
+    topic = "sensor/BLE/Scanner/";
+    TEST_ASSERT_EQUAL(CT_OTHER, collectorSplitTopic(topic, strlen(topic), logger, len));
+    topic = "ota/BLE/Scanner/a/b";
+    TEST_ASSERT_EQUAL(CT_OTHER, collectorSplitTopic(topic, strlen(topic), logger, len));
+
+    const char *kind;
+    const char *msg = " {\"metrics\": {\"queue\": 1}}";
+    collectorAdminKind(msg, strlen(msg), kind, len);
+    assertText("metrics", kind, len);
+    msg = "Going to restart";
+    collectorAdminKind(msg, strlen(msg), kind, len);
+    assertText("text", kind, len);
+}
+
+struct Sighting {
+    uint64_t address;
+    int64_t tsMs;
+    uint32_t logger;
+
+    bool operator<(const Sighting &o) const {
+        return address != o.address ? address < o.address : tsMs != o.tsMs ? tsMs < o.tsMs : logger < o.logger;
+    }
+    bool operator==(const Sighting &o) const { return address == o.address && tsMs == o.tsMs && logger == o.logger; }
+};
+
+static std::string hexOf(const char *p, size_t len) {
+    static const char HEX[] = "0123456789abcdef";
+    std::string s;
+    for (size_t i = 0; i < len; i++) {
+        s += HEX[(uint8_t)p[i] >> 4];
+        s += HEX[(uint8_t)p[i] & 0xf];
+    }
+    return s;
+}
+
+/**
+ * Subscriber output of three loggers, 40 devices, single records, JSON and binary (hex) batches,
+ * with admin messages, other topics and CRLF in between.
+ */
+static std::string traffic(std::vector<Sighting> &expected) {
+    std::string out;
+    char buf[512];
+    uint32_t n = 0;
+    for (int msg = 0; msg < 300; msg++) {
+        uint32_t logger = rnd(3);
+        std::string topic = "sensor/BLE/Scanner/ssid/logger_" + std::to_string(logger);
+        int mode = rnd(3);
+        BleBatch batch;
+        batchInit(batch, buf, sizeof(buf), mode == 2);
+        for (size_t k = 0, want = mode == 0 ? 1 : 1 + rnd(8); k < want; k++, n++) {
+            BleAdvRecord rec = record(rnd(40), 1651042693 + n / 4);
+            if (mode == 0) {
+                out += topic + " " + std::string(buf, serializeBleAdvRecord(buf, sizeof(buf), rec)) + "\n";
+            } else if (!batchAdd(batch, rec, 0)) {
+                break;
+            }
+            expected.push_back({addressOf(rec), (int64_t)rec.timestamp * 1000 + rec.micros / 1000, logger});
+        }
+        if (mode == 1) out += topic + " " + std::string(buf, batchFinish(batch)) + "\r\n";
+        if (mode == 2) {
+            size_t len = batchFinish(batch);
+            out += topic + " " + hexOf(buf, len) + "\n";
+        }
+        if (msg % 50 == 0) out += "admin/BLE/Scanner/ssid/logger_" + std::to_string(logger) + " {\"status\": \"online\"}\n";
+        if (msg % 70 == 0) out += "ota/BLE/Scanner/ssid/logger_0 {}\n";
+    }
+    return out;
+}
+
+/**
+ * Logger ids are given in order of first message, expected has topic numbers.
+ */
+static void mapLoggers(const CollectorStore &store, std::vector<Sighting> &expected) {
+    for (Sighting &s : expected) {
+        std::string name = "ssid/logger_" + std::to_string(s.logger);
+        s.logger = store.loggerDict().find(name.data(), name.size());
+        TEST_ASSERT_TRUE(s.logger != LoggerDict::NONE);
+    }
+    std::sort(expected.begin(), expected.end());
+}
+
+static void assertQueries(const CollectorStore &store, const std::vector<Sighting> &expected) {
+    int64_t first = expected.front().tsMs, last = expected.front().tsMs;
+    for (const Sighting &s : expected) {
+        first = std::min(first, s.tsMs);
+        last = std::max(last, s.tsMs);
+    }
+    for (uint32_t device = 0; device < 40; device++) {
+        uint64_t address = addressOf(record(device, 0));
+        for (int q = 0; q < 4; q++) {
+            // all, random ranges, and exactly the time of a sighting (bounds included)
+            int64_t t0 = q == 0 ? INT64_MIN : first + rnd((uint32_t)(last - first + 1));
+            int64_t t1 = q == 0 ? INT64_MAX : t0 + rnd(30000);
+            if (q == 3)
+                for (const Sighting &s : expected)
+                    if (s.address == address) t0 = t1 = s.tsMs;
+            std::vector<Sighting> want;
+            for (const Sighting &s : expected)
+                if (s.address == address && s.tsMs >= t0 && s.tsMs <= t1) want.push_back(s);
+            for (int useIndex = 0; useIndex < 2; useIndex++) {
+                std::vector<Sighting> got;
+                store.sightings(address, t0, t1, [&](const Segment &seg, uint32_t row) { got.push_back({seg.address[row], seg.ts[row], seg.logger[row]}); },
+                                useIndex == 1);
+                std::sort(got.begin(), got.end());
+                TEST_ASSERT_TRUE(got == want);
+            }
+        }
+    }
+}
+
+static std::string tempDir() {
+    char dir[] = "/tmp/test_collector.XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    tempParent = dir;
+    return tempParent + "/store";
+}
+
+// lines split anywhere between chunks, segments of 64 rows
+void test_ingest_and_query() {
+    std::vector<Sighting> expected;
+    std::string input = traffic(expected);
+    std::string dir = tempDir();
+    {
+        CollectorStore store(dir);
+        TEST_ASSERT_TRUE(store.openForAppend(64));
+        CollectorIngest ingest(store);
+        for (size_t off = 0, chunk; off < input.size(); off += chunk) {
+            chunk = std::min((size_t)1 + rnd(300), input.size() - off);
+            ingest.feed(input.data() + off, chunk);
+        }
+        ingest.finish();
+        TEST_ASSERT_EQUAL_UINT64(expected.size(), ingest.stats.records);
+        TEST_ASSERT_EQUAL_UINT64(0, ingest.stats.malformed);
+        TEST_ASSERT_EQUAL_UINT64(6, ingest.stats.adminMessages);
+        TEST_ASSERT_EQUAL_UINT64(5, ingest.stats.skipped);
+        store.close();
+    }
+    CollectorStore store(dir);
+    TEST_ASSERT_TRUE(store.openForRead());
+    TEST_ASSERT_EQUAL_size_t(3, store.loggerDict().size());
+    uint64_t rows = 0;
+    for (const auto &s : store.allSegments()) {
+        TEST_ASSERT_TRUE(s->indexed());
+        rows += s->rows();
+    }
+    TEST_ASSERT_EQUAL_UINT64(expected.size(), rows);
+    TEST_ASSERT_EQUAL_size_t((expected.size() + 63) / 64, store.allSegments().size());
+    size_t admin = 0;
+    store.forEachAdmin([&](int64_t, uint32_t, const char *payload, uint32_t len) {
+        assertText("{\"status\": \"online\"}", payload, len);
+        admin++;
+    });
+    TEST_ASSERT_EQUAL_size_t(6, admin);
+    mapLoggers(store, expected);
+    assertQueries(store, expected);
+}
+
+// rows of a segment not sealed (writer gone) are found by scan, and indexed on next open for append
+void test_unsealed_segment() {
+    std::vector<Sighting> expected;
+    std::string input = traffic(expected);
+    std::string dir = tempDir();
+    CollectorStore writer(dir);
+    TEST_ASSERT_TRUE(writer.openForAppend(1 << 16));
+    CollectorIngest ingest(writer);
+    ingest.feed(input.data(), input.size());
+    // writer not closed, as after a crash
+    CollectorStore reader(dir);
+    TEST_ASSERT_TRUE(reader.openForRead());
+    TEST_ASSERT_EQUAL_size_t(1, reader.allSegments().size());
+    TEST_ASSERT_FALSE(reader.allSegments()[0]->sealed());
+    mapLoggers(reader, expected);
+    assertQueries(reader, expected);
+
+    CollectorStore recovered(dir);
+    TEST_ASSERT_TRUE(recovered.openForAppend());
+    recovered.close();
+    CollectorStore store(dir);
+    TEST_ASSERT_TRUE(store.openForRead());
+    TEST_ASSERT_TRUE(store.allSegments()[0]->indexed());
+    assertQueries(store, expected);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_parse_json_record);
+    RUN_TEST(test_parse_malformed);
+    RUN_TEST(test_parse_firmware_messages);
+    RUN_TEST(test_topics_and_admin_kind);
+    RUN_TEST(test_ingest_and_query);
+    RUN_TEST(test_unsealed_segment);
+    return UNITY_END();
+}
@@ -0,0 +1,160 @@
+/**
+ * Delta encoding (src/ble_delta.h) against its decoder (host_tools/lib/ble_delta_decoder),
+ * also when messages that failed are stored and replayed after newer ones (STORE_AND_FORWARD).
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <vector>
+
+#include "ble_delta.h"
+#include "ble_delta_decoder.h"
+
+static std::mt19937 rng(11);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static const uint32_t DEVICES = 20;
+
+// next sighting of a device, fields change now and then
+static BleAdvRecord sighting(std::vector<BleAdvRecord> &devices, uint64_t &timeUs) {
+    BleAdvRecord &rec = devices[rnd(DEVICES)];
+    timeUs += 1 + rnd(2000000);
+    rec.timestamp = (uint32_t)(timeUs / 1000000);
+    rec.micros = (uint32_t)(timeUs % 1000000);
+    rec.rssi = (int8_t)(-30 - (int)rnd(70));
+    if (rnd(10) == 0) {
+        char name[4] = {'d', (char)('a' + rnd(26)), (char)('a' + rnd(26)), '\0'};
+        bleRecSetName(rec, name, 3);
+    }
+    if (rnd(10) == 0) {
+        uint8_t data[4] = {0x4c, 0x00, (uint8_t)rnd(256), (uint8_t)rnd(256)};
+        bleRecSetManufData(rec, data, sizeof(data));
+    }
+    if (rnd(20) == 0) rec.flags ^= BLE_REC_HAVE_TX_POWER;
+    return rec;
+}
+
+static void assertSameRecord(const BleAdvRecord &expected, const BleAdvRecord &actual) {
+    TEST_ASSERT_EQUAL_MEMORY(expected.address, actual.address, BLE_ADDR_LEN);
+    TEST_ASSERT_EQUAL_UINT32(expected.timestamp, actual.timestamp);
+    TEST_ASSERT_EQUAL_INT8(expected.rssi, actual.rssi);
+    TEST_ASSERT_TRUE(bleDeltaSameFields(expected, actual));
+}
+
+static std::vector<BleAdvRecord> initDevices() {
+    std::vector<BleAdvRecord> devices(DEVICES);
+    for (uint32_t i = 0; i < DEVICES; i++) {
+        BleAdvRecord &rec = devices[i];
+        memset(&rec, 0, sizeof(rec));
+        rec.address[0] = 0xc0;
+        rec.address[5] = (uint8_t)i;
+        rec.payloadLength = 20;
+        rec.flags = BLE_REC_HAVE_RSSI;
+    }
+    return devices;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_round_trip() {
+    std::vector<BleAdvRecord> devices = initDevices();
+    BleDeltaCache<64> cache(300);
+    BleDeltaDecoder decoder;
+    uint64_t timeUs = 1651042690000000ULL;
+    for (int i = 0; i < 20000; i++) {
+        BleAdvRecord full = sighting(devices, timeUs);
+        BleAdvRecord rec = full;
+        bool keyframe = cache.encode(rec);
+        BleDeltaResult r = decoder.apply(rec);
+        TEST_ASSERT_EQUAL(keyframe ? BLE_DELTA_FULL : BLE_DELTA_MERGED, r);
+        assertSameRecord(full, rec);
+    }
+    TEST_ASSERT_TRUE(cache.deltaCount() > cache.keyframeCount());
+}
+
+/**
+ * Logger as publisher.h does it: while messages fail, the cache is reset and records are sent in full,
+ * a failed delta is stored as its full record. Stored records are replayed after live ones.
+ * Every record the backend reconstructs has to be the one captured, no live record may be lost.
+ */
+void test_replay_after_newer_records() {
+    std::vector<BleAdvRecord> devices = initDevices();
+    BleDeltaCache<64> cache(300);
+    BleDeltaDecoder decoder;
+    std::vector<BleAdvRecord> store;
+    uint64_t timeUs = 1651042690000000ULL;
+    bool paused = false;
+    uint32_t replayed = 0;
+    for (int i = 0; i < 20000; i++) {
+        // outages of some records every now and then
+        bool online = (i / 50) % 4 != 3;
+        BleAdvRecord full = sighting(devices, timeUs);
+        BleAdvRecord rec = full;
+        if (!paused) cache.encode(rec);
+        if (!online) {
+            cache.reset();
+            paused = true;
+            store.push_back(full);
+            continue;
+        }
+        paused = false;
+        TEST_ASSERT_TRUE(decoder.apply(rec) != BLE_DELTA_NO_BASE);
+        assertSameRecord(full, rec);
+        // replay is limited, so it runs behind live records
+        if (!store.empty() && rnd(2) == 0) {
+            BleAdvRecord old = store.front();
+            store.erase(store.begin());
+            BleAdvRecord copy = old;
+            TEST_ASSERT_EQUAL(BLE_DELTA_FULL, decoder.apply(copy));
+            assertSameRecord(old, copy);
+            replayed++;
+        }
+    }
+    TEST_ASSERT_TRUE(replayed > 1000);
+}
+
+// an older keyframe does not replace the base, an older delta is left as it is
+void test_older_records() {
+    BleDeltaDecoder decoder;
+    BleAdvRecord base;
+    memset(&base, 0, sizeof(base));
+    base.timestamp = 1000;
+    bleRecSetName(base, "new", 3);
+    BleAdvRecord rec = base;
+    TEST_ASSERT_EQUAL(BLE_DELTA_FULL, decoder.apply(rec));
+
+    BleAdvRecord old = base;
+    old.timestamp = 900;
+    bleRecSetName(old, "old", 3);
+    rec = old;
+    TEST_ASSERT_EQUAL(BLE_DELTA_FULL, decoder.apply(rec));
+    TEST_ASSERT_EQUAL_STRING("old", rec.name);
+
+    BleAdvRecord delta = base;
+    delta.timestamp = 1100;
+    delta.flags &= ~BLE_REC_HAVE_NAME;
+    delta.name[0] = '\0';
+    delta.delta = BLE_DELTA_RECORD | BLE_DELTA_SAME_META;
+    rec = delta;
+    TEST_ASSERT_EQUAL(BLE_DELTA_MERGED, decoder.apply(rec));
+    TEST_ASSERT_EQUAL_STRING("new", rec.name);
+
+    rec = delta;
+    rec.timestamp = 950;
+    TEST_ASSERT_EQUAL(BLE_DELTA_STALE, decoder.apply(rec));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_replay_after_newer_records);
+    RUN_TEST(test_older_records);
+    return UNITY_END();
+}
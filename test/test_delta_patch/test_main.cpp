@@ -0,0 +1,283 @@
+/**
+ * Delta OTA patcher (src/delta_patch.h) with crafted patches: a valid one fed whole and in 1-byte
+ * chunks (header and varints split), and one per error path: bad magic, other base, block beyond
+ * new size, zero or oversized run, seek before or past base, varint longer than 42 bits, bytes
+ * after the end and a new image not matching its hash.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <vector>
+
+#include "delta_patch.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+static std::mt19937 rng(19);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static Bytes randomBytes(size_t len) {
+    Bytes b(len);
+    for (uint8_t &v : b) v = (uint8_t)rnd(256);
+    return b;
+}
+
+static void sha256(const Bytes &b, uint8_t digest[SHA256_LEN]) {
+    Sha256 sha;
+    sha.update(b.data(), b.size());
+    sha.finish(digest);
+}
+
+struct Patch {
+    Bytes bytes;
+
+    // blocks only
+    Patch() {}
+
+    // header of a patch from base to next
+    Patch(const Bytes &base, const Bytes &next) : Patch((uint32_t)base.size(), (uint32_t)next.size()) {
+        DeltaPatchHeader h;
+        h.baseSize = (uint32_t)base.size();
+        h.newSize = (uint32_t)next.size();
+        sha256(base, h.baseSha256);
+        sha256(next, h.newSha256);
+        deltaPatchPutHeader(bytes.data(), h);
+    }
+
+    // header with sizes only, hashes zero
+    Patch(uint32_t baseSize, uint32_t newSize) : bytes(DELTA_PATCH_HEADER_LEN) {
+        DeltaPatchHeader h;
+        memset(&h, 0, sizeof(h));
+        h.baseSize = baseSize;
+        h.newSize = newSize;
+        deltaPatchPutHeader(bytes.data(), h);
+    }
+
+    Patch &varint(uint64_t v) {
+        for (; v >= 0x80; v >>= 7) bytes.push_back((uint8_t)(v | 0x80));
+        bytes.push_back((uint8_t)v);
+        return *this;
+    }
+
+    Patch &ctrl(uint64_t diffLen, uint64_t extraLen, int64_t seek) {
+        varint(diffLen).varint(extraLen);
+        return varint(seek < 0 ? ((uint64_t)-seek << 1) - 1 : (uint64_t)seek << 1);
+    }
+
+    Patch &same(uint64_t n) { return varint(n << 1); }
+
+    Patch &diff(const Bytes &d) {
+        varint(d.size() << 1 | 1);
+        return append(d);
+    }
+
+    Patch &append(const Bytes &b) {
+        bytes.insert(bytes.end(), b.begin(), b.end());
+        return *this;
+    }
+};
+
+struct MemoryTarget {
+    const Bytes &base;
+    Bytes out;
+    bool begun = false;
+
+    explicit MemoryTarget(const Bytes &b) : base(b) {}
+    bool begin(const DeltaPatchHeader &h) {
+        begun = true;
+        return h.baseSize == base.size();
+    }
+    bool readBase(uint32_t offset, uint8_t *buf, size_t len) {
+        TEST_ASSERT_TRUE(offset + len <= base.size());
+        memcpy(buf, base.data() + offset, len);
+        return true;
+    }
+    bool writeNew(const uint8_t *buf, size_t len) {
+        out.insert(out.end(), buf, buf + len);
+        return true;
+    }
+};
+
+// small buffer, so blocks span several writes
+typedef DeltaPatcher<MemoryTarget, 128> Patcher;
+
+/**
+ * Feeds patch in chunks of chunkLen bytes (0: all at once), stops on error.
+ */
+static DeltaPatchStatus apply(Patcher &patcher, const Bytes &patch, size_t chunkLen = 0) {
+    if (chunkLen == 0) return patcher.feed(patch.data(), patch.size());
+    DeltaPatchStatus status = DELTA_PATCH_MORE;
+    for (size_t i = 0; i < patch.size() && status != DELTA_PATCH_ERROR; i += chunkLen)
+        status = patcher.feed(patch.data() + i, patch.size() - i < chunkLen ? patch.size() - i : chunkLen);
+    return status;
+}
+
+static Bytes base;
+static Bytes next;
+static Bytes delta;
+
+/**
+ * Two blocks: same 400, diff 100 (varint of two bytes), same 500, extra 300, seek +200,
+ * then same 600 to 1800 of base, extra 0.
+ */
+static Bytes validPatch() {
+    base = randomBytes(2000);
+    delta = randomBytes(100);
+    for (uint8_t &d : delta) d |= 1;
+    next.assign(base.begin(), base.begin() + 1000);
+    for (size_t i = 0; i < delta.size(); i++) next[400 + i] += delta[i];
+    Bytes extra = randomBytes(300);
+    next.insert(next.end(), extra.begin(), extra.end());
+    next.insert(next.end(), base.begin() + 1200, base.begin() + 1800);
+    Patch p(base, next);
+    p.ctrl(1000, 300, 200).same(400).diff(delta).same(500).append(extra);
+    p.ctrl(600, 0, 0).same(600);
+    return p.bytes;
+}
+
+static void assertFails(const Bytes &patch, DeltaPatchError expected, size_t chunkLen = 0) {
+    MemoryTarget target(base);
+    Patcher patcher(target);
+    TEST_ASSERT_EQUAL(DELTA_PATCH_ERROR, apply(patcher, patch, chunkLen));
+    TEST_ASSERT_EQUAL_STRING(DELTA_PATCH_ERROR_NAMES[expected], DELTA_PATCH_ERROR_NAMES[patcher.error()]);
+    // and stays failed
+    uint8_t b = 0;
+    TEST_ASSERT_EQUAL(DELTA_PATCH_ERROR, patcher.feed(&b, 1));
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_valid_patch() {
+    Bytes patch = validPatch();
+    const size_t chunks[] = {0, 1, 2, 7, 76, 77, 129};
+    for (size_t chunkLen : chunks) {
+        MemoryTarget target(base);
+        Patcher patcher(target);
+        TEST_ASSERT_EQUAL(DELTA_PATCH_DONE, apply(patcher, patch, chunkLen));
+        TEST_ASSERT_EQUAL(DELTA_ERR_NONE, patcher.error());
+        TEST_ASSERT_EQUAL_UINT32(1900, patcher.writtenBytes());
+        TEST_ASSERT_TRUE(target.out == next);
+    }
+}
+
+// the last byte completes it, nothing before
+void test_one_byte_chunks_done_at_end() {
+    Bytes patch = validPatch();
+    MemoryTarget target(base);
+    Patcher patcher(target);
+    for (size_t i = 0; i + 1 < patch.size(); i++) {
+        TEST_ASSERT_EQUAL(DELTA_PATCH_MORE, patcher.feed(&patch[i], 1));
+        TEST_ASSERT_EQUAL(i + 1 >= DELTA_PATCH_HEADER_LEN, target.begun);
+    }
+    TEST_ASSERT_EQUAL(DELTA_PATCH_DONE, patcher.feed(&patch.back(), 1));
+    TEST_ASSERT_TRUE(target.out == next);
+    // empty chunk after the end is fine
+    TEST_ASSERT_EQUAL(DELTA_PATCH_DONE, patcher.feed(nullptr, 0));
+}
+
+void test_bad_magic_and_base() {
+    Bytes patch = validPatch();
+    patch[3] = '2';
+    assertFails(patch, DELTA_ERR_MAGIC);
+    assertFails(patch, DELTA_ERR_MAGIC, 1);
+    patch = validPatch();
+    deltaPatchPutU32(&patch[4], 1999);
+    assertFails(patch, DELTA_ERR_BEGIN, 1);
+}
+
+// diff and extra length of a block together beyond what is left of new size
+void test_block_beyond_new_size() {
+    validPatch();
+    assertFails(Patch(2000, 10).ctrl(6, 5, 0).bytes, DELTA_ERR_RANGE);
+    assertFails(Patch(2000, 10).ctrl(0, 11, 0).bytes, DELTA_ERR_RANGE, 1);
+    // second block beyond what the first one left
+    assertFails(Patch(2000, 10).ctrl(4, 0, 0).same(4).ctrl(0, 7, 0).bytes, DELTA_ERR_RANGE);
+    // lengths summing up beyond 32 bit
+    assertFails(Patch(2000, 10).ctrl(1ULL << 32, 1ULL << 32, 0).bytes, DELTA_ERR_RANGE);
+}
+
+void test_zero_or_oversized_run() {
+    validPatch();
+    assertFails(Patch(2000, 10).ctrl(10, 0, 0).same(0).bytes, DELTA_ERR_FORMAT);
+    assertFails(Patch(2000, 10).ctrl(10, 0, 0).diff(Bytes()).bytes, DELTA_ERR_FORMAT);
+    assertFails(Patch(2000, 10).ctrl(10, 0, 0).same(11).bytes, DELTA_ERR_FORMAT);
+    assertFails(Patch(2000, 10).ctrl(10, 0, 0).same(4).diff(Bytes(7, 1)).bytes, DELTA_ERR_FORMAT);
+    // run of 2^32 + 1, not to be taken as a run of 1
+    assertFails(Patch(2000, 10).ctrl(10, 0, 0).same((1ULL << 32) + 1).bytes, DELTA_ERR_FORMAT);
+}
+
+void test_seek_out_of_base() {
+    validPatch();
+    assertFails(Patch(2000, 10).ctrl(0, 5, -1).append(Bytes(5)).bytes, DELTA_ERR_RANGE);
+    assertFails(Patch(2000, 10).ctrl(4, 0, -5).same(4).bytes, DELTA_ERR_RANGE);
+    assertFails(Patch(2000, 10).ctrl(0, 5, 2001).append(Bytes(5)).bytes, DELTA_ERR_RANGE, 1);
+    // right to the end of base is fine, but no base byte is left
+    Patch p(2000, 10);
+    p.ctrl(0, 5, 2000).append(Bytes(5)).ctrl(5, 0, 0).same(5);
+    assertFails(p.bytes, DELTA_ERR_RANGE);
+}
+
+// 6 bytes (42 bits) at most, also if the value fits
+void test_varint_longer_than_42_bits() {
+    validPatch();
+    Patch p(2000, 10);
+    p.bytes.insert(p.bytes.end(), {0x8a, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00});
+    assertFails(p.bytes, DELTA_ERR_FORMAT);
+    assertFails(p.bytes, DELTA_ERR_FORMAT, 1);
+
+    Patch ok(base, Bytes(base.begin(), base.begin() + 10));
+    ok.bytes.insert(ok.bytes.end(), {0x8a, 0x80, 0x80, 0x80, 0x80, 0x00});
+    ok.varint(0).varint(0).same(10);
+    MemoryTarget target(base);
+    Patcher patcher(target);
+    TEST_ASSERT_EQUAL(DELTA_PATCH_DONE, apply(patcher, ok.bytes, 1));
+}
+
+void test_trailing_bytes() {
+    Bytes patch = validPatch();
+    patch.push_back(0);
+    assertFails(patch, DELTA_ERR_TRAILING);
+
+    patch.pop_back();
+    MemoryTarget target(base);
+    Patcher patcher(target);
+    TEST_ASSERT_EQUAL(DELTA_PATCH_DONE, apply(patcher, patch));
+    uint8_t b = 0;
+    TEST_ASSERT_EQUAL(DELTA_PATCH_ERROR, patcher.feed(&b, 1));
+    TEST_ASSERT_EQUAL(DELTA_ERR_TRAILING, patcher.error());
+}
+
+void test_hash_mismatch() {
+    Bytes patch = validPatch();
+    patch[12 + SHA256_LEN + 31] ^= 1;
+    assertFails(patch, DELTA_ERR_HASH);
+    // or new image differs: last run of 600 replaced by 599 unchanged and one changed byte
+    patch = validPatch();
+    patch.resize(patch.size() - 2);
+    Patch tail;
+    tail.same(599).diff(Bytes(1, 1));
+    Bytes wrong = patch;
+    wrong.insert(wrong.end(), tail.bytes.begin(), tail.bytes.end());
+    assertFails(wrong, DELTA_ERR_HASH, 1);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_patch);
+    RUN_TEST(test_one_byte_chunks_done_at_end);
+    RUN_TEST(test_bad_magic_and_base);
+    RUN_TEST(test_block_beyond_new_size);
+    RUN_TEST(test_zero_or_oversized_run);
+    RUN_TEST(test_seek_out_of_base);
+    RUN_TEST(test_varint_longer_than_42_bits);
+    RUN_TEST(test_trailing_bytes);
+    RUN_TEST(test_hash_mismatch);
+    return UNITY_END();
+}
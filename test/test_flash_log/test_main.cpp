@@ -0,0 +1,237 @@
+/**
+ * FlashLog (src/flash_log.h) on a file as flash (host_tools/lib/flash_file): order and
+ * persistence, wrap of the ring, CRC errors and recovery after power loss at every point of
+ * a write.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "file_flash_io.h"
+#include "flash_log.h"
+
+static const char *PATH = "test_flash_log.bin";
+
+static std::string message(uint32_t i) {
+    // lengths vary, so records end at various offsets in sectors
+    std::string s = "{\"n\": " + std::to_string(i) + ", \"pad\": \"";
+    s.append(i * 37 % 300, (char)('a' + i % 26));
+    return s + "\"}";
+}
+
+static bool append(FlashLog &log, const std::string &s) {
+    return log.append((const uint8_t *)s.data(), s.size());
+}
+
+// reads (and consumes) all unread records
+static std::vector<std::string> drain(FlashLog &log) {
+    std::vector<std::string> out;
+    uint8_t buf[FLASH_LOG_MAX_RECORD_LEN];
+    size_t len;
+    while ((len = log.peek(buf, sizeof(buf))) > 0) {
+        out.push_back(std::string((const char *)buf, len));
+        log.consume();
+    }
+    return out;
+}
+
+void setUp() {
+    remove(PATH);
+}
+
+void tearDown() {
+    remove(PATH);
+}
+
+void test_order_and_persistence() {
+    std::vector<std::string> expected;
+    {
+        FileFlashIo io;
+        TEST_ASSERT_TRUE(io.open(PATH, 8));
+        FlashLog log(io);
+        TEST_ASSERT_TRUE(log.begin());
+        for (uint32_t i = 0; i < 60; i++) {
+            expected.push_back(message(i));
+            TEST_ASSERT_TRUE(append(log, expected.back()));
+        }
+        // replay first half
+        uint8_t buf[FLASH_LOG_MAX_RECORD_LEN];
+        for (size_t i = 0; i < 30; i++) {
+            size_t len = log.peek(buf, sizeof(buf));
+            TEST_ASSERT_EQUAL_STRING(expected[i].c_str(), std::string((const char *)buf, len).c_str());
+            // peek again gives the same record
+            TEST_ASSERT_EQUAL_size_t(len, log.peek(buf, sizeof(buf)));
+            log.consume();
+        }
+        TEST_ASSERT_EQUAL_UINT32(0, io.violationCount());
+    }
+    // after reboot the rest follows, then records appended since
+    FileFlashIo io;
+    TEST_ASSERT_TRUE(io.open(PATH, 8));
+    FlashLog log(io);
+    TEST_ASSERT_TRUE(log.begin());
+    for (uint32_t i = 60; i < 70; i++) {
+        expected.push_back(message(i));
+        TEST_ASSERT_TRUE(append(log, expected.back()));
+    }
+    std::vector<std::string> rest = drain(log);
+    TEST_ASSERT_EQUAL_size_t(40, rest.size());
+    for (size_t i = 0; i < rest.size(); i++) TEST_ASSERT_EQUAL_STRING(expected[30 + i].c_str(), rest[i].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, log.corruptCount());
+    TEST_ASSERT_EQUAL_UINT32(0, io.violationCount());
+}
+
+void test_wrap_drops_oldest() {
+    FileFlashIo io;
+    TEST_ASSERT_TRUE(io.open(PATH, 3));
+    FlashLog log(io);
+    TEST_ASSERT_TRUE(log.begin());
+    const uint32_t N = 500;
+    for (uint32_t i = 0; i < N; i++) TEST_ASSERT_TRUE(append(log, message(i)));
+    std::vector<std::string> kept = drain(log);
+    // newest records in order, the others counted as dropped
+    TEST_ASSERT_TRUE(kept.size() > 0);
+    TEST_ASSERT_EQUAL_UINT32(N, kept.size() + log.droppedCount());
+    for (size_t i = 0; i < kept.size(); i++) TEST_ASSERT_EQUAL_STRING(message(N - kept.size() + (uint32_t)i).c_str(), kept[i].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, log.corruptCount());
+    // ring goes on after wrap
+    TEST_ASSERT_TRUE(append(log, message(N)));
+    std::vector<std::string> next = drain(log);
+    TEST_ASSERT_EQUAL_size_t(1, next.size());
+    TEST_ASSERT_EQUAL_UINT32(0, io.violationCount());
+}
+
+// a record peeked and then dropped by a wrap is not consumed in place of another one
+void test_consume_after_wrap() {
+    FileFlashIo io;
+    TEST_ASSERT_TRUE(io.open(PATH, 2));
+    FlashLog log(io);
+    TEST_ASSERT_TRUE(log.begin());
+    uint32_t i = 0;
+    TEST_ASSERT_TRUE(append(log, message(i++)));
+    uint8_t buf[FLASH_LOG_MAX_RECORD_LEN];
+    TEST_ASSERT_TRUE(log.peek(buf, sizeof(buf)) > 0);
+    // fill until the sector of the peeked record is dropped
+    while (log.droppedCount() == 0) TEST_ASSERT_TRUE(append(log, message(i++)));
+    log.consume();
+    TEST_ASSERT_EQUAL_UINT32(0, log.replayedCount());
+    std::vector<std::string> kept = drain(log);
+    TEST_ASSERT_EQUAL_UINT32(i, kept.size() + log.droppedCount());
+    TEST_ASSERT_EQUAL_STRING(message(i - (uint32_t)kept.size()).c_str(), kept[0].c_str());
+}
+
+void test_crc_error_skipped() {
+    std::vector<std::string> expected;
+    {
+        FileFlashIo io;
+        TEST_ASSERT_TRUE(io.open(PATH, 4));
+        FlashLog log(io);
+        TEST_ASSERT_TRUE(log.begin());
+        for (uint32_t i = 0; i < 5; i++) {
+            expected.push_back(message(i));
+            TEST_ASSERT_TRUE(append(log, expected.back()));
+        }
+    }
+    // flip a bit in the payload of the second record (behind sector and record header of the first one)
+    size_t offset = FLASH_LOG_SECTOR_HEADER_LEN + ((FLASH_LOG_RECORD_HEADER_LEN + expected[0].size() + 3) & ~(size_t)3) +
+                    FLASH_LOG_RECORD_HEADER_LEN + 3;
+    FILE *f = fopen(PATH, "r+b");
+    TEST_ASSERT_NOT_NULL(f);
+    fseek(f, (long)offset, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, (long)offset, SEEK_SET);
+    fputc(c ^ 0x01, f);
+    fclose(f);
+
+    FileFlashIo io;
+    TEST_ASSERT_TRUE(io.open(PATH, 4));
+    FlashLog log(io);
+    TEST_ASSERT_TRUE(log.begin());
+    std::vector<std::string> read = drain(log);
+    TEST_ASSERT_EQUAL_size_t(4, read.size());
+    TEST_ASSERT_EQUAL_STRING(expected[0].c_str(), read[0].c_str());
+    for (size_t i = 1; i < read.size(); i++) TEST_ASSERT_EQUAL_STRING(expected[i + 1].c_str(), read[i].c_str());
+    TEST_ASSERT_EQUAL_UINT32(1, log.corruptCount());
+}
+
+/**
+ * Runs appends of records with power lost after budget bytes, reboots and appends one more.
+ * Returns records read after reboot (without the last one), appended is set to the appends that succeeded.
+ */
+static std::vector<std::string> powerLossRun(size_t sectors, uint32_t records, size_t budget, uint32_t &appended, bool &lost) {
+    remove(PATH);
+    appended = 0;
+    {
+        FileFlashIo io;
+        TEST_ASSERT_TRUE(io.open(PATH, sectors));
+        FlashLog log(io);
+        TEST_ASSERT_TRUE(log.begin());
+        io.losePowerAfter(budget);
+        for (uint32_t i = 0; i < records; i++) {
+            if (!append(log, message(i))) break;
+            appended++;
+        }
+        lost = io.powerWasLost();
+        TEST_ASSERT_EQUAL_UINT32(0, io.violationCount());
+    }
+    FileFlashIo io;
+    TEST_ASSERT_TRUE(io.open(PATH, sectors));
+    FlashLog log(io);
+    TEST_ASSERT_TRUE(log.begin());
+    TEST_ASSERT_TRUE(append(log, "after reboot"));
+    std::vector<std::string> read = drain(log);
+    TEST_ASSERT_TRUE(read.size() >= 1);
+    TEST_ASSERT_EQUAL_STRING("after reboot", read.back().c_str());
+    read.pop_back();
+    TEST_ASSERT_EQUAL_UINT32(0, io.violationCount());
+    return read;
+}
+
+/**
+ * Power is lost after each possible number of bytes (odd steps hit header and payload bytes).
+ * After reboot every record appended in full is there in order, the interrupted one is not,
+ * and the log takes new records.
+ */
+void test_power_loss() {
+    for (size_t budget = 0;; budget += 7) {
+        uint32_t appended;
+        bool lost;
+        // ring does not wrap
+        std::vector<std::string> read = powerLossRun(4, 40, budget, appended, lost);
+        TEST_ASSERT_EQUAL_size_t(appended, read.size());
+        for (size_t i = 0; i < read.size(); i++) TEST_ASSERT_EQUAL_STRING(message((uint32_t)i).c_str(), read[i].c_str());
+        if (!lost) break;
+    }
+}
+
+// as above while the ring wraps: the newest complete records are there, in order
+void test_power_loss_while_wrapping() {
+    for (size_t budget = 0;; budget += 7) {
+        uint32_t appended;
+        bool lost;
+        std::vector<std::string> read = powerLossRun(3, 80, budget, appended, lost);
+        TEST_ASSERT_LESS_OR_EQUAL(appended, read.size());
+        // a sector cut by power loss and the oldest one may be gone, never all of them
+        if (appended > 0) TEST_ASSERT_TRUE(read.size() > 0);
+        for (size_t i = 0; i < read.size(); i++)
+            TEST_ASSERT_EQUAL_STRING(message(appended - (uint32_t)read.size() + (uint32_t)i).c_str(), read[i].c_str());
+        if (!lost) break;
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_order_and_persistence);
+    RUN_TEST(test_wrap_drops_oldest);
+    RUN_TEST(test_consume_after_wrap);
+    RUN_TEST(test_crc_error_skipped);
+    RUN_TEST(test_power_loss);
+    RUN_TEST(test_power_loss_while_wrapping);
+    return UNITY_END();
+}
@@ -0,0 +1,289 @@
+/**
+ * Beacon frames (src/ble_frames.h) decoded from raw advertisements and their JSON fields,
+ * and filter rules (src/ble_filter.h) on records and on views of raw advertisements.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_filter.h"
+#include "ble_frames.h"
+#include "ble_json.h"
+
+static std::mt19937 rng(10);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static const uint8_t ADDRESS[BLE_ADDR_LEN] = {0xc0, 0x01, 0x02, 0x03, 0x04, 0x05};
+
+static BleAdvRecord fromRaw(const std::vector<uint8_t> &adv, int rssi = -60, uint8_t addrType = 1) {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    fillBleAdvRecordFromRaw(rec, ADDRESS, addrType, rssi, adv.data(), adv.size());
+    bleDecodeFrames(rec, adv.data(), adv.size());
+    return rec;
+}
+
+static std::string frameJson(const BleAdvRecord &rec) {
+    char buf[512];
+    JsonBuf jb;
+    jsonInit(jb, buf, sizeof(buf));
+    jsonPutBleFrame(jb, rec);
+    TEST_ASSERT_TRUE(jsonFinish(jb) > 0 || rec.frameType == 0);
+    return std::string(buf, jb.len);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_ibeacon() {
+    std::vector<uint8_t> adv = {0x02, 0x01, 0x06, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+                                0xf7, 0x82, 0x6d, 0xa6, 0x4f, 0xa2, 0x4e, 0x98, 0x80, 0x24, 0xbc, 0x5b, 0x71, 0xe0, 0x89, 0x3e,
+                                0x00, 0x01, 0x01, 0x02, 0xc5};
+    BleAdvRecord rec = fromRaw(adv);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_IBEACON, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(
+        ", \"frame\": \"ibeacon\", \"beaconUUID\": \"f7826da6-4fa2-4e98-8024-bc5b71e0893e\", \"major\": \"1\", \"minor\": \"258\", "
+        "\"measuredPower\": \"-59\"",
+        frameJson(rec).c_str());
+    // one byte short: manufacturer data is kept, but no frame
+    adv[3]--;
+    adv.pop_back();
+    rec = fromRaw(adv);
+    TEST_ASSERT_EQUAL_UINT8(0, rec.frameType);
+    TEST_ASSERT_EQUAL_INT32(BLE_COMPANY_APPLE, bleCompanyId(rec));
+}
+
+void test_apple_and_microsoft() {
+    BleAdvRecord rec = fromRaw({0x07, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x0b, 0x1c});
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_APPLE, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"apple\", \"appleType\": \"16\"", frameJson(rec).c_str());
+    rec = fromRaw({0x06, 0xff, 0x06, 0x00, 0x01, 0x29, 0x02});
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_MICROSOFT, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"microsoft\", \"msScenario\": \"1\", \"msDeviceType\": \"9\"", frameJson(rec).c_str());
+    // other company
+    rec = fromRaw({0x05, 0xff, 0x59, 0x00, 0x01, 0x02});
+    TEST_ASSERT_EQUAL_UINT8(0, rec.frameType);
+}
+
+void test_eddystone_uid() {
+    std::vector<uint8_t> adv = {0x03, 0x03, 0xaa, 0xfe, 0x17, 0x16, 0xaa, 0xfe, 0x00, 0xe7,
+                                0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99,
+                                0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0x00, 0x00};
+    BleAdvRecord rec = fromRaw(adv);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_EDDYSTONE_UID, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"eddystoneUid\", \"measuredPower\": \"-25\", \"namespace\": \"00112233445566778899\", "
+                             "\"instance\": \"aabbccddeeff\"",
+                             frameJson(rec).c_str());
+    // reserved bytes are optional, instance is not
+    adv[4] -= 2;
+    adv.resize(adv.size() - 2);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_EDDYSTONE_UID, fromRaw(adv).frameType);
+    adv[4]--;
+    adv.pop_back();
+    TEST_ASSERT_EQUAL_UINT8(0, fromRaw(adv).frameType);
+}
+
+void test_eddystone_url() {
+    // https://www.google.com/
+    std::vector<uint8_t> adv = {0x0d, 0x16, 0xaa, 0xfe, 0x10, 0xeb, 0x01, 'g', 'o', 'o', 'g', 'l', 'e', 0x00};
+    BleAdvRecord rec = fromRaw(adv);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_EDDYSTONE_URL, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"eddystoneUrl\", \"measuredPower\": \"-21\", \"url\": \"https://www.google.com/\"",
+                             frameJson(rec).c_str());
+    // characters that would break JSON are escaped
+    char url[64];
+    const uint8_t encoded[] = {0x02, 'a', '"', '\\', ' ', 0x07};
+    TEST_ASSERT_EQUAL_size_t(strlen("http://a%22%5c%20.com"), bleEddystoneUrl(url, sizeof(url), encoded, sizeof(encoded)));
+    TEST_ASSERT_EQUAL_STRING("http://a%22%5c%20.com", url);
+    // unknown scheme, too small output
+    const uint8_t unknown[] = {0x04, 'a'};
+    TEST_ASSERT_EQUAL_size_t(0, bleEddystoneUrl(url, sizeof(url), unknown, sizeof(unknown)));
+    TEST_ASSERT_EQUAL_size_t(0, bleEddystoneUrl(url, 8, encoded, sizeof(encoded)));
+    // URL longer than 17 bytes
+    adv = {0x03, 0x16, 0xaa, 0xfe, 0x10, 0xeb, 0x00};
+    adv.insert(adv.end(), BLE_EDDYSTONE_URL_MAX_LEN + 1, 'a');
+    adv[0] = (uint8_t)(adv.size() - 1);
+    TEST_ASSERT_EQUAL_UINT8(0, fromRaw(adv).frameType);
+    adv.pop_back();
+    adv[0]--;
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_EDDYSTONE_URL, fromRaw(adv).frameType);
+}
+
+void test_eddystone_tlm() {
+    std::vector<uint8_t> adv = {0x11, 0x16, 0xaa, 0xfe, 0x20, 0x00, 0x0b, 0xb8, 0x17, 0x80,
+                                0x00, 0x00, 0x00, 0x64, 0x00, 0x00, 0x03, 0xe8};
+    BleAdvRecord rec = fromRaw(adv);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_EDDYSTONE_TLM, rec.frameType);
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"eddystoneTlm\", \"battery\": \"3000\", \"temperature\": \"2350\", \"advCount\": \"100\", "
+                             "\"secCount\": \"1000\"",
+                             frameJson(rec).c_str());
+    // temperature not available
+    adv[8] = 0x80;
+    adv[9] = 0x00;
+    TEST_ASSERT_EQUAL_STRING(", \"frame\": \"eddystoneTlm\", \"battery\": \"3000\", \"advCount\": \"100\", \"secCount\": \"1000\"",
+                             frameJson(fromRaw(adv)).c_str());
+    // encrypted
+    adv[5] = 0x01;
+    TEST_ASSERT_EQUAL_UINT8(0, fromRaw(adv).frameType);
+}
+
+// broken AD lengths end decoding, frames before them are kept
+void test_malformed_ad_structures() {
+    std::vector<uint8_t> adv = {0x06, 0xff, 0x06, 0x00, 0x01, 0x29, 0x02, 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15};
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    TEST_ASSERT_TRUE(bleDecodeFrames(rec, adv.data(), adv.size()));
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_MICROSOFT, rec.frameType);
+    for (int i = 0; i < 20000; i++) {
+        std::vector<uint8_t> data(rnd(40));
+        for (uint8_t &b : data) b = (uint8_t)rnd(256);
+        // frames of service data and manufacturer data more often
+        if (data.size() > 4 && rnd(2) == 0) {
+            data[1] = rnd(2) == 0 ? BLE_AD_SERVICE_DATA16 : BLE_AD_MANUFACTURER;
+            data[2] = 0xaa;
+            data[3] = 0xfe;
+        }
+        memset(&rec, 0, sizeof(rec));
+        // exact size, so reads beyond the end are caught by the address sanitizer
+        bleDecodeFrames(rec, data.data(), data.size());
+        TEST_ASSERT_TRUE(rec.frameLen <= BLE_MAX_FRAME_LEN);
+        frameJson(rec);
+    }
+}
+
+void test_filter_rules() {
+    BleFilter<> filter;
+    filter.rssiFloor = -80;
+    filter.dropAddrTypes = 1 << 1;
+    filter.minPayloadLen = 3;
+    filter.maxPayloadLen = 31;
+    TEST_ASSERT_TRUE(filter.addCompanyRule(BLE_COMPANY_APPLE, BLE_FILTER_TRUNCATE));
+    TEST_ASSERT_TRUE(filter.addCompanyRule(BLE_COMPANY_MICROSOFT, BLE_FILTER_DROP));
+    std::vector<uint8_t> apple = {0x07, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x0b, 0x1c};
+    std::vector<uint8_t> ms = {0x06, 0xff, 0x06, 0x00, 0x01, 0x29, 0x02};
+    std::vector<uint8_t> other = {0x05, 0xff, 0x59, 0x00, 0x01, 0x02};
+    std::vector<uint8_t> none = {0x02, 0x01, 0x06};
+
+    TEST_ASSERT_EQUAL(BLE_FILTER_TRUNCATE, filter.evaluate(fromRaw(apple, -60, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(ms, -60, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(fromRaw(other, -60, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(fromRaw(none, -60, 0)));
+    // cheap rules first
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(fromRaw(other, -80, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(other, -81, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(other, -60, 1)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(fromRaw(other, -60, 2)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw({0x01, 0x01}, -60, 0)));
+    std::vector<uint8_t> longAdv(32, 0);
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(longAdv, -60, 0)));
+    // no RSSI, no floor
+    BleAdvRecord rec = fromRaw(other, -100, 0);
+    rec.flags &= ~BLE_REC_HAVE_RSSI;
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(rec));
+
+    filter.defaultAction = BLE_FILTER_DROP;
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(other, -60, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(fromRaw(none, -60, 0)));
+    TEST_ASSERT_EQUAL(BLE_FILTER_TRUNCATE, filter.evaluate(fromRaw(apple, -60, 0)));
+    // rule replaced, not added
+    TEST_ASSERT_TRUE(filter.addCompanyRule(BLE_COMPANY_APPLE, BLE_FILTER_KEEP));
+    TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(fromRaw(apple, -60, 0)));
+}
+
+void test_filter_table_full() {
+    BleFilter<4, 2> filter;
+    uint16_t added[4];
+    size_t n = 0;
+    // a company that does not fit fails, the ones added are still found
+    uint16_t id = 0;
+    for (; n < 4; id++) {
+        if (!filter.addCompanyRule(id, BLE_FILTER_DROP)) break;
+        added[n++] = id;
+    }
+    TEST_ASSERT_TRUE(n >= 2);
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    uint8_t data[2];
+    for (size_t i = 0; i < n; i++) {
+        data[0] = (uint8_t)added[i];
+        data[1] = (uint8_t)(added[i] >> 8);
+        bleRecSetManufData(rec, data, 2);
+        TEST_ASSERT_EQUAL(BLE_FILTER_DROP, filter.evaluate(rec));
+    }
+    if (n < 4) {
+        data[0] = (uint8_t)id;
+        data[1] = (uint8_t)(id >> 8);
+        bleRecSetManufData(rec, data, 2);
+        TEST_ASSERT_EQUAL(BLE_FILTER_KEEP, filter.evaluate(rec));
+    }
+}
+
+// evaluating the view of an advertisement gives the same as evaluating its record
+void test_filter_view_same_as_record() {
+    static const uint16_t COMPANIES[] = {BLE_COMPANY_APPLE, BLE_COMPANY_MICROSOFT, 0x0059, 0x0075};
+    for (int f = 0; f < 4; f++) {
+        BleFilter<> filter;
+        filter.rssiFloor = (int8_t)(-100 + (int)rnd(40));
+        filter.dropAddrTypes = (uint8_t)rnd(16);
+        filter.minPayloadLen = (uint16_t)rnd(8);
+        filter.maxPayloadLen = (uint16_t)(20 + rnd(20));
+        filter.defaultAction = (BleFilterAction)rnd(3);
+        // without rules, the view skips parsing
+        if (f > 0)
+            for (uint16_t c : COMPANIES) filter.addCompanyRule(c, (BleFilterAction)rnd(3));
+        for (int i = 0; i < 20000; i++) {
+            std::vector<uint8_t> adv;
+            while (adv.size() < 40 && rnd(3) != 0) {
+                if (rnd(2) == 0) {
+                    uint16_t c = COMPANIES[rnd(4)];
+                    size_t len = rnd(6);
+                    adv.push_back((uint8_t)(1 + len));
+                    adv.push_back(BLE_AD_MANUFACTURER);
+                    for (size_t j = 0; j < len; j++) adv.push_back(j < 2 ? (uint8_t)(c >> (8 * j)) : (uint8_t)rnd(256));
+                } else {
+                    adv.push_back((uint8_t)rnd(256));
+                }
+            }
+            int rssi = -110 + (int)rnd(90);
+            uint8_t addrType = (uint8_t)rnd(4);
+            BleAdView view(ADDRESS, addrType, rssi, adv.data(), adv.size());
+            TEST_ASSERT_EQUAL(filter.evaluate(fromRaw(adv, rssi, addrType)), filter.evaluate(view));
+        }
+    }
+}
+
+void test_filter_truncate() {
+    std::vector<uint8_t> adv = {0x05, 0x09, 'n', 'a', 'm', 'e', 0x07, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x0b, 0x1c};
+    BleAdvRecord rec = fromRaw(adv);
+    TEST_ASSERT_TRUE(bleRecHas(rec, BLE_REC_HAVE_NAME));
+    bleFilterTruncate(rec);
+    TEST_ASSERT_FALSE(bleRecHas(rec, BLE_REC_HAVE_NAME));
+    TEST_ASSERT_EQUAL_STRING("", rec.name);
+    TEST_ASSERT_EQUAL_size_t(2, rec.manufDataLen);
+    TEST_ASSERT_EQUAL_INT32(BLE_COMPANY_APPLE, bleCompanyId(rec));
+    // frame is kept
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_APPLE, rec.frameType);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_ibeacon);
+    RUN_TEST(test_apple_and_microsoft);
+    RUN_TEST(test_eddystone_uid);
+    RUN_TEST(test_eddystone_url);
+    RUN_TEST(test_eddystone_tlm);
+    RUN_TEST(test_malformed_ad_structures);
+    RUN_TEST(test_filter_rules);
+    RUN_TEST(test_filter_table_full);
+    RUN_TEST(test_filter_view_same_as_record);
+    RUN_TEST(test_filter_truncate);
+    return UNITY_END();
+}
@@ -0,0 +1,219 @@
+/**
+ * HyperLogLog sketch of COUNT_ONLY (src/ble_hll.h): relative error against exact counts within the
+ * standard error 1.04 / sqrt(2^p), duplicates not counted, merge equal to the sketch of the union,
+ * the switch from sparse to dense registers where dense gets shorter, and messages decoded again
+ * as the collector does (host_tools/lib/ble_collector/collector_counts.h).
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <math.h>
+
+#include <vector>
+
+#include "ble_hll.h"
+#include "collector_counts.h"
+
+static void addressOf(uint64_t trial, uint64_t i, uint8_t *address) {
+    // odd multiplier is a bijection on 48 bits, so addresses within a trial are distinct
+    uint64_t a = ((trial << 40 | i) * 0x9e3779b97f4bULL + 0x2f5a) & 0xffffffffffffULL;
+    for (size_t b = 0; b < BLE_ADDR_LEN; b++) address[b] = (uint8_t)(a >> (8 * (BLE_ADDR_LEN - 1 - b)));
+}
+
+template <uint8_t P>
+static void addRange(BleHll<P> &sketch, uint64_t trial, uint64_t from, uint64_t to) {
+    uint8_t address[BLE_ADDR_LEN];
+    for (uint64_t i = from; i < to; i++) {
+        addressOf(trial, i, address);
+        sketch.add(address);
+    }
+}
+
+template <uint8_t P>
+static size_t used(const BleHll<P> &sketch) {
+    size_t n = 0;
+    for (size_t i = 0; i < sketch.size; i++) n += sketch.registers()[i] != 0;
+    return n;
+}
+
+/**
+ * 30 trials per count: RMSE within 1.5, any error within 5 standard errors (as hll_bench checks).
+ */
+template <uint8_t P>
+static void assertAccuracy() {
+    const double stdErr = 1.04 / sqrt((double)(1 << P));
+    const uint64_t checkpoints[] = {100, 1000, 10000, 100000};
+    const int TRIALS = 30;
+    double sq[4] = {}, maxErr[4] = {};
+    for (int trial = 0; trial < TRIALS; trial++) {
+        BleHll<P> sketch;
+        uint64_t n = 0;
+        for (int c = 0; c < 4; c++) {
+            addRange(sketch, trial, n, checkpoints[c]);
+            n = checkpoints[c];
+            double err = sketch.estimate() / n - 1;
+            sq[c] += err * err;
+            maxErr[c] = fmax(maxErr[c], fabs(err));
+        }
+    }
+    for (int c = 0; c < 4; c++) {
+        TEST_ASSERT_TRUE(sqrt(sq[c] / TRIALS) <= 1.5 * stdErr);
+        TEST_ASSERT_TRUE(maxErr[c] <= 5 * stdErr);
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_relative_error_p10() { assertAccuracy<10>(); }
+void test_relative_error_p14() { assertAccuracy<14>(); }
+
+// few devices (most windows): one exactly, up to 50 within 3 standard errors plus one device
+void test_small_counts() {
+    BleHll<10> empty;
+    TEST_ASSERT_TRUE(empty.estimate() == 0);
+    for (uint64_t trial = 0; trial < 20; trial++) {
+        BleHll<10> sketch;
+        for (uint64_t n = 1; n <= 50; n++) {
+            addRange(sketch, trial, n - 1, n);
+            TEST_ASSERT_TRUE(fabs(sketch.estimate() - n) <= (n == 1 ? 0.01 : 1 + 3 * 1.04 / 32 * n));
+        }
+    }
+}
+
+void test_duplicates_not_counted() {
+    BleHll<10> once, often;
+    addRange(once, 1, 0, 1000);
+    for (int k = 0; k < 5; k++) addRange(often, 1, 0, 1000);
+    TEST_ASSERT_EQUAL_MEMORY(once.registers(), often.registers(), once.size);
+}
+
+// loggers with overlapping crowds: merged sketch is the sketch of the union, in any order and repeated
+void test_merge_equals_union() {
+    BleHll<12> a, b, both, ab, ba;
+    addRange(a, 2, 0, 6000);
+    addRange(b, 2, 4000, 10000);
+    addRange(both, 2, 0, 10000);
+    ab = a;
+    ab.merge(b);
+    ba = b;
+    ba.merge(a);
+    ba.merge(a);
+    TEST_ASSERT_EQUAL_MEMORY(both.registers(), ab.registers(), both.size);
+    TEST_ASSERT_EQUAL_MEMORY(both.registers(), ba.registers(), both.size);
+    TEST_ASSERT_TRUE(fabs(ab.estimate() / 10000 - 1) <= 5 * 1.04 / 64);
+    // sum of both counts the overlap twice
+    TEST_ASSERT_TRUE(a.estimate() + b.estimate() > 1.1 * ab.estimate());
+}
+
+/**
+ * Sparse (2 bytes per register in use for p = 10) while shorter than dense (768 bytes), so up to
+ * 383 registers in use; both decode to the registers.
+ */
+void test_sparse_to_dense() {
+    BleHll<10> sketch;
+    uint8_t buf[BleHll<10>::maxEncodedLen];
+    bool sparse;
+    TEST_ASSERT_EQUAL_size_t(0, sketch.encode(buf, sizeof(buf), sparse));
+    TEST_ASSERT_TRUE(sparse);
+    TEST_ASSERT_EQUAL_size_t(768, bleHllDenseLen(10));
+    size_t lastSparse = 0, firstDense = 0;
+    for (uint64_t i = 0; used(sketch) < 600; i++) {
+        addRange(sketch, 3, i, i + 1);
+        size_t len = sketch.encode(buf, sizeof(buf), sparse);
+        size_t inUse = used(sketch);
+        TEST_ASSERT_EQUAL(inUse * 2 < 768, sparse);
+        TEST_ASSERT_EQUAL_size_t(sparse ? inUse * 2 : 768, len);
+        if (sparse) lastSparse = inUse;
+        else if (firstDense == 0) firstDense = inUse;
+        BleHll<10> decoded;
+        TEST_ASSERT_TRUE(decoded.decode(buf, len, sparse));
+        TEST_ASSERT_EQUAL_MEMORY(sketch.registers(), decoded.registers(), sketch.size);
+    }
+    TEST_ASSERT_EQUAL_size_t(383, lastSparse);
+    TEST_ASSERT_EQUAL_size_t(384, firstDense);
+    // buffer too small
+    TEST_ASSERT_EQUAL_size_t(0, sketch.encode(buf, 767, sparse));
+}
+
+// odd p, entries of 3 bytes and registers across byte boundaries
+void test_encoding_p13() {
+    BleHll<13> sketch;
+    static uint8_t buf[BleHll<13>::maxEncodedLen];
+    bool sparse;
+    const uint64_t counts[] = {10, 2000, 3000, 200000};
+    uint64_t n = 0;
+    for (uint64_t c : counts) {
+        addRange(sketch, 4, n, c);
+        n = c;
+        size_t len = sketch.encode(buf, sizeof(buf), sparse);
+        TEST_ASSERT_EQUAL(used(sketch) * 3 < bleHllDenseLen(13), sparse);
+        TEST_ASSERT_EQUAL_size_t(sparse ? used(sketch) * 3 : bleHllDenseLen(13), len);
+        BleHll<13> decoded;
+        TEST_ASSERT_TRUE(decoded.decode(buf, len, sparse));
+        TEST_ASSERT_EQUAL_MEMORY(sketch.registers(), decoded.registers(), sketch.size);
+    }
+}
+
+void test_decode_rejects_malformed() {
+    BleHll<10> sketch;
+    addRange(sketch, 5, 0, 100);
+    uint8_t buf[BleHll<10>::maxEncodedLen];
+    bool sparse;
+    size_t len = sketch.encode(buf, sizeof(buf), sparse);
+    TEST_ASSERT_TRUE(sparse);
+    BleHll<10> decoded;
+    TEST_ASSERT_FALSE(decoded.decode(buf, len - 1, true));
+    // register value beyond 65 - p
+    uint8_t bad[2] = {0x00, 0x3f};
+    TEST_ASSERT_FALSE(decoded.decode(bad, 2, true));
+    TEST_ASSERT_FALSE(decoded.decode(buf, 767, false));
+    uint8_t dense[768];
+    memset(dense, 0xff, sizeof(dense));
+    TEST_ASSERT_FALSE(decoded.decode(dense, sizeof(dense), false));
+}
+
+// JSON and binary messages, sparse and dense, as the collector reads them
+void test_messages_round_trip() {
+    const uint64_t counts[] = {50, 5000};
+    for (uint64_t n : counts) {
+        BleHll<10> sketch;
+        addRange(sketch, 6, 0, n);
+        std::vector<char> json(bleHllJsonLen<10>() + 1);
+        std::vector<uint8_t> bin(bleHllBinLen<10>());
+        size_t jsonLen = bleHllSerializeJson(json.data(), json.size(), sketch, 1651042690, 10);
+        size_t binLen = bleHllSerializeBin(bin.data(), bin.size(), sketch, 1651042690, 10);
+        TEST_ASSERT_TRUE(jsonLen > 0 && binLen > 0);
+        TEST_ASSERT_EQUAL(n < 1000, bin[2] == 1);
+        TEST_ASSERT_TRUE(collectorIsSketch((const uint8_t *)json.data(), jsonLen));
+        TEST_ASSERT_TRUE(collectorIsSketch(bin.data(), binLen));
+        const uint8_t *messages[] = {(const uint8_t *)json.data(), bin.data()};
+        const size_t lens[] = {jsonLen, binLen};
+        for (int m = 0; m < 2; m++) {
+            CollectorSketch got;
+            TEST_ASSERT_TRUE(collectorParseSketch(messages[m], lens[m], got));
+            TEST_ASSERT_EQUAL_UINT32(1651042690, got.start);
+            TEST_ASSERT_EQUAL_UINT32(10, got.seconds);
+            TEST_ASSERT_EQUAL_UINT8(10, got.p);
+            TEST_ASSERT_EQUAL_UINT32((uint32_t)lround(sketch.estimate()), got.estimate);
+            TEST_ASSERT_EQUAL_size_t(sketch.size, got.registers.size());
+            TEST_ASSERT_EQUAL_MEMORY(sketch.registers(), got.registers.data(), sketch.size);
+        }
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_relative_error_p10);
+    RUN_TEST(test_relative_error_p14);
+    RUN_TEST(test_small_counts);
+    RUN_TEST(test_duplicates_not_counted);
+    RUN_TEST(test_merge_equals_union);
+    RUN_TEST(test_sparse_to_dense);
+    RUN_TEST(test_encoding_p13);
+    RUN_TEST(test_decode_rejects_malformed);
+    RUN_TEST(test_messages_round_trip);
+    return UNITY_END();
+}
@@ -0,0 +1,237 @@
+/**
+ * Scan controller (src/scan_controller.h): back-off on queue, heap and flood, quiet and demand steps
+ * after holdWindows with the hold doubled after a step up was one too many, sightings dropped by
+ * filter rules not taken as duplicates, and window never beyond interval or the config bounds.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+
+#include "scan_controller.h"
+
+static std::mt19937 rng(18);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+// intervals 100..1280 ms, windows 20..100 ms, quiet below 30 devices/min with 80% duplicates,
+// flood above 500 sightings/s, queue high at 75%, heap low below 40000 bytes, hold 3 windows
+static const ScanControlConfig CONFIG = {100, 1280, 20, 100, 30, 80, 500, 75, 40000, 3};
+static const uint32_t WINDOW_MS = 10000;
+
+// devices and sightings of a 10 s window, no pressure
+static ScanWindowInput window(uint32_t devices, uint32_t sightings, uint32_t filtered = 0) {
+    ScanWindowInput in;
+    in.windowMs = WINDOW_MS;
+    in.sightings = sightings;
+    in.devices = devices;
+    in.filtered = filtered;
+    in.queueDepth = 0;
+    in.queueCapacity = 64;
+    in.queueDropped = 0;
+    in.freeHeap = 100000;
+    return in;
+}
+
+static ScanWindowInput quiet() {
+    return window(2, 100);
+}
+
+// 600 devices/min, 20 sightings/s
+static ScanWindowInput demand() {
+    return window(100, 200);
+}
+
+static void assertBounds(const ScanParams &p) {
+    TEST_ASSERT_TRUE(p.windowMs <= p.intervalMs);
+    TEST_ASSERT_TRUE(p.intervalMs >= CONFIG.minIntervalMs && p.intervalMs <= CONFIG.maxIntervalMs);
+    TEST_ASSERT_TRUE(p.windowMs >= CONFIG.minWindowMs && p.windowMs <= CONFIG.maxWindowMs);
+}
+
+void setUp() {}
+void tearDown() {}
+
+// passive first, then shorter window, then longer interval, down to the bounds
+void test_queue_pressure_backs_off() {
+    ScanController c(CONFIG, {100, 100, true});
+    ScanWindowInput in = window(100, 200);
+    in.queueDepth = 48;
+    ScanDecision d = c.update(in);
+    TEST_ASSERT_TRUE(d.changed);
+    TEST_ASSERT_EQUAL(SCAN_REASON_QUEUE, d.reason);
+    TEST_ASSERT_FALSE(d.params.active);
+    TEST_ASSERT_EQUAL_UINT16(100, d.params.windowMs);
+    const uint16_t windows[] = {50, 25, 20};
+    for (uint16_t w : windows) {
+        d = c.update(in);
+        TEST_ASSERT_EQUAL(SCAN_REASON_QUEUE, d.reason);
+        TEST_ASSERT_EQUAL_UINT16(w, d.params.windowMs);
+        TEST_ASSERT_EQUAL_UINT16(100, d.params.intervalMs);
+    }
+    const uint16_t intervals[] = {200, 400, 800, 1280};
+    for (uint16_t i : intervals) {
+        d = c.update(in);
+        TEST_ASSERT_TRUE(d.changed);
+        TEST_ASSERT_EQUAL_UINT16(i, d.params.intervalMs);
+        TEST_ASSERT_EQUAL_UINT16(20, d.params.windowMs);
+    }
+    // nothing left to give up
+    d = c.update(in);
+    TEST_ASSERT_FALSE(d.changed);
+    TEST_ASSERT_EQUAL(SCAN_REASON_QUEUE, d.reason);
+    TEST_ASSERT_EQUAL_UINT8(1, c.dutyPercent());
+}
+
+void test_dropped_and_heap_pressure() {
+    ScanController c(CONFIG, {100, 100, true});
+    ScanWindowInput in = window(100, 200);
+    in.queueDropped = 1;
+    ScanDecision d = c.update(in);
+    TEST_ASSERT_EQUAL(SCAN_REASON_QUEUE, d.reason);
+    TEST_ASSERT_FALSE(d.params.active);
+
+    ScanController h(CONFIG, {100, 100, true});
+    in = window(100, 200);
+    in.freeHeap = 39999;
+    d = h.update(in);
+    TEST_ASSERT_EQUAL(SCAN_REASON_HEAP, d.reason);
+    TEST_ASSERT_FALSE(d.params.active);
+    d = h.update(in);
+    TEST_ASSERT_EQUAL(SCAN_REASON_HEAP, d.reason);
+    TEST_ASSERT_EQUAL_UINT16(50, d.params.windowMs);
+}
+
+// flood applies while active only, duty cycle is kept
+void test_flood_goes_passive() {
+    ScanController c(CONFIG, {100, 100, true});
+    ScanWindowInput in = window(1000, 5010);
+    ScanDecision d = c.update(in);
+    TEST_ASSERT_EQUAL_UINT32(501, d.sightingsPerSec);
+    TEST_ASSERT_TRUE(d.changed);
+    TEST_ASSERT_EQUAL(SCAN_REASON_FLOOD, d.reason);
+    TEST_ASSERT_FALSE(d.params.active);
+    TEST_ASSERT_EQUAL_UINT16(100, d.params.windowMs);
+    d = c.update(in);
+    TEST_ASSERT_FALSE(d.changed);
+    TEST_ASSERT_EQUAL_UINT8(100, c.dutyPercent());
+}
+
+// a quiet step each holdWindows windows, not if devices are seen rarely
+void test_quiet_steps_after_hold() {
+    ScanController c(CONFIG, {100, 100, true});
+    for (int step = 0; step < 3; step++) {
+        for (int i = 0; i < CONFIG.holdWindows - 1; i++) TEST_ASSERT_FALSE(c.update(quiet()).changed);
+        ScanDecision d = c.update(quiet());
+        TEST_ASSERT_EQUAL_UINT8(98, d.duplicatePercent);
+        TEST_ASSERT_TRUE(d.changed);
+        TEST_ASSERT_EQUAL(SCAN_REASON_QUIET, d.reason);
+        assertBounds(d.params);
+    }
+    TEST_ASSERT_EQUAL_UINT16(20, c.params().windowMs);
+    TEST_ASSERT_TRUE(c.params().active);
+
+    ScanController rare(CONFIG, {100, 100, true});
+    for (int i = 0; i < 20; i++) TEST_ASSERT_FALSE(rare.update(window(2, 3)).changed);
+}
+
+// sightings dropped by filter rules are no duplicates: a busy site is not taken as quiet
+void test_filtered_not_duplicates() {
+    ScanController c(CONFIG, {100, 100, true});
+    for (int i = 0; i < 20; i++) {
+        ScanDecision d = c.update(window(2, 100, 98));
+        TEST_ASSERT_EQUAL_UINT8(0, d.duplicatePercent);
+        TEST_ASSERT_FALSE(d.changed);
+    }
+    ScanDecision d = c.update(window(2, 100, 50));
+    TEST_ASSERT_EQUAL_UINT8(96, d.duplicatePercent);
+}
+
+/**
+ * Demand steps interval down, then window up, then gets active. Pressure after a step up doubles
+ * the hold, which is halved again after four times its length calm.
+ */
+void test_demand_steps_and_hold_doubling() {
+    ScanController c(CONFIG, {400, 20, false});
+    ScanDecision d;
+    for (int i = 0; i < CONFIG.holdWindows - 1; i++) TEST_ASSERT_FALSE(c.update(demand()).changed);
+    d = c.update(demand());
+    TEST_ASSERT_EQUAL(SCAN_REASON_DEMAND, d.reason);
+    TEST_ASSERT_EQUAL_UINT16(200, d.params.intervalMs);
+
+    // step up was one too many
+    ScanWindowInput in = demand();
+    in.queueDepth = 64;
+    d = c.update(in);
+    TEST_ASSERT_EQUAL(SCAN_REASON_QUEUE, d.reason);
+    TEST_ASSERT_EQUAL_UINT16(400, d.params.intervalMs);
+    TEST_ASSERT_EQUAL_UINT16(2 * CONFIG.holdWindows, c.holdWindows());
+    for (int i = 0; i < 2 * CONFIG.holdWindows - 1; i++) TEST_ASSERT_FALSE(c.update(demand()).changed);
+    d = c.update(demand());
+    TEST_ASSERT_EQUAL(SCAN_REASON_DEMAND, d.reason);
+
+    // up to full duty cycle and active
+    for (int i = 0; i < 200 && !c.params().active; i++) {
+        d = c.update(demand());
+        assertBounds(d.params);
+    }
+    TEST_ASSERT_TRUE(c.params().active);
+    TEST_ASSERT_EQUAL_UINT16(100, c.params().intervalMs);
+    TEST_ASSERT_EQUAL_UINT16(100, c.params().windowMs);
+
+    // nothing left to step up, hold goes back
+    for (int i = 0; i < 8 * 2 * CONFIG.holdWindows && c.holdWindows() > CONFIG.holdWindows; i++) c.update(demand());
+    TEST_ASSERT_EQUAL_UINT16(CONFIG.holdWindows, c.holdWindows());
+}
+
+// repeated pressure after steps up doubles up to 16 times holdWindows
+void test_hold_capped() {
+    ScanController c(CONFIG, {1280, 20, false});
+    ScanWindowInput pressure = demand();
+    pressure.queueDepth = 64;
+    for (int round = 0; round < 8; round++) {
+        ScanDecision d;
+        do d = c.update(demand());
+        while (!d.changed);
+        c.update(pressure);
+    }
+    TEST_ASSERT_EQUAL_UINT16(16 * CONFIG.holdWindows, c.holdWindows());
+}
+
+// window never beyond interval, also where max. window exceeds min. interval (limitWindow())
+void test_window_within_interval() {
+    ScanControlConfig cfg = CONFIG;
+    cfg.minIntervalMs = 40;
+    cfg.maxWindowMs = 100;
+    ScanController c(cfg, {40, 100, true});
+    TEST_ASSERT_EQUAL_UINT16(40, c.params().windowMs);
+    for (int i = 0; i < 20000; i++) {
+        ScanWindowInput in = window(rnd(300), rnd(8000));
+        in.devices = in.devices < in.sightings ? in.devices : in.sightings;
+        in.filtered = rnd(in.sightings - in.devices + 1);
+        in.queueDepth = rnd(10) == 0 ? 60 : rnd(20);
+        in.queueDropped = rnd(50) == 0 ? 1 : 0;
+        in.freeHeap = rnd(30) == 0 ? 30000 : 100000;
+        ScanDecision d = c.update(in);
+        TEST_ASSERT_TRUE(d.params.windowMs <= d.params.intervalMs);
+        TEST_ASSERT_TRUE(d.params.intervalMs >= cfg.minIntervalMs && d.params.intervalMs <= cfg.maxIntervalMs);
+        TEST_ASSERT_TRUE(d.params.windowMs >= cfg.minWindowMs && d.params.windowMs <= cfg.maxWindowMs);
+    }
+    TEST_ASSERT_TRUE(c.changeCount() > 10);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_queue_pressure_backs_off);
+    RUN_TEST(test_dropped_and_heap_pressure);
+    RUN_TEST(test_flood_goes_passive);
+    RUN_TEST(test_quiet_steps_after_hold);
+    RUN_TEST(test_filtered_not_duplicates);
+    RUN_TEST(test_demand_steps_and_hold_doubling);
+    RUN_TEST(test_hold_capped);
+    RUN_TEST(test_window_within_interval);
+    return UNITY_END();
+}
@@ -0,0 +1,95 @@
+/**
+ * Duplicate filter of continuous scan (src/ble_seen_set.h): first sighting per window only,
+ * stale slots reused in the next window, and a full set that does not report on every sighting.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include "ble_seen_set.h"
+
+static void address(uint8_t *a, uint32_t n) {
+    memset(a, 0, BLE_ADDR_LEN);
+    for (size_t i = 0; i < 4; i++) a[2 + i] = (uint8_t)(n >> (8 * i));
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_first_sighting_per_window() {
+    static BleSeenSet<64> set;
+    uint8_t a[BLE_ADDR_LEN];
+    for (uint16_t window = 1; window <= 3; window++) {
+        for (uint32_t n = 0; n < 20; n++) {
+            address(a, n);
+            TEST_ASSERT_TRUE(set.markSeen(a, window));
+        }
+        for (uint32_t n = 0; n < 20; n++) {
+            address(a, n);
+            TEST_ASSERT_FALSE(set.markSeen(a, window));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, set.overflowCount());
+}
+
+// more addresses than slots: each is reported at most once per window, the rest is counted
+void test_overflow_treated_as_seen() {
+    static BleSeenSet<16, 4> set;
+    uint8_t a[BLE_ADDR_LEN];
+    const uint32_t ADDRESSES = 64, SIGHTINGS = 10;
+    uint32_t reported = 0;
+    for (uint32_t s = 0; s < SIGHTINGS; s++) {
+        for (uint32_t n = 0; n < ADDRESSES; n++) {
+            address(a, n);
+            if (set.markSeen(a, 1)) reported++;
+        }
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(16, reported);
+    TEST_ASSERT_EQUAL_UINT32(ADDRESSES * SIGHTINGS, reported + set.overflowCount() + (SIGHTINGS - 1) * reported);
+    // next window has all slots again
+    address(a, ADDRESSES);
+    TEST_ASSERT_TRUE(set.markSeen(a, 2));
+}
+
+// a device seen in the first window after boot is reported again in the second one
+void test_first_windows_after_boot() {
+    static BleSeenSet<64> set;
+    const int64_t WINDOW_US = 10000000;
+    uint8_t a[BLE_ADDR_LEN];
+    address(a, 1);
+    TEST_ASSERT_TRUE(bleSeenWindow(0, WINDOW_US) != 0);
+    TEST_ASSERT_EQUAL_UINT32(bleSeenWindow(0, WINDOW_US), bleSeenWindow(WINDOW_US - 1, WINDOW_US));
+    TEST_ASSERT_TRUE(set.markSeen(a, bleSeenWindow(5000000, WINDOW_US)));
+    TEST_ASSERT_FALSE(set.markSeen(a, bleSeenWindow(WINDOW_US - 1, WINDOW_US)));
+    TEST_ASSERT_TRUE(set.markSeen(a, bleSeenWindow(WINDOW_US, WINDOW_US)));
+}
+
+// windows 65536 apart (7.6 days of 10 s) have different tags, an entry left since is stale
+void test_no_wrap_after_65536_windows() {
+    static BleSeenSet<64> set;
+    const int64_t WINDOW_US = 10000000;
+    uint8_t a[BLE_ADDR_LEN], b[BLE_ADDR_LEN];
+    address(a, 2);
+    address(b, 3);
+    // b is not seen again in between, its entry stays
+    TEST_ASSERT_TRUE(set.markSeen(b, bleSeenWindow(0, WINDOW_US)));
+    TEST_ASSERT_TRUE(set.markSeen(b, bleSeenWindow(65536 * WINDOW_US, WINDOW_US)));
+    const int64_t WINDOWS[] = {0, 65535, 65536, 131072};
+    for (int64_t w : WINDOWS) {
+        uint32_t window = bleSeenWindow(w * WINDOW_US, WINDOW_US);
+        TEST_ASSERT_TRUE(window != 0);
+        TEST_ASSERT_TRUE(set.markSeen(a, window));
+        TEST_ASSERT_FALSE(set.markSeen(a, window));
+    }
+    TEST_ASSERT_TRUE(bleSeenWindow(65536 * WINDOW_US, WINDOW_US) != bleSeenWindow(0, WINDOW_US));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_first_sighting_per_window);
+    RUN_TEST(test_overflow_treated_as_seen);
+    RUN_TEST(test_first_windows_after_boot);
+    RUN_TEST(test_no_wrap_after_65536_windows);
+    return UNITY_END();
+}
@@ -0,0 +1,152 @@
+/**
+ * serializeBleAdvRecord() (src/ble_schema.h) against the stringstream serializer it replaced
+ * (host_tools/lib/ble_reference), byte for byte.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <random>
+#include <string>
+
+#include "ble_legacy_json.h"
+#include "ble_schema.h"
+
+static std::mt19937 rng(1);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+/**
+ * Random record with the fields a BLEAdvertisedDevice could have, no delta, stats or frame.
+ */
+static BleAdvRecord randomRecord() {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    for (size_t i = 0; i < BLE_ADDR_LEN; i++) rec.address[i] = (uint8_t)rnd(256);
+    rec.addrType = (uint8_t)rnd(4);
+    rec.payloadLength = (uint16_t)rnd(BLE_MAX_PAYLOAD_LEN + 1);
+    rec.timestamp = rnd(2) ? 1651042690 + rnd(100000000) : rnd(1000);
+    rec.micros = rnd(1000000);
+    if (rnd(2)) {
+        char name[BLE_MAX_NAME_LEN + 1];
+        size_t len = rnd(BLE_MAX_NAME_LEN + 1);
+        for (size_t i = 0; i < len; i++) name[i] = (char)(' ' + 1 + rnd(94));
+        bleRecSetName(rec, name, len);
+    }
+    if (rnd(2)) {
+        rec.appearance = (uint16_t)rnd(65536);
+        rec.flags |= BLE_REC_HAVE_APPEARANCE;
+    }
+    if (rnd(2)) {
+        uint8_t data[BLE_MAX_MANUF_DATA_LEN];
+        size_t len = rnd(BLE_MAX_MANUF_DATA_LEN + 1);
+        for (size_t i = 0; i < len; i++) data[i] = (uint8_t)rnd(256);
+        bleRecSetManufData(rec, data, len);
+    }
+    if (rnd(2)) {
+        static const size_t LENS[] = {2, 4, 16};
+        uint8_t uuid[BLE_MAX_UUID_LEN];
+        for (size_t i = 0; i < sizeof(uuid); i++) uuid[i] = (uint8_t)rnd(256);
+        bleRecSetServiceUUID(rec, uuid, LENS[rnd(3)]);
+    }
+    if (rnd(2)) {
+        rec.txPower = (int8_t)(rnd(256) - 128);
+        rec.flags |= BLE_REC_HAVE_TX_POWER;
+    }
+    if (rnd(4) != 0) {
+        rec.rssi = (int8_t)(rnd(256) - 128);
+        rec.flags |= BLE_REC_HAVE_RSSI;
+    }
+    return rec;
+}
+
+static void assertSameAsLegacy(const BleAdvRecord &rec) {
+    char buf[BleLegacySchema<>::maxJsonLen + 1];
+    size_t len = serializeBleAdvRecord(buf, sizeof(buf), rec);
+    std::string expected = legacySerialize(rec);
+    TEST_ASSERT_EQUAL_size_t(expected.size(), len);
+    TEST_ASSERT_EQUAL_STRING(expected.c_str(), buf);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_minimal_record() {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    const uint8_t address[] = {0x38, 0x2f, 0xa6, 0x01, 0x02, 0x03};
+    memcpy(rec.address, address, sizeof(address));
+    rec.payloadLength = 20;
+    rec.timestamp = 1651042693;
+    rec.micros = 123;
+    char buf[256];
+    serializeBleAdvRecord(buf, sizeof(buf), rec);
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"address\": \"38:2f:a6:01:02:03\", \"payloadLength\": \"20\", \"addrType\": \"0\", \"timestamp\": \"1651042693\", "
+        "\"micros\": \"123\"}",
+        buf);
+    assertSameAsLegacy(rec);
+}
+
+void test_all_fields_extreme_values() {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    memset(rec.address, 0xff, BLE_ADDR_LEN);
+    rec.addrType = 255;
+    rec.payloadLength = 65535;
+    rec.timestamp = 4294967295u;  // printed as int, as before
+    rec.micros = 999999;
+    char name[BLE_MAX_NAME_LEN];
+    memset(name, 'x', sizeof(name));
+    bleRecSetName(rec, name, sizeof(name));
+    rec.appearance = 65535;
+    rec.flags |= BLE_REC_HAVE_APPEARANCE;
+    uint8_t data[BLE_MAX_MANUF_DATA_LEN];
+    memset(data, 0xab, sizeof(data));
+    bleRecSetManufData(rec, data, sizeof(data));
+    uint8_t uuid[16] = {0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0x0f, 0x18, 0x00, 0x00};
+    bleRecSetServiceUUID(rec, uuid, sizeof(uuid));
+    rec.txPower = -128;
+    rec.rssi = -128;
+    rec.flags |= BLE_REC_HAVE_TX_POWER | BLE_REC_HAVE_RSSI;
+    assertSameAsLegacy(rec);
+}
+
+void test_short_uuids() {
+    BleAdvRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    const uint8_t uuid16[] = {0x9f, 0xfe};
+    bleRecSetServiceUUID(rec, uuid16, sizeof(uuid16));
+    assertSameAsLegacy(rec);
+    const uint8_t uuid32[] = {0x0f, 0x18, 0x34, 0x12};
+    bleRecSetServiceUUID(rec, uuid32, sizeof(uuid32));
+    assertSameAsLegacy(rec);
+}
+
+void test_random_records() {
+    for (int i = 0; i < 20000; i++) assertSameAsLegacy(randomRecord());
+}
+
+void test_buffer_too_small() {
+    for (int i = 0; i < 200; i++) {
+        BleAdvRecord rec = randomRecord();
+        std::string expected = legacySerialize(rec);
+        char buf[BleLegacySchema<>::maxJsonLen + 1];
+        // needs one byte for '\0'
+        TEST_ASSERT_EQUAL_size_t(0, serializeBleAdvRecord(buf, expected.size(), rec));
+        TEST_ASSERT_EQUAL_size_t(expected.size(), serializeBleAdvRecord(buf, expected.size() + 1, rec));
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_minimal_record);
+    RUN_TEST(test_all_fields_extreme_values);
+    RUN_TEST(test_short_uuids);
+    RUN_TEST(test_random_records);
+    RUN_TEST(test_buffer_too_small);
+    return UNITY_END();
+}
@@ -0,0 +1,177 @@
+/**
+ * SpscQueue (src/spsc_queue.h) on one thread and under contention of a producer and a consumer
+ * thread: order, no loss below capacity, full and empty.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <atomic>
+#include <thread>
+
+#include "spsc_queue.h"
+
+// larger than a word, so torn copies show up in check
+struct Item {
+    uint32_t seq;
+    uint32_t payload[7];
+    uint32_t check;
+};
+
+static Item makeItem(uint32_t seq) {
+    Item it;
+    it.seq = seq;
+    it.check = seq;
+    for (size_t i = 0; i < 7; i++) {
+        it.payload[i] = seq * 2654435761u + (uint32_t)i;
+        it.check ^= it.payload[i];
+    }
+    return it;
+}
+
+static bool intact(const Item &it) {
+    uint32_t check = it.seq;
+    for (size_t i = 0; i < 7; i++) check ^= it.payload[i];
+    return check == it.check;
+}
+
+static const uint32_t ITEMS = 500000;
+
+// lets the other thread run on single core hosts
+static void backOff() {
+    std::this_thread::yield();
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_full_and_empty() {
+    static SpscQueue<Item, 8> q;
+    Item it;
+    TEST_ASSERT_TRUE(q.empty());
+    TEST_ASSERT_FALSE(q.pop(it));
+    for (uint32_t round = 0; round < 3; round++) {
+        for (uint32_t i = 0; i < 8; i++) TEST_ASSERT_TRUE(q.push(makeItem(round * 8 + i)));
+        TEST_ASSERT_EQUAL_size_t(8, q.size());
+        TEST_ASSERT_FALSE(q.push(makeItem(999)));
+        TEST_ASSERT_EQUAL_UINT32(round + 1, q.droppedCount());
+        for (uint32_t i = 0; i < 8; i++) {
+            TEST_ASSERT_TRUE(q.pop(it));
+            TEST_ASSERT_EQUAL_UINT32(round * 8 + i, it.seq);
+        }
+        TEST_ASSERT_FALSE(q.pop(it));
+        TEST_ASSERT_TRUE(q.empty());
+    }
+    TEST_ASSERT_EQUAL_UINT32(24, q.pushedCount());
+    TEST_ASSERT_EQUAL_UINT32(8, q.highWaterMark());
+}
+
+// producer retries when full: every item arrives once, in order
+void test_contention_order_no_loss() {
+    static SpscQueue<Item, 64> q;
+    std::atomic<bool> failed{false};
+    std::thread consumer([&] {
+        Item it;
+        uint32_t expected = 0;
+        while (expected < ITEMS) {
+            if (!q.pop(it)) {
+                backOff();
+                continue;
+            }
+            if (it.seq != expected || !intact(it)) failed = true;
+            expected++;
+        }
+    });
+    uint32_t retries = 0;
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        Item it = makeItem(i);
+        while (!q.push(it)) {
+            retries++;
+            backOff();
+        }
+    }
+    consumer.join();
+    TEST_ASSERT_FALSE(failed.load());
+    TEST_ASSERT_TRUE(q.empty());
+    TEST_ASSERT_EQUAL_UINT32(ITEMS, q.pushedCount());
+    TEST_ASSERT_EQUAL_UINT32(retries, q.droppedCount());
+    TEST_ASSERT_LESS_OR_EQUAL(64, q.highWaterMark());
+}
+
+// producer never waits: items pushed arrive in order, the others are counted as dropped
+void test_contention_drop_when_full() {
+    static SpscQueue<Item, 16> q;
+    std::atomic<bool> done{false};
+    std::atomic<bool> failed{false};
+    uint32_t popped = 0;
+    std::thread consumer([&] {
+        Item it;
+        int64_t last = -1;
+        for (;;) {
+            bool finished = done.load(std::memory_order_acquire);
+            if (q.pop(it)) {
+                if ((int64_t)it.seq <= last || !intact(it)) failed = true;
+                last = it.seq;
+                popped++;
+            } else if (finished) {
+                break;
+            } else {
+                backOff();
+            }
+        }
+    });
+    uint32_t accepted = 0;
+    for (uint32_t i = 0; i < ITEMS; i++) {
+        if (q.push(makeItem(i))) accepted++;
+        // give the consumer a chance to keep up now and then
+        if (i % 64 == 0) backOff();
+    }
+    done.store(true, std::memory_order_release);
+    consumer.join();
+    TEST_ASSERT_FALSE(failed.load());
+    TEST_ASSERT_EQUAL_UINT32(accepted, popped);
+    TEST_ASSERT_EQUAL_UINT32(accepted, q.pushedCount());
+    TEST_ASSERT_EQUAL_UINT32(ITEMS - accepted, q.droppedCount());
+    TEST_ASSERT_LESS_OR_EQUAL(16, q.highWaterMark());
+}
+
+// bursts up to capacity while the consumer drains: nothing is dropped
+void test_contention_below_capacity() {
+    static SpscQueue<Item, 32> q;
+    std::atomic<uint32_t> popped{0};
+    std::atomic<bool> failed{false};
+    const uint32_t BURSTS = 20000;
+    std::thread consumer([&] {
+        Item it;
+        uint32_t expected = 0;
+        while (expected < BURSTS * 32) {
+            if (!q.pop(it)) {
+                backOff();
+                continue;
+            }
+            if (it.seq != expected || !intact(it)) failed = true;
+            expected++;
+            popped.store(expected, std::memory_order_release);
+        }
+    });
+    uint32_t seq = 0;
+    for (uint32_t b = 0; b < BURSTS; b++) {
+        // next burst once the consumer took all of the last one
+        while (popped.load(std::memory_order_acquire) != seq) backOff();
+        for (uint32_t i = 0; i < 32; i++) q.push(makeItem(seq++));
+    }
+    consumer.join();
+    TEST_ASSERT_FALSE(failed.load());
+    TEST_ASSERT_EQUAL_UINT32(0, q.droppedCount());
+    TEST_ASSERT_EQUAL_UINT32(BURSTS * 32, q.pushedCount());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_full_and_empty);
+    RUN_TEST(test_contention_order_no_loss);
+    RUN_TEST(test_contention_drop_when_full);
+    RUN_TEST(test_contention_below_capacity);
+    return UNITY_END();
+}
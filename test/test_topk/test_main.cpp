@@ -0,0 +1,230 @@
+/**
+ * Space-Saving counters of TOP_K (src/ble_topk.h) against exact counts: exact while keys fit,
+ * guaranteed count (count - error <= true <= count), any key above total / N tracked and the bound
+ * of keys left out; name prefixes and the report; and devices counted once per scan even though
+ * each sighting is reported with AGGREGATE_WINDOW (seen set gating as in ble.h).
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <math.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ble_seen_set.h"
+#include "ble_topk.h"
+
+static std::mt19937 rng(25);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+/**
+ * Ranks 0..n-1 with weight 1 / (rank + 1)^s.
+ */
+static std::vector<uint16_t> zipfStream(size_t items, size_t keys, double s) {
+    std::vector<double> cdf(keys);
+    double sum = 0;
+    for (size_t i = 0; i < keys; i++) cdf[i] = sum += 1 / pow((double)(i + 1), s);
+    std::vector<uint16_t> stream(items);
+    for (uint16_t &key : stream) {
+        double u = std::uniform_real_distribution<double>(0, sum)(rng);
+        size_t rank = std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), keys - 1);
+        // ranks scattered over company IDs
+        key = (uint16_t)(rank * 7919 % 65536);
+    }
+    return stream;
+}
+
+static uint16_t keyOf(const uint8_t *k) { return (uint16_t)(k[0] << 8 | k[1]); }
+
+template <size_t N>
+static void count(BleSpaceSaving<N, 2> &counters, const std::vector<uint16_t> &stream, std::map<uint16_t, uint32_t> &exact) {
+    for (uint16_t key : stream) {
+        uint8_t k[2] = {(uint8_t)(key >> 8), (uint8_t)key};
+        counters.add(k, 2);
+        exact[key]++;
+    }
+    counters.sort();
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_exact_while_keys_fit() {
+    BleSpaceSaving<20, 2> counters;
+    std::map<uint16_t, uint32_t> exact;
+    count(counters, zipfStream(5000, 20, 1.0), exact);
+    TEST_ASSERT_EQUAL_UINT32(5000, counters.total());
+    TEST_ASSERT_EQUAL_UINT32(0, counters.evictedCount());
+    TEST_ASSERT_EQUAL_size_t(exact.size(), counters.size());
+    for (size_t i = 0; i < counters.size(); i++) {
+        const BleSpaceSaving<20, 2>::Entry &e = counters.entry(i);
+        TEST_ASSERT_EQUAL_UINT32(exact[keyOf(e.key)], e.count);
+        TEST_ASSERT_EQUAL_UINT32(0, e.error);
+        if (i > 0) TEST_ASSERT_TRUE(counters.entry(i - 1).count >= e.count);
+    }
+    // nothing left out
+    TEST_ASSERT_EQUAL_UINT32(0, counters.bound(counters.size()));
+}
+
+/**
+ * 20 counters over 1000 keys, skews from flat to steep: every counter holds its true count
+ * within its error, counts add up to total, keys above total / N have a counter, and no key
+ * left out of the top k is more frequent than bound(k).
+ */
+void test_guarantees_against_exact() {
+    const double skews[] = {0.6, 1.0, 1.5};
+    for (double s : skews) {
+        BleSpaceSaving<20, 2> counters;
+        std::map<uint16_t, uint32_t> exact;
+        count(counters, zipfStream(100000, 1000, s), exact);
+        TEST_ASSERT_TRUE(counters.evictedCount() > 0);
+        uint64_t sum = 0;
+        std::map<uint16_t, size_t> rank;
+        for (size_t i = 0; i < counters.size(); i++) {
+            const BleSpaceSaving<20, 2>::Entry &e = counters.entry(i);
+            uint32_t truth = exact[keyOf(e.key)];
+            TEST_ASSERT_TRUE(e.count >= truth);
+            TEST_ASSERT_TRUE(e.count - e.error <= truth);
+            // error at most total / N
+            TEST_ASSERT_TRUE(e.error <= counters.total() / 20);
+            sum += e.count;
+            rank[keyOf(e.key)] = i;
+        }
+        TEST_ASSERT_EQUAL_UINT64(counters.total(), sum);
+        const size_t ks[] = {1, 5, 10, 20};
+        for (const auto &x : exact) {
+            if (x.second > counters.total() / 20) TEST_ASSERT_TRUE(rank.count(x.first) == 1);
+            for (size_t k : ks)
+                if (rank.count(x.first) == 0 || rank[x.first] >= k) TEST_ASSERT_TRUE(x.second <= counters.bound(k));
+        }
+    }
+    // the most frequent keys of a skewed crowd come out in order
+    BleSpaceSaving<20, 2> counters;
+    std::map<uint16_t, uint32_t> exact;
+    count(counters, zipfStream(100000, 1000, 1.5), exact);
+    for (size_t rank = 0; rank < 3; rank++) TEST_ASSERT_EQUAL_UINT16(rank * 7919 % 65536, keyOf(counters.entry(rank).key));
+}
+
+// a new key takes over the smallest counter with its count as error
+void test_take_over() {
+    BleSpaceSaving<2, 2> counters;
+    const uint8_t a[2] = {0, 'a'}, b[2] = {0, 'b'}, c[2] = {0, 'c'};
+    counters.add(a, 2);
+    counters.add(a, 2);
+    counters.add(b, 2);
+    counters.add(c, 2);
+    counters.sort();
+    TEST_ASSERT_EQUAL_UINT32(1, counters.evictedCount());
+    TEST_ASSERT_EQUAL_UINT32(2, counters.entry(1).count);
+    TEST_ASSERT_EQUAL_UINT32(1, counters.entry(1).error);
+    TEST_ASSERT_EQUAL_HEX8('c', counters.entry(1).key[1]);
+    TEST_ASSERT_EQUAL_UINT32(2, counters.bound(1));
+    TEST_ASSERT_EQUAL_UINT32(2, counters.bound(2));
+    counters.clear();
+    TEST_ASSERT_EQUAL_size_t(0, counters.size());
+    TEST_ASSERT_EQUAL_UINT32(0, counters.bound(0));
+}
+
+// prefix cut before an UTF-8 sequence, quotes and control characters masked, keys by kind
+void test_keys_and_report() {
+    BleTopK<8, 8> topK;
+    const uint8_t uuid16[2] = {0x9f, 0xfe};
+    topK.add(0x004c, uuid16, 2, "Galaxy Watch4", 13);
+    topK.add(0x004c, nullptr, 0, "Galaxy Watch5", 13);
+    // 'ä' (2 bytes) at 7 would be cut, 3 bytes is no UUID
+    topK.add(-1, uuid16, 3, "Galaxy \xc3\xa4", 9);
+    topK.add(0x0006, nullptr, 0, "a\"b\\c\n", 6);
+    topK.add(-1, nullptr, 0, nullptr, 0);
+    TEST_ASSERT_EQUAL_UINT32(3, topK.company.total());
+    TEST_ASSERT_EQUAL_UINT32(1, topK.uuid.total());
+    TEST_ASSERT_EQUAL_UINT32(4, topK.name.total());
+
+    const size_t maxLen = BleTopK<8, 8>::maxJsonLen(3);
+    static char buf[maxLen + 1];
+    size_t len = topK.serializeJson(buf, sizeof(buf), 1651042690, 60, 3);
+    TEST_ASSERT_TRUE(len > 0 && len <= maxLen);
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"topK\": {\"start\": 1651042690, \"seconds\": 60, "
+        "\"company\": {\"total\": 3, \"bound\": 0, \"top\": [{\"key\": 76, \"count\": 2, \"error\": 0}, {\"key\": 6, \"count\": 1, \"error\": 0}]}, "
+        "\"uuid\": {\"total\": 1, \"bound\": 0, \"top\": [{\"key\": \"0000fe9f-0000-1000-8000-00805f9b34fb\", \"count\": 1, \"error\": 0}]}, "
+        "\"name\": {\"total\": 4, \"bound\": 0, \"top\": [{\"key\": \"Galaxy W\", \"count\": 2, \"error\": 0}, "
+        "{\"key\": \"Galaxy \", \"count\": 1, \"error\": 0}, {\"key\": \"a?b?c?\", \"count\": 1, \"error\": 0}]}}}",
+        buf);
+    // too small
+    TEST_ASSERT_EQUAL_size_t(0, topK.serializeJson(buf, len, 1651042690, 60, 3));
+
+    // 16 bit, 32 bit and 128 bit UUIDs are different keys, k = 1 leaves a bound
+    BleTopK<8, 8> uuids;
+    uint8_t uuid[16] = {0x9f, 0xfe};
+    uuids.add(-1, uuid, 2, nullptr, 0);
+    uuids.add(-1, uuid, 4, nullptr, 0);
+    uuids.add(-1, uuid, 4, nullptr, 0);
+    uuids.add(-1, uuid, 16, nullptr, 0);
+    const size_t maxLenK1 = BleTopK<8, 8>::maxJsonLen(1);
+    len = uuids.serializeJson(buf, sizeof(buf), 0, 60, 1);
+    TEST_ASSERT_TRUE(len > 0 && len <= maxLenK1);
+    TEST_ASSERT_EQUAL_UINT32(4, uuids.uuid.total());
+    TEST_ASSERT_EQUAL_size_t(3, uuids.uuid.size());
+    TEST_ASSERT_EQUAL_UINT8(4, uuids.uuid.entry(0).keyLen);
+    TEST_ASSERT_EQUAL_UINT32(2, uuids.uuid.entry(0).count);
+    TEST_ASSERT_EQUAL_UINT32(1, uuids.uuid.bound(1));
+}
+
+/**
+ * With AGGREGATE_WINDOW BLEScan reports every sighting. 300 devices advertise 1-20 times in each
+ * of three scans: counted once per scan, so totals are devices per scan and counts match a
+ * count of distinct devices, whatever their advertising rate.
+ */
+void test_once_per_device_and_scan() {
+    static BleSeenSet<1024> seen;
+    BleTopK<16, 8> topK;
+    std::map<uint16_t, uint32_t> devicesPerCompany;
+    uint32_t scan = 1;
+    for (int s = 0; s < 3; s++, scan++) {
+        std::vector<uint32_t> sightings;
+        for (uint32_t d = 0; d < 300; d++)
+            for (uint32_t k = 0, n = 1 + rnd(20); k < n; k++) sightings.push_back(d);
+        std::shuffle(sightings.begin(), sightings.end(), rng);
+        for (uint32_t d : sightings) {
+            BleAdvRecord rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.address[0] = 0xc0;
+            rec.address[4] = (uint8_t)(d >> 8);
+            rec.address[5] = (uint8_t)d;
+            // devices of 10 companies, fast advertisers not more frequent per company
+            const uint8_t manuf[2] = {(uint8_t)(d % 10), 0};
+            bleRecSetManufData(rec, manuf, 2);
+            if (seen.markSeen(rec.address, scan)) topK.add(rec);
+        }
+        for (uint32_t d = 0; d < 300; d++) devicesPerCompany[(uint16_t)(d % 10)]++;
+        TEST_ASSERT_EQUAL_UINT32(300 * (s + 1), topK.company.total());
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, seen.overflowCount());
+    topK.company.sort();
+    TEST_ASSERT_EQUAL_size_t(10, topK.company.size());
+    for (size_t i = 0; i < topK.company.size(); i++) {
+        const BleSpaceSaving<16, 2>::Entry &e = topK.company.entry(i);
+        // big endian key of little endian company ID
+        TEST_ASSERT_EQUAL_UINT32(devicesPerCompany[e.key[1]], e.count);
+        TEST_ASSERT_EQUAL_UINT32(90, e.count);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_exact_while_keys_fit);
+    RUN_TEST(test_guarantees_against_exact);
+    RUN_TEST(test_take_over);
+    RUN_TEST(test_keys_and_report);
+    RUN_TEST(test_once_per_device_and_scan);
+    return UNITY_END();
+}
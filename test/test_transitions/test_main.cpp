@@ -0,0 +1,304 @@
+/**
+ * Transitions between loggers (host_tools/lib/ble_collector/collector_transitions.h): the join on
+ * address with dwell and travel, confirmation against single sightings elsewhere, reordering within
+ * lateness, expiry and eviction, clock offsets, and the engine finding exactly the moves of a
+ * synthetic trace inline and over sharded threads.
+ *
+ * Run with: pio test -e native
+ * */
+
+#include <unity.h>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "collector_transitions.h"
+
+static std::mt19937 rng(22);
+
+static uint32_t rnd(uint32_t n) {
+    return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+}
+
+static const int64_t T0 = 1651042693000LL;
+
+struct Sink {
+    std::vector<Transition> transitions;
+    void operator()(const Transition &t) { transitions.push_back(t); }
+};
+
+static TransitionConfig config(int64_t latenessMs = 0) {
+    TransitionConfig cfg;
+    cfg.latenessMs = latenessMs;
+    cfg.maxAddresses = 1024;
+    return cfg;
+}
+
+static void push(TransitionShard &shard, Sink &sink, uint64_t address, uint32_t logger, int64_t ms) {
+    shard.push({T0 + ms, address, logger}, sink);
+}
+
+void setUp() {}
+void tearDown() {}
+
+// three sightings at 1, then two at 2: one move, arrival at the first of the confirming run
+void test_join_dwell_and_travel() {
+    TransitionShard shard(config());
+    Sink sink;
+    push(shard, sink, 0xa1, 1, 0);
+    push(shard, sink, 0xa1, 1, 4000);
+    push(shard, sink, 0xa1, 1, 9000);
+    // other address in between is no transition
+    push(shard, sink, 0xb2, 2, 9500);
+    push(shard, sink, 0xa1, 2, 15000);
+    TEST_ASSERT_EQUAL_size_t(0, sink.transitions.size());
+    push(shard, sink, 0xa1, 2, 20000);
+    shard.flush(sink);
+    TEST_ASSERT_EQUAL_size_t(1, sink.transitions.size());
+    const Transition &t = sink.transitions[0];
+    TEST_ASSERT_TRUE(t.address == 0xa1);
+    TEST_ASSERT_EQUAL_UINT32(1, t.from);
+    TEST_ASSERT_EQUAL_UINT32(2, t.to);
+    TEST_ASSERT_TRUE(t.leftMs == T0 + 9000);
+    TEST_ASSERT_TRUE(t.arrivedMs == T0 + 15000);
+    TEST_ASSERT_TRUE(t.dwellMs == 9000);
+    TEST_ASSERT_TRUE(t.travelMs == 6000);
+    TEST_ASSERT_EQUAL_UINT32(3, t.fromSightings);
+    TEST_ASSERT_EQUAL_UINT64(1, shard.stats.transitions);
+    TEST_ASSERT_EQUAL_UINT64(2, shard.stats.live);
+}
+
+/**
+ * A single sighting by a neighbouring logger does not split a stay, a run at another logger
+ * starts over. Seen by both at once, travel is zero.
+ */
+void test_confirmation() {
+    TransitionShard shard(config());
+    Sink sink;
+    push(shard, sink, 0xa1, 1, 0);
+    push(shard, sink, 0xa1, 2, 1000);
+    push(shard, sink, 0xa1, 1, 2000);
+    push(shard, sink, 0xa1, 2, 3000);
+    push(shard, sink, 0xa1, 3, 4000);
+    push(shard, sink, 0xa1, 1, 5000);
+    TEST_ASSERT_EQUAL_size_t(0, sink.transitions.size());
+    TEST_ASSERT_EQUAL_UINT64(3, shard.stats.unconfirmed);
+
+    push(shard, sink, 0xa1, 3, 6000);
+    push(shard, sink, 0xa1, 3, 7000);
+    TEST_ASSERT_EQUAL_size_t(1, sink.transitions.size());
+    TEST_ASSERT_EQUAL_UINT32(3, sink.transitions[0].to);
+    TEST_ASSERT_TRUE(sink.transitions[0].dwellMs == 5000);
+    TEST_ASSERT_EQUAL_UINT32(3, sink.transitions[0].fromSightings);
+
+    // 3 confirming sightings needed
+    TransitionConfig cfg = config();
+    cfg.confirmSightings = 3;
+    TransitionShard three(cfg);
+    Sink sink3;
+    push(three, sink3, 0xa1, 1, 0);
+    push(three, sink3, 0xa1, 2, 1000);
+    push(three, sink3, 0xa1, 2, 2000);
+    TEST_ASSERT_EQUAL_size_t(0, sink3.transitions.size());
+    push(three, sink3, 0xa1, 2, 3000);
+    TEST_ASSERT_EQUAL_size_t(1, sink3.transitions.size());
+    TEST_ASSERT_TRUE(sink3.transitions[0].travelMs == 1000);
+
+    TransitionShard overlap(config());
+    Sink sinkO;
+    push(overlap, sinkO, 0xa1, 2, 1000);
+    push(overlap, sinkO, 0xa1, 1, 1000);
+    push(overlap, sinkO, 0xa1, 1, 1700);
+    TEST_ASSERT_EQUAL_size_t(1, sinkO.transitions.size());
+    TEST_ASSERT_TRUE(sinkO.transitions[0].travelMs == 0);
+}
+
+// out of order within lateness gives the same as in order, beyond it is late and dropped
+void test_reorder_and_late() {
+    std::vector<TransitionInput> in;
+    for (int i = 0; i < 200; i++) in.push_back({T0 + i * 1000, (uint64_t)(0xa0 + i % 5), (uint32_t)(1 + i / 20 % 4)});
+    TransitionShard ordered(config(10000));
+    Sink want;
+    for (const TransitionInput &s : in) ordered.push(s, want);
+    ordered.flush(want);
+    TEST_ASSERT_TRUE(want.transitions.size() >= 20);
+
+    // each sighting delayed by up to 9 s
+    std::vector<std::pair<int64_t, TransitionInput>> arrival;
+    for (const TransitionInput &s : in) arrival.push_back({s.tsMs + rnd(9000), s});
+    std::sort(arrival.begin(), arrival.end(), [](const std::pair<int64_t, TransitionInput> &a, const std::pair<int64_t, TransitionInput> &b) { return a.first < b.first; });
+    TransitionShard shuffled(config(10000));
+    Sink got;
+    for (const auto &a : arrival) shuffled.push(a.second, got);
+    shuffled.flush(got);
+    TEST_ASSERT_EQUAL_UINT64(0, shuffled.stats.late);
+    TEST_ASSERT_EQUAL_size_t(want.transitions.size(), got.transitions.size());
+    for (size_t i = 0; i < got.transitions.size(); i++) {
+        TEST_ASSERT_TRUE(got.transitions[i].address == want.transitions[i].address);
+        TEST_ASSERT_TRUE(got.transitions[i].arrivedMs == want.transitions[i].arrivedMs);
+        TEST_ASSERT_TRUE(got.transitions[i].leftMs == want.transitions[i].leftMs);
+    }
+    TEST_ASSERT_TRUE(shuffled.stats.peakBuffered > 1);
+
+    TransitionShard shard(config(10000));
+    Sink sink;
+    push(shard, sink, 0xa1, 1, 0);
+    push(shard, sink, 0xa1, 1, 12000);
+    // older than the newest by more than lateness, but nothing newer processed yet
+    push(shard, sink, 0xa1, 2, 1000);
+    push(shard, sink, 0xa1, 2, 40000);
+    TEST_ASSERT_EQUAL_UINT64(0, shard.stats.late);
+    // 12000 is processed now
+    push(shard, sink, 0xa1, 2, 5000);
+    TEST_ASSERT_EQUAL_UINT64(1, shard.stats.late);
+    TEST_ASSERT_EQUAL_UINT64(5, shard.stats.sightings);
+}
+
+// forgotten windowMs after the last sighting, least recently seen evicted beyond maxAddresses
+void test_expiry_and_eviction() {
+    TransitionShard shard(config());
+    Sink sink;
+    push(shard, sink, 0xa1, 1, 0);
+    push(shard, sink, 0xb2, 1, 60000);
+    push(shard, sink, 0xa1, 2, 15 * 60000 + 1);
+    push(shard, sink, 0xa1, 2, 15 * 60000 + 2);
+    TEST_ASSERT_EQUAL_size_t(0, sink.transitions.size());
+    TEST_ASSERT_EQUAL_UINT64(1, shard.stats.expired);
+    // 0xb2 still known
+    push(shard, sink, 0xb2, 2, 15 * 60000 + 3);
+    push(shard, sink, 0xb2, 2, 15 * 60000 + 4);
+    TEST_ASSERT_EQUAL_size_t(1, sink.transitions.size());
+
+    TransitionConfig cfg = config();
+    cfg.maxAddresses = 64;
+    TransitionShard small(cfg);
+    Sink sinkS;
+    for (uint64_t a = 0; a < 64; a++) small.push({T0, a, 1}, sinkS);
+    // address 0 seen again, 1 is least recently seen now
+    small.push({T0 + 1, 0, 1}, sinkS);
+    small.push({T0 + 2, 1000, 1}, sinkS);
+    TEST_ASSERT_EQUAL_UINT64(1, small.stats.evicted);
+    TEST_ASSERT_EQUAL_UINT64(64, small.stats.live);
+    // 0 is kept, 1 was evicted and is new now (evicting 2)
+    for (uint64_t a = 0; a < 2; a++) {
+        small.push({T0 + 3, a, 2}, sinkS);
+        small.push({T0 + 4, a, 2}, sinkS);
+    }
+    TEST_ASSERT_EQUAL_UINT64(2, small.stats.evicted);
+    TEST_ASSERT_EQUAL_size_t(1, sinkS.transitions.size());
+    TEST_ASSERT_TRUE(sinkS.transitions[0].address == 0);
+    // all others still found after removals moved slots
+    for (uint64_t a = 3; a <= 1000; a = a == 63 ? 1000 : a + 1) {
+        small.push({T0 + 5 + 2 * (int64_t)a, a, 2}, sinkS);
+        small.push({T0 + 6 + 2 * (int64_t)a, a, 2}, sinkS);
+    }
+    TEST_ASSERT_EQUAL_size_t(1 + 62, sinkS.transitions.size());
+    TEST_ASSERT_EQUAL_UINT64(2, small.stats.evicted);
+}
+
+// loggers 1 and 2 run 3 s ahead and 2 s behind, each publishes 100-400 ms after the timestamp
+void test_clock_offsets() {
+    LoggerClockOffsets offsets(60000);
+    const int64_t clock[] = {0, 3000, -2000, 0, 0};
+    for (int64_t t = 0; t < 10 * 60000; t += 500)
+        for (uint32_t l = 0; l < 5; l++) offsets.observe(l, T0 + t + clock[l], T0 + t + 100 + rnd(300));
+    for (uint32_t l = 0; l < 5; l++) {
+        int64_t corrected = clock[l] + offsets.correction(l);
+        TEST_ASSERT_TRUE(corrected >= -20 && corrected <= 20);
+    }
+    offsets.set(1, 1000);
+    TEST_ASSERT_TRUE(offsets.correction(1) == -1000);
+    // a backlog is no offset
+    for (int64_t t = 10 * 60000; t < 20 * 60000; t += 500)
+        for (uint32_t l = 0; l < 5; l++) offsets.observe(l, T0 + t + clock[l] - (l == 4 ? 60000 : 0), T0 + t + 100 + rnd(300));
+    TEST_ASSERT_TRUE(offsets.correction(1) == -1000);
+    TEST_ASSERT_TRUE(llabs(offsets.correction(4)) <= 20);
+    TEST_ASSERT_TRUE(offsets.correction(99) == 0);
+}
+
+struct Move {
+    uint64_t address;
+    uint32_t from;
+    uint32_t to;
+    int64_t arrivedMs;
+
+    bool operator<(const Move &o) const { return address != o.address ? address < o.address : arrivedMs < o.arrivedMs; }
+    bool operator==(const Move &o) const { return address == o.address && from == o.from && to == o.to && arrivedMs == o.arrivedMs; }
+};
+
+struct EngineSink {
+    std::mutex lock;
+    std::vector<Move> moves;
+    void operator()(unsigned, const Transition &t) {
+        std::lock_guard<std::mutex> guard(lock);
+        moves.push_back({t.address, t.from, t.to, t.arrivedMs});
+    }
+};
+
+/**
+ * 500 devices walk over 8 loggers, 2-6 sightings per stay, published in 5 s batches per logger.
+ * Each stay after the first is one transition, found alike inline and by 3 shard threads.
+ */
+void test_engine_finds_moves() {
+    std::vector<CollectorRecord> sightings;
+    std::vector<Move> want;
+    for (uint64_t address = 1; address <= 500; address++) {
+        int64_t t = T0 + rnd(60000);
+        uint32_t logger = rnd(8);
+        for (int stay = 0; stay < 6; stay++) {
+            if (stay > 0) {
+                uint32_t next = (logger + 1 + rnd(7)) % 8;
+                want.push_back({address, logger, next, t});
+                logger = next;
+            }
+            for (uint32_t k = 0, n = 2 + rnd(5); k < n; k++, t += 1000 + rnd(5000)) {
+                CollectorRecord rec;
+                memset(&rec, 0, sizeof(rec));
+                rec.address = address;
+                rec.logger = logger;
+                rec.tsMs = t;
+                sightings.push_back(rec);
+            }
+            t += 10000 + rnd(60000);
+        }
+    }
+    // loggers publish what they saw in a 5 s period together
+    std::stable_sort(sightings.begin(), sightings.end(), [](const CollectorRecord &a, const CollectorRecord &b) {
+        int64_t pa = a.tsMs / 5000, pb = b.tsMs / 5000;
+        return pa != pb ? pa < pb : a.logger < b.logger;
+    });
+    std::sort(want.begin(), want.end());
+    for (unsigned threads = 0; threads <= 3; threads += 3) {
+        EngineSink sink;
+        TransitionConfig cfg;
+        cfg.latenessMs = 20000;
+        cfg.maxAddresses = 4096;
+        TransitionEngine<EngineSink, 256> engine(cfg, threads, sink);
+        engine.correct = false;
+        for (const CollectorRecord &rec : sightings) engine.push(rec);
+        engine.finish();
+        TEST_ASSERT_EQUAL_size_t(threads == 0 ? 1 : 3, engine.shardCount());
+        TransitionStats st = engine.stats();
+        TEST_ASSERT_EQUAL_UINT64(sightings.size(), st.sightings);
+        TEST_ASSERT_EQUAL_UINT64(0, st.late);
+        TEST_ASSERT_EQUAL_UINT64(0, st.evicted);
+        std::sort(sink.moves.begin(), sink.moves.end());
+        TEST_ASSERT_EQUAL_size_t(want.size(), sink.moves.size());
+        TEST_ASSERT_TRUE(sink.moves == want);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_join_dwell_and_travel);
+    RUN_TEST(test_confirmation);
+    RUN_TEST(test_reorder_and_late);
+    RUN_TEST(test_expiry_and_eviction);
+    RUN_TEST(test_clock_offsets);
+    RUN_TEST(test_engine_finds_moves);
+    return UNITY_END();
+}